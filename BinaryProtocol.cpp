@@ -0,0 +1,95 @@
+/*
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "BinaryProtocol.h"
+#include "DCC.h"
+#include "Turnouts.h"
+#include "Sensors.h"
+#include "DIAG.h"
+
+void BinaryProtocol::parse(Print * stream, byte * frame) {
+  byte length=frame[1];
+  byte opcode=frame[2];
+  byte * p=frame+3;  // payload
+  if (Diag::CMD) DIAG(F("BINARY:%c length %d"), opcode, length);
+
+  switch (opcode) {
+  case '?':  // hello
+    if (length!=1) break;
+    send(stream, '?', &BINARY_VERSION, 1);
+    return;
+
+  case 't': { // throttle
+    if (length!=4) break;
+    uint16_t cab=get16(p);
+    byte speed=p[2] & 0x7F;
+    if (!validCab(cab) || (cab==0 && speed>1)) break;  // ignore broadcasts of speed>1
+    DCC::setThrottle(cab, speed, p[2] & 0x80);
+    sendLoco(stream, cab);
+    return;
+  }
+
+  case 'f': { // function
+    if (length!=5) break;
+    uint16_t cab=get16(p);
+    if (cab==0 || !validCab(cab)) break;
+    DCC::setFn(cab, p[2], p[3]);
+    sendLoco(stream, cab);
+    return;
+  }
+
+  case 'l':  // loco state
+    if (length!=3 || !validCab(get16(p))) break;
+    sendLoco(stream, get16(p));
+    return;
+
+  case 'T': { // turnout
+    if (length!=4) break;
+    uint16_t id=get16(p);
+    if (!Turnout::exists(id)) break;
+    if (p[2]<2 && !Turnout::setClosed(id, p[2]==0)) break;
+    byte reply[3]={p[0], p[1], (byte)!Turnout::isClosed(id)};
+    send(stream, 'H', reply, 3);
+    return;
+  }
+
+  case 'Q': { // sensor
+    if (length!=3) break;
+    Sensor * sensor=Sensor::get(get16(p));
+    if (!sensor) break;
+    byte reply[3]={p[0], p[1], (byte)sensor->active};
+    send(stream, 'Q', reply, 3);
+    return;
+  }
+  }
+  send(stream, 'X', &opcode, 1);
+}
+
+void BinaryProtocol::sendLoco(Print * stream, uint16_t cab) {
+  uint32_t functions=DCC::getFunctionMap(cab);
+  byte reply[7]={lowByte(cab), highByte(cab),
+    (byte)(DCC::getThrottleSpeed(cab) | (DCC::getThrottleDirection(cab) ? 0x80 : 0)),
+    (byte)functions, (byte)(functions>>8), (byte)(functions>>16), (byte)(functions>>24)};
+  send(stream, 'l', reply, 7);
+}
+
+void BinaryProtocol::send(Print * stream, byte opcode, const byte * payload, byte length) {
+  stream->write(BINARY_START);
+  stream->write(length+1);
+  stream->write(opcode);
+  stream->write(payload, length);
+}
@@ -0,0 +1,62 @@
+/*
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef BinaryProtocol_h
+#define BinaryProtocol_h
+#include <Arduino.h>
+
+// Compact binary frames, accepted alongside the text protocol on serial and network
+// connections, for software that drives many locos.  A frame is
+//
+//    BINARY_START, length, opcode, payload (length-1 bytes)
+//
+// with 16 bit values least significant byte first.  BINARY_START never appears in a
+// text command, so a client can mix the two.  A binary request is answered with a
+// binary frame; broadcasts remain in text.  A client asks whether binary frames are
+// supported by sending BINARY_HELLO, answered with BINARY_HELLO and the protocol version.
+//
+//   Request                                 Reply
+//   '?'                                     '?' version
+//   't' cab(2) speed(1)                     'l' cab(2) speed(1) functions(4)
+//   'f' cab(2) function(1) on(1)            'l' ...
+//   'l' cab(2)                              'l' ...
+//   'T' id(2) state(1)                      'H' id(2) thrown(1)
+//   'Q' id(2)                               'Q' id(2) active(1)
+//   anything invalid                        'X' opcode
+//
+// speed is the DCC speed 0-127 with bit 7 set for forward.  cab is checked as for
+// <t> and <F>: 1-10239, or 0 only to stop or emergency stop all locos.
+// Turnout state is 0 to close, 1 to throw, 2 just to report it.
+
+const byte BINARY_START = 0xDC;
+const byte BINARY_VERSION = 1;
+const byte BINARY_MAX_FRAME = 16;  // largest frame, including start and length bytes
+
+class BinaryProtocol {
+public:
+  // Whether a frame with this length byte is acceptable.  The bytes of a frame that
+  // isn't are skipped by the caller, never taken as text.
+  static inline bool validLength(byte length) { return length!=0 && length+2<=BINARY_MAX_FRAME; }
+  // frame points to BINARY_START and holds the whole frame
+  static void parse(Print * stream, byte * frame);
+
+private:
+  static void sendLoco(Print * stream, uint16_t cab);
+  static void send(Print * stream, byte opcode, const byte * payload, byte length);
+  static inline uint16_t get16(const byte * p) { return p[0] | (p[1]<<8); }
+  static inline bool validCab(uint16_t cab) { return cab<=10239; }  // 0x27FF according to standard
+};
+#endif
@@ -28,6 +28,14 @@
 #include "defines.h"
 #include "DCCWaveform.h"
 #include "DCC.h"
+#include "BinaryProtocol.h"
+#include "Turnouts.h"
+#include "Outputs.h"
+#include "Sensors.h"
+#include "CurrentTelemetry.h"
+#if ETHERNET_ON
+#include "EthernetInterface.h"
+#endif
 
 #if defined(BIG_MEMORY) | defined(WIFI_ON) | defined(ETHERNET_ON)
 // This section of CommandDistributor is simply not relevant on a uno or similar
@@ -35,9 +43,10 @@ const byte NO_CLIENT=255;
 
 RingStream *  CommandDistributor::ring=0;
 byte CommandDistributor::ringClient=NO_CLIENT;
+byte CommandDistributor::multicastClients=0;
 CommandDistributor::clientType  CommandDistributor::clients[8]={
   NONE_TYPE,NONE_TYPE,NONE_TYPE,NONE_TYPE,NONE_TYPE,NONE_TYPE,NONE_TYPE,NONE_TYPE};
-RingStream * CommandDistributor::broadcastBufferWriter=new RingStream(100);
+RingStream * CommandDistributor::broadcastBufferWriter=new RingStream(128);
 
 void  CommandDistributor::parse(byte clientId,byte * buffer, RingStream * stream) {
   ring=stream;
@@ -45,6 +54,9 @@ void  CommandDistributor::parse(byte clientId,byte * buffer, RingStream * stream
   if (buffer[0] == '<')  {
     clients[clientId]=COMMAND_TYPE;
     DCCEXParser::parse(stream, buffer, ring);
+  } else if (buffer[0] == BINARY_START) {
+    clients[clientId]=COMMAND_TYPE;
+    BinaryProtocol::parse(stream, buffer);
   } else {
     clients[clientId]=WITHROTTLE_TYPE;
     WiThrottle::getThrottle(clientId)->parse(ring, buffer);
@@ -54,6 +66,23 @@ void  CommandDistributor::parse(byte clientId,byte * buffer, RingStream * stream
 
 void CommandDistributor::forget(byte clientId) {
   clients[clientId]=NONE_TYPE;
+  multicastClients &= ~(1<<clientId);
+  CurrentTelemetry::forget(clientId);
+#if WIFI_ON || ETHERNET_ON
+  stateCursors[clientId].ring=NULL;  // drop any state reply still to send
+#endif
+}
+
+bool CommandDistributor::setMulticast(byte clientId, bool on) {
+#if ETHERNET_ON && defined(ETHERNET_MULTICAST)
+  if (clientId>=sizeof(clients)) return false;
+  if (on) multicastClients |= 1<<clientId;
+  else multicastClients &= ~(1<<clientId);
+  return true;
+#else
+  (void)clientId; (void)on;
+  return false;
+#endif
 }
 
 
@@ -69,11 +98,21 @@ void CommandDistributor::broadcast(bool includeWithrottleClients) {
   // the process continues to output to its client.
   if (ringClient!=NO_CLIENT) ring->commit();
 
-  /* loop through ring clients */
+  /* store the message once in the ring for all the clients concerned */
+  byte clientMask=0;
   for (byte clientId=0; clientId<sizeof(clients); clientId++) {
     if (clients[clientId]==NONE_TYPE) continue;
     if ( clients[clientId]==WITHROTTLE_TYPE && !includeWithrottleClients) continue;
-    ring->mark(clientId);
+    clientMask |= 1<<clientId;
+  }
+#if ETHERNET_ON && defined(ETHERNET_MULTICAST)
+  // One packet for all the listeners, who only need a TCP copy while it can't be sent
+  if (EthernetInterface::multicast(broadcastBufferWriter)) clientMask &= ~multicastClients;
+#endif
+  // Replies to commands take priority over broadcasts, so drop a broadcast that
+  // would take the last of the ring space.
+  if (clientMask && ring && ring->freeSpace() >= BROADCAST_RESERVE) {
+    ring->markBroadcast(clientMask);
     broadcastBufferWriter->printBuffer(ring);
     ring->commit();
   }
@@ -93,7 +132,13 @@ void CommandDistributor::broadcast(bool includeWithrottleClients) {
 #endif
 
 void  CommandDistributor::broadcastSensor(int16_t id, bool on ) {
-  StringFormatter::send(broadcastBufferWriter,F("<%c %d>\n"), on?'Q':'q', id);
+  StringFormatter::emit(broadcastBufferWriter, on ? F("<Q ") : F("<q "), id, F(">\n"));
+  broadcast(false);
+}
+
+// A main track CV read by RailCom, <r CAB CV VALUE>
+void  CommandDistributor::broadcastCV(int16_t cab, int16_t cv, byte value) {
+  StringFormatter::emit(broadcastBufferWriter, F("<r "), cab, ' ', cv, ' ', value, F(">\n"));
   broadcast(false);
 }
 
@@ -101,17 +146,51 @@ void  CommandDistributor::broadcastTurnout(int16_t id, bool isClosed ) {
   // For DCC++ classic compatibility, state reported to JMRI is 1 for thrown and 0 for closed;
   // The string below contains serial and Withrottle protocols which should
   // be safe for both types.
-  StringFormatter::send(broadcastBufferWriter,F("<H %d %d>\n"),id, !isClosed);
+  StringFormatter::emit(broadcastBufferWriter, F("<H "), id, isClosed ? F(" 0>\n") : F(" 1>\n"));
 #if defined(WIFI_ON) | defined(ETHERNET_ON)
-  StringFormatter::send(broadcastBufferWriter,F("PTA%c%d\n"), isClosed?'2':'4', id);
+  StringFormatter::emit(broadcastBufferWriter, isClosed ? F("PTA2") : F("PTA4"), id, '\n');
 #endif
   broadcast(true);
 }
 
+byte CommandDistributor::locoPending[(MAX_LOCOS+7)/8];
+bool CommandDistributor::anyLocoPending=false;
+unsigned long CommandDistributor::lastLocoBroadcast=0;
+
 void  CommandDistributor::broadcastLoco(byte slot) {
+  DCC::speedTable[slot].version=newVersion();
+  unsigned long now=millis();
+  if (!anyLocoPending && now-lastLocoBroadcast >= BROADCAST_LOCO_WINDOW) {
+    // Nothing sent recently, so no need to wait
+    lastLocoBroadcast=now;
+    sendLoco(slot);
+    return;
+  }
+  locoPending[slot/8] |= 1<<(slot%8);
+  anyLocoPending=true;
+}
+
+// Send held back loco changes at the end of the window
+void CommandDistributor::loop() {
+#if WIFI_ON || ETHERNET_ON
+  sendPendingState();
+#endif
+  if (!anyLocoPending) return;
+  unsigned long now=millis();
+  if (now-lastLocoBroadcast < BROADCAST_LOCO_WINDOW) return;
+  lastLocoBroadcast=now;
+  anyLocoPending=false;
+  for (byte slot=0; slot<MAX_LOCOS; slot++) {
+    if (!(locoPending[slot/8] & 1<<(slot%8))) continue;
+    locoPending[slot/8] &= ~(1<<(slot%8));
+    if (DCC::speedTable[slot].loco > 0) sendLoco(slot);  // unless forgotten meanwhile
+  }
+}
+
+void  CommandDistributor::sendLoco(byte slot) {
   DCC::LOCO * sp=&DCC::speedTable[slot];
-  StringFormatter::send(broadcastBufferWriter,F("<l %d %d %d %l>\n"),
-			sp->loco,slot,sp->speedCode,sp->functions);
+  StringFormatter::emit(broadcastBufferWriter, F("<l "), sp->loco, ' ', slot, ' ',
+                        sp->speedCode, ' ', (long)DCC::getFunctionMap(*sp), F(">\n"));
   broadcast(false);
 #if defined(WIFI_ON) | defined(ETHERNET_ON)
   WiThrottle::markForBroadcast(sp->loco);
@@ -122,6 +201,7 @@ void  CommandDistributor::broadcastPower() {
   bool main=DCCWaveform::mainTrack.getPowerMode()==POWERMODE::ON;
   bool prog=DCCWaveform::progTrack.getPowerMode()==POWERMODE::ON;
   bool join=DCCWaveform::progTrackSyncMain;
+  powerVersion=newVersion();
   const FSH * reason=F("");
   char state='1';
   if (main && prog && join) reason=F(" JOIN");
@@ -140,3 +220,149 @@ void CommandDistributor::broadcastText(const FSH * msg) {
   StringFormatter::send(broadcastBufferWriter,F("%S"),msg);
   broadcast(false); 
 }
+
+uint16_t CommandDistributor::stateVersion=0;
+uint16_t CommandDistributor::powerVersion=0;
+uint16_t CommandDistributor::bootEpoch=0;
+
+// <$> sends the whole layout state, <$ EPOCH VERSION> what has changed since VERSION.
+// Either ends with <$ EPOCH VERSION ALL>, giving the epoch and version to ask from next
+// time, and ALL=1 if everything was sent.  Everything is sent if EPOCH isn't this boot's,
+// as the versions have restarted since.  Removed objects are not reported, so a client
+// should ask for everything again after removing any.
+// A reply to a WiFi or Ethernet client may be too big for the outbound ring, which would
+// throw it all away, so it is sent in pieces that fit, the rest from loop().  VERSION is
+// the one at the start, so changes made meanwhile are sent again next time.
+void CommandDistributor::sendState(Print * stream, RingStream * ringStream, bool all, uint16_t epoch, uint16_t since) {
+  // The epoch is taken from the time of the first request, which varies from boot to boot
+  if (bootEpoch==0) bootEpoch=micros()%32767+1;
+  StateCursor cursor;
+  cursor.ring=ringStream;
+  // From before a restart, or too old to tell what has changed since
+  cursor.all=all || epoch!=bootEpoch || (uint16_t)(stateVersion-since) >= 0x8000;
+  cursor.since=since;
+  cursor.version=stateVersion;
+  cursor.phase=0;
+  cursor.pos=0;
+#if WIFI_ON || ETHERNET_ON
+  if (ringStream) {
+    byte clientId=ringStream->peekTargetMark();
+    if (clientId>=sizeof(clients)) return;
+    // A new request replaces one still being sent
+    if (!sendStatePiece(stream, cursor)) cursor.ring=NULL;
+    else anyStatePending=true;  // to be continued by loop()
+    stateCursors[clientId]=cursor;
+    return;
+  }
+#endif
+  cursor.ring=NULL;  // no limit
+  sendStatePiece(stream, cursor);
+}
+
+// Sends the state lines for which the cursor's ring has room, or all if it has none.
+// Returns true while there is more to send.
+bool CommandDistributor::sendStatePiece(Print * stream, StateCursor & c) {
+  // Leave room for command replies, as broadcasts do
+#define ROOM (!c.ring || c.ring->freeSpace() >= STATE_LINE_MAX+BROADCAST_RESERVE)
+#define CHANGED(v) (c.all || (int16_t)((v)-c.since) > 0)
+  switch (c.phase) {
+  case 0:
+    if (CHANGED(powerVersion)) {
+      if (!ROOM) return true;
+      bool main=DCCWaveform::mainTrack.getPowerMode()==POWERMODE::ON;
+      bool prog=DCCWaveform::progTrack.getPowerMode()==POWERMODE::ON;
+      StringFormatter::send(stream, F("<p%c%S>\n"), (main || prog) ? '1' : '0',
+        (main && prog) ? (DCCWaveform::progTrackSyncMain ? F(" JOIN") : F("")) : main ? F(" MAIN") : prog ? F(" PROG") : F(""));
+    }
+    c.phase=1;
+    c.pos=0;
+    // fall through
+  case 1:  // pos is the speedTable slot
+    for ( ; c.pos<MAX_LOCOS; c.pos++) {
+      DCC::LOCO * sp=&DCC::speedTable[c.pos];
+      if (sp->loco<=0 || !CHANGED(sp->version)) continue;
+      if (!ROOM) return true;
+      StringFormatter::emit(stream, F("<l "), sp->loco, ' ', c.pos, ' ',
+                            sp->speedCode, ' ', (long)DCC::getFunctionMap(*sp), F(">\n"));
+    }
+    c.phase=2;
+    c.pos=0;
+    // fall through
+  case 2: { // pos counts along the turnout list
+    Turnout * tt=Turnout::first();
+    for (uint16_t i=0; tt && i<c.pos; i++) tt=tt->next();
+    for ( ; tt; tt=tt->next(), c.pos++) {
+      if (tt->isHidden() || !CHANGED(tt->getVersion())) continue;
+      if (!ROOM) return true;
+      StringFormatter::emit(stream, F("<H "), tt->getId(), tt->isThrown() ? F(" 1>\n") : F(" 0>\n"));
+    }
+    c.phase=3;
+    c.pos=0;
+  }
+    // fall through
+  case 3:  // unused EXRAIL turnouts, which haven't changed since startup
+    if (c.all) {
+      for (uint16_t next=c.pos, id; Turnout::nextUnused(next, id); c.pos=next) {
+        if (!ROOM) return true;
+        StringFormatter::emit(stream, F("<H "), id, F(" 1>\n"));
+      }
+    }
+    c.phase=4;
+    c.pos=0;
+    // fall through
+  case 4: { // pos counts along the output list
+    Output * tt=Output::firstOutput;
+    for (uint16_t i=0; tt && i<c.pos; i++) tt=tt->nextOutput;
+    for ( ; tt; tt=tt->nextOutput, c.pos++) {
+      if (!CHANGED(tt->version)) continue;
+      if (!ROOM) return true;
+      StringFormatter::emit(stream, F("<Y "), tt->data.id, ' ', (int)tt->data.active, F(">\n"));
+    }
+    c.phase=5;
+    c.pos=0;
+  }
+    // fall through
+  case 5: { // pos counts along the sensor list
+    Sensor * tt=Sensor::firstSensor;
+    for (uint16_t i=0; tt && i<c.pos; i++) tt=tt->nextSensor;
+    for ( ; tt; tt=tt->nextSensor, c.pos++) {
+      if (!CHANGED(tt->version)) continue;
+      if (!ROOM) return true;
+      StringFormatter::emit(stream, tt->active ? F("<Q ") : F("<q "), tt->data.snum, F(">\n"));
+    }
+    c.phase=6;
+  }
+    // fall through
+  default:
+    if (!ROOM) return true;
+    StringFormatter::send(stream, F("<$ %u %u %d>\n"), bootEpoch, c.version, c.all);
+    return false;
+  }
+#undef CHANGED
+#undef ROOM
+}
+
+#if WIFI_ON || ETHERNET_ON
+CommandDistributor::StateCursor CommandDistributor::stateCursors[sizeof(clients)];
+bool CommandDistributor::anyStatePending=false;
+
+// Continue state replies too big to send at once, a piece per client each loop
+void CommandDistributor::sendPendingState() {
+  if (!anyStatePending) return;
+  anyStatePending=false;
+  for (byte clientId=0; clientId<sizeof(clients); clientId++) {
+    StateCursor & c=stateCursors[clientId];
+    if (!c.ring) continue;
+    if (c.ring->freeSpace() >= STATE_LINE_MAX+BROADCAST_RESERVE) {
+      c.ring->mark(clientId);
+      bool more=sendStatePiece(c.ring, c);
+      c.ring->commit();
+      if (!more) {
+        c.ring=NULL;
+        continue;
+      }
+    }
+    anyStatePending=true;
+  }
+}
+#endif
@@ -23,6 +23,22 @@
 #define CommandDistributor_h
 #include "DCCEXParser.h"
 #include "RingStream.h"
+#include "DCC.h"
+
+// Loco changes within this many milliseconds of the last loco broadcast are
+// held back and sent together at the end of the window, only the latest state
+// of each loco being sent.  0 sends every change straight away.
+#ifndef BROADCAST_LOCO_WINDOW
+#define BROADCAST_LOCO_WINDOW 100
+#endif
+// Free space that must be left in the WiFi/Ethernet outbound ring for command replies.
+// Broadcasts are dropped rather than use it.
+#ifndef BROADCAST_RESERVE
+#define BROADCAST_RESERVE 200
+#endif
+// Room for the longest <$> state line, which are sent while there is this much
+// more than BROADCAST_RESERVE free in the ring
+#define STATE_LINE_MAX 40
 
 class CommandDistributor {
 
@@ -31,14 +47,50 @@ public :
   static void broadcastLoco(byte slot);
   static void broadcastSensor(int16_t id, bool value);
   static void broadcastTurnout(int16_t id, bool isClosed);
+  static void broadcastCV(int16_t cab, int16_t cv, byte value);
   static void broadcastPower();
   static void broadcastText(const FSH * msg);
   static void forget(byte clientId);
+  // Leave the client out of TCP broadcasts while they are multicast (ETHERNET_MULTICAST)
+  static bool setMulticast(byte clientId, bool on);
+  static void loop();
+
+  // Layout state version, stepped on every change.  Each loco, turnout, sensor and
+  // output keeps the version it last changed at, so that <$ EPOCH VERSION> can send a
+  // client just what has changed since it last asked.  Versions restart at 0 when the
+  // command station restarts, so they only count within the same boot epoch.
+  static uint16_t stateVersion;
+  static inline uint16_t newVersion() { return ++stateVersion; }
+  // Send the state of everything (all), or of what has changed since version since
+  // if epoch is this boot's.  To a ringStream client, in pieces if need be.
+  static void sendState(Print * stream, RingStream * ringStream, bool all, uint16_t epoch, uint16_t since);
 private:
+  // Where a state reply has got to
+  struct StateCursor {
+    RingStream * ring;  // NULL when nothing is pending (or for Serial, no limit)
+    uint16_t since;
+    uint16_t version;   // stateVersion when asked
+    uint16_t pos;       // within the phase
+    byte phase;         // power, locos, turnouts, unused turnouts, outputs, sensors, end
+    bool all;
+  };
+  static bool sendStatePiece(Print * stream, StateCursor & cursor);
+#if WIFI_ON || ETHERNET_ON
+  static void sendPendingState();
+  static StateCursor stateCursors[8];  // per client
+  static bool anyStatePending;
+#endif
+  static uint16_t powerVersion;
+  static uint16_t bootEpoch;  // 1-32767, 0 until first asked for
+  static void sendLoco(byte slot);
+  static byte locoPending[(MAX_LOCOS+7)/8];  // bit per speedTable slot
+  static bool anyLocoPending;
+  static unsigned long lastLocoBroadcast;
   static void broadcast(bool includeWithrottleClients);
   static RingStream * ring;
   static RingStream * broadcastBufferWriter;
   static byte ringClient;
+  static byte multicastClients;  // bit per client taking broadcasts by multicast
 
    // each bit in broadcastlist = 1<<clientid
    enum clientType: byte {NONE_TYPE,COMMAND_TYPE,WITHROTTLE_TYPE};
@@ -57,9 +57,12 @@
 #warning You have myAutomation.h but your hardware has not enough memory to do that, so EX-RAIL DISABLED
 #endif
 
+static void addLoopTasks();
+
 void setup()
 {
   // The main sketch has responsibilities during setup()
+  paintFreeMemory();  // so the lowest free memory can be found later, see freeMemory.h
 
   // Responsibility 1: Start the usb connection for diagnostics
   // This is normally Serial but uses SerialUSB on a SAMD processor
@@ -75,8 +78,11 @@ void setup()
 
   // Responsibility 2: Start all the communications before the DCC engine
   // Start the WiFi interface on a MEGA, Uno cannot currently handle WiFi
+  // (the ES is brought up in the background by WifiInterface::loop)
   // Start Ethernet if it exists
-#if WIFI_ON
+#if WIFI_ON && defined(ARDUINO_ARCH_ESP32)
+  WifiESP::setup(F(WIFI_SSID), F(WIFI_PASSWORD), F(WIFI_HOSTNAME), IP_PORT, WIFI_CHANNEL);
+#elif WIFI_ON
   WifiInterface::setup(WIFI_SERIAL_LINK_SPEED, F(WIFI_SSID), F(WIFI_PASSWORD), F(WIFI_HOSTNAME), IP_PORT, WIFI_CHANNEL);
 #endif // WIFI_ON
 
@@ -108,43 +114,31 @@ void setup()
   LCN::init(LCN_SERIAL);
   #endif
 
+  addLoopTasks();
+
   LCD(3,F("Ready"));
   CommandDistributor::broadcastPower();
 }
 
-void loop()
-{
-  // The main sketch has responsibilities during loop()
-
-  // Responsibility 1: Handle DCC background processes
-  //                   (loco reminders and power checks)
-  DCC::loop();
-
-  // Responsibility 2: handle any incoming commands on USB connection
-  SerialManager::loop();
-
-  // Responsibility 3: Optionally handle any incoming WiFi traffic
-#if WIFI_ON
+// Tasks of the main loop which are more than one call
+static void networkLoop() {
+#if WIFI_ON && defined(ARDUINO_ARCH_ESP32)
+  WifiESP::loop();
+#elif WIFI_ON
   WifiInterface::loop();
 #endif
 #if ETHERNET_ON
   EthernetInterface::loop();
 #endif
+}
 
-  RMFT::loop();  // ignored if no automation
-
-  #if defined(LCN_SERIAL)
-  LCN::loop();
-  #endif
-
-  LCDDisplay::loop();  // ignored if LCD not in use
-
-  // Handle/update IO devices.
+static void ioLoop() {
   IODevice::loop();
+  Turnout::loop();  // Set the turnouts queued by routes
+}
 
-  Sensor::checkAll(); // Update and print changes
-
-  // Report any decrease in memory (will automatically trigger on first call)
+// Report any decrease in memory (will automatically trigger on first call)
+static void memoryLoop() {
   static int ramLowWatermark = __INT_MAX__; // replaced on first loop
 
   int freeNow = minimumFreeMemory();
@@ -153,3 +147,49 @@ void loop()
     LCD(3,F("Free RAM=%5db"), ramLowWatermark);
   }
 }
+
+#ifdef DIAG_REPORT_MS
+// Print the timing figures every DIAG_REPORT_MS, for builds where no one can
+// type the commands (eg mega2560-sim)
+static void diagReportLoop() {
+#ifdef DIAG_LOOPTIMES
+  DCCEXParser::parse(F("<D LOOP>"));
+#endif
+#ifdef DIAG_WAVE
+  DCCEXParser::parse(F("<D WAVE>"));
+#endif
+}
+#endif
+
+// The tasks run by loop(), see LoopScheduler.h.  Budgets are in microseconds.
+static void addLoopTasks() {
+  //                  name               task                       priority         period  budget
+  // DCC background processes (loco reminders, power checks and the prog track)
+  LoopScheduler::add(F("DCC"),          DCC::loop,                  LOOP_URGENT,     0,      500,  LOOP_DCC);
+  // Track current records for <D CURRENT>, sampled as often as possible
+  LoopScheduler::add(F("Current"),      CurrentTelemetry::loop,     LOOP_URGENT,     0,      300);
+  // Incoming commands on USB and the network
+  LoopScheduler::add(F("Serial"),       SerialManager::loop,        LOOP_HIGH,       0,      2000, LOOP_SERIAL);
+  LoopScheduler::add(F("Network"),      networkLoop,                LOOP_HIGH,       0,      5000, LOOP_NETWORK);
+  LoopScheduler::add(F("RMFT"),         RMFT::loop,                 LOOP_NORMAL,     0,      2000, LOOP_RMFT); // ignored if no automation
+  LoopScheduler::add(F("Broadcast"),    CommandDistributor::loop,   LOOP_NORMAL,     0,      2000);  // Send held back broadcasts
+#if defined(LCN_SERIAL)
+  LoopScheduler::add(F("LCN"),          LCN::loop,                  LOOP_NORMAL,     0,      1000, LOOP_LCD);
+#endif
+  LoopScheduler::add(F("IO"),           ioLoop,                     LOOP_NORMAL,     0,      2000, LOOP_IO);
+  LoopScheduler::add(F("Sensors"),      Sensor::checkAll,           LOOP_NORMAL,     0,      2000, LOOP_SENSORS); // Update and print changes
+  LoopScheduler::add(F("LCD"),          LCDDisplay::loop,           LOOP_BACKGROUND, 10,     5000, LOOP_LCD); // ignored if LCD not in use
+#ifndef DISABLE_EEPROM
+  LoopScheduler::add(F("EEStore"),      EEStore::loop,              LOOP_BACKGROUND, 0,      10000); // Write changed turnout and output states
+#endif
+  LoopScheduler::add(F("Memory"),       memoryLoop,                 LOOP_BACKGROUND, 1000,   200);
+#ifdef DIAG_REPORT_MS
+  LoopScheduler::add(F("Report"),       diagReportLoop,             LOOP_BACKGROUND, DIAG_REPORT_MS, 20000);
+#endif
+}
+
+void loop()
+{
+  // The main sketch runs the tasks added by addLoopTasks(), most urgent first
+  LoopScheduler::loop();
+}
@@ -0,0 +1,115 @@
+/*
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "CurrentTelemetry.h"
+#include "DCCTimer.h"
+#include "StringFormatter.h"
+
+TrackPower *CurrentTelemetry::track = NULL;
+Print *CurrentTelemetry::stream = NULL;
+RingStream *CurrentTelemetry::ringStream = NULL;
+byte CurrentTelemetry::target = 0;
+uint16_t CurrentTelemetry::windowMs = 10;
+unsigned long CurrentTelemetry::windowStart = 0;
+int CurrentTelemetry::low = 0;
+int CurrentTelemetry::high = 0;
+unsigned long CurrentTelemetry::sum = 0;
+unsigned long CurrentTelemetry::count = 0;
+byte CurrentTelemetry::samplesSeen = 0;
+byte CurrentTelemetry::seq = 0;
+CurrentTelemetry::Record CurrentTelemetry::ring[CURRENT_TELEMETRY_RING];
+byte CurrentTelemetry::ringHead = 0;
+byte CurrentTelemetry::ringCount = 0;
+
+void CurrentTelemetry::start(TrackPower *t, uint16_t window, Print *s, RingStream *rs) {
+  track = t;
+  windowMs = window < 5 ? 5 : window;  // records for shorter windows couldn't be sent fast enough
+  stream = s;
+  ringStream = rs;
+  target = rs ? rs->peekTargetMark() : 0;
+  windowStart = millis();
+  low = __INT_MAX__;
+  high = 0;
+  sum = 0;
+  count = 0;
+  seq = 0;
+  ringCount = 0;
+  int values[ADC_RING_SIZE];
+  track->getCurrentSamples(values, samplesSeen);  // only count samples from now on
+}
+
+void CurrentTelemetry::stop() {
+  track = NULL;
+}
+
+// The client has gone away
+void CurrentTelemetry::forget(byte clientId) {
+  if (track && ringStream && target == clientId) stop();
+}
+
+void CurrentTelemetry::loop() {
+  if (!track) return;
+  sample();
+  send();
+}
+
+// Add the samples taken since the last pass to the window, and close the window
+// when its time is up.  Each sample is counted once.  If the loop is slower than
+// the ADC fills its ring, the overwritten ones are missed.
+void CurrentTelemetry::sample() {
+  int values[ADC_RING_SIZE];
+  byte n = track->getCurrentSamples(values, samplesSeen);
+  for (byte i = 0; i < n; i++) {
+    if (values[i] < low) low = values[i];
+    if (values[i] > high) high = values[i];
+    sum += values[i];
+  }
+  count += n;
+
+  unsigned long now = millis();
+  if (now - windowStart < windowMs || count == 0) return;
+  if (ringCount < CURRENT_TELEMETRY_RING) {
+    Record *r = &ring[(ringHead + ringCount) % CURRENT_TELEMETRY_RING];
+    r->seq = seq;
+    r->min = track->raw2mA(low);
+    r->max = track->raw2mA(high);
+    r->avg = track->raw2mA(sum / count);
+    ringCount++;
+  }
+  seq++;
+  windowStart = now;
+  low = __INT_MAX__;
+  high = 0;
+  sum = 0;
+  count = 0;
+}
+
+// One record per loop, so a slow client doesn't hold up the loop.
+void CurrentTelemetry::send() {
+  if (ringCount == 0) return;
+  Record *r = &ring[ringHead];
+  if (ringStream) {
+    if (ringStream->freeSpace() < 32) return;  // wait for the network to catch up
+    ringStream->mark(target);
+    StringFormatter::send(ringStream, F("<cs %d %d %d %d>\n"), r->seq, r->min, r->max, r->avg);
+    ringStream->commit();
+  } else {
+    StringFormatter::send(stream, F("<cs %d %d %d %d>\n"), r->seq, r->min, r->max, r->avg);
+  }
+  ringHead = (ringHead + 1) % CURRENT_TELEMETRY_RING;
+  ringCount--;
+}
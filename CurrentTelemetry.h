@@ -0,0 +1,75 @@
+/*
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef CurrentTelemetry_h
+#define CurrentTelemetry_h
+#include <Arduino.h>
+#include "DCCWaveform.h"
+#include "RingStream.h"
+
+// Streams the current of one track to one client, as the lowest, highest and
+// average current in mA over each window of a few milliseconds, for finding
+// intermittent shorts and tuning sound decoders.
+//
+//    <D CURRENT MAIN|PROG|district [windowms]>   start, window 10ms unless given
+//    <D CURRENT OFF>                             stop
+//
+// Each window is sent as  <cs seq min max avg>  where seq counts windows from 0
+// to 255, so a gap shows records dropped because the client couldn't keep up.
+// Samples are taken in the loop, from the motor driver's background ADC ring
+// where it has one, so the waveform interrupt isn't involved.
+
+#ifndef CURRENT_TELEMETRY_RING
+#if defined(ARDUINO_AVR_UNO) || defined(ARDUINO_AVR_NANO)
+#define CURRENT_TELEMETRY_RING 4   // windows waiting to be sent
+#else
+#define CURRENT_TELEMETRY_RING 16
+#endif
+#endif
+
+class CurrentTelemetry {
+public:
+  // ringStream and its client, or stream if there isn't one, get the records
+  static void start(TrackPower *track, uint16_t windowMs, Print *stream, RingStream *ringStream);
+  static void stop();
+  static void forget(byte clientId);
+  static void loop();
+private:
+  struct Record {
+    byte seq;
+    uint16_t min;
+    uint16_t max;
+    uint16_t avg;
+  };
+  static void sample();
+  static void send();
+  static TrackPower *track;
+  static Print *stream;
+  static RingStream *ringStream;
+  static byte target;
+  static uint16_t windowMs;
+  static unsigned long windowStart;
+  static int low;
+  static int high;
+  static unsigned long sum;
+  static unsigned long count;   // a window of up to 65535ms holds more than 65535 samples
+  static byte samplesSeen;      // ADC ring position already counted
+  static byte seq;
+  static Record ring[CURRENT_TELEMETRY_RING];
+  static byte ringHead;
+  static byte ringCount;
+};
+#endif
@@ -49,11 +49,23 @@
 //   Obtaining ACKs from the prog track using a function
 //   There are no volatiles here.
 
-const byte FN_GROUP_1=0x01;
-const byte FN_GROUP_2=0x02;
-const byte FN_GROUP_3=0x04;
-const byte FN_GROUP_4=0x08;
-const byte FN_GROUP_5=0x10;
+// Function groups 0 to 2 are F0-F4, F5-F8 and F9-F12, the rest eight 
+// functions each from F13.  groupFlags and changedFlags have a bit per group.
+static inline byte functionGroup(int16_t functionNumber) {
+  if (functionNumber<=4)  return 0;
+  if (functionNumber<=8)  return 1;
+  if (functionNumber<=12) return 2;
+  return (functionNumber-13)/8+3;
+}
+const byte FN_GROUPS=(MAX_FUNCTION_NUMBER-13)/8+4;
+const byte FN_GROUP_START[]={0,5,9,13,21,29,37,45,53,61};
+// Instruction byte for the groups from F13, as for F13-F20 and F21-F28
+const byte FN_GROUP_OPCODE[]={0xDE,0xDF,0xD8,0xD9,0xDA,0xDB,0xDC};
+const uint16_t SPEED_CHANGED=0x8000;  // changedFlags bit: speed changed, remind ahead of the rotation
+
+// CV cache entry flags
+const byte CVCACHE_VALID=0x01;    // value holds the whole byte
+const byte CVCACHE_CHANGED=0x02;  // written on main since last read or written on prog track
 
 FSH* DCC::shieldName=NULL;
 byte DCC::joinRelay=UNUSED_PIN;
@@ -66,13 +78,19 @@ void DCC::begin(const FSH * motorShieldName, MotorDriver * mainDriver, MotorDriv
   // Initialise HAL layer before reading EEprom.
   IODevice::begin();
 
+#ifdef EESTORE_LOAD_AFTER_WAVEFORM
+  DCCWaveform::begin(mainDriver,progDriver);
+#endif
+
 #ifndef DISABLE_EEPROM
   // Load stuff from EEprom
   (void)EEPROM; // tell compiler not to warn this is unused
   EEStore::init();
 #endif
 
+#ifndef EESTORE_LOAD_AFTER_WAVEFORM
   DCCWaveform::begin(mainDriver,progDriver);
+#endif
 }
 
 void DCC::setJoinRelayPin(byte joinRelayPin) {
@@ -90,6 +108,53 @@ void DCC::setThrottle( uint16_t cab, uint8_t tSpeed, bool tDirection)  {
   updateLocoReminder(cab, speedCode );
 }
 
+void DCC::emergencyStop(uint16_t cab) {
+  int reg=-1;
+  if (cab!=0) reg=lookupSpeedTable(cab,false);
+  // Keep the loco's direction, broadcasts leave it to each decoder
+  bool forward= (reg>=0) && (speedTable[reg].speedCode & 0x80);
+  uint8_t b[3];
+  uint8_t nB = 0;
+  if (cab > HIGHEST_SHORT_ADDR)
+    b[nB++] = highByte(cab) | 0xC0;    // convert train number into a two-byte address
+  b[nB++] = lowByte(cab);
+  // Basic speed instruction, e-stop, which decoders obey in any speed step mode
+  b[nB++] = 0b01000001 | (forward ? 0b00100000 : 0);
+  // Speeds still queued for the loco(s) were set before the stop, so mustn't follow it.
+  // Nor must the interrupt's reminders, until the loop sends the stopped speed.
+  DCCWaveform::mainTrack.schedulePriorityPacket(b, nB, 2, cab);
+  DCCWaveform::forgetReminder(cab);
+  if (cab==0) updateLocoReminder(0, 1);  // all locos in one pass
+  else if (reg>=0) updateLocoReminder(cab, forward ? 0x81 : 0x01);
+}
+
+// Speed steps between two speed codes, where stop (0) is next to speed 2, 
+// and changing direction goes through stop.
+static uint16_t rampDistance(byte fromCode, byte toCode) {
+  byte from=fromCode & 0x7F;
+  byte to=toCode & 0x7F;
+  from = from>1 ? from-1 : 0;
+  to = to>1 ? to-1 : 0;
+  if ((fromCode ^ toCode) & 0x80) return from+to;
+  return from>to ? from-to : to-from;
+}
+
+void DCC::setThrottleRamp(uint16_t cab, uint8_t tSpeed, bool tDirection, uint16_t rampMs) {
+  byte target = (tSpeed & 0x7F)  + tDirection * 128;
+  int reg=lookupSpeedTable(cab);
+  if (reg<0) return;
+  uint16_t steps=rampDistance(speedTable[reg].speedCode, target);
+  // emergency stops are never ramped
+  if (rampMs==0 || steps<2 || (target & 0x7F)==1) {
+    setThrottle(cab, tSpeed, tDirection);
+    return;
+  }
+  speedTable[reg].targetSpeedCode=target;
+  speedTable[reg].rampInterval=rampMs/steps ? rampMs/steps : 1;
+  speedTable[reg].lastRampStep=millis();
+  rampActive=true;
+}
+
 void DCC::setThrottle2( uint16_t cab, byte speedCode)  {
 
   uint8_t b[4];
@@ -129,6 +194,7 @@ void DCC::setThrottle2( uint16_t cab, byte speedCode)  {
   }
 
   DCCWaveform::mainTrack.schedulePacket(b, nB, 0);
+  DCCWaveform::setReminder(cab, b, nB);
 }
 
 void DCC::setFunctionInternal(int cab, byte byte1, byte byte2) {
@@ -159,9 +225,9 @@ bool DCC::getThrottleDirection(int cab) {
 
 // Set function to value on or off
 void DCC::setFn( int cab, int16_t functionNumber, bool on) {
-  if (cab<=0 ) return;
+  if (cab<=0 || functionNumber<0) return;
 
-  if (functionNumber>28) {
+  if (functionNumber>MAX_FUNCTION_NUMBER) {
     //non reminding advanced binary bit set
     byte b[5];
     byte nB = 0;
@@ -186,55 +252,50 @@ void DCC::setFn( int cab, int16_t functionNumber, bool on) {
 
   // Take care of functions:
   // Set state of function
-  unsigned long previous=speedTable[reg].functions;
-  unsigned long funcmask = (1UL<<functionNumber);
-  if (on) {
-      speedTable[reg].functions |= funcmask;
-  } else {
-      speedTable[reg].functions &= ~funcmask;
-  }
-  if (speedTable[reg].functions != previous) {
-    updateGroupflags(speedTable[reg].groupFlags, functionNumber);
-    CommandDistributor::broadcastLoco(reg);
-  }
+  byte & functionByte=speedTable[reg].functions[functionNumber>>3];
+  byte funcmask = 1<<(functionNumber & 7);
+  if (on == ((functionByte & funcmask)!=0)) return;
+  functionByte ^= funcmask;
+  functionChanged(reg, functionNumber);
 }
 
 // Flip function state
 void DCC::changeFn( int cab, int16_t functionNumber) {
-  if (cab<=0 || functionNumber>28) return;
+  if (cab<=0 || functionNumber<0 || functionNumber>MAX_FUNCTION_NUMBER) return;
   int reg = lookupSpeedTable(cab);
   if (reg<0) return;
-  unsigned long funcmask = (1UL<<functionNumber);
-  speedTable[reg].functions ^= funcmask;
-  updateGroupflags(speedTable[reg].groupFlags, functionNumber);
-  CommandDistributor::broadcastLoco(reg);
+  speedTable[reg].functions[functionNumber>>3] ^= 1<<(functionNumber & 7);
+  functionChanged(reg, functionNumber);
 }
 
 int DCC::getFn( int cab, int16_t functionNumber) {
-  if (cab<=0 || functionNumber>28) return -1;  // unknown
+  if (cab<=0 || functionNumber<0 || functionNumber>MAX_FUNCTION_NUMBER) return -1;  // unknown
   int reg = lookupSpeedTable(cab);
   if (reg<0) return -1;
 
-  unsigned long funcmask = (1UL<<functionNumber);
-  return  (speedTable[reg].functions & funcmask)? 1 : 0;
+  return (speedTable[reg].functions[functionNumber>>3] >> (functionNumber & 7)) & 1;
 }
 
-// Set the group flag to say we have touched the particular group.
-// A group will be reminded only if it has been touched.
-void DCC::updateGroupflags(byte & flags, int16_t functionNumber) {
-  byte groupMask;
-  if (functionNumber<=4)       groupMask=FN_GROUP_1;
-  else if (functionNumber<=8)  groupMask=FN_GROUP_2;
-  else if (functionNumber<=12) groupMask=FN_GROUP_3;
-  else if (functionNumber<=20) groupMask=FN_GROUP_4;
-  else                         groupMask=FN_GROUP_5;
-  flags |= groupMask;
+// The group of a changed function is sent ahead of the reminder rotation,
+// and from then on reminded.  Untouched groups are never sent.
+void DCC::functionChanged(int reg, int16_t functionNumber) {
+  uint16_t groupMask=1<<functionGroup(functionNumber);
+  speedTable[reg].groupFlags |= groupMask;
+  speedTable[reg].changedFlags |= groupMask;
+  CommandDistributor::broadcastLoco(reg);
 }
 
+// F0-F31, as reported in <l> and to throttles
 uint32_t DCC::getFunctionMap(int cab) {
   if (cab<=0) return 0;  // unknown pretend all functions off
   int reg = lookupSpeedTable(cab);
-  return (reg<0)?0:speedTable[reg].functions;
+  return (reg<0)?0:getFunctionMap(speedTable[reg]);
+}
+
+uint32_t DCC::getFunctionMap(const LOCO & l) {
+  uint32_t map=0;
+  for (byte b=0; b<4 && b<sizeof(l.functions); b++) map |= (uint32_t)l.functions[b] << (8*b);
+  return map;
 }
 
 void DCC::setAccessory(int address, byte number, bool activate) {
@@ -246,17 +307,83 @@ void DCC::setAccessory(int address, byte number, bool activate) {
     return;
   if(number != (number & 3))
     return;
-  byte b[2];
 
-  b[0] = address % 64 + 128;                                     // first byte is of the form 10AAAAAA, where AAAAAA represent 6 least signifcant bits of accessory address
-  b[1] = ((((address / 64) % 8) << 4) + (number % 4 << 1) + activate % 2) ^ 0xF8; // second byte is of the form 1AAACDDD, where C should be 1, and the least significant D represent activate/deactivate
-
-  DCCWaveform::mainTrack.schedulePacket(b, 2, 4);      // Repeat the packet four times
+  queueAccessory(address<<2 | number, activate);
 #if defined(EXRAIL_ACTIVE)
   RMFT2::activateEvent(address<<2|number,activate);
 #endif
 }
 
+// Set the aspect of an extended accessory decoder, e.g. a signal head, with a 
+// single packet.
+void DCC::setExtendedAccessory(int address, byte number, byte aspect) {
+  #ifdef DIAG_IO
+  DIAG(F("DCC::setExtendedAccessory(%d,%d,%d)"), address, number, aspect);
+  #endif
+  if(address != (address & 511))
+    return;
+  if(number != (number & 3))
+    return;
+
+  queueAccessory(ACCESSORY_EXTENDED | address<<2 | number, aspect);
+}
+
+// Queue a command to an accessory output, replacing one to the same output 
+// which has not been completely sent yet.
+void DCC::queueAccessory(uint16_t output, byte data) {
+  ACCESSORY *entry=NULL;
+  for (byte i=0; i<ACCESSORY_QUEUE_SIZE; i++) {
+    ACCESSORY *a=&accessoryQueue[i];
+    if (a->sends>0 && a->output==output) {
+      entry=a;
+      break;
+    }
+    if (a->sends==0 && entry==NULL) entry=a;
+  }
+  if (entry==NULL) {
+    // Queue full, so send it straight away
+    byte b[3];
+    byte nBytes=accessoryPacket(b, output, data);
+    DCCWaveform::mainTrack.schedulePacket(b, nBytes, ACCESSORY_SENDS-1);
+    return;
+  }
+  entry->output=output;
+  entry->data=data;
+  entry->sends=ACCESSORY_SENDS;
+}
+
+// Send one packet for the next queued accessory command.
+// The queued commands take turns, so their repeats are interleaved.
+bool DCC::sendAccessory() {
+  for (byte i=0; i<ACCESSORY_QUEUE_SIZE; i++) {
+    byte slot=(nextAccessory+i) % ACCESSORY_QUEUE_SIZE;
+    ACCESSORY *a=&accessoryQueue[slot];
+    if (a->sends==0) continue;
+    byte b[3];
+    byte nBytes=accessoryPacket(b, a->output, a->data);
+    DCCWaveform::mainTrack.schedulePacket(b, nBytes, 0);
+    a->sends--;
+    nextAccessory=(slot+1) % ACCESSORY_QUEUE_SIZE;
+    return true;
+  }
+  return false;
+}
+
+// Build a basic or extended accessory packet, returning its length.
+byte DCC::accessoryPacket(byte *b, uint16_t output, byte data) {
+  int address=(output>>2) & 511;
+  byte number=output & 3;
+
+  b[0] = address % 64 + 128;                                     // first byte is of the form 10AAAAAA, where AAAAAA represent 6 least signifcant bits of accessory address
+  if (output & ACCESSORY_EXTENDED) {
+    b[1] = ((((address / 64) % 8) << 4) + (number << 1) + 1) ^ 0x70;  // second byte is of the form 0AAA0AA1, with the high address bits inverted
+    b[2] = data;                                                 // third byte is the aspect
+    return 3;
+  }
+  b[1] = ((((address / 64) % 8) << 4) + (number % 4 << 1) + data % 2) ^ 0xF8; // second byte is of the form 1AAACDDD, where C should be 1, and the least significant D represent activate/deactivate
+  return 2;
+}
+
 //
 // writeCVByteMain: Write a byte with PoM on main. This writes
 // the 5 byte sized packet to implement this DCC function
@@ -273,6 +400,40 @@ void DCC::writeCVByteMain(int cab, int cv, byte bValue)  {
   b[nB++] = bValue;
 
   DCCWaveform::mainTrack.schedulePacket(b, nB, 4);
+  cacheCV(cab, cv, bValue, CVCACHE_VALID | CVCACHE_CHANGED);
+}
+
+//
+// readCVByteMain: Ask a decoder on main for a CV with a PoM verify packet.
+// The decoder answers in the RailCom cutout, and the value goes into the CV 
+// cache and is broadcast as <r CAB CV VALUE>.
+//
+void DCC::readCVByteMain(int cab, int cv)  {
+  byte b[5];
+  byte nB = 0;
+  if (cab > HIGHEST_SHORT_ADDR)
+    b[nB++] = highByte(cab) | 0xC0;    // convert train number into a two-byte address
+
+  b[nB++] = lowByte(cab);
+  b[nB++] = cv1(VERIFY_BYTE_MAIN, cv);
+  b[nB++] = cv2(cv);
+  b[nB++] = 0;
+
+  railcomPomCab = cab;
+  railcomPomCv = cv;
+  railcomPomTime = millis();
+  DCCWaveform::mainTrack.schedulePacket(b, nB, 4);
+}
+
+void DCC::railcomPOM(byte value) {
+  if (railcomPomCab == 0) return;
+  if (millis() - railcomPomTime > RAILCOM_POM_TIMEOUT) {
+    railcomPomCab = 0;
+    return;
+  }
+  cacheCV(railcomPomCab, railcomPomCv, value, CVCACHE_VALID);
+  CommandDistributor::broadcastCV(railcomPomCab, railcomPomCv, value);
+  railcomPomCab = 0;  // answered, repeats of the packet are answered again
 }
 
 //
@@ -294,6 +455,7 @@ void DCC::writeCVBitMain(int cab, int cv, byte bNum, bool bValue)  {
   b[nB++] = WRITE_BIT | (bValue ? BIT_ON : BIT_OFF) | bNum;
 
   DCCWaveform::mainTrack.schedulePacket(b, nB, 4);
+  cacheCVBit(cab, cv, bNum, bValue, true);
 }
 
 void DCC::setProgTrackSyncMain(bool on) {
@@ -429,7 +591,17 @@ const ackOp FLASH LOCO_ID_PROG[] = {
       SETBIT,(ackOp)5,
       V0, WACK, ITSKIP,  // Skip to SKIPTARGET if bit 5 of CV29 is zero
 
-      // Long locoid
+      // Long locoid, trying the likely ones first
+      GUESSLONGID,
+      SETCV, (ackOp)17,
+      SETBYTEH,
+      VB, WACK, NAKGUESS,
+      STASHLOCOID,
+      SETCV, (ackOp)18,
+      SETBYTEL,
+      VB, WACK, NAKGUESS,
+      COMBINELOCOID,
+      ENDGUESS,              // no guess was right, so read it bit by bit
       SETCV, (ackOp)17,       // CV 17 is part of locoid
       STARTMERGE,
       V0, WACK, MERGE,  // read and merge bit 1 etc
@@ -458,6 +630,11 @@ const ackOp FLASH LOCO_ID_PROG[] = {
 
       // ITSKIP Skips to here if CV 29 bit 5 was zero. so read CV 1 and return that
       SKIPTARGET,
+      GUESSSHORTID,
+      SETCV, (ackOp)1,
+      VB, WACK, NAKGUESS,
+      ITCB,
+      ENDGUESS,              // no guess was right, so read it bit by bit
       SETCV, (ackOp)1,
       STARTMERGE,
       SETBIT, (ackOp)6,  // skip over first bit as we know its a zero
@@ -523,7 +700,9 @@ void DCC::writeCVBit(int16_t cv, byte bitNum, bool bitValue, ACK_CALLBACK callba
 }
 
 void  DCC::verifyCVByte(int16_t cv, byte byteValue, ACK_CALLBACK callback)  {
-  ackManagerSetup(cv, byteValue,  VERIFY_BYTE_PROG, callback);
+  int16_t cached=getCachedCV(cv);
+  if (cached>=0) callback(cached);
+  else ackManagerSetup(cv, byteValue,  VERIFY_BYTE_PROG, callback);
 }
 
 void DCC::verifyCVBit(int16_t cv, byte bitNum, bool bitValue, ACK_CALLBACK callback)  {
@@ -538,13 +717,61 @@ void DCC::readCVBit(int16_t cv, byte bitNum, ACK_CALLBACK callback)  {
 }
 
 void DCC::readCV(int16_t cv, ACK_CALLBACK callback)  {
-  ackManagerSetup(cv, 0,READ_CV_PROG, callback);
+  int16_t cached=getCachedCV(cv);
+  if (cached>=0) callback(cached);
+  else ackManagerSetup(cv, 0,READ_CV_PROG, callback);
+}
+
+void DCC::readCVBatch(int16_t cv, bool moreToFollow, ACK_CALLBACK callback)  {
+  if (ackManagerSetup(cv, 0,READ_CV_PROG, callback))
+    ackManagerKeepPower=moreToFollow;  // not if setup has failed
 }
 
 void DCC::getLocoId(ACK_CALLBACK callback) {
+  if (ackManagerProg) {  // don't disturb the guesses of a read in progress
+    callback(-1);
+    return;
+  }
+  makeLocoIdGuesses();
   ackManagerSetup(0,0, LOCO_ID_PROG, callback);
 }
 
+// Verifying a guessed address costs one or two packets, where reading it bit by bit
+// costs 8 for a short address and 18 for a long one.
+void DCC::makeLocoIdGuesses() {
+  locoIdGuessCount=0;
+  locoIdGuessNext=0;
+  for (byte i=0; i<LOCO_ID_RECENT; i++) addLocoIdGuess(recentLocoIds[i]);
+#if defined(EXRAIL_ACTIVE)
+  for (int16_t r=0; r<RMFT2::rosterNameCount; r++) addLocoIdGuess(GETFLASHW(RMFT2::rosterIdList+r));
+#endif
+  for (int reg=0; reg<MAX_LOCOS; reg++) addLocoIdGuess(speedTable[reg].loco);
+}
+
+void DCC::addLocoIdGuess(int16_t id) {
+  if (id<=0 || locoIdGuessCount>=LOCO_ID_GUESSES) return;
+  for (byte i=0; i<locoIdGuessCount; i++)
+    if (locoIdGuesses[i]==id) return;
+  locoIdGuesses[locoIdGuessCount++]=id;
+}
+
+// Next guess of the kind wanted, 0 if there are no more
+int16_t DCC::nextLocoIdGuess(bool longAddr) {
+  while (locoIdGuessNext<locoIdGuessCount) {
+    int16_t id=locoIdGuesses[locoIdGuessNext++];
+    if ((id>HIGHEST_SHORT_ADDR)==longAddr) return id;
+  }
+  return 0;
+}
+
+void DCC::rememberLocoId(int16_t id) {
+  byte i;
+  for (i=0; i<LOCO_ID_RECENT-1; i++)
+    if (recentLocoIds[i]==id) break;
+  for ( ; i>0; i--) recentLocoIds[i]=recentLocoIds[i-1];
+  recentLocoIds[0]=id;
+}
+
 void DCC::setLocoId(int id,ACK_CALLBACK callback) {
   if (id<1 || id>10239) { //0x27FF according to standard
     callback(-1);
@@ -558,16 +785,122 @@ void DCC::setLocoId(int id,ACK_CALLBACK callback) {
 
 void DCC::forgetLoco(int cab) {  // removes any speed reminders for this loco
   setThrottle2(cab,1); // ESTOP this loco if still on track
-  int reg=lookupSpeedTable(cab);
-  if (reg>=0) speedTable[reg].loco=0;
+  forgetReminder(cab);
   setThrottle2(cab,1); // ESTOP if this loco still on track
+  DCCWaveform::forgetReminder(cab);  // which the second stop put back in the pool
+}
+
+// Stop reminding a loco, without stopping it
+void DCC::forgetReminder(int cab) {
+  DCCWaveform::forgetReminder(cab);
+  int reg=lookupSpeedTable(cab,false);
+  if (reg>=0) {
+    speedTable[reg].loco=0;
+    rebuildLocoIndex();
+  }
 }
 void DCC::forgetAllLocos() {  // removes all speed reminders
   setThrottle2(0,1); // ESTOP all locos still on track
   for (int i=0;i<MAX_LOCOS;i++) speedTable[i].loco=0;
+  rebuildLocoIndex();
+}
+
+// A consist is driven as a single loco at the consist address, so its 
+// members cost no speed packets or reminder slots of their own.  A member 
+// keeps its own address for functions, and for leaving the consist.
+bool DCC::setConsist(byte consist, const int16_t members[], byte count) {
+#if MAX_CONSISTS > 0
+  if (consist<1 || consist>HIGHEST_SHORT_ADDR || count==0 || count>MAX_CONSIST_MEMBERS) return false;
+  for (byte m=0; m<count; m++) {
+    int loco=abs(members[m]);
+    if (loco==0 || loco>10239 || loco==consist) return false;  // 0x27FF according to standard
+    for (byte other=0; other<m; other++)
+      if (abs(members[other])==loco) return false;  // listed twice
+  }
+  removeConsist(consist);
+  byte c;
+  for (c=0; c<MAX_CONSISTS; c++) if (consists[c].consist==0) break;
+  if (c==MAX_CONSISTS) return false;
+
+  // the consist carries on at the lead loco's speed
+  int lead=lookupSpeedTable(abs(members[0]),false);
+  byte speedCode=(lead>=0) ? speedTable[lead].speedCode : 128;
+  if (members[0]<0) speedCode^=0x80;
+
+  for (byte m=0; m<count; m++) {
+    leaveConsists(members[m]);
+    int16_t loco=abs(members[m]);
+    writeCVByteMain(loco, 19, consist | (members[m]<0 ? 0x80 : 0));
+    forgetReminder(loco);
+  }
+  consists[c].consist=consist;
+  memset(consists[c].members, 0, sizeof(consists[c].members));
+  memcpy(consists[c].members, members, count*sizeof(members[0]));
+  setThrottle(consist, speedCode & 0x7F, speedCode & 0x80);
+  return true;
+#else
+  (void)consist; (void)members; (void)count;
+  return false;
+#endif
+}
+
+void DCC::removeConsist(byte consist) {
+#if MAX_CONSISTS > 0
+  for (byte c=0; c<MAX_CONSISTS; c++) {
+    if (consists[c].consist!=consist || consist==0) continue;
+    int reg=lookupSpeedTable(consist,false);
+    byte speedCode=(reg>=0) ? speedTable[reg].speedCode : 128;
+    // Members carry on at the consist speed on their own address
+    for (byte m=0; m<MAX_CONSIST_MEMBERS; m++) {
+      int16_t member=consists[c].members[m];
+      if (member==0) continue;
+      writeCVByteMain(abs(member), 19, 0);
+      byte memberSpeed=(member<0) ? speedCode^0x80 : speedCode;
+      setThrottle(abs(member), memberSpeed & 0x7F, memberSpeed & 0x80);
+    }
+    consists[c].consist=0;
+    forgetReminder(consist);
+  }
+#else
+  (void)consist;
+#endif
+}
+
+// A loco joining a consist leaves any it was in, its CV19 is rewritten anyway
+void DCC::leaveConsists(int16_t loco) {
+#if MAX_CONSISTS > 0
+  for (byte c=0; c<MAX_CONSISTS; c++)
+    for (byte m=0; m<MAX_CONSIST_MEMBERS; m++)
+      if (consists[c].consist && abs(consists[c].members[m])==abs(loco)) consists[c].members[m]=0;
+#else
+  (void)loco;
+#endif
+}
+
+void DCC::displayConsists(Print *stream) {
+#if MAX_CONSISTS > 0
+  for (byte c=0; c<MAX_CONSISTS; c++) {
+    if (consists[c].consist==0) continue;
+    StringFormatter::send(stream, F("<K %d"), consists[c].consist);
+    for (byte m=0; m<MAX_CONSIST_MEMBERS; m++)
+      if (consists[c].members[m]) StringFormatter::send(stream, F(" %d"), consists[c].members[m]);
+    StringFormatter::send(stream, F(">\n"));
+  }
+#else
+  (void)stream;
+#endif
 }
 
 byte DCC::loopStatus=0;
+#if MAX_CONSISTS > 0
+DCC::CONSIST DCC::consists[MAX_CONSISTS];
+#endif
+int16_t DCC::railcomPomCab=0;
+int16_t DCC::railcomPomCv=0;
+unsigned long DCC::railcomPomTime=0;
+DCC::ACCESSORY DCC::accessoryQueue[ACCESSORY_QUEUE_SIZE];
+byte DCC::nextAccessory=0;
+bool DCC::accessoryTurn=false;
 
 void DCC::loop()  {
   DCCWaveform::loop(ackManagerProg!=NULL); // power overload checks
@@ -576,14 +909,62 @@ void DCC::loop()  {
 }
 
 void DCC::issueReminders() {
-  // if the main track transmitter still has a pending packet, skip this time around.
-  if ( DCCWaveform::mainTrack.packetPending) return;
+  if (rampActive) stepRamps();
+
+  // if the main track transmitter still has queued packets, skip this time around
+  // so that reminders never delay packets sent on request.
+  if ( DCCWaveform::mainTrack.isPacketPending()) {
+#ifdef DIAG_WAVE
+    reminderSkips++;
+#endif
+    return;
+  }
+
+  // Queued accessory commands take turns with loco reminders.
+  accessoryTurn=!accessoryTurn;
+  if (accessoryTurn && sendAccessory()) return;
+
+  // A loco whose speed has just changed gets its reminder first, as soon as
+  // the minimum gap between packets to the same address has passed, and
+  // changed function groups are sent next.
+  uint16_t now=millis();
+  for (int reg=0;reg<MAX_LOCOS;reg++) {
+    uint16_t changed=speedTable[reg].changedFlags;
+    if (speedTable[reg].loco <= 0 || !changed) continue;
+    if ((changed & SPEED_CHANGED)
+        && (uint16_t)(now-speedTable[reg].lastSpeedReminder) >= MIN_REMINDER_GAP) {
+      speedTable[reg].changedFlags &= ~SPEED_CHANGED;
+      setThrottle2(speedTable[reg].loco, speedTable[reg].speedCode);
+      speedReminderSent(reg);
+      return;
+    }
+    changed &= ~SPEED_CHANGED;
+    if (changed) {
+      byte group=0;
+      while (!(changed & (1<<group))) group++;
+      sendFunctionGroup(reg, group);
+      return;
+    }
+  }
 
   // This loop searches for a loco in the speed table starting at nextLoco and cycling back around
   for (int reg=0;reg<MAX_LOCOS;reg++) {
        int slot=reg+nextLoco;
        if (slot>=MAX_LOCOS) slot-=MAX_LOCOS;
        if (speedTable[slot].loco > 0) {
+          // A loco part way through its reminder cycle is always finished,
+          // otherwise locos that are not yet due are passed over.
+          if (loopStatus==0 && !isReminderDue(slot)) continue;
+          // Each pass round the table refreshes the next function group
+          if (loopStatus==0 && slot<nextLoco) {
+            if (++refreshGroup>=FN_GROUPS) refreshGroup=0;
+#ifdef DIAG_WAVE
+            unsigned long now=millis();
+            lastReminderCycle=now-reminderCycleStart;
+            if (lastReminderCycle>maxReminderCycle) maxReminderCycle=lastReminderCycle;
+            reminderCycleStart=now;
+#endif
+          }
           // have found the next loco to remind
           // issueReminder will return true if this loco is completed (ie speed and functions)
           if (issueReminder(slot)) nextLoco=slot+1;
@@ -592,46 +973,103 @@ void DCC::issueReminders() {
   }
 }
 
+// Move ramping locos on by the speed steps now due.  The new speed is 
+// sent as a changed speed reminder, and only broadcast once the ramp ends.
+void DCC::stepRamps() {
+  uint16_t now=millis();
+  rampActive=false;
+  for (int reg=0;reg<MAX_LOCOS;reg++) {
+    LOCO & l=speedTable[reg];
+    if (l.loco<=0 || l.speedCode==l.targetSpeedCode) continue;
+    byte speedCode=l.speedCode;
+    while ((uint16_t)(now-l.lastRampStep) >= l.rampInterval && speedCode!=l.targetSpeedCode) {
+      speedCode=rampStep(speedCode, l.targetSpeedCode);
+      l.lastRampStep+=l.rampInterval;
+    }
+    if (speedCode!=l.speedCode) {
+      l.speedCode=speedCode;
+      l.changedFlags |= SPEED_CHANGED;
+      if (speedCode==l.targetSpeedCode) CommandDistributor::broadcastLoco(reg);
+    }
+    if (speedCode!=l.targetSpeedCode) rampActive=true;
+  }
+}
+
+// One speed step from speedCode towards targetSpeedCode
+byte DCC::rampStep(byte speedCode, byte targetSpeedCode) {
+  byte direction=speedCode & 0x80;
+  byte speed=speedCode & 0x7F;
+  if (speed==1) speed=0;
+  byte target=targetSpeedCode & 0x7F;
+  if (direction!=(targetSpeedCode & 0x80)) {
+    if (speed==0) return targetSpeedCode & 0x80;  // reverse while stopped
+    target=0;
+  }
+  if (speed>target) speed = speed>2 ? speed-1 : 0;
+  else if (speed<target) speed = speed<2 ? 2 : speed+1;
+  speedCode = direction | speed;
+  // arriving at stop leaves the direction to change on the next step
+  if (speed==(targetSpeedCode & 0x7F) && direction==(targetSpeedCode & 0x80)) return targetSpeedCode;
+  return speedCode;
+}
+
+// Moving locos are reminded on every cycle, stopped ones only
+// every STOPPED_REMINDER_INTERVAL.
+bool DCC::isReminderDue(int reg) {
+  if ((speedTable[reg].speedCode & 0x7F) > 1) return true;
+  return (uint16_t)((uint16_t)millis()-speedTable[reg].lastSpeedReminder) >= STOPPED_REMINDER_INTERVAL;
+}
+
+// Keep track of the worst case interval between speed packets for a loco
+void DCC::speedReminderSent(int reg) {
+  uint16_t now=millis();
+  uint16_t gap=now-speedTable[reg].lastSpeedReminder;
+  if (gap>speedTable[reg].maxReminderGap) speedTable[reg].maxReminderGap=gap;
+  speedTable[reg].lastSpeedReminder=now;
+}
+
+// A loco's reminder is its speed, then the function group being refreshed
+// on this pass, if the loco uses it.  Returns true once the loco is done.
 bool DCC::issueReminder(int reg) {
-  unsigned long functions=speedTable[reg].functions;
-  int loco=speedTable[reg].loco;
-  byte flags=speedTable[reg].groupFlags;
-
-  switch (loopStatus) {
-        case 0:
-      //   DIAG(F("Reminder %d speed %d"),loco,speedTable[reg].speedCode);
-         setThrottle2(loco, speedTable[reg].speedCode);
-         break;
-       case 1: // remind function group 1 (F0-F4)
-          if (flags & FN_GROUP_1)
-              setFunctionInternal(loco,0, 128 | ((functions>>1)& 0x0F) | ((functions & 0x01)<<4)); // 100D DDDD
-          break;
-       case 2: // remind function group 2 F5-F8
-          if (flags & FN_GROUP_2)
-              setFunctionInternal(loco,0, 176 | ((functions>>5)& 0x0F));                           // 1011 DDDD
-          break;
-       case 3: // remind function group 3 F9-F12
-          if (flags & FN_GROUP_3)
-              setFunctionInternal(loco,0, 160 | ((functions>>9)& 0x0F));                           // 1010 DDDD
-          break;
-       case 4: // remind function group 4 F13-F20
-          if (flags & FN_GROUP_4)
-              setFunctionInternal(loco,222, ((functions>>13)& 0xFF));
-          flags&= ~FN_GROUP_4;  // dont send them again
-          break;
-       case 5: // remind function group 5 F21-F28
-          if (flags & FN_GROUP_5)
-              setFunctionInternal(loco,223, ((functions>>21)& 0xFF));
-          flags&= ~FN_GROUP_5;  // dont send them again
-          break;
-      }
-      loopStatus++;
-      // if we reach status 6 then this loco is done so
-      // reset status to 0 for next loco and return true so caller
-      // moves on to next loco.
-      if (loopStatus>5) loopStatus=0;
-      return loopStatus==0;
+  if (loopStatus==0) {
+    //   DIAG(F("Reminder %d speed %d"),loco,speedTable[reg].speedCode);
+    setThrottle2(speedTable[reg].loco, speedTable[reg].speedCode);
+    speedTable[reg].changedFlags &= ~SPEED_CHANGED;
+    speedReminderSent(reg);
+    if (speedTable[reg].groupFlags & (1<<refreshGroup)) {
+      loopStatus=1;
+      return false;
     }
+    return true;
+  }
+  loopStatus=0;
+  sendFunctionGroup(reg, refreshGroup);
+  return true;
+}
+
+void DCC::sendFunctionGroup(int reg, byte group) {
+  speedTable[reg].changedFlags &= ~(1<<group);
+  const byte * functions=speedTable[reg].functions;
+  byte first=FN_GROUP_START[group];
+  // the group's bits, starting with its first function
+  uint16_t bits=functions[first>>3];
+  if ((first>>3)+1 < (int)sizeof(speedTable[reg].functions)) bits |= functions[(first>>3)+1]<<8;
+  bits >>= first & 7;
+  int loco=speedTable[reg].loco;
+  switch (group) {
+    case 0: // F0-F4
+      setFunctionInternal(loco,0, 128 | ((bits>>1)& 0x0F) | ((bits & 0x01)<<4)); // 100D DDDD
+      break;
+    case 1: // F5-F8
+      setFunctionInternal(loco,0, 176 | (bits & 0x0F));                           // 1011 DDDD
+      break;
+    case 2: // F9-F12
+      setFunctionInternal(loco,0, 160 | (bits & 0x0F));                           // 1010 DDDD
+      break;
+    default: // eight at a time from F13
+      setFunctionInternal(loco,FN_GROUP_OPCODE[group-3], bits & 0xFF);
+  }
+}
 
 
 
@@ -647,40 +1085,69 @@ byte DCC::cv2(int cv)  {
   return lowByte(cv);
 }
 
+// The speed table slots are indexed by loco address in an open addressing
+// hash table. Each bucket holds slot+1 so that zero marks an empty bucket.
+static inline byte locoHash(int locoId) {
+  return (locoId ^ (locoId>>7)) & (LOCO_INDEX_SIZE-1);
+}
+
 int DCC::lookupSpeedTable(int locoId, bool autoCreate) {
-  // determine speed reg for this loco
-  int firstEmpty = MAX_LOCOS;
-  int reg;
-  for (reg = 0; reg < MAX_LOCOS; reg++) {
-    if (speedTable[reg].loco == locoId) break;
-    if (speedTable[reg].loco == 0 && firstEmpty == MAX_LOCOS) firstEmpty = reg;
+  if (locoId<=0) return -1;
+  // find the loco in the index, or the empty bucket where it belongs
+  byte bucket=locoHash(locoId);
+  while (locoIndex[bucket]) {
+    int reg=locoIndex[bucket]-1;
+    if (speedTable[reg].loco == locoId) return reg;
+    bucket=(bucket+1) & (LOCO_INDEX_SIZE-1);
   }
 
   // return -1 if not found and not auto creating
-  if (reg== MAX_LOCOS && !autoCreate) return -1; 
-  if (reg == MAX_LOCOS) reg = firstEmpty;
+  if (!autoCreate) return -1;
+  int reg;
+  for (reg = 0; reg < MAX_LOCOS; reg++) {
+    if (speedTable[reg].loco == 0) break;
+  }
   if (reg >= MAX_LOCOS) {
     DIAG(F("Too many locos"));
     return -1;
   }
-  if (reg==firstEmpty){
-        speedTable[reg].loco = locoId;
-        speedTable[reg].speedCode=128;  // default direction forward
-        speedTable[reg].groupFlags=0;
-        speedTable[reg].functions=0;
-  }
+  locoIndex[bucket]=reg+1;
+  speedTable[reg].loco = locoId;
+  speedTable[reg].speedCode=128;  // default direction forward
+  speedTable[reg].targetSpeedCode=128;
+  speedTable[reg].groupFlags=0;
+  speedTable[reg].changedFlags=0;
+  memset(speedTable[reg].functions,0,sizeof(speedTable[reg].functions));
+  speedTable[reg].lastSpeedReminder=millis();
+  speedTable[reg].maxReminderGap=0;
+  speedTable[reg].version=CommandDistributor::newVersion();
   return reg;
 }
 
+// Called when locos are removed from the speed table, as
+// linear probing does not allow buckets to be simply emptied.
+void DCC::rebuildLocoIndex() {
+  memset(locoIndex,0,sizeof(locoIndex));
+  for (int reg=0;reg<MAX_LOCOS;reg++) {
+    if (speedTable[reg].loco<=0) continue;
+    byte bucket=locoHash(speedTable[reg].loco);
+    while (locoIndex[bucket]) bucket=(bucket+1) & (LOCO_INDEX_SIZE-1);
+    locoIndex[bucket]=reg+1;
+  }
+}
+
 void  DCC::updateLocoReminder(int loco, byte speedCode) {
 
   if (loco==0) {
      // broadcast stop/estop but dont change direction
      for (int reg = 0; reg < MAX_LOCOS; reg++) {
        if (speedTable[reg].loco==0) continue;
+       speedReminderSent(reg);
        byte newspeed=(speedTable[reg].speedCode & 0x80) |  (speedCode & 0x7f);
+       speedTable[reg].targetSpeedCode=newspeed;  // a stop ends any ramp
        if (speedTable[reg].speedCode != newspeed) {
          speedTable[reg].speedCode = newspeed;
+         speedTable[reg].changedFlags |= SPEED_CHANGED;
          CommandDistributor::broadcastLoco(reg);
        }
      }
@@ -689,14 +1156,33 @@ void  DCC::updateLocoReminder(int loco, byte speedCode) {
 
   // determine speed reg for this loco
   int reg=lookupSpeedTable(loco);
-  if (reg>=0 && speedTable[reg].speedCode!=speedCode) {
+  if (reg<0) return;
+  speedReminderSent(reg);  // setThrottle has just sent the speed
+  speedTable[reg].targetSpeedCode = speedCode;  // a new speed ends any ramp
+  if (speedTable[reg].speedCode!=speedCode) {
     speedTable[reg].speedCode = speedCode;
+    speedTable[reg].changedFlags |= SPEED_CHANGED;
     CommandDistributor::broadcastLoco(reg);
   }
 }
 
 DCC::LOCO DCC::speedTable[MAX_LOCOS];
+byte DCC::locoIndex[LOCO_INDEX_SIZE];
 int DCC::nextLoco = 0;
+#ifdef DIAG_WAVE
+uint32_t DCC::reminderSkips = 0;
+unsigned long DCC::reminderCycleStart = 0;
+uint16_t DCC::lastReminderCycle = 0;
+uint16_t DCC::maxReminderCycle = 0;
+#endif
+byte DCC::refreshGroup = 0;
+bool DCC::rampActive=false;
+#if CV_CACHE_SIZE > 0
+DCC::CVCACHE DCC::cvCache[CV_CACHE_SIZE];
+#endif
+byte DCC::cvCacheNext=0;
+bool DCC::cvCacheReads=false;
+int16_t DCC::progLocoId=0;
 
 //ACK MANAGER
 ackOp  const *  DCC::ackManagerProg;
@@ -713,33 +1199,51 @@ int    DCC::ackManagerCv;
 byte   DCC::ackManagerBitNum;
 bool   DCC::ackReceived;
 bool   DCC::ackManagerRejoin;
+bool   DCC::ackManagerKeepPower=false;
+bool   DCC::ackManagerContinuing=false;
+int16_t DCC::locoIdGuesses[LOCO_ID_GUESSES];
+byte   DCC::locoIdGuessCount=0;
+byte   DCC::locoIdGuessNext=0;
+ackOp const *DCC::locoIdGuessOp;
+int16_t DCC::recentLocoIds[LOCO_ID_RECENT];
 
 CALLBACK_STATE DCC::callbackState=READY;
 
 ACK_CALLBACK DCC::ackManagerCallback;
 
-void  DCC::ackManagerSetup(int cv, byte byteValueOrBitnum, ackOp const program[], ACK_CALLBACK callback) {
+bool  DCC::ackManagerSetup(int cv, byte byteValueOrBitnum, ackOp const program[], ACK_CALLBACK callback) {
+  // Refuse, rather than overwrite, a prog track operation already in progress.
+  // Callers should queue behind the parser's prog commands (DCCEXParser::queueLocoId).
+  if (ackManagerProg) {
+    callback(-1);
+    return false;
+  }
+  // A read following on in a batch finds power and JOIN as the previous read left them
+  ackManagerContinuing=ackManagerKeepPower;
+  ackManagerKeepPower=false;
   if (!DCCWaveform::progTrack.canMeasureCurrent()) {
     callback(-2);
-    return;
+    return false;
   }
 
-  ackManagerRejoin=DCCWaveform::progTrackSyncMain;
-  if (ackManagerRejoin ) {
-        // Change from JOIN must zero resets packet.
-        setProgTrackSyncMain(false);
-        DCCWaveform::progTrack.sentResetsSincePacket = 0;
-      }
+  if (!ackManagerContinuing) {
+    ackManagerRejoin=DCCWaveform::progTrackSyncMain;
+    if (ackManagerRejoin ) {
+          // Change from JOIN must zero resets packet.
+          setProgTrackSyncMain(false);
+          DCCWaveform::progTrack.sentResetsSincePacket = 0;
+        }
 
-   DCCWaveform::progTrack.autoPowerOff=false;
-   if (DCCWaveform::progTrack.getPowerMode() == POWERMODE::OFF) {
-        DCCWaveform::progTrack.autoPowerOff=true;  // power off afterwards
-        if (Diag::ACK) DIAG(F("Auto Prog power on"));
-        DCCWaveform::progTrack.setPowerMode(POWERMODE::ON);
-	if (MotorDriver::commonFaultPin)
-	  DCCWaveform::mainTrack.setPowerMode(POWERMODE::ON);
-        DCCWaveform::progTrack.sentResetsSincePacket = 0;
-    }
+     DCCWaveform::progTrack.autoPowerOff=false;
+     if (DCCWaveform::progTrack.getPowerMode() == POWERMODE::OFF) {
+          DCCWaveform::progTrack.autoPowerOff=true;  // power off afterwards
+          if (Diag::ACK) DIAG(F("Auto Prog power on"));
+          DCCWaveform::progTrack.setPowerMode(POWERMODE::ON);
+          if (MotorDriver::commonFaultPin)
+            DCCWaveform::mainTrack.setPowerMode(POWERMODE::ON);
+          DCCWaveform::progTrack.sentResetsSincePacket = 0;
+      }
+  }
 
   ackManagerCv = cv;
   ackManagerProg = program;
@@ -749,11 +1253,16 @@ void  DCC::ackManagerSetup(int cv, byte byteValueOrBitnum, ackOp const program[]
   ackManagerByteVerify = byteValueOrBitnum;
   ackManagerBitNum=byteValueOrBitnum;
   ackManagerCallback = callback;
+  return true;
 }
 
-void  DCC::ackManagerSetup(int wordval, ackOp const program[], ACK_CALLBACK callback) {
+bool  DCC::ackManagerSetup(int wordval, ackOp const program[], ACK_CALLBACK callback) {
+  if (ackManagerProg) {
+    callback(-1);
+    return false;
+  }
   ackManagerWord=wordval;
-  ackManagerSetup(0, 0, program, callback);
+  return ackManagerSetup(0, 0, program, callback);
   }
 
 const byte RESET_MIN=8;  // tuning of reset counter before sending message
@@ -773,7 +1282,7 @@ void DCC::ackManagerLoop() {
     switch (opcode) {
       case BASELINE:
           if (DCCWaveform::progTrack.getPowerMode()==POWERMODE::OVERLOAD) return;
-      	  if (checkResets(DCCWaveform::progTrack.autoPowerOff || ackManagerRejoin  ? 20 : 3)) return;
+      	  if (checkResets(!ackManagerContinuing && (DCCWaveform::progTrack.autoPowerOff || ackManagerRejoin)  ? 20 : 3)) return;
           DCCWaveform::progTrack.setAckBaseline();
           callbackState=READY;
           break;
@@ -932,6 +1441,31 @@ void DCC::ackManagerLoop() {
             opcode=GETFLASH(ackManagerProg);
           }
           break;
+     case GUESSSHORTID:
+     case GUESSLONGID:
+          {
+            locoIdGuessOp=ackManagerProg;
+            int16_t id=nextLocoIdGuess(opcode==GUESSLONGID);
+            if (id>0) {
+              if (Diag::ACK) DIAG(F("Guess loco %d"),id);
+              ackManagerWord=id | 0xc000;  // CV17 and CV18 as setLocoId writes them
+              ackManagerByte=lowByte(id);
+              break;
+            }
+            // SKIP opcodes until ENDGUESS found
+            while (opcode!=ENDGUESS) {
+              ackManagerProg++;
+              opcode=GETFLASH(ackManagerProg);
+            }
+          }
+          break;
+
+     case NAKGUESS:
+          if (ackReceived) break;
+          ackManagerProg=locoIdGuessOp;  // wrong, so try the next guess
+          continue;
+
+     case ENDGUESS:
      case SKIPTARGET:
           break;
      default:
@@ -993,6 +1527,14 @@ void DCC::callback(int value) {
             break;
 
        case READY:  // ready after read, or write after power delay and off period.
+          cacheAckResult(value);
+          if (ackManagerKeepPower) {
+              ackManagerProg=NULL;  // no more steps to execute
+              // more reads of a batch follow, leave power and JOIN as they are
+              if (Diag::ACK) DIAG(F("Callback(%d)"),value);
+              (ackManagerCallback)( value);
+              return;
+          }
             // power off if we powered it on
            if (DCCWaveform::progTrack.autoPowerOff) {
               if (Diag::ACK) DIAG(F("Auto Prog power off"));
@@ -1012,16 +1554,152 @@ void DCC::callback(int value) {
     }
 }
 
+// CV cache
+
+void DCC::cacheCV(int16_t loco, int16_t cv, byte value, byte flags) {
+#if CV_CACHE_SIZE > 0
+  byte slot=cvCacheNext;
+  bool found=false;
+  for (byte i=0; i<CV_CACHE_SIZE; i++) {
+    if (cvCache[i].cv==cv && cvCache[i].loco==loco) {
+      slot=i;
+      found=true;
+      break;
+    }
+  }
+  if (!found) {
+    for (byte i=0; i<CV_CACHE_SIZE; i++) {
+      if (cvCache[i].cv==0) {
+        slot=i;
+        found=true;
+        break;
+      }
+    }
+  }
+  if (!found) cvCacheNext=(cvCacheNext+1) % CV_CACHE_SIZE;  // replace oldest
+  cvCache[slot].loco=loco;
+  cvCache[slot].cv=cv;
+  cvCache[slot].value=value;
+  cvCache[slot].flags=flags;
+#else
+  (void)loco; (void)cv; (void)value; (void)flags;
+#endif
+}
+
+// Record a bit write or read. When the CV is not already cached only a main
+// track write creates an entry, without a whole byte value.
+void DCC::cacheCVBit(int16_t loco, int16_t cv, byte bitNum, bool bitValue, bool create) {
+#if CV_CACHE_SIZE > 0
+  byte mask=1<<bitNum;
+  for (byte i=0; i<CV_CACHE_SIZE; i++) {
+    if (cvCache[i].cv==cv && cvCache[i].loco==loco) {
+      if (bitValue) cvCache[i].value |= mask;
+      else cvCache[i].value &= ~mask;
+      if (create) cvCache[i].flags |= CVCACHE_CHANGED;
+      return;
+    }
+  }
+  if (create) cacheCV(loco, cv, bitValue ? mask : 0, CVCACHE_CHANGED);
+#else
+  (void)loco; (void)cv; (void)bitNum; (void)bitValue; (void)create;
+#endif
+}
+
+// Returns the value of a prog track cv if reads may be answered from the
+// cache and the value is known to be what the decoder holds, else -1.
+int16_t DCC::getCachedCV(int16_t cv) {
+#if CV_CACHE_SIZE > 0
+  if (!cvCacheReads) return -1;
+  for (byte i=0; i<CV_CACHE_SIZE; i++) {
+    if (cvCache[i].cv==cv && cvCache[i].loco==progLocoId) {
+      if ((cvCache[i].flags & (CVCACHE_VALID | CVCACHE_CHANGED)) != CVCACHE_VALID) return -1;
+      if (Diag::ACK) DIAG(F("Cached cv=%d value=%d"), cv, cvCache[i].value);
+      return cvCache[i].value;
+    }
+  }
+#else
+  (void)cv;
+#endif
+  return -1;
+}
+
+// Called with the result of a prog track operation, before it goes to the caller
+void DCC::cacheAckResult(int value) {
+  if (value<0) return;
+  ackOp const * program=ackManagerProgStart;
+  if (program==READ_CV_PROG || program==VERIFY_BYTE_PROG)
+    cacheCV(progLocoId, ackManagerCv, value, CVCACHE_VALID);
+  else if (program==WRITE_BYTE_PROG)
+    cacheCV(progLocoId, ackManagerCv, ackManagerByte, CVCACHE_VALID);
+  else if (program==WRITE_BIT0_PROG || program==WRITE_BIT1_PROG)
+    cacheCVBit(progLocoId, ackManagerCv, ackManagerBitNum, program==WRITE_BIT1_PROG, false);
+  else if (program==READ_BIT_PROG || program==VERIFY_BIT0_PROG || program==VERIFY_BIT1_PROG)
+    cacheCVBit(progLocoId, ackManagerCv, ackManagerBitNum, value==1, false);
+  else if (program==SHORT_LOCO_ID_PROG || program==LONG_LOCO_ID_PROG)
+    forgetProgCVs();  // address changed
+  else if (program==LOCO_ID_PROG && value>0) {
+    // Now we know which loco this is, what has been read so far belongs to it
+    progLocoId= value & ~LONG_ADDR_MARKER;
+    rememberLocoId(progLocoId);
+#if CV_CACHE_SIZE > 0
+    for (byte i=0; i<CV_CACHE_SIZE; i++) {
+      if (cvCache[i].cv!=0 && cvCache[i].loco==0) {
+        CVCACHE entry=cvCache[i];
+        cvCache[i].cv=0;
+        cacheCV(progLocoId, entry.cv, entry.value, entry.flags);
+      }
+    }
+#endif
+  }
+}
+
+void DCC::forgetProgCVs() {
+#if CV_CACHE_SIZE > 0
+  for (byte i=0; i<CV_CACHE_SIZE; i++)
+    if (cvCache[i].loco==0) cvCache[i].cv=0;
+#endif
+  progLocoId=0;
+}
+
+void DCC::displayCVCache(Print * stream) {
+  int used=0;
+#if CV_CACHE_SIZE > 0
+  for (byte i=0; i<CV_CACHE_SIZE; i++) {
+    if (cvCache[i].cv==0) continue;
+    used++;
+    if (cvCache[i].flags & CVCACHE_VALID)
+      StringFormatter::send(stream,F("cab=%d, cv=%d, value=%d%S\n"),
+         cvCache[i].loco, cvCache[i].cv, cvCache[i].value,
+         (cvCache[i].flags & CVCACHE_CHANGED) ? F(", changed") : F(""));
+    else
+      StringFormatter::send(stream,F("cab=%d, cv=%d, bits=%b, changed\n"),
+         cvCache[i].loco, cvCache[i].cv, cvCache[i].value);
+  }
+#endif
+  StringFormatter::send(stream,F("Prog cab=%d, reads %S, used=%d, max=%d\n"),
+     progLocoId, cvCacheReads ? F("cached") : F("direct"), used, CV_CACHE_SIZE);
+}
+
 void DCC::displayCabList(Print * stream) {
 
     int used=0;
     for (int reg = 0; reg < MAX_LOCOS; reg++) {
        if (speedTable[reg].loco>0) {
         used ++;
-        StringFormatter::send(stream,F("cab=%d, speed=%d, dir=%c \n"),
-           speedTable[reg].loco,  speedTable[reg].speedCode & 0x7f,(speedTable[reg].speedCode & 0x80) ? 'F':'R');
+        StringFormatter::send(stream,F("cab=%d, speed=%d, dir=%c, max refresh=%umS \n"),
+           speedTable[reg].loco,  speedTable[reg].speedCode & 0x7f,(speedTable[reg].speedCode & 0x80) ? 'F':'R',
+           speedTable[reg].maxReminderGap);
        }
      }
      StringFormatter::send(stream,F("Used=%d, max=%d\n"),used,MAX_LOCOS);
 
 }
+
+#ifdef DIAG_WAVE
+void DCC::displayReminderStats(Print * stream) {
+  StringFormatter::send(stream,F("Reminder cycle=%umS max=%umS, skipped for queued packets=%l\n"),
+    lastReminderCycle, maxReminderCycle, reminderSkips);
+  maxReminderCycle=0;
+  reminderSkips=0;
+}
+#endif
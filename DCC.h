@@ -38,6 +38,15 @@
 #endif
 const uint16_t LONG_ADDR_MARKER = 0x4000;
 
+// Reminder scheduling. Unit: milliseconds
+// A stopped loco is only refreshed every STOPPED_REMINDER_INTERVAL. Keep this well
+// below the packet timeout (CV11) of any decoder on the layout.
+#ifndef STOPPED_REMINDER_INTERVAL
+#define STOPPED_REMINDER_INTERVAL 500
+#endif
+// NMRA S-9.2.4: packets to the same address should be separated by at least 5mS
+const byte MIN_REMINDER_GAP = 5;
+
 typedef void (*ACK_CALLBACK)(int16_t result);
 
 enum ackOp : byte
@@ -68,6 +77,10 @@ enum ackOp : byte
   STASHLOCOID,      // keeps current byte value for later
   COMBINELOCOID,    // combines current value with stashed value and returns it
   ITSKIP,           // skip to SKIPTARGET if ack true
+  GUESSSHORTID,     // sets current byte to the next short address guess, or skips to ENDGUESS if none left
+  GUESSLONGID,      // sets word to the next long address guess, or skips to ENDGUESS if none left
+  NAKGUESS,         // if false go back to the last guess
+  ENDGUESS = 0xFE,  // continue here when out of guesses
   SKIPTARGET = 0xFF // jump to target
 };
 
@@ -80,15 +93,70 @@ enum   CALLBACK_STATE : byte {
 
 
 // Allocations with memory implications..!
-// Base system takes approx 900 bytes + 8 per loco. Turnouts, Sensors etc are dynamically created
+// Base system takes approx 900 bytes + 27 per loco (22 on Uno and Nano). Turnouts, Sensors etc are dynamically created
+// LOCO_INDEX_SIZE must be a power of 2 larger than MAX_LOCOS
 #if defined(ARDUINO_AVR_UNO)
 const byte MAX_LOCOS = 20;
+const byte LOCO_INDEX_SIZE = 32;
 #elif defined(ARDUINO_AVR_NANO)
 const byte MAX_LOCOS = 30;
+const byte LOCO_INDEX_SIZE = 64;
 #else
 const byte MAX_LOCOS = 50;
+const byte LOCO_INDEX_SIZE = 128;
+#endif
+
+// Functions F0 to MAX_FUNCTION_NUMBER are remembered for each loco and 
+// reminded, in the DCC function groups, higher ones are sent just once.
+#if defined(ARDUINO_AVR_UNO) || defined(ARDUINO_AVR_NANO)
+const byte MAX_FUNCTION_NUMBER = 28;
+#else
+const byte MAX_FUNCTION_NUMBER = 68;
+#endif
+
+// Cache of recently read and written CVs, 6 bytes per entry. 0 disables it.
+#ifndef CV_CACHE_SIZE
+#if defined(ARDUINO_AVR_UNO) || defined(ARDUINO_AVR_NANO)
+#define CV_CACHE_SIZE 0
+#else
+#define CV_CACHE_SIZE 32
+#endif
 #endif
 
+// Addresses which getLocoId verifies a byte at a time before reading the address
+// bit by bit: the locos most recently identified, then the EXRAIL roster, then
+// the locos driven since startup.
+#ifndef LOCO_ID_GUESSES
+#if defined(ARDUINO_AVR_UNO) || defined(ARDUINO_AVR_NANO)
+#define LOCO_ID_GUESSES 4
+#else
+#define LOCO_ID_GUESSES 8
+#endif
+#endif
+const byte LOCO_ID_RECENT = 4;
+
+// Accessory commands waiting to be sent, 4 bytes per entry.  A command to an 
+// output that is already queued replaces the one there.
+#ifndef ACCESSORY_QUEUE_SIZE
+#if defined(ARDUINO_AVR_UNO) || defined(ARDUINO_AVR_NANO)
+#define ACCESSORY_QUEUE_SIZE 4
+#else
+#define ACCESSORY_QUEUE_SIZE 16
+#endif
+#endif
+// Advanced consists (CV19) managed by the command station, 13 bytes each
+#ifndef MAX_CONSISTS
+#if defined(ARDUINO_AVR_UNO) || defined(ARDUINO_AVR_NANO)
+#define MAX_CONSISTS 2
+#else
+#define MAX_CONSISTS 8
+#endif
+#endif
+const byte MAX_CONSIST_MEMBERS = 6;
+
+// Number of times each accessory packet is sent
+const byte ACCESSORY_SENDS = 5;
+
 class DCC
 {
 public:
@@ -98,23 +166,33 @@ public:
 
   // Public DCC API functions
   static void setThrottle(uint16_t cab, uint8_t tSpeed, bool tDirection);
+  // Emergency stop a loco, or every loco for cab 0, ahead of the packet queue
+  static void emergencyStop(uint16_t cab);
+  // Change speed gradually, taking about rampMs to get from the current speed,
+  // the intermediate speed steps being sent by the reminders.
+  static void setThrottleRamp(uint16_t cab, uint8_t tSpeed, bool tDirection, uint16_t rampMs);
   static uint8_t getThrottleSpeed(int cab);
   static bool getThrottleDirection(int cab);
   static void writeCVByteMain(int cab, int cv, byte bValue);
   static void writeCVBitMain(int cab, int cv, byte bNum, bool bValue);
+  static void readCVByteMain(int cab, int cv);
+  static void railcomPOM(byte value);  // value received from a RailCom detector
   static void setFunction(int cab, byte fByte, byte eByte);
   static void setFn(int cab, int16_t functionNumber, bool on);
   static void changeFn(int cab, int16_t functionNumber);
   static int  getFn(int cab, int16_t functionNumber);
   static uint32_t getFunctionMap(int cab);
-  static void updateGroupflags(byte &flags, int16_t functionNumber);
   static void setAccessory(int aAdd, byte aNum, bool activate);
+  static void setExtendedAccessory(int aAdd, byte aNum, byte aspect);
   static bool writeTextPacket(byte *b, int nBytes);
   static void setProgTrackSyncMain(bool on); // when true, prog track becomes driveable
   static void setProgTrackBoost(bool on);    // when true, special prog track current limit does not apply
 
   // ACKable progtrack calls  bitresults callback 0,0 or -1, cv returns value or -1
   static void readCV(int16_t cv, ACK_CALLBACK callback);
+  // As readCV, but if moreToFollow the prog track power and JOIN state is kept
+  // for the next read of the batch, so it can start without the power on delay.
+  static void readCVBatch(int16_t cv, bool moreToFollow, ACK_CALLBACK callback);
   static void readCVBit(int16_t cv, byte bitNum, ACK_CALLBACK callback); // -1 for error
   static void writeCVByte(int16_t cv, byte byteValue, ACK_CALLBACK callback);
   static void writeCVBit(int16_t cv, byte bitNum, bool bitValue, ACK_CALLBACK callback);
@@ -124,10 +202,22 @@ public:
   static void getLocoId(ACK_CALLBACK callback);
   static void setLocoId(int id,ACK_CALLBACK callback);
 
+  // Advanced consists: members (negative if reversed) are given the consist
+  // address in CV19, and follow speed packets sent to it with setThrottle.
+  static bool setConsist(byte consist, const int16_t members[], byte count);
+  static void removeConsist(byte consist);  // members return to their own address
+  static void displayConsists(Print *stream);
+
   // Enhanced API functions
   static void forgetLoco(int cab); // removes any speed reminders for this loco
   static void forgetAllLocos();    // removes all speed reminders
   static void displayCabList(Print *stream);
+  static void displayReminderStats(Print *stream);  // with DIAG_WAVE, for <D WAVE>
+  static void displayCVCache(Print *stream);
+  static void forgetProgCVs();     // decoder on the prog track may have been changed
+  static inline void setCVCacheReads(bool on) {
+    cvCacheReads = on;  // answer prog track reads from the cache when possible
+  };
   static FSH *getMotorShieldName();
   static inline void setGlobalSpeedsteps(byte s) {
     globalSpeedsteps = s;
@@ -143,26 +233,103 @@ public:
   {
     int loco;
     byte speedCode;
-    byte groupFlags;
-    unsigned long functions;
+    uint16_t groupFlags;         // function groups in use, reminded in the background
+    uint16_t changedFlags;       // speed or function groups to be sent straight away
+    byte functions[MAX_FUNCTION_NUMBER/8+1];  // bit per function
+    uint16_t lastSpeedReminder;  // millis() (low 16 bits) when speed was last sent
+    uint16_t maxReminderGap;     // worst case mS between speed packets
+    byte targetSpeedCode;        // speed being ramped to, speedCode if not ramping
+    uint16_t rampInterval;       // mS per speed step while ramping
+    uint16_t lastRampStep;       // millis() (low 16 bits) of the last ramp step
+    uint16_t version;            // CommandDistributor::stateVersion when last changed
   };
  static LOCO speedTable[MAX_LOCOS];
+ static uint32_t getFunctionMap(const LOCO & l);
  static int lookupSpeedTable(int locoId, bool autoCreate=true);
   
 private:
   static byte joinRelay;
   static byte loopStatus;
+  static byte locoIndex[LOCO_INDEX_SIZE];
+  static void rebuildLocoIndex();
   static void setThrottle2(uint16_t cab, uint8_t speedCode);
   static void updateLocoReminder(int loco, byte speedCode);
   static void setFunctionInternal(int cab, byte fByte, byte eByte);
+  static void forgetReminder(int cab);
+  static void functionChanged(int reg, int16_t functionNumber);
   static bool issueReminder(int reg);
+  static byte refreshGroup;
+  static void sendFunctionGroup(int reg, byte group);
+  static bool isReminderDue(int reg);
+  static void speedReminderSent(int reg);
+  static bool rampActive;
+  static void stepRamps();
+  static byte rampStep(byte speedCode, byte targetSpeedCode);
   static int nextLoco;
+  // Reminder figures kept with DIAG_WAVE
+  static uint32_t reminderSkips;        // times skipped because packets were queued
+  static unsigned long reminderCycleStart;
+  static uint16_t lastReminderCycle;    // millis for a pass round the speed table
+  static uint16_t maxReminderCycle;
   static FSH *shieldName;
+
+  // CV cache. Entries are by loco address, prog track reads and writes use
+  // progLocoId which is 0 until the decoder address has been read.
+  struct CVCACHE
+  {
+    int16_t loco;
+    int16_t cv;      // 0 for an unused entry
+    byte value;
+    byte flags;
+  };
+#if CV_CACHE_SIZE > 0
+  static CVCACHE cvCache[CV_CACHE_SIZE];
+#endif
+  static byte cvCacheNext;
+  static bool cvCacheReads;
+  static int16_t progLocoId;
+  static void cacheCV(int16_t loco, int16_t cv, byte value, byte flags);
+  static void cacheCVBit(int16_t loco, int16_t cv, byte bitNum, bool bitValue, bool create);
+  static int16_t getCachedCV(int16_t cv);
+  static void cacheAckResult(int value);
   static byte globalSpeedsteps;
 
   static byte cv1(byte opcode, int cv);
   static byte cv2(int cv);
   static void issueReminders();
+
+  struct CONSIST
+  {
+    byte consist;   // short address, 0 for an unused entry
+    int16_t members[MAX_CONSIST_MEMBERS];  // loco, negative if reversed, 0 unused
+  };
+#if MAX_CONSISTS > 0
+  static CONSIST consists[MAX_CONSISTS];
+#endif
+  static void leaveConsists(int16_t loco);
+
+  // Main track CV read waiting for a RailCom answer
+  static int16_t railcomPomCab;
+  static int16_t railcomPomCv;
+  static unsigned long railcomPomTime;
+  static const unsigned long RAILCOM_POM_TIMEOUT = 1000;  // mS
+
+  // Accessory command queue.  output is the linear address, address<<2 | number,
+  // with ACCESSORY_EXTENDED set for an extended accessory, and data is the
+  // activate bit or the aspect.  An entry with no sends left is free.
+  static const uint16_t ACCESSORY_EXTENDED = 0x8000;
+  struct ACCESSORY
+  {
+    uint16_t output;
+    byte data;
+    byte sends;
+  };
+  static ACCESSORY accessoryQueue[ACCESSORY_QUEUE_SIZE];
+  static byte nextAccessory;
+  static bool accessoryTurn;
+  static void queueAccessory(uint16_t output, byte data);
+  static bool sendAccessory();
+  static byte accessoryPacket(byte *b, uint16_t output, byte data);
   static void callback(int value);
 
   // ACK MANAGER
@@ -180,18 +347,31 @@ private:
   static byte ackManagerStash;
   static bool ackReceived;
   static bool ackManagerRejoin;
+  static bool ackManagerKeepPower;   // batch read: leave power and JOIN state for next read
+  static bool ackManagerContinuing;  // this read follows on from a batch read
   static ACK_CALLBACK ackManagerCallback;
   static CALLBACK_STATE callbackState;
-  static void ackManagerSetup(int cv, byte bitNumOrbyteValue, ackOp const program[], ACK_CALLBACK callback);
-  static void ackManagerSetup(int wordval, ackOp const program[], ACK_CALLBACK callback);
+  static bool ackManagerSetup(int cv, byte bitNumOrbyteValue, ackOp const program[], ACK_CALLBACK callback);
+  static bool ackManagerSetup(int wordval, ackOp const program[], ACK_CALLBACK callback);
   static void ackManagerLoop();
   static bool checkResets( uint8_t numResets);
+  // Loco address guesses for LOCO_ID_PROG
+  static int16_t locoIdGuesses[LOCO_ID_GUESSES];
+  static byte locoIdGuessCount;
+  static byte locoIdGuessNext;
+  static ackOp const *locoIdGuessOp;
+  static int16_t recentLocoIds[LOCO_ID_RECENT];
+  static void makeLocoIdGuesses();
+  static void addLocoIdGuess(int16_t id);
+  static int16_t nextLocoIdGuess(bool longAddr);
+  static void rememberLocoId(int16_t id);
   static const int PROG_REPEATS = 8; // repeats of programming commands (some decoders need at least 8 to be reliable)
   
   // NMRA codes #
   static const byte SET_SPEED = 0x3f;
   static const byte WRITE_BYTE_MAIN = 0xEC;
   static const byte WRITE_BIT_MAIN = 0xE8;
+  static const byte VERIFY_BYTE_MAIN = 0xE4;
   static const byte WRITE_BYTE = 0x7C;
   static const byte VERIFY_BYTE = 0x74;
   static const byte BIT_MANIPULATE = 0x78;
@@ -223,6 +403,10 @@ private:
 #define ARDUINO_TYPE "TEENSY40"
 #elif defined(ARDUINO_TEENSY41)
 #define ARDUINO_TYPE "TEENSY41"
+#elif defined(ARDUINO_ARCH_ESP32)
+#define ARDUINO_TYPE "ESP32"
+#elif defined(ARDUINO_ARCH_NATIVE)
+#define ARDUINO_TYPE "NATIVE"
 #else
 #error CANNOT COMPILE - DCC++ EX ONLY WORKS WITH AN ARDUINO UNO, NANO 328, OR ARDUINO MEGA 1280/2560
 #endif
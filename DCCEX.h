@@ -32,17 +32,25 @@
 #include "DCCEXParser.h"
 #include "SerialManager.h"
 #include "version.h"
+#if defined(ARDUINO_ARCH_ESP32)
+#include "WifiESP32.h"
+#else
 #include "WifiInterface.h"
+#endif
 #if ETHERNET_ON == true
 #include "EthernetInterface.h"
 #endif
 #include "LCD_Implementation.h"
 #include "LCN.h"
 #include "freeMemory.h"
+#include "LoopTimes.h"
+#include "LoopScheduler.h"
+#include "CurrentTelemetry.h"
 #include "IODevice.h"
 #include "Turnouts.h"
 #include "Sensors.h"
 #include "Outputs.h"
+#include "EEStore.h"
 #include "CommandDistributor.h"
 #include "EXRAIL.h"
     
@@ -31,6 +31,10 @@
 #include "Outputs.h"
 #include "Sensors.h"
 #include "freeMemory.h"
+#include "MemoryPool.h"
+#include "LoopTimes.h"
+#include "LoopScheduler.h"
+#include "CurrentTelemetry.h"
 #include "GITHUB_SHA.h"
 #include "version.h"
 #include "defines.h"
@@ -38,6 +42,7 @@
 #include "EEStore.h"
 #include "DIAG.h"
 #include "EXRAIL2.h"
+#include "I2CManager.h"
 #include <avr/wdt.h>
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -71,6 +76,10 @@ const int16_t HASH_KEYWORD_MAX = 16244;
 const int16_t HASH_KEYWORD_MIN = 15978;
 const int16_t HASH_KEYWORD_RESET = 26133;
 const int16_t HASH_KEYWORD_RETRY = 25704;
+const int16_t HASH_KEYWORD_TRIP = -17217;
+const int16_t HASH_KEYWORD_CVS = 10182;
+const int16_t HASH_KEYWORD_CVCACHE = -15367;
+const int16_t HASH_KEYWORD_LOOP = 28540;
 const int16_t HASH_KEYWORD_SPEED28 = -17064;
 const int16_t HASH_KEYWORD_SPEED128 = 25816;
 const int16_t HASH_KEYWORD_SERVO=27709;
@@ -87,12 +96,65 @@ const int16_t HASH_KEYWORD_ANOUT = -26399;
 const int16_t HASH_KEYWORD_WIFI = -5583;
 const int16_t HASH_KEYWORD_ETHERNET = -30767;
 const int16_t HASH_KEYWORD_WIT = 31594;
-
-int16_t DCCEXParser::stashP[MAX_COMMAND_PARAMS];
-bool DCCEXParser::stashBusy;
-Print *DCCEXParser::stashStream = NULL;
-RingStream *DCCEXParser::stashRingStream = NULL;
-byte DCCEXParser::stashTarget=0;
+const int16_t HASH_KEYWORD_I2C = 24095;
+const int16_t HASH_KEYWORD_RAILCOM = -29097;
+const int16_t HASH_KEYWORD_WAVE = -14811;
+const int16_t HASH_KEYWORD_TASKS = 22622;
+const int16_t HASH_KEYWORD_CURRENT = 11433;
+const int16_t HASH_KEYWORD_MULTICAST = -27988;
+CHECK_KEYWORD(PROG);
+CHECK_KEYWORD(MAIN);
+CHECK_KEYWORD(JOIN);
+CHECK_KEYWORD(CABS);
+CHECK_KEYWORD(RAM);
+CHECK_KEYWORD(CMD);
+CHECK_KEYWORD(ACK);
+CHECK_KEYWORD(ON);
+CHECK_KEYWORD(DCC);
+CHECK_KEYWORD(SLOW);
+CHECK_KEYWORD(PROGBOOST);
+#ifndef DISABLE_EEPROM
+CHECK_KEYWORD(EEPROM);
+#endif
+CHECK_KEYWORD(LIMIT);
+CHECK_KEYWORD(MAX);
+CHECK_KEYWORD(MIN);
+CHECK_KEYWORD(RESET);
+CHECK_KEYWORD(RETRY);
+CHECK_KEYWORD(TRIP);
+CHECK_KEYWORD(CVS);
+CHECK_KEYWORD(CVCACHE);
+CHECK_KEYWORD(LOOP);
+CHECK_KEYWORD(TASKS);
+CHECK_KEYWORD(CURRENT);
+CHECK_KEYWORD(MULTICAST);
+CHECK_KEYWORD(SPEED28);
+CHECK_KEYWORD(SPEED128);
+CHECK_KEYWORD(SERVO);
+CHECK_KEYWORD(VPIN);
+CHECK_KEYWORD(A);
+CHECK_KEYWORD(C);
+CHECK_KEYWORD(R);
+CHECK_KEYWORD(T);
+CHECK_KEYWORD(LCN);
+CHECK_KEYWORD(HAL);
+CHECK_KEYWORD(SHOW);
+CHECK_KEYWORD(ANIN);
+CHECK_KEYWORD(ANOUT);
+CHECK_KEYWORD(WIFI);
+CHECK_KEYWORD(ETHERNET);
+CHECK_KEYWORD(WIT);
+CHECK_KEYWORD(I2C);
+CHECK_KEYWORD(RAILCOM);
+CHECK_KEYWORD(WAVE);
+
+DCCEXParser::ProgRequest DCCEXParser::progQueue[PROG_QUEUE_SIZE];
+byte DCCEXParser::progQueueHead=0;
+byte DCCEXParser::progQueueCount=0;
+int16_t *DCCEXParser::stashP = NULL;
+bool DCCEXParser::stashBatchRange=false;
+int16_t DCCEXParser::stashBatchCount=0;
+int16_t DCCEXParser::stashBatchNext=0;
 
 // This is a JMRI command parser.
 // It doesnt know how the string got here, nor how it gets back.
@@ -240,7 +302,7 @@ void DCCEXParser::parseOne(Print *stream, byte *com, RingStream * ringStream)
         if (slot>=0) {
             DCC::LOCO * sp=&DCC::speedTable[slot];
             StringFormatter::send(stream,F("<l %d %d %d %l>\n"),
-			sp->loco,slot,sp->speedCode,sp->functions);
+			sp->loco,slot,sp->speedCode,DCC::getFunctionMap(*sp));
             }
         else // send dummy state speed 0 fwd no functions. 
             StringFormatter::send(stream,F("<l %d -1 128 0>\n"),p[0]);
@@ -287,6 +349,13 @@ void DCCEXParser::parseOne(Print *stream, byte *com, RingStream * ringStream)
         // speed change will be broadcast anyway in new <l > format
         return;
     }
+    case 'm': // RAMPED THROTTLE <m CAB SPEED DIRECTION RAMPMS>
+        // speed as for <t>, changed gradually over RAMPMS milliseconds
+        if (params != 4 || p[0] <= 0 || p[1] > 126 || p[1] < 0 || p[2] < 0 || p[2] > 1)
+            break;
+        DCC::setThrottleRamp(p[0], p[1] ? p[1]+1 : 0, p[2], (uint16_t)p[3]);
+        return;
+
     case 'f': // FUNCTION <f CAB BYTE1 [BYTE2]>
         if (parsef(stream, params, p))
             return;
@@ -322,6 +391,14 @@ void DCCEXParser::parseOne(Print *stream, byte *com, RingStream * ringStream)
 #endif
         }
         return;
+
+    case 'A': // EXTENDED ACCESSORY <A LINEARADDRESS ASPECT>
+        {
+          if (params!=2) break;
+          if (p[0]<1 || p[0]>2044 || (p[1] & 0xFF)!=p[1]) break;
+          DCC::setExtendedAccessory((p[0] - 1) / 4 + 1, (p[0] - 1) % 4, p[1]);
+        }
+        return;
      
     case 'T': // TURNOUT  <T ...>
         if (parseT(stream, params, p))
@@ -338,10 +415,30 @@ void DCCEXParser::parseOne(Print *stream, byte *com, RingStream * ringStream)
             return;
         break;
 
+    case 'K': // CONSIST <K> list, <K CONSIST [-]LOCO...> set up, <K CONSIST> remove
+        if (params == 0) {
+            DCC::displayConsists(stream);
+            return;
+        }
+        if (p[0] < 1 || p[0] > HIGHEST_SHORT_ADDR) break;
+        if (params == 1) {
+            DCC::removeConsist(p[0]);
+            StringFormatter::send(stream, F("<O>\n"));
+            return;
+        }
+        if (!DCC::setConsist(p[0], p+1, params-1)) break;
+        StringFormatter::send(stream, F("<O>\n"));
+        return;
+
     case 'w': // WRITE CV on MAIN <w CAB CV VALUE>
         DCC::writeCVByteMain(p[0], p[1], p[2]);
         return;
 
+    case 'r': // READ CV ON MAIN BY RAILCOM <r CAB CV>
+        if (params != 2) break;
+        DCC::readCVByteMain(p[0], p[1]);
+        return;
+
     case 'b': // WRITE CV BIT ON MAIN <b CAB CV BIT VALUE>
         DCC::writeCVBitMain(p[0], p[1], p[2], p[3]);
         return;
@@ -361,64 +458,20 @@ void DCCEXParser::parseOne(Print *stream, byte *com, RingStream * ringStream)
         }
         return;
         
-    case 'W': // WRITE CV ON PROG <W CV VALUE CALLBACKNUM CALLBACKSUB>
-            if (!stashCallback(stream, p, ringStream))
-                break;
-        if (params == 1) // <W id> Write new loco id (clearing consist and managing short/long)
-            DCC::setLocoId(p[0],callback_Wloco);
-        else if (params == 4)  // WRITE CV ON PROG <W CV VALUE [CALLBACKNUM] [CALLBACKSUB]>
-            DCC::writeCVByte(p[0], p[1], callback_W4);
-        else  // WRITE CV ON PROG <W CV VALUE>
-            DCC::writeCVByte(p[0], p[1], callback_W);
-        return;
-
     case 'V': // VERIFY CV ON PROG <V CV VALUE> <V CV BIT 0|1>
-        if (params == 2)
-        { // <V CV VALUE>
-            if (!stashCallback(stream, p, ringStream))
-                break;
-            DCC::verifyCVByte(p[0], p[1], callback_Vbyte);
-            return;
-        }
-        if (params == 3)
-        {
-            if (!stashCallback(stream, p, ringStream))
-                break;
-            DCC::verifyCVBit(p[0], p[1], p[2], callback_Vbit);
-            return;
-        }
-        break;
-
+        if (params != 2 && params != 3)
+            break;
+        // fall through
+    case 'W': // WRITE CV ON PROG <W CV VALUE CALLBACKNUM CALLBACKSUB>
     case 'B': // WRITE CV BIT ON PROG <B CV BIT VALUE CALLBACKNUM CALLBACKSUB>
-        if (!stashCallback(stream, p, ringStream))
+    case 'R': // READ CV ON PROG
+        if (opcode == 'R' && params == 2 && (p[0] < 1 || p[1] < p[0] || p[1] > 1024))
+            break;
+        // Carried out by startProg() when the prog track is free, <X> if too many are waiting
+        if (!queueProg(stream, opcode, params, p, ringStream))
             break;
-        DCC::writeCVBit(p[0], p[1], p[2], callback_B);
         return;
 
-    case 'R': // READ CV ON PROG
-        if (params == 1)
-        { // <R CV> -- uses verify callback
-            if (!stashCallback(stream, p, ringStream))
-                break;
-            DCC::verifyCVByte(p[0], p[1], callback_Vbyte);
-            return;
-        }
-        if (params == 3)
-        { // <R CV CALLBACKNUM CALLBACKSUB>
-            if (!stashCallback(stream, p, ringStream))
-                break;
-            DCC::readCV(p[0], callback_R);
-            return;
-        }
-        if (params == 0)
-        { // <R> New read loco id
-            if (!stashCallback(stream, p, ringStream))
-                break;
-            DCC::getLocoId(callback_Rloco);
-            return;
-        }
-        break;
-
     case '1': // POWERON <1   [MAIN|PROG|JOIN]>
         {
         bool main=false;
@@ -474,6 +527,7 @@ void DCCEXParser::parseOne(Print *stream, byte *com, RingStream * ringStream)
         if (prog) {
             DCC::setProgTrackBoost(false);  // Prog track boost mode will not outlive prog track off
             DCCWaveform::progTrack.setPowerMode(POWERMODE::OFF);
+            DCC::forgetProgCVs();  // decoder may be changed now
         }
         DCC::setProgTrackSyncMain(false);
 
@@ -482,13 +536,18 @@ void DCCEXParser::parseOne(Print *stream, byte *com, RingStream * ringStream)
         }
 
     case '!': // ESTOP ALL  <!>
-        DCC::setThrottle(0,1,1); // this broadcasts speed 1(estop) and sets all reminders to speed 1.
+        DCC::emergencyStop(0); // this broadcasts estop at once and sets all reminders to speed 1.
         return;
 
     case 'c': // SEND METER RESPONSES <c>
         //                               <c MeterName value C/V unit min max res warn>
         StringFormatter::send(stream, F("<c CurrentMAIN %d C Milli 0 %d 1 %d>\n"), DCCWaveform::mainTrack.getCurrentmA(), 
             DCCWaveform::mainTrack.getMaxmA(), DCCWaveform::mainTrack.getTripmA());
+        for (byte d=0; d<DCCWaveform::districtCount; d++) {
+            TrackPower * district=DCCWaveform::districts[d];
+            StringFormatter::send(stream, F("<c Current%S %d C Milli 0 %d 1 %d>\n"), district->getName(),
+                district->getCurrentmA(), district->getMaxmA(), district->getTripmA());
+        }
         StringFormatter::send(stream, F("<a %d>\n"), DCCWaveform::mainTrack.get1024Current()); //'a' message deprecated, remove once JMRI 4.22 is available
         return;
 
@@ -521,10 +580,15 @@ void DCCEXParser::parseOne(Print *stream, byte *com, RingStream * ringStream)
         return;
 
     case 'D': // < >
-        if (parseD(stream, params, p))
+        if (parseD(stream, params, p, ringStream))
             return;
         return;
 
+    case '$': // LAYOUT STATE <$> everything, <$ EPOCH VERSION> changes since VERSION
+        if (params != 0 && params != 2) break;
+        CommandDistributor::sendState(stream, ringStream, params==0, params ? (uint16_t)p[0] : 0, params ? (uint16_t)p[1] : 0);
+        return;
+
     case '#': // NUMBER OF LOCOSLOTS <#>
         StringFormatter::send(stream, F("<# %d>\n"), MAX_LOCOS);
         return;
@@ -595,10 +659,11 @@ void DCCEXParser::parseOne(Print *stream, byte *com, RingStream * ringStream)
                         if (t->isHidden()) continue;          
                         StringFormatter::send(stream, F(" %d"),t->getId());
                     }
+                    for (uint16_t pos=0, tid; Turnout::nextUnused(pos, tid); )
+                        StringFormatter::send(stream, F(" %d"),tid);
                 }
                 else { // <JT id>
-                    Turnout * t=Turnout::get(id);
-                    if (!t || t->isHidden()) StringFormatter::send(stream, F(" %d X"),id);
+                    if (!Turnout::exists(id) || Turnout::isHidden(id)) StringFormatter::send(stream, F(" %d X"),id);
                     else {
 		      const FSH *tdesc = NULL;
 #ifdef EXRAIL_ACTIVE
@@ -607,7 +672,7 @@ void DCCEXParser::parseOne(Print *stream, byte *com, RingStream * ringStream)
 		      if (tdesc == NULL)
 			tdesc = F("");
 		      StringFormatter::send(stream, F(" %d %c \"%S\""),
-					    id,t->isThrown()?'T':'C',
+					    id,Turnout::isThrown(id)?'T':'C',
 					    tdesc);
 		    }
                 }
@@ -711,6 +776,8 @@ bool DCCEXParser::parsef(Print *stream, int16_t params, int16_t p[])
             funcmap(p[0], p[2], 13, 20);
         else if (p[1] == 223)
             funcmap(p[0], p[2], 21, 28);
+        else if (p[1] >= 216 && p[1] <= 220)  // F29-F36 ... F61-F68
+            funcmap(p[0], p[2], 29 + (p[1] - 216) * 8, 36 + (p[1] - 216) * 8);
     }
     (void)stream; // NO RESPONSE
     return true;
@@ -738,6 +805,9 @@ bool DCCEXParser::parseT(Print *stream, int16_t params, int16_t p[])
             gotOne = true;
             tt->print(stream);
         }
+        uint16_t pos=0, id;
+        if (Turnout::nextUnused(pos, id, true)) gotOne = true;
+        Turnout::printUnused(stream);
         return gotOne; // will <X> if none found
     }
 
@@ -836,7 +906,7 @@ bool DCCEXParser::parseS(Print *stream, int16_t params, int16_t p[])
     return false;
 }
 
-bool DCCEXParser::parseD(Print *stream, int16_t params, int16_t p[])
+bool DCCEXParser::parseD(Print *stream, int16_t params, int16_t p[], RingStream * ringStream)
 {
     if (params == 0)
         return false;
@@ -847,8 +917,18 @@ bool DCCEXParser::parseD(Print *stream, int16_t params, int16_t p[])
         DCC::displayCabList(stream);
         return true;
 
+    case HASH_KEYWORD_CVS: // <D CVS>
+        DCC::displayCVCache(stream);
+        return true;
+
+    case HASH_KEYWORD_CVCACHE: // <D CVCACHE ON/OFF>
+        DCC::setCVCacheReads(onOff);
+        return true;
+
     case HASH_KEYWORD_RAM: // <D RAM>
         StringFormatter::send(stream, F("Free memory=%d\n"), minimumFreeMemory());
+        displayHeap(stream);
+        MemoryPool::displayAll(stream);
         break;
 
     case HASH_KEYWORD_ACK: // <D ACK ON/OFF> <D ACK [LIMIT|MIN|MAX|RETRY] Value>
@@ -872,10 +952,62 @@ bool DCCEXParser::parseD(Print *stream, int16_t params, int16_t p[])
 	}
         return true;
 
+    case HASH_KEYWORD_TRIP: // <D TRIP MAIN|PROG|district shortpercent sustainms>
+	if (params < 4 || p[2] < 0 || p[3] < 0) return false;
+	if (p[1] == HASH_KEYWORD_MAIN) {
+	  // the districts too, as they carry the main track
+	  DCCWaveform::mainTrack.setTripCurve(p[2], p[3]);
+	  for (byte d = 0; d < DCCWaveform::districtCount; d++)
+	    DCCWaveform::districts[d]->setTripCurve(p[2], p[3]);
+	}
+	else if (p[1] >= 1 && p[1] <= DCCWaveform::districtCount)  // <D TRIP 2 300 100> just D2
+	  DCCWaveform::districts[p[1]-1]->setTripCurve(p[2], p[3]);
+	else if (p[1] == HASH_KEYWORD_PROG)
+	  DCCWaveform::progTrack.setTripCurve(p[2], p[3]);
+	else return false;
+	LCD(0, F("Trip short=%d%% sustain=%dmS"), p[2], p[3]);  // <D TRIP MAIN 300 100>
+	return true;
+
     case HASH_KEYWORD_CMD: // <D CMD ON/OFF>
         Diag::CMD = onOff;
         return true;
 
+#ifdef DIAG_WAVE
+    case HASH_KEYWORD_WAVE: // <D WAVE>
+        DCCWaveform::displayStats(stream);
+        DCC::displayReminderStats(stream);
+        return true;
+#endif
+
+    case HASH_KEYWORD_TASKS: // <D TASKS>
+        LoopScheduler::display(stream);
+        return true;
+
+    case HASH_KEYWORD_CURRENT: // <D CURRENT MAIN|PROG|district [windowms]>  <D CURRENT OFF>
+    {
+        uint16_t window = params >= 3 ? p[2] : 10;
+        if (params < 2) return false;
+        if (p[1] == HASH_KEYWORD_MAIN)
+            CurrentTelemetry::start(&DCCWaveform::mainTrack, window, stream, ringStream);
+        else if (p[1] == HASH_KEYWORD_PROG)
+            CurrentTelemetry::start(&DCCWaveform::progTrack, window, stream, ringStream);
+        else if (p[1] >= 1 && p[1] <= DCCWaveform::districtCount)
+            CurrentTelemetry::start(DCCWaveform::districts[p[1]-1], window, stream, ringStream);
+        else
+            CurrentTelemetry::stop();
+        return true;
+    }
+
+    case HASH_KEYWORD_MULTICAST: // <D MULTICAST ON/OFF> take broadcasts by UDP instead of over this connection
+        if (!ringStream) return false;
+        return CommandDistributor::setMulticast(ringStream->peekTargetMark(), onOff);
+
+#ifdef DIAG_LOOPTIMES
+    case HASH_KEYWORD_LOOP: // <D LOOP>
+        LoopTimes::display(stream);
+        return true;
+#endif
+
 #ifdef HAS_ENOUGH_MEMORY
     case HASH_KEYWORD_WIFI: // <D WIFI ON/OFF>
         Diag::WIFI = onOff;
@@ -938,6 +1070,15 @@ bool DCCEXParser::parseD(Print *stream, int16_t params, int16_t p[])
         break;
 #endif
 
+    case HASH_KEYWORD_RAILCOM: // <D RAILCOM ON/OFF>
+        if (!DCCWaveform::mainTrack.setRailcom(onOff)) 
+            StringFormatter::send(stream, F("RailCom not available\n"));
+        return true;
+
+    case HASH_KEYWORD_I2C:  // <D I2C>  I2C transactions and bus use since the last <D I2C>
+        I2CManager.showStats();
+        break;
+
     default: // invalid/unknown
         break;
     }
@@ -945,29 +1086,103 @@ bool DCCEXParser::parseD(Print *stream, int16_t params, int16_t p[])
 }
 
 // CALLBACKS must be static
-bool DCCEXParser::stashCallback(Print *stream, int16_t p[MAX_COMMAND_PARAMS], RingStream * ringStream)
+bool DCCEXParser::queueProg(Print *stream, byte opcode, int16_t params, int16_t p[], RingStream * ringStream, ACK_CALLBACK callback)
 {
-    if (stashBusy )
+    if (progQueueCount == PROG_QUEUE_SIZE)
         return false;
-    stashBusy = true;
-    stashStream = stream;
-    stashRingStream=ringStream;
-    if (ringStream) stashTarget= ringStream->peekTargetMark();
-    memcpy(stashP, p, MAX_COMMAND_PARAMS * sizeof(p[0]));
+    ProgRequest *r = &progQueue[(progQueueHead + progQueueCount) % PROG_QUEUE_SIZE];
+    r->opcode = opcode;
+    r->params = params;
+    r->stream = stream;
+    r->ringStream = ringStream;
+    r->target = ringStream ? ringStream->peekTargetMark() : 0;
+    r->callback = callback;
+    memcpy(r->p, p, MAX_COMMAND_PARAMS * sizeof(p[0]));
+    progQueueCount++;
+    if (progQueueCount == 1)
+        startProg();
     return true;
 }
 
+bool DCCEXParser::queueLocoId(ACK_CALLBACK callback)
+{
+    int16_t p[MAX_COMMAND_PARAMS] = {0};
+    return queueProg(NULL, 'L', 0, p, NULL, callback);
+}
+
+// Start the request at the head of the queue.  Its callback replies and starts the next.
+void DCCEXParser::startProg()
+{
+    ProgRequest *r = &progQueue[progQueueHead];
+    stashP = r->p;
+    int16_t *p = r->p;
+    switch (r->opcode)
+    {
+    case 'W':
+        if (r->params == 1) // <W id> Write new loco id (clearing consist and managing short/long)
+            DCC::setLocoId(p[0], callback_Wloco);
+        else if (r->params == 4) // WRITE CV ON PROG <W CV VALUE [CALLBACKNUM] [CALLBACKSUB]>
+            DCC::writeCVByte(p[0], p[1], callback_W4);
+        else // WRITE CV ON PROG <W CV VALUE>
+            DCC::writeCVByte(p[0], p[1], callback_W);
+        break;
+
+    case 'V':
+        if (r->params == 2) // <V CV VALUE>
+            DCC::verifyCVByte(p[0], p[1], callback_Vbyte);
+        else // <V CV BIT 0|1>
+            DCC::verifyCVBit(p[0], p[1], p[2], callback_Vbit);
+        break;
+
+    case 'B':
+        DCC::writeCVBit(p[0], p[1], p[2], callback_B);
+        break;
+
+    case 'L': // queueLocoId
+        DCC::getLocoId(callback_Lqueued);
+        break;
+
+    case 'R':
+        if (r->params == 0) // <R> New read loco id
+            DCC::getLocoId(callback_Rloco);
+        else if (r->params == 1) // <R CV> -- uses verify callback
+            DCC::verifyCVByte(p[0], p[1], callback_Vbyte);
+        else if (r->params == 3) // <R CV CALLBACKNUM CALLBACKSUB>
+            DCC::readCV(p[0], callback_R);
+        else
+        { // <R FROMCV TOCV> or <R CV1 CV2 CV3 CV4 ...> -- batch read, replies <v CV VALUE> for each
+            stashBatchRange = (r->params == 2);
+            stashBatchCount = stashBatchRange ? p[1] - p[0] + 1 : r->params;
+            stashBatchNext = 0;
+            DCC::readCVBatch(batchCV(0), stashBatchCount > 1, callback_Rbatch);
+        }
+        break;
+    }
+}
+
 Print * DCCEXParser::getAsyncReplyStream() {
-       if (stashRingStream) {
-           stashRingStream->mark(stashTarget);
-           return stashRingStream;
+       ProgRequest *r = &progQueue[progQueueHead];
+       if (r->ringStream) {
+           r->ringStream->mark(r->target);
+           return r->ringStream;
        }
-       return stashStream;
+       return r->stream;
 }
 
 void DCCEXParser::commitAsyncReplyStream() {
-     if (stashRingStream) stashRingStream->commit();
-     stashBusy = false;
+     ProgRequest *r = &progQueue[progQueueHead];
+     if (r->ringStream) r->ringStream->commit();
+     progQueueHead = (progQueueHead + 1) % PROG_QUEUE_SIZE;
+     progQueueCount--;
+     // The ack manager is free, so start the next without waiting for the loop
+     if (progQueueCount > 0) startProg();
+}
+
+// There is no reply stream, so pass the result on before moving to the next request
+void DCCEXParser::callback_Lqueued(int16_t result)
+{
+    progQueue[progQueueHead].callback(result);
+    commitAsyncReplyStream();
 }
 
 void DCCEXParser::callback_W(int16_t result)
@@ -1007,6 +1222,24 @@ void DCCEXParser::callback_R(int16_t result)
     commitAsyncReplyStream();
 }
 
+int16_t DCCEXParser::batchCV(int16_t index) {
+    return stashBatchRange ? stashP[0] + index : stashP[index];
+}
+
+void DCCEXParser::callback_Rbatch(int16_t result)
+{
+    StringFormatter::send(getAsyncReplyStream(), F("<v %d %d>\n"), batchCV(stashBatchNext), result);
+    stashBatchNext++;
+    // -2 means the prog track cant read at all so give up on the rest
+    if (result == -2 || stashBatchNext >= stashBatchCount) {
+        commitAsyncReplyStream();
+        return;
+    }
+    // keep the request at the head of the queue until the whole batch has been read
+    if (progQueue[progQueueHead].ringStream) progQueue[progQueueHead].ringStream->commit();
+    DCC::readCVBatch(batchCV(stashBatchNext), stashBatchNext + 1 < stashBatchCount, callback_Rbatch);
+}
+
 void DCCEXParser::callback_Rloco(int16_t result) {
   const FSH * detail;
   if (result<=0) {
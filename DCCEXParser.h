@@ -24,10 +24,33 @@
 #include <Arduino.h>
 #include "FSH.h"
 #include "RingStream.h"
+#include "DCC.h"
+
+// Prog track commands (<R>, <W>, <V>, <B>) waiting for the ack manager, about 30 bytes 
+// each.  They are carried out in turn, each answering the client that sent it.
+// Loco id reads for EXRAIL and WiThrottle wait in the same queue.
+#ifndef PROG_QUEUE_SIZE
+#if defined(ARDUINO_AVR_UNO) || defined(ARDUINO_AVR_NANO)
+#define PROG_QUEUE_SIZE 2
+#else
+#define PROG_QUEUE_SIZE 8
+#endif
+#endif
 
 typedef void (*FILTER_CALLBACK)(Print * stream, byte & opcode, byte & paramCount, int16_t p[]);
 typedef void (*AT_COMMAND_CALLBACK)(HardwareSerial * stream,const byte * command);
 
+// Compile time equivalent of the hash that splitValues makes of a keyword, letters
+// hashed and digits accumulated in decimal, so that the HASH_KEYWORD constants
+// can be checked when the code is built:  CHECK_KEYWORD(PROG) after HASH_KEYWORD_PROG
+constexpr int16_t keywordHash(const char * keyword, uint16_t hash=0) {
+  return *keyword=='\0' ? (int16_t)hash
+    : keywordHash(keyword+1, (*keyword>='0' && *keyword<='9')
+        ? (uint16_t)(hash*10 + (*keyword-'0'))
+        : (uint16_t)(((hash<<5)+hash) ^ *keyword));
+}
+#define CHECK_KEYWORD(k) static_assert(HASH_KEYWORD_##k==keywordHash(#k), "HASH_KEYWORD_" #k " does not match its keyword")
+
 struct DCCEXParser
 {
    
@@ -38,6 +61,9 @@ struct DCCEXParser
    static void setRMFTFilter(FILTER_CALLBACK filter);
    static void setAtCommandCallback(AT_COMMAND_CALLBACK filter);
    static const int MAX_COMMAND_PARAMS=10;  // Must not exceed this
+   // Read the loco id on the prog track once the commands ahead of it are done, then
+   // call callback as DCC::getLocoId would.  False if the queue is full.
+   static bool queueLocoId(ACK_CALLBACK callback);
  
    private:
   
@@ -48,23 +74,38 @@ struct DCCEXParser
      static bool parseZ(Print * stream, int16_t params, int16_t p[]);
      static bool parseS(Print * stream,  int16_t params, int16_t p[]);
      static bool parsef(Print * stream,  int16_t params, int16_t p[]);
-     static bool parseD(Print * stream,  int16_t params, int16_t p[]);
+     static bool parseD(Print * stream,  int16_t params, int16_t p[], RingStream * ringStream);
 
      static Print * getAsyncReplyStream();
      static void commitAsyncReplyStream();
 
-    static bool stashBusy;
-    static byte stashTarget;
-    static Print * stashStream;
-    static RingStream * stashRingStream;
-    
-    static int16_t stashP[MAX_COMMAND_PARAMS];
-    static bool stashCallback(Print * stream, int16_t p[MAX_COMMAND_PARAMS], RingStream * ringStream);
+    struct ProgRequest {
+      byte opcode;
+      byte params;
+      byte target;              // client of ringStream to reply to
+      Print * stream;
+      RingStream * ringStream;
+      ACK_CALLBACK callback;    // for queueLocoId
+      int16_t p[MAX_COMMAND_PARAMS];
+    };
+    static ProgRequest progQueue[PROG_QUEUE_SIZE];
+    static byte progQueueHead;
+    static byte progQueueCount;
+    static bool queueProg(Print * stream, byte opcode, int16_t params, int16_t p[], RingStream * ringStream, ACK_CALLBACK callback=NULL);
+    static void startProg();
+
+    static int16_t * stashP;   // params of the request being carried out
     static void callback_W(int16_t result);
     static void callback_W4(int16_t result);
     static void callback_B(int16_t result);        
     static void callback_R(int16_t result);
     static void callback_Rloco(int16_t result);
+    static void callback_Lqueued(int16_t result);
+    static void callback_Rbatch(int16_t result);
+    static int16_t batchCV(int16_t index);
+    static bool stashBatchRange;    // stashP[0..1] is first and last cv, else a list of cvs
+    static int16_t stashBatchCount;
+    static int16_t stashBatchNext;  // index of cv being read
     static void callback_Wloco(int16_t result);
     static void callback_Vbit(int16_t result);
     static void callback_Vbyte(int16_t result);
@@ -93,7 +93,77 @@ INTERRUPT_CALLBACK interruptHandler=0;
     mac[0] |= 0x02;
   }
 
+  // No background ADC scanning on this architecture yet
+  int8_t ADCee::init(byte pin) {
+    (void) pin;
+    return -1;
+  }
+  int ADCee::read(int8_t slot) {
+    (void) slot;
+    return 0;
+  }
+  byte ADCee::readSamples(int8_t slot, int *values, byte &seen) {
+    (void) slot;
+    (void) values;
+    (void) seen;
+    return 0;
+  }
+  void ADCee::scan() {}
+  int ADCee::readPin(byte pin) {
+    noInterrupts();
+    int value = analogRead(pin);
+    interrupts();
+    return value;
+  }
+
 #elif defined(TEENSYDUINO)
+#if defined(__MK20DX256__) || defined(__MK64FX512__) || defined(__MK66FX1M0__)
+  // Teensy 3.2, 3.5 and 3.6
+  // The 58uS tick is generated by FlexTimer FTM1 rather than an IntervalTimer so that
+  // the two FTM1 channels can switch the signal pins in hardware, exactly as Timer1
+  // does on the Mega. Channel duty is buffered by the FTM so a new value written
+  // during the interrupt takes effect at the start of the next cycle.
+  #define TIMER1_A_PIN   3   // FTM1_CH0
+  #define TIMER1_B_PIN   4   // FTM1_CH1
+  const uint16_t FTM_CYCLES=(F_BUS / 1000000 * DCC_SIGNAL_TIME);
+
+  void DCCTimer::begin(INTERRUPT_CALLBACK callback) {
+    interruptHandler=callback;
+    noInterrupts();
+    FTM1_SC = 0;
+    FTM1_CNT = 0;
+    FTM1_MOD = FTM_CYCLES - 1;
+    FTM1_C0SC = FTM_CSC_MSB | FTM_CSC_ELSB;  // edge aligned PWM, high true pulses
+    FTM1_C1SC = FTM_CSC_MSB | FTM_CSC_ELSB;
+    FTM1_C0V = 0;
+    FTM1_C1V = 0;
+    FTM1_SC = FTM_SC_CLKS(1) | FTM_SC_PS(0) | FTM_SC_TOIE; // bus clock, no prescale, overflow interrupt
+    NVIC_ENABLE_IRQ(IRQ_FTM1);
+    interrupts();
+  }
+
+  // ISR called by timer overflow every 58uS
+  void ftm1_isr() {
+    FTM1_SC &= ~FTM_SC_TOF;
+    interruptHandler();
+  }
+
+  bool DCCTimer::isPWMPin(byte pin) {
+       return pin==TIMER1_A_PIN || pin==TIMER1_B_PIN;
+  }
+
+ void DCCTimer::setPWM(byte pin, bool high) {
+    // A channel value beyond FTM1_MOD is a 100% duty cycle
+    if (pin==TIMER1_A_PIN) {
+      CORE_PIN3_CONFIG = PORT_PCR_MUX(3) | PORT_PCR_DSE | PORT_PCR_SRE;
+      FTM1_C0V = high ? FTM_CYCLES : 0;
+    }
+    else if (pin==TIMER1_B_PIN) {
+      CORE_PIN4_CONFIG = PORT_PCR_MUX(3) | PORT_PCR_DSE | PORT_PCR_SRE;
+      FTM1_C1V = high ? FTM_CYCLES : 0;
+    }
+ }
+#else
   IntervalTimer myDCCTimer;
 
   void DCCTimer::begin(INTERRUPT_CALLBACK callback) {
@@ -114,6 +184,7 @@ INTERRUPT_CALLBACK interruptHandler=0;
     (void) pin;
     (void) high;
 }
+#endif
 
   void   DCCTimer::getSimulatedMacAddress(byte mac[6]) {
 #if defined(__IMXRT1062__)  //Teensy 4.0 and Teensy 4.1
@@ -151,6 +222,128 @@ void DCCTimer::read(uint8_t word, uint8_t *mac, uint8_t offset) {
 }
 #endif
 
+  // No background ADC scanning on this architecture yet
+  int8_t ADCee::init(byte pin) {
+    (void) pin;
+    return -1;
+  }
+  int ADCee::read(int8_t slot) {
+    (void) slot;
+    return 0;
+  }
+  byte ADCee::readSamples(int8_t slot, int *values, byte &seen) {
+    (void) slot;
+    (void) values;
+    (void) seen;
+    return 0;
+  }
+  void ADCee::scan() {}
+  int ADCee::readPin(byte pin) {
+    noInterrupts();
+    int value = analogRead(pin);
+    interrupts();
+    return value;
+  }
+
+#elif defined(ARDUINO_ARCH_ESP32)
+  // Native ESP32.  The timer interrupt is serviced by the core that attaches it,
+  // which is the Arduino loop core, leaving the other core to the networking task.
+  // The handler and all it calls (waveform, motor drivers, ADC) live in flash, so
+  // the interrupt is attached without the IRAM flag.  The system then holds it off
+  // while the flash cache is disabled, for WiFi, NVS and EEPROM writes, rather
+  // than letting it fault.
+  #include <esp_system.h>
+  static hw_timer_t * dccTimer = NULL;
+
+  static void dccTimerISR() { interruptHandler(); }
+
+  void DCCTimer::begin(INTERRUPT_CALLBACK callback) {
+    interruptHandler=callback;
+    dccTimer = timerBegin(0, 80, true);  // 80MHz APB clock / 80 = 1us ticks
+    timerAttachInterrupt(dccTimer, &dccTimerISR, true);
+    timerAlarmWrite(dccTimer, DCC_SIGNAL_TIME, true);
+    timerAlarmEnable(dccTimer);
+  }
+
+  bool DCCTimer::isPWMPin(byte pin) {
+       (void) pin; 
+       return false;  // no timer-driven pin switching on this architecture
+  }
+
+  void DCCTimer::setPWM(byte pin, bool high) {
+    (void) pin;
+    (void) high;
+  }
+
+  void DCCTimer::getSimulatedMacAddress(byte mac[6]) {
+    esp_efuse_mac_get_default(mac);
+    mac[0] &= 0xFE;
+    mac[0] |= 0x02;
+  }
+
+  // No background ADC scanning on this architecture yet
+  int8_t ADCee::init(byte pin) {
+    (void) pin;
+    return -1;
+  }
+  int ADCee::read(int8_t slot) {
+    (void) slot;
+    return 0;
+  }
+  byte ADCee::readSamples(int8_t slot, int *values, byte &seen) {
+    (void) slot;
+    (void) values;
+    (void) seen;
+    return 0;
+  }
+  void ADCee::scan() {}
+  int ADCee::readPin(byte pin) {
+    return analogRead(pin);
+  }
+
+#elif defined(ARDUINO_ARCH_NATIVE)
+  // Host build (env:native).  There is no timer: the handler runs each time
+  // something waiting for the waveform calls yield().
+  void DCCTimer::begin(INTERRUPT_CALLBACK callback) {
+    interruptHandler=callback;
+    nativeTimerInterrupt(callback);
+  }
+
+  bool DCCTimer::isPWMPin(byte pin) {
+       (void) pin; 
+       return false;
+  }
+
+  void DCCTimer::setPWM(byte pin, bool high) {
+    (void) pin;
+    (void) high;
+  }
+
+  void DCCTimer::getSimulatedMacAddress(byte mac[6]) {
+    static const byte hostMac[6]={0xBE, 0xEF, 0xFE, 0xED, 0xDE, 0xED};
+    memcpy(mac, hostMac, 6);
+  }
+
+  // No background ADC scanning
+  int8_t ADCee::init(byte pin) {
+    (void) pin;
+    return -1;
+  }
+  int ADCee::read(int8_t slot) {
+    (void) slot;
+    return 0;
+  }
+  byte ADCee::readSamples(int8_t slot, int *values, byte &seen) {
+    (void) slot;
+    (void) values;
+    (void) seen;
+    return 0;
+  }
+  void ADCee::scan() {}
+  int ADCee::readPin(byte pin) {
+    return analogRead(pin);
+  }
+
 #else 
   // Arduino nano, uno, mega etc
 #if defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
@@ -215,4 +408,82 @@ void DCCTimer::read(uint8_t word, uint8_t *mac, uint8_t offset) {
 
   }
 
+  byte ADCee::numPins=0;
+  byte ADCee::channels[ADC_MAX_PINS];
+  volatile int ADCee::samples[ADC_MAX_PINS][ADC_RING_SIZE];
+  volatile byte ADCee::ringPos[ADC_MAX_PINS];
+  byte ADCee::scanSlot=0;
+  volatile bool ADCee::converting=false;
+
+  int8_t ADCee::init(byte pin) {
+    if (pin >= A0) pin -= A0;  // channel number, as analogRead does
+    for (byte slot=0; slot<numPins; slot++)
+      if (channels[slot]==pin) return slot;
+    if (numPins>=ADC_MAX_PINS) return -1;
+    int value=readPin(pin);
+    for (byte i=0; i<ADC_RING_SIZE; i++) samples[numPins][i]=value;
+    ringPos[numPins]=0;
+    channels[numPins]=pin;
+    return numPins++;
+  }
+
+  int ADCee::read(int8_t slot) {
+    // The interrupt may store a sample while we add them up,
+    // in which case ringPos will have moved, so try again.
+    byte pos;
+    int sum;
+    do {
+      pos=ringPos[slot];
+      sum=0;
+      for (byte i=0; i<ADC_RING_SIZE; i++) sum+=samples[slot][i];
+    } while (pos!=ringPos[slot]);
+    return sum/ADC_RING_SIZE;
+  }
+
+  byte ADCee::readSamples(int8_t slot, int *values, byte &seen) {
+    byte pos;
+    byte n;
+    do {
+      pos=ringPos[slot];
+      n=pos-seen;
+      if (n>ADC_RING_SIZE) n=ADC_RING_SIZE;  // the older ones have been overwritten
+      for (byte i=0; i<n; i++) values[i]=samples[slot][(pos-n+i) & (ADC_RING_SIZE-1)];
+    } while (pos!=ringPos[slot]);
+    seen=pos;
+    return n;
+  }
+
+  // Called every 58uS from the DCC interrupt. Collects the result of the
+  // previous conversion, if it is complete, and starts one for the next pin.
+  void ADCee::scan() {
+    if (numPins==0 || (ADCSRA & _BV(ADSC))) return;  // nothing to scan or conversion still running
+    if (converting) {
+      byte low=ADCL;  // ADCL must be read first
+      byte high=ADCH;
+      byte pos=ringPos[scanSlot];
+      samples[scanSlot][pos & (ADC_RING_SIZE-1)]=(high<<8) | low;
+      ringPos[scanSlot]=pos+1;
+      if (++scanSlot>=numPins) scanSlot=0;
+    }
+    byte channel=channels[scanSlot];
+  #if defined(MUX5)
+    ADCSRB = (ADCSRB & ~_BV(MUX5)) | (((channel >> 3) & 0x01) << MUX5);
+  #endif
+    ADMUX = _BV(REFS0) | (channel & 0x07);  // AVCC reference, as analogRead would use
+    ADCSRA |= _BV(ADSC);
+    converting=true;
+  }
+
+  // Reads of other analogue pins must not overlap a background conversion,
+  // so finish that one first and let scan() restart it later.
+  int ADCee::readPin(byte pin) {
+    byte sreg=SREG;
+    cli();
+    while (ADCSRA & _BV(ADSC));
+    converting=false;
+    int value=analogRead(pin);
+    SREG=sreg;
+    return value;
+  }
+
 #endif
@@ -39,4 +39,30 @@ class DCCTimer {
   private:
 };
 
+// Background sampling of the motor driver current sense pins.
+// Where the architecture supports it, conversions are started and collected
+// by the DCC timer interrupt (see DCCWaveform::interruptHandler), so reading
+// a track current never waits for the ADC or needs interrupts disabled.
+// Each pin keeps a short ring of samples which read() averages.
+const byte ADC_MAX_PINS = 4;
+const byte ADC_RING_SIZE = 4;  // must be a power of 2
+
+class ADCee {
+  public:
+  static int8_t init(byte pin);  // returns slot to read, or -1 if not scanned in background
+  static int read(int8_t slot);  // average of the most recent samples
+  // Copies the samples taken since seen, oldest first, up to ADC_RING_SIZE of them,
+  // and moves seen on.  Returns how many.
+  static byte readSamples(int8_t slot, int *values, byte &seen);
+  static int readPin(byte pin);  // blocking read of any other analogue pin
+  static void scan();            // interrupt time only
+  private:
+  static byte numPins;
+  static byte channels[ADC_MAX_PINS];
+  static volatile int samples[ADC_MAX_PINS][ADC_RING_SIZE];
+  static volatile byte ringPos[ADC_MAX_PINS];  // samples taken, the ring index is the low bits
+  static byte scanSlot;          // slot being converted
+  static volatile bool converting;
+};
+
 #endif
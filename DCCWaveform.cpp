@@ -27,7 +27,6 @@
 #include "DCCWaveform.h"
 #include "DCCTimer.h"
 #include "DIAG.h"
-#include "freeMemory.h"
 
 DCCWaveform  DCCWaveform::mainTrack(PREAMBLE_BITS_MAIN, true);
 DCCWaveform  DCCWaveform::progTrack(PREAMBLE_BITS_PROG, false);
@@ -38,6 +37,21 @@ int  DCCWaveform::progTripValue=0;
 volatile uint8_t DCCWaveform::numAckGaps=0;
 volatile uint8_t DCCWaveform::numAckSamples=0;
 uint8_t DCCWaveform::trailingEdgeCounter=0;
+TrackPower * DCCWaveform::districts[MAX_DISTRICTS];
+byte DCCWaveform::districtCount=0;
+
+// District names for diag messages
+static const FSH * districtName(byte d) {
+  switch (d) {
+    case 0: return F("D1");
+    case 1: return F("D2");
+    case 2: return F("D3");
+    case 3: return F("D4");
+    case 4: return F("D5");
+    case 5: return F("D6");
+    default: return F("D7");
+  }
+}
 
 void DCCWaveform::begin(MotorDriver * mainDriver, MotorDriver * progDriver) {
   mainTrack.motorDriver=mainDriver;
@@ -45,19 +59,40 @@ void DCCWaveform::begin(MotorDriver * mainDriver, MotorDriver * progDriver) {
   progTripValue = progDriver->mA2raw(TRIP_CURRENT_PROG); // need only calculate once hence static
   mainTrack.setPowerMode(POWERMODE::OFF);      
   progTrack.setPowerMode(POWERMODE::OFF);
+#ifdef POWER_DISTRICTS
+  // Further main track power districts, each on its own motor driver
+  MotorDriver * districtDrivers[] = { POWER_DISTRICTS };
+  districtCount = sizeof(districtDrivers)/sizeof(districtDrivers[0]);
+  if (districtCount > MAX_DISTRICTS) {
+    DIAG(F("Only %d POWER_DISTRICTS are supported"), MAX_DISTRICTS);
+    districtCount = MAX_DISTRICTS;
+  }
+  for (byte d=0; d<districtCount; d++) {
+    districts[d] = new TrackPower(districtDrivers[d], districtName(d));
+    districts[d]->setPowerMode(POWERMODE::OFF);
+  }
+#endif
   // Fault pin config for odd motor boards (example pololu)
   MotorDriver::commonFaultPin = ((mainDriver->getFaultPin() == progDriver->getFaultPin())
 				 && (mainDriver->getFaultPin() != UNUSED_PIN));
   // Only use PWM if both pins are PWM capable. Otherwise JOIN does not work
   MotorDriver::usePWM= mainDriver->isPWMCapable() && progDriver->isPWMCapable();
+  for (byte d=0; d<districtCount; d++)
+    if (!districts[d]->motorDriver->isPWMCapable()) MotorDriver::usePWM=false;
   DIAG(F("Signal pin config: %S accuracy waveform"),
 	 MotorDriver::usePWM ? F("high") : F("normal") );
+  if (districtCount) DIAG(F("Main track power districts: %d"), districtCount);
+#ifdef RAILCOM
+  if (!mainTrack.setRailcom(true)) DIAG(F("RailCom cutout needs a brake pin on the MAIN and district motor drivers"));
+#endif
   DCCTimer::begin(DCCWaveform::interruptHandler);     
 }
 
 void DCCWaveform::loop(bool ackManagerActive) {
   mainTrack.checkPowerOverload(false);
   progTrack.checkPowerOverload(ackManagerActive);
+  for (byte d=0; d<districtCount; d++)
+    districts[d]->checkPowerOverload(districts[d]->motorDriver->getRawCurrentTripValue());
 }
 
 #pragma GCC push_options
@@ -65,75 +100,144 @@ void DCCWaveform::loop(bool ackManagerActive) {
 void DCCWaveform::interruptHandler() {
   // call the timer edge sensitive actions for progtrack and maintrack
   // member functions would be cleaner but have more overhead
+#ifdef DIAG_WAVE
+  unsigned long start=micros();
+#endif
   byte sigMain=signalTransform[mainTrack.state];
   byte sigProg=progTrackSyncMain? sigMain : signalTransform[progTrack.state];
   
   // Set the signal state for both tracks
   mainTrack.motorDriver->setSignal(sigMain);
   progTrack.motorDriver->setSignal(sigProg);
+  for (byte d=0; d<districtCount; d++) districts[d]->motorDriver->setSignal(sigMain);
   
   // Move on in the state engine
   mainTrack.state=stateTransform[mainTrack.state];    
   progTrack.state=stateTransform[progTrack.state];    
 
+  // Collect and restart the background current sense conversions
+  ADCee::scan();
+
 
   // WAVE_PENDING means we dont yet know what the next bit is
   if (mainTrack.state==WAVE_PENDING) mainTrack.interrupt2();  
   if (progTrack.state==WAVE_PENDING) progTrack.interrupt2();
   else if (progTrack.ackPending) progTrack.checkAck();
 
+#ifdef DIAG_WAVE
+  unsigned int elapsed=micros()-start;
+  if (elapsed>maxInterruptMicros) maxInterruptMicros=elapsed;
+#endif
 }
 #pragma GCC push_options
 
 // An instance of this class handles the DCC transmissions for one track. (main or prog)
 // Interrupts are marshalled via the statics.
-// A track has a current transmit buffer, and a pending buffer.
-// When the current buffer is exhausted, either the pending buffer (if there is one waiting) or an idle buffer.
-
+// A track has a current transmit buffer, and a queue of pending packets.
+// When the current buffer is exhausted, either the next queued packet (if there is one waiting) or an idle buffer.
 
-// This bitmask has 9 entries as each byte is trasmitted as a zero + 8 bits.
-const byte bitMask[] = {0x00, 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01};
 
+TrackPower::TrackPower(MotorDriver * driver, const FSH * trackName) {
+  motorDriver = driver;
+  name = trackName;
+  lastCurrent = 0;
+  maxmA = 0;
+  tripmA = 0;
+  powerMode = POWERMODE::OFF;
+  sampleDelay = 0;
+  lastSampleTaken = millis();
+}
 
 DCCWaveform::DCCWaveform( byte preambleBits, bool isMain) {
   isMainTrack = isMain;
-  packetPending = false;
-  memcpy(transmitPacket, idlePacket, sizeof(idlePacket));
+  name = isMain ? F("MAIN") : F("PROG");
+  pendingHead = 0;
+  pendingTail = 0;
   state = WAVE_START;
   // The +1 below is to allow the preamble generator to create the stop bit
   // for the previous packet. 
   requiredPreambles = preambleBits+1;  
-  bytes_sent = 0;
-  bits_sent = 0;
-  sampleDelay = 0;
-  lastSampleTaken = millis();
+  if (isMain) requiredPreambles += RAILCOM_CUTOUT_BITS;
+  // Fortunately reset and idle packets are the same length
+  idleBitCount = encodePacket(idleBits, isMainTrack ? idlePacket : resetPacket, sizeof(idlePacket));
+  memcpy(transmitPacket, idleBits, sizeof(idleBits));
+  transmitBitCount = idleBitCount;
+  transmitBitsRemaining = idleBitCount;
+  transmitRepeats = 0;
+  transmitByte = 0;
+  transmitMask = 0x80;
+  transmitIdle = true;
   ackPending=false;
 }
 
-POWERMODE DCCWaveform::getPowerMode() {
+bool DCCWaveform::setRailcom(bool on) {
+#ifdef RAILCOM
+  if (on && (!isMainTrack || !motorDriver->canBrake())) return false;
+  for (byte d=0; on && d<districtCount; d++)
+    if (!districts[d]->motorDriver->canBrake()) return false;
+  railcom = on;
+  if (!on) {
+    // in case it stopped in a cutout
+    motorDriver->setBrake(false);
+    setDistrictBrakes(false);
+  }
+  return true;
+#else
+  return !on;
+#endif
+}
+
+#pragma GCC push_options
+#pragma GCC optimize ("-O3")
+void DCCWaveform::setDistrictBrakes(bool on) {
+  for (byte d=0; d<districtCount; d++) districts[d]->motorDriver->setBrake(on);
+}
+#pragma GCC pop_options
+
+POWERMODE TrackPower::getPowerMode() {
   return powerMode;
 }
 
-void DCCWaveform::setPowerMode(POWERMODE mode) {
+void TrackPower::setPowerMode(POWERMODE mode) {
   powerMode = mode;
   bool ison = (mode == POWERMODE::ON);
   motorDriver->setPower( ison);
-  sentResetsSincePacket=0; 
+  powerModeChanged(mode);
+}
+
+// Switching the main track switches all its districts, but an overload
+// (TrackPower::checkPowerOverload) only affects the one that tripped.
+void DCCWaveform::setPowerMode(POWERMODE mode) {
+  TrackPower::setPowerMode(mode);
+  if (isMainTrack)
+    for (byte d=0; d<districtCount; d++) districts[d]->setPowerMode(mode);
 }
 
+void DCCWaveform::powerModeChanged(POWERMODE mode) {
+  sentResetsSincePacket=0; 
+  if (mode == POWERMODE::OFF) ackLearnCount=0;  // decoder may be changed while off
+}
 
 void DCCWaveform::checkPowerOverload(bool ackManagerActive) {
-  if (millis() - lastSampleTaken  < sampleDelay) return;
-  lastSampleTaken = millis();
   int tripValue= motorDriver->getRawCurrentTripValue();
   if (!isMainTrack && !ackManagerActive && !progTrackSyncMain && !progTrackBoosted)
     tripValue=progTripValue;
+  TrackPower::checkPowerOverload(tripValue);
+}
+
+void TrackPower::checkPowerOverload(int tripValue) {
+  unsigned long now = millis();
+  unsigned long elapsed = now - lastSampleTaken;
+  if (elapsed < sampleDelay) return;
+  lastSampleTaken = now;
+  if (elapsed > 255) elapsed = 255; // loop was held up, don't let one sample count for ever
   
   // Trackname for diag messages later
-  const FSH*trackname = isMainTrack ? F("MAIN") : F("PROG");
+  const FSH*trackname = name;
   switch (powerMode) {
     case POWERMODE::OFF:
       sampleDelay = POWER_SAMPLE_OFF_WAIT;
+      tripHeat = 0;
       break;
     case POWERMODE::ON:
       // Check current
@@ -156,10 +260,10 @@ void DCCWaveform::checkPowerOverload(bool ackManagerActive) {
 	      }
 	  }
       }
-      if (lastCurrent < tripValue) {
-        sampleDelay = POWER_SAMPLE_ON_WAIT;
-	if(power_good_counter<100)
-	  power_good_counter++;
+      if (powerMode == POWERMODE::ON && !checkTripCurve(lastCurrent, tripValue, elapsed)) {
+        sampleDelay = motorDriver->isSampledInBackground() ? POWER_SAMPLE_ON_WAIT : POWER_SAMPLE_ON_WAIT_BLOCKING;
+	if(power_good_counter<POWER_GOOD_RESET_TIME)
+	  power_good_counter+=elapsed;
 	else
 	  if (power_sample_overload_wait>POWER_SAMPLE_OVERLOAD_WAIT) power_sample_overload_wait=POWER_SAMPLE_OVERLOAD_WAIT;
       } else {
@@ -167,6 +271,7 @@ void DCCWaveform::checkPowerOverload(bool ackManagerActive) {
         unsigned int mA=motorDriver->raw2mA(lastCurrent);
         unsigned int maxmA=motorDriver->raw2mA(tripValue);
 	power_good_counter=0;
+	tripHeat=0;
         sampleDelay = power_sample_overload_wait;
         DIAG(F("%S TRACK POWER OVERLOAD current=%d max=%d offtime=%d"), trackname, mA, maxmA, sampleDelay);
 	if (power_sample_overload_wait >= 10000)
@@ -178,7 +283,7 @@ void DCCWaveform::checkPowerOverload(bool ackManagerActive) {
     case POWERMODE::OVERLOAD:
       // Try setting it back on after the OVERLOAD_WAIT
       setPowerMode(POWERMODE::ON);
-      sampleDelay = POWER_SAMPLE_ON_WAIT;
+      sampleDelay = motorDriver->isSampledInBackground() ? POWER_SAMPLE_ON_WAIT : POWER_SAMPLE_ON_WAIT_BLOCKING;
       // Debug code....
       DIAG(F("%S TRACK POWER RESET delay=%d"), trackname, sampleDelay);
       break;
@@ -186,6 +291,24 @@ void DCCWaveform::checkPowerOverload(bool ackManagerActive) {
       sampleDelay = 999; // cant get here..meaningless statement to avoid compiler warning.
   }
 }
+
+// Returns true if the track should trip. Called every POWER_SAMPLE_ON_WAIT
+// (or POWER_SAMPLE_ON_WAIT_BLOCKING) with the time in millis since the previous sample.
+bool TrackPower::checkTripCurve(int current, int tripValue, byte elapsed) {
+  // instantaneous trip on a hard short
+  if ((long)current*100 >= (long)tripValue*tripShortPercent) return true;
+  // I2t: heat while over the trip current, cool while under it
+  unsigned long trip2 = (unsigned long)tripValue*tripValue;
+  unsigned long current2 = (unsigned long)current*current;
+  if (current2 > trip2) {
+    tripHeat += (current2-trip2)*elapsed;
+    // twice the trip current is 3*trip2 over, so trips after tripSustainMs
+    return tripHeat >= 3*trip2*tripSustainMs;
+  }
+  unsigned long cooling = (trip2-current2)*elapsed;
+  tripHeat = (tripHeat > cooling) ? tripHeat-cooling : 0;
+  return false;
+}
 // For each state of the wave  nextState=stateTransform[currentState] 
 const WAVE_STATE DCCWaveform::stateTransform[]={
    /* WAVE_START   -> */ WAVE_PENDING,
@@ -210,89 +333,321 @@ void DCCWaveform::interrupt2() {
   // calculate the next bit to be sent:
   // set state WAVE_MID_1  for a 1=bit
   //        or WAVE_HIGH_0 for a 0 bit.
+  // The packet has already been laid out bit by bit, so
+  // all that is needed here is to shift out the next one.
+
+  state=(transmitPacket[transmitByte] & transmitMask)? WAVE_MID_1 : WAVE_HIGH_0;
+
+#ifdef RAILCOM
+  if (railcom) {
+    // Bit 0 of the buffer is the end bit of the previous packet, and the
+    // cutout replaces the preamble bits after it.
+    byte bit=transmitBitCount-transmitBitsRemaining;
+    if (bit==1) {
+      motorDriver->setBrake(true);
+      if (districtCount) setDistrictBrakes(true);
+    }
+    else if (bit==1+RAILCOM_CUTOUT_BITS) {
+      motorDriver->setBrake(false);
+      if (districtCount) setDistrictBrakes(false);
+      railcomCutouts++;
+    }
+  }
+#endif
 
-  if (remainingPreambles > 0 ) {
-    state=WAVE_MID_1;  // switch state to trigger LOW on next interrupt
-    remainingPreambles--;
-    // Update free memory diagnostic as we don't have anything else to do this time.
-    // Allow for checkAck and its called functions using 22 bytes more.
-    updateMinimumFreeMemory(22); 
+  if (--transmitBitsRemaining) {
+    transmitMask >>= 1;
+    if (transmitMask==0) {
+      transmitMask=0x80;
+      transmitByte++;
+    }
     return;
   }
 
-  // Wave has gone HIGH but what happens next depends on the bit to be transmitted
-  // beware OF 9-BIT MASK  generating a zero to start each byte
-  state=(transmitPacket[bytes_sent] & bitMask[bits_sent])? WAVE_MID_1 : WAVE_HIGH_0; 
-  bits_sent++;
-
-  // If this is the last bit of a byte, prepare for the next byte
-
-  if (bits_sent == 9) { // zero followed by 8 bits of a byte
-    //end of Byte
-    bits_sent = 0;
-    bytes_sent++;
-    // if this is the last byte, prepere for next packet
-    if (bytes_sent >= transmitLength) {
-      // end of transmission buffer... repeat or switch to next message
-      bytes_sent = 0;
-      remainingPreambles = requiredPreambles;
-
-      if (transmitRepeats > 0) {
-        transmitRepeats--;
-      }
-      else if (packetPending) {
-        // Copy pending packet to transmit packet
-        // a fixed length memcpy is faster than a variable length loop for these small lengths
-        // for (int b = 0; b < pendingLength; b++) transmitPacket[b] = pendingPacket[b];
-        memcpy( transmitPacket, pendingPacket, sizeof(pendingPacket));
-        
-        transmitLength = pendingLength;
-        transmitRepeats = pendingRepeats;
-        packetPending = false;
-        sentResetsSincePacket=0;
-      }
-      else {
-        // Fortunately reset and idle packets are the same length
-        memcpy( transmitPacket, isMainTrack ? idlePacket : resetPacket, sizeof(idlePacket));
-        transmitLength = sizeof(idlePacket);
+  // end of transmission buffer... repeat or switch to next message
+#ifdef DIAG_WAVE
+  if (transmitIdle) sentIdles++;
+  else sentPackets++;
+#endif
+  transmitByte = 0;
+  transmitMask = 0x80;
+  if (priorityPending) {
+    // An emergency stop goes before repeats and queued packets
+    memcpy( transmitPacket, priorityPacket, sizeof(priorityPacket));
+    transmitBitCount = priorityBitCount;
+    transmitRepeats = priorityRepeats;
+    // Queued speed packets for the stopped loco(s) are out of date, so mark them to be skipped
+    for (byte i=pendingHead; i!=pendingTail; i=(i+1) & (PACKET_QUEUE_SIZE-1)) {
+      uint16_t loco=pendingSpeedLoco[i];
+      if (loco!=NOT_SPEED && (priorityStoppedLoco==0 || loco==priorityStoppedLoco)) pendingBitCount[i]=0;
+    }
+    priorityPending = false;
+    transmitIdle = false;
+    sentResetsSincePacket=0;
+  }
+  else if (transmitRepeats > 0) {
+    transmitRepeats--;
+  }
+  else if (skipDroppedPackets()) {
+    // Copy next queued packet to transmit packet
+    // a fixed length memcpy is faster than a variable length loop for these small lengths
+    byte head=pendingHead;
+    memcpy( transmitPacket, pendingPacket[head], sizeof(pendingPacket[0]));
+    transmitBitCount = pendingBitCount[head];
+    transmitRepeats = pendingRepeats[head];
+    pendingHead = (head+1) & (PACKET_QUEUE_SIZE-1);  // release the entry
+    transmitIdle = false;
+    sentResetsSincePacket=0;
+  }
+  else {
+#if REMINDER_POOL_SIZE > 0
+    // Nothing queued, so send a reminder from the pool.  An idle goes after each, as
+    // the pool may hold only one loco and its packets mustn't be back to back.
+    if (isMainTrack && transmitIdle) {
+      for (byte n=0; n<REMINDER_POOL_SIZE; n++) {
+        byte i=reminderNext;
+        reminderNext = (i+1) % REMINDER_POOL_SIZE;
+        byte bits=reminderBitCount[i];
+        if (bits==0) continue;
+        memcpy( transmitPacket, reminderBits[i], sizeof(reminderBits[0]));
+        transmitBitCount = bits;
         transmitRepeats = 0;
-        if (sentResetsSincePacket<250) sentResetsSincePacket++;
+        transmitIdle = false;
+        transmitBitsRemaining = bits;
+#ifdef DIAG_WAVE
+        sentPoolReminders++;
+#endif
+        return;
       }
     }
-  }  
+#endif
+    if (!transmitIdle) {
+      memcpy( transmitPacket, idleBits, sizeof(idleBits));
+      transmitBitCount = idleBitCount;
+      transmitIdle = true;
+    }
+    transmitRepeats = 0;
+    if (sentResetsSincePacket<250) sentResetsSincePacket++;
+  }
+  transmitBitsRemaining = transmitBitCount;
 }
 #pragma GCC pop_options
 
+// Lay out a packet (including its checksum) exactly as it will be sent:
+// preamble ones, then for each byte a zero start bit followed by its 8 bits.
+// The following packet's preamble provides the end bit.
+// Returns the number of bits.
+byte DCCWaveform::encodePacket(byte encoded[MAX_ENCODED_SIZE], const byte packet[], byte length) {
+  memset(encoded, 0, MAX_ENCODED_SIZE);
+  byte bit = 0;
+  for (byte p = 0; p < requiredPreambles; p++, bit++)
+    encoded[bit>>3] |= 0x80>>(bit&7);
+  for (byte b = 0; b < length; b++) {
+    bit++; // zero start bit
+    for (byte mask = 0x80; mask; mask >>= 1, bit++)
+      if (packet[b] & mask) encoded[bit>>3] |= 0x80>>(bit&7);
+  }
+  return bit;
+}
 
-// Wait until there is no packet pending, then make this pending
+// Wait until there is room in the queue, then add this packet to it
 void DCCWaveform::schedulePacket(const byte buffer[], byte byteCount, byte repeats) {
   if (byteCount > MAX_PACKET_SIZE) return; // allow for chksum
-  while (packetPending);
 
+  byte packet[MAX_PACKET_SIZE+1]; // +1 for checksum
   byte checksum = 0;
   for (byte b = 0; b < byteCount; b++) {
     checksum ^= buffer[b];
-    pendingPacket[b] = buffer[b];
+    packet[b] = buffer[b];
   }
-  // buffer is MAX_PACKET_SIZE but pendingPacket is one bigger
-  pendingPacket[byteCount] = checksum;
-  pendingLength = byteCount + 1;
-  pendingRepeats = repeats;
-  packetPending = true;
+  // buffer is MAX_PACKET_SIZE but packet is one bigger
+  packet[byteCount] = checksum;
+
+#ifdef DIAG_WAVE
+  queuedPackets[packetType(buffer, byteCount)]++;
+#endif
+  while (isPacketQueueFull()) yield();
+  byte tail=pendingTail;
+  pendingBitCount[tail] = encodePacket(pendingPacket[tail], packet, byteCount + 1);
+  pendingRepeats[tail] = repeats;
+  pendingSpeedLoco[tail] = speedPacketLoco(buffer, byteCount);
+  // The entry must be complete before the interrupt can see it
+  __asm__ __volatile__ ("" ::: "memory");
+  pendingTail = (tail+1) & (PACKET_QUEUE_SIZE-1);
   sentResetsSincePacket=0;
 }
 
+void DCCWaveform::schedulePriorityPacket(const byte buffer[], byte byteCount, byte repeats, uint16_t stoppedLoco) {
+  if (byteCount > MAX_PACKET_SIZE) return; // allow for chksum
+
+  byte packet[MAX_PACKET_SIZE+1]; // +1 for checksum
+  byte checksum = 0;
+  for (byte b = 0; b < byteCount; b++) {
+    checksum ^= buffer[b];
+    packet[b] = buffer[b];
+  }
+  packet[byteCount] = checksum;
+
+#ifdef DIAG_WAVE
+  queuedPackets[packetType(buffer, byteCount)]++;
+#endif
+  while (priorityPending) yield();  // at most one packet time
+  priorityBitCount = encodePacket(priorityPacket, packet, byteCount + 1);
+  priorityRepeats = repeats;
+  priorityStoppedLoco = stoppedLoco;
+  // The packet must be complete before the interrupt can see it
+  __asm__ __volatile__ ("" ::: "memory");
+  priorityPending = true;
+}
+
+// The loco a packet (without its checksum) sets the speed of, 0 for a broadcast,
+// or NOT_SPEED if it isn't a main track speed packet
+uint16_t DCCWaveform::speedPacketLoco(const byte packet[], byte length) {
+  if (!isMainTrack) return NOT_SPEED;
+  byte address=packet[0];
+  if (address>=0x80 && address<0xC0) return NOT_SPEED;  // accessory
+  if (address>=0xE8) return NOT_SPEED;
+  byte i=(address>=0xC0) ? 2 : 1;  // long addresses have two bytes
+  if (length<=i) return NOT_SPEED;
+  byte instruction=packet[i];
+  if (instruction!=0x3F && (instruction&0xC0)!=0x40) return NOT_SPEED;  // 128 step, or 14/28 step
+  return (i==2) ? ((address & 0x3F)<<8) | packet[1] : address;
+}
+
+#if REMINDER_POOL_SIZE > 0
+byte DCCWaveform::reminderBits[REMINDER_POOL_SIZE][MAX_ENCODED_SIZE];
+volatile byte DCCWaveform::reminderBitCount[REMINDER_POOL_SIZE];
+uint16_t DCCWaveform::reminderLoco[REMINDER_POOL_SIZE];
+byte DCCWaveform::reminderReplace=0;
+byte DCCWaveform::reminderNext=0;
+#endif
+
+void DCCWaveform::setReminder(uint16_t loco, const byte buffer[], byte byteCount) {
+#if REMINDER_POOL_SIZE > 0
+  if (byteCount > MAX_PACKET_SIZE) return;
+  if (loco==0) {  // a broadcast stops every loco, so their reminders are out of date
+    forgetReminder(0);
+    return;
+  }
+  byte packet[MAX_PACKET_SIZE+1];
+  byte checksum = 0;
+  for (byte b = 0; b < byteCount; b++) {
+    checksum ^= buffer[b];
+    packet[b] = buffer[b];
+  }
+  packet[byteCount] = checksum;
+
+  byte slot=REMINDER_POOL_SIZE;
+  for (byte i=0; i<REMINDER_POOL_SIZE; i++) {
+    if (reminderBitCount[i] && reminderLoco[i]==loco) { slot=i; break; }
+    if (reminderBitCount[i]==0 && slot==REMINDER_POOL_SIZE) slot=i;
+  }
+  if (slot==REMINDER_POOL_SIZE) {
+    slot=reminderReplace;
+    reminderReplace = (slot+1) % REMINDER_POOL_SIZE;
+  }
+  reminderBitCount[slot]=0;
+  __asm__ __volatile__ ("" ::: "memory");
+  reminderLoco[slot]=loco;
+  byte bits=mainTrack.encodePacket(reminderBits[slot], packet, byteCount + 1);
+  // The entry must be complete before the interrupt can see it
+  __asm__ __volatile__ ("" ::: "memory");
+  reminderBitCount[slot]=bits;
+#else
+  (void)loco; (void)buffer; (void)byteCount;
+#endif
+}
+
+void DCCWaveform::forgetReminder(uint16_t loco) {
+#if REMINDER_POOL_SIZE > 0
+  for (byte i=0; i<REMINDER_POOL_SIZE; i++)
+    if (loco==0 || reminderLoco[i]==loco) reminderBitCount[i]=0;
+#else
+  (void)loco;
+#endif
+}
+
+#ifdef DIAG_WAVE
+volatile unsigned int DCCWaveform::maxInterruptMicros=0;
+unsigned long DCCWaveform::statsStart=0;
+
+// Sort a packet (without its checksum) by what it does, for <D WAVE>
+byte DCCWaveform::packetType(const byte packet[], byte length) {
+  if (!isMainTrack) return (length>=3) ? PACKET_CV : PACKET_OTHER;  // service mode packets, or resets
+  byte address=packet[0];
+  if (address>=0x80 && address<0xC0) return PACKET_ACCESSORY;
+  byte i=(address>=0xC0) ? 2 : 1;  // long addresses have two bytes
+  if (address>=0xE8 || length<=i) return PACKET_OTHER;
+  byte instruction=packet[i];
+  if (instruction==0x3F || (instruction&0xC0)==0x40) return PACKET_SPEED;  // 128 step, or 14/28 step
+  if ((instruction&0xC0)==0x80 || (instruction&0xF8)==0xD8 || instruction==0xC0)
+    return PACKET_FUNCTION;  // groups 1-3, F13 and up, binary states
+  if ((instruction&0xF0)==0xE0) return PACKET_CV;  // programming on main
+  return PACKET_OTHER;
+}
+
+// Percentage, without overflowing for large counts.  Rounding whole down to
+// hundreds can make part/(whole/100) exceed 100, so it is clamped.
+static byte percentOf(uint32_t part, uint32_t whole) {
+  if (whole==0) return 0;
+  uint32_t percent=(whole>=100) ? part/(whole/100) : part*100/whole;
+  return (percent>100) ? 100 : percent;
+}
+
+void DCCWaveform::displayTrackStats(Print * stream, unsigned long seconds) {
+  noInterrupts();
+  uint32_t sent=sentPackets;
+  uint32_t idles=sentIdles;
+  uint32_t pool=sentPoolReminders;
+  sentPackets=0;
+  sentIdles=0;
+  sentPoolReminders=0;
+  interrupts();
+  StringFormatter::send(stream, F("%S sent=%l/s idle=%d%% pool=%d%% queued/s speed=%l function=%l accessory=%l cv=%l other=%l\n"),
+    isMainTrack ? F("MAIN") : F("PROG"), (sent+idles)/seconds, percentOf(idles, sent+idles), percentOf(pool, sent+idles),
+    queuedPackets[PACKET_SPEED]/seconds, queuedPackets[PACKET_FUNCTION]/seconds,
+    queuedPackets[PACKET_ACCESSORY]/seconds, queuedPackets[PACKET_CV]/seconds,
+    queuedPackets[PACKET_OTHER]/seconds);
+  memset(queuedPackets, 0, sizeof(queuedPackets));
+}
+
+void DCCWaveform::displayStats(Print * stream) {
+  unsigned long seconds=(millis()-statsStart)/1000;
+  if (seconds==0) seconds=1;
+  StringFormatter::send(stream, F("Wave stats over %ls\n"), seconds);
+  mainTrack.displayTrackStats(stream, seconds);
+  progTrack.displayTrackStats(stream, seconds);
+  noInterrupts();
+  unsigned int maxMicros=maxInterruptMicros;
+  maxInterruptMicros=0;
+  interrupts();
+  StringFormatter::send(stream, F("Interrupt max=%uus\n"), maxMicros);
+  statsStart=millis();
+}
+#endif
+
 // Operations applicable to PROG track ONLY.
 // (yes I know I could have subclassed the main track but...) 
 
 void DCCWaveform::setAckBaseline() {
       if (isMainTrack) return;
       int baseline=motorDriver->getCurrentRaw();
-      ackThreshold= baseline + motorDriver->mA2raw(ackLimitmA);
-      if (Diag::ACK) DIAG(F("ACK baseline=%d/%dmA Threshold=%d/%dmA Duration between %uus and %uus"),
+      ackBaseline32=baseline*32;
+      ackLimitRaw=motorDriver->mA2raw(ackLimitmA);
+      ackMinWindow=minAckPulseDuration;
+      ackMaxWindow=maxAckPulseDuration;
+      if (ACK_LEARN_COUNT>0 && ackLearnCount>=ACK_LEARN_COUNT) {
+        // tighten up to suit the pulses this decoder has been sending
+        if (ackLearnHeight/2 > ackLimitRaw) ackLimitRaw=ackLearnHeight/2;
+        if (ackLearnPulse/2 > ackMinWindow) ackMinWindow=ackLearnPulse/2;
+        if (ackLearnPulse < ackMaxWindow/2) ackMaxWindow=ackLearnPulse*2;
+      }
+      ackThreshold= baseline + ackLimitRaw;
+      if (Diag::ACK) DIAG(F("ACK baseline=%d/%dmA Threshold=%d/%dmA Duration between %uus and %uus%S"),
 			  baseline,motorDriver->raw2mA(baseline),
 			  ackThreshold,motorDriver->raw2mA(ackThreshold),
-                          minAckPulseDuration, maxAckPulseDuration);
+                          ackMinWindow, ackMaxWindow,
+                          ackMinWindow!=minAckPulseDuration || ackMaxWindow!=maxAckPulseDuration ? F(" (learnt)") : F(""));
 }
 
 void DCCWaveform::setAckPending() {
@@ -311,10 +666,27 @@ byte DCCWaveform::getAck() {
       if (ackPending) return (2);  // still waiting
       if (Diag::ACK) DIAG(F("%S after %dmS max=%d/%dmA pulse=%uuS samples=%d gaps=%d"),ackDetected?F("ACK"):F("NO-ACK"), ackCheckDuration,
 			  ackMaxCurrent,motorDriver->raw2mA(ackMaxCurrent), ackPulseDuration, numAckSamples, numAckGaps);
-      if (ackDetected) return (1); // Yes we had an ack
+      if (ackDetected) {
+        learnAck();
+        return (1); // Yes we had an ack
+      }
       return(0);  // pending set off but not detected means no ACK.   
 }
 
+// Keep running averages of the width and height of genuine ACK pulses
+void DCCWaveform::learnAck() {
+      int height=ackMaxCurrent-(int)(ackBaseline32/32);
+      if (height<=0) return;
+      if (ackLearnCount==0) {
+        ackLearnPulse=ackPulseDuration;
+        ackLearnHeight=height;
+      } else {
+        ackLearnPulse=(unsigned int)(((unsigned long)ackLearnPulse*3+ackPulseDuration)/4);
+        ackLearnHeight=(ackLearnHeight*3+height)/4;
+      }
+      if (ackLearnCount<255) ackLearnCount++;
+}
+
 #pragma GCC push_options
 #pragma GCC optimize ("-O3")
 void DCCWaveform::checkAck() {
@@ -329,6 +701,7 @@ void DCCWaveform::checkAck() {
     numAckSamples++;
     if (current > ackMaxCurrent) ackMaxCurrent=current;
     // An ACK is a pulse lasting between minAckPulseDuration and maxAckPulseDuration uSecs (refer @haba)
+    // or the narrower window learnt from earlier ACKs
         
     if (current>ackThreshold) {
        if (trailingEdgeCounter > 0) {
@@ -340,7 +713,14 @@ void DCCWaveform::checkAck() {
     }
     
     // not in pulse
-    if (ackPulseStart==0) return; // keep waiting for leading edge 
+    if (ackPulseStart==0) {
+      // keep waiting for leading edge, following any drift in the idle current
+      if (current>=0) {
+        ackBaseline32 += current - (int)(ackBaseline32/32);
+        ackThreshold = ackBaseline32/32 + ackLimitRaw;
+      }
+      return;
+    }
     
     // if we reach to this point, we have
     // detected trailing edge of pulse
@@ -357,7 +737,7 @@ void DCCWaveform::checkAck() {
     }
     trailingEdgeCounter = 0;
 
-    if (ackPulseDuration>=minAckPulseDuration && ackPulseDuration<=maxAckPulseDuration) {
+    if (ackPulseDuration>=ackMinWindow && ackPulseDuration<=ackMaxWindow) {
         ackCheckDuration=millis()-ackCheckStart;
         ackDetected=true;
         ackPending=false;
@@ -24,17 +24,82 @@
 #ifndef DCCWaveform_h
 #define DCCWaveform_h
 
+#include "defines.h"
 #include "MotorDriver.h"
 
+// Define symbol DIAG_WAVE to count the packets queued and sent on each track,
+// the reminder cycle and the longest DCC interrupt.  The figures are printed
+// and cleared by the <D WAVE> command.
+//#define DIAG_WAVE
+
 // Wait times for power management. Unit: milliseconds
-const int  POWER_SAMPLE_ON_WAIT = 100;
+const int  POWER_SAMPLE_ON_WAIT = 1;          // current scanned in the background by ADCee
+const int  POWER_SAMPLE_ON_WAIT_BLOCKING = 100; // current read with a blocking analogRead
 const int  POWER_SAMPLE_OFF_WAIT = 1000;
 const int  POWER_SAMPLE_OVERLOAD_WAIT = 20;
+const unsigned int POWER_GOOD_RESET_TIME = 10000; // time at good current before overload backoff is reset
+
+// Trip curve for track power. Power is cut at once if the current reaches
+// POWER_TRIP_SHORT_PERCENT of the trip current. Below that, current over the
+// trip value heats an I2t accumulator which cools again when the current drops,
+// so short inrush (eg sound decoder capacitors) rides through but a sustained
+// overload does not. POWER_TRIP_SUSTAIN_MS is how long twice the trip current
+// may flow before power is cut. Both can be changed per track with setTripCurve.
+#ifndef POWER_TRIP_SHORT_PERCENT
+#define POWER_TRIP_SHORT_PERCENT 300
+#endif
+#ifndef POWER_TRIP_SUSTAIN_MS
+#define POWER_TRIP_SUSTAIN_MS 100
+#endif
+const unsigned int POWER_TRIP_SUSTAIN_MAX = 1000;  // keeps the accumulator in range
+
+// Adaptive ACK detection. Once this many genuine ACKs have been seen since the
+// prog track was powered on, the pulse duration window narrows to half and
+// twice the learnt pulse width, and the threshold rises to half the learnt
+// pulse height if that is above the ACK limit. 0 disables learning.
+#ifndef ACK_LEARN_COUNT
+#define ACK_LEARN_COUNT 3
+#endif
+
+// RailCom (RCN-217) cutout on the main track. After the end bit of each packet
+// the motor driver brake is applied, shorting the track outputs for four bit
+// times (464uS) while decoders send their data to the detectors.  The timer
+// runs at half bit intervals, so the cutout starts as the end bit finishes
+// rather than the 26-32uS after it that the standard asks for.  The main track
+// preamble is lengthened by the cutout, so the full preamble still follows it.
+#ifdef RAILCOM
+const byte  RAILCOM_CUTOUT_BITS = 4;
+#else
+const byte  RAILCOM_CUTOUT_BITS = 0;
+#endif
 
 // Number of preamble bits.
 const int   PREAMBLE_BITS_MAIN = 16;
 const int   PREAMBLE_BITS_PROG = 22;
 const byte   MAX_PACKET_SIZE = 5;  // NMRA standard extended packets, payload size WITHOUT checksum.
+// Bytes needed for a packet laid out bit by bit: preamble plus stop bit of the
+// previous packet, then a zero start bit and 8 bits for each byte and the checksum.
+const int    MAX_PREAMBLE_BITS = (PREAMBLE_BITS_PROG > PREAMBLE_BITS_MAIN + RAILCOM_CUTOUT_BITS) ?
+                                  PREAMBLE_BITS_PROG : PREAMBLE_BITS_MAIN + RAILCOM_CUTOUT_BITS;
+const byte   MAX_ENCODED_SIZE = (MAX_PREAMBLE_BITS + 1 + (MAX_PACKET_SIZE+1)*9 + 7) / 8;
+
+// Number of queue entries for packets waiting to be transmitted. Must be a power of 2.
+// One entry is always left empty so the queue holds one less than this.
+#if defined(ARDUINO_AVR_UNO) || defined(ARDUINO_AVR_NANO)
+const byte   PACKET_QUEUE_SIZE = 4;
+#else
+const byte   PACKET_QUEUE_SIZE = 8;
+#endif
+
+// Speed packets the main track interrupt sends in place of idle packets, so that
+// locos are still refreshed while the loop is held up.  MAX_ENCODED_SIZE+3 bytes each.
+#ifndef REMINDER_POOL_SIZE
+#if defined(ARDUINO_AVR_UNO) || defined(ARDUINO_AVR_NANO)
+#define REMINDER_POOL_SIZE 0
+#else
+#define REMINDER_POOL_SIZE 8
+#endif
+#endif
 
 // The WAVE_STATE enum is deliberately numbered because a change of order would be catastrophic
 // to the transform array.
@@ -50,18 +115,21 @@ enum class POWERMODE : byte { OFF, ON, OVERLOAD };
 const byte idlePacket[] = {0xFF, 0x00, 0xFF};
 const byte resetPacket[] = {0x00, 0x00, 0x00};
 
-class DCCWaveform {
-  public:
-    DCCWaveform( byte preambleBits, bool isMain);
-    static void begin(MotorDriver * mainDriver, MotorDriver * progDriver);
-    static void loop(bool ackManagerActive);
-    static DCCWaveform  mainTrack;
-    static DCCWaveform  progTrack;
+// Most main track power districts besides the main track itself
+const byte MAX_DISTRICTS = 7;
 
-    void beginTrack();
+// Power management for one track output: its motor driver, power state and
+// overload protection.  The main and prog tracks each have one, and further 
+// main track power districts (POWER_DISTRICTS in config.h) have one each
+// and follow the main track waveform, so a short in one district only cuts
+// the power there.
+class TrackPower {
+  public:
+    TrackPower(MotorDriver * driver=NULL, const FSH * trackName=NULL);
     void setPowerMode(POWERMODE);
     POWERMODE getPowerMode();
-    void checkPowerOverload(bool ackManagerActive);
+    void checkPowerOverload(int tripValue);
+    inline const FSH * getName() { return name; }
     inline int get1024Current() {
 	  if (powerMode == POWERMODE::ON)
 	      return (int)(lastCurrent*(long int)1024/motorDriver->getRawCurrentTripValue());
@@ -72,6 +140,13 @@ class DCCWaveform {
         return motorDriver->raw2mA(lastCurrent);
       return 0;
     }
+    // Raw samples and their conversion, for CurrentTelemetry
+    inline byte getCurrentSamples(int *values, byte &seen) {
+      return motorDriver->getCurrentSamples(values, seen);
+    }
+    inline unsigned int raw2mA(int raw) {
+      return motorDriver->raw2mA(raw);
+    }
     inline int getMaxmA() {
       if (maxmA == 0) { //only calculate this for first request, it doesn't change
         maxmA = motorDriver->raw2mA(motorDriver->getRawCurrentTripValue()); //TODO: replace with actual max value or calc
@@ -84,8 +159,66 @@ class DCCWaveform {
       }
       return tripmA;        
     }
+    inline bool canMeasureCurrent() {
+      return motorDriver->canMeasureCurrent();
+    };
+    inline void setTripCurve(unsigned int shortPercent, unsigned int sustainMs) {
+	tripShortPercent = shortPercent<100 ? 100 : shortPercent;
+	tripSustainMs = sustainMs>POWER_TRIP_SUSTAIN_MAX ? POWER_TRIP_SUSTAIN_MAX : sustainMs;
+	tripHeat = 0;
+    }
+
+  protected:
+    friend class DCCWaveform;
+    virtual void powerModeChanged(POWERMODE mode) { (void)mode; }
+    const FSH * name;
+    MotorDriver*  motorDriver;
+    int  lastCurrent;
+    int maxmA;
+    int tripmA;
+    
+    // current sampling
+    POWERMODE powerMode;
+    unsigned long lastSampleTaken;
+    unsigned int sampleDelay;
+    unsigned long power_sample_overload_wait = POWER_SAMPLE_OVERLOAD_WAIT;
+    unsigned int power_good_counter = 0;  // millis at good current
+    bool checkTripCurve(int current, int tripValue, byte elapsed);
+    unsigned int tripShortPercent = POWER_TRIP_SHORT_PERCENT;
+    unsigned int tripSustainMs = POWER_TRIP_SUSTAIN_MS;
+    unsigned long tripHeat = 0;  // I2t above trip current, raw^2 * millis
+};
+
+class DCCWaveform : public TrackPower {
+  public:
+    DCCWaveform( byte preambleBits, bool isMain);
+    static void begin(MotorDriver * mainDriver, MotorDriver * progDriver);
+    static void loop(bool ackManagerActive);
+    static DCCWaveform  mainTrack;
+    static DCCWaveform  progTrack;
+    // Further main track power districts
+    static TrackPower * districts[MAX_DISTRICTS];
+    static byte districtCount;
+
+    void beginTrack();
+    // Setting the main track power sets that of all the districts
+    void setPowerMode(POWERMODE);
+    void checkPowerOverload(bool ackManagerActive);
     void schedulePacket(const byte buffer[], byte byteCount, byte repeats);
-    volatile bool packetPending;
+    // Send a packet as soon as the one being transmitted ends, ahead of the queue.
+    // Used for emergency stops: queued speed packets for the stopped loco (every
+    // loco if 0) are dropped, other packets are left in the queue.
+    void schedulePriorityPacket(const byte buffer[], byte byteCount, byte repeats, uint16_t stoppedLoco);
+    // Keep the latest speed packet sent to a loco in the reminder pool, replacing the
+    // loco that was sent longest ago if the pool is full.  Main track only.
+    static void setReminder(uint16_t loco, const byte buffer[], byte byteCount);
+    static void forgetReminder(uint16_t loco);  // 0 for all locos
+    inline bool isPacketPending() {
+      return pendingHead!=pendingTail;
+    }
+    inline bool isPacketQueueFull() {
+      return ((pendingTail+1) & (PACKET_QUEUE_SIZE-1)) == pendingHead;
+    }
     volatile byte sentResetsSincePacket;
     volatile bool autoPowerOff=false;
     void setAckBaseline();  //prog track only
@@ -99,18 +232,26 @@ class DCCWaveform {
 	    autoPowerOff=false;
 	}
     };
-    inline bool canMeasureCurrent() {
-      return motorDriver->canMeasureCurrent();
-    };
     inline void setAckLimit(int mA) {
 	ackLimitmA = mA;
+	ackLearnCount = 0;
     }
     inline void setMinAckPulseDuration(unsigned int i) {
 	minAckPulseDuration = i;
+	ackLearnCount = 0;
     }
     inline void setMaxAckPulseDuration(unsigned int i) {
 	maxAckPulseDuration = i;
+	ackLearnCount = 0;
     }
+    // RailCom cutout, main track only.  Returns false if it can't be generated.
+    bool setRailcom(bool on);
+    inline bool isRailcom() { return railcom; }
+    volatile byte railcomCutouts=0;  // count of cutouts completed
+#ifdef DIAG_WAVE
+    // Print the counts for both tracks and start again
+    static void displayStats(Print * stream);
+#endif
 
   private:
     
@@ -124,34 +265,71 @@ class DCCWaveform {
     void interrupt2();
     void checkAck();
     
+    void powerModeChanged(POWERMODE mode) override;
+    static void setDistrictBrakes(bool on);
     bool isMainTrack;
-    MotorDriver*  motorDriver;
+    bool railcom=false;
+    byte encodePacket(byte encoded[MAX_ENCODED_SIZE], const byte packet[], byte length);
     // Transmission controller
-    byte transmitPacket[MAX_PACKET_SIZE+1]; // +1 for checksum
-    byte transmitLength;
+    byte transmitPacket[MAX_ENCODED_SIZE]; // bit stream including preamble and start bits
+    byte transmitBitCount;     // number of bits in transmitPacket
     byte transmitRepeats;      // remaining repeats of transmission
-    byte remainingPreambles;
+    byte transmitBitsRemaining; // bits still to send from transmitPacket
+    byte transmitByte;         // byte of transmitPacket being sent
+    byte transmitMask;         // bit of transmitPacket[transmitByte] to send next
+    bool transmitIdle;         // transmitPacket holds the idle (or reset) packet
     byte requiredPreambles;
-    byte bits_sent;           // 0-8 (yes 9 bits) sent for current byte
-    byte bytes_sent;          // number of bytes sent from transmitPacket
+    byte idleBits[MAX_ENCODED_SIZE];  // idle packet (main) or reset packet (prog), encoded once
+    byte idleBitCount;
     WAVE_STATE state;         // wave generator state machine
-    byte pendingPacket[MAX_PACKET_SIZE+1]; // +1 for checksum
-    byte pendingLength;
-    byte pendingRepeats;
-    int  lastCurrent;
+    // Packet queue. schedulePacket (main loop) is the only writer of pendingTail
+    // and interrupt2 the only writer of pendingHead, so no locking is needed.
+    byte pendingPacket[PACKET_QUEUE_SIZE][MAX_ENCODED_SIZE];
+    byte pendingBitCount[PACKET_QUEUE_SIZE];
+    byte pendingRepeats[PACKET_QUEUE_SIZE];
+    uint16_t pendingSpeedLoco[PACKET_QUEUE_SIZE];  // loco of a speed packet, else NOT_SPEED
+    static const uint16_t NOT_SPEED=0xFFFF;
+    uint16_t speedPacketLoco(const byte packet[], byte length);
+    // Step over queued packets dropped by an emergency stop (bit count 0), returning
+    // true if there is a packet left to send.  Interrupt time only.
+    inline bool skipDroppedPackets() {
+      byte head=pendingHead;
+      while (head!=pendingTail && pendingBitCount[head]==0) head=(head+1) & (PACKET_QUEUE_SIZE-1);
+      pendingHead=head;
+      return head!=pendingTail;
+    }
+    volatile byte pendingHead;  // next entry to be transmitted
+    volatile byte pendingTail;  // next free entry
+    // Priority packet, taken by interrupt2 before the queue once priorityPending is set
+    byte priorityPacket[MAX_ENCODED_SIZE];
+    byte priorityBitCount;
+    byte priorityRepeats;
+    uint16_t priorityStoppedLoco;
+    volatile bool priorityPending=false;
+#if REMINDER_POOL_SIZE > 0
+    // A pool entry is only used by interrupt2 while its bit count is non-zero, so
+    // setReminder clears that while it changes the entry.
+    static byte reminderBits[REMINDER_POOL_SIZE][MAX_ENCODED_SIZE];
+    static volatile byte reminderBitCount[REMINDER_POOL_SIZE];
+    static uint16_t reminderLoco[REMINDER_POOL_SIZE];
+    static byte reminderReplace;  // next entry for setReminder to reuse
+    static byte reminderNext;     // next entry for interrupt2 to send
+#endif
+#ifdef DIAG_WAVE
+    enum : byte { PACKET_SPEED, PACKET_FUNCTION, PACKET_ACCESSORY, PACKET_CV, PACKET_OTHER, PACKET_TYPES };
+    byte packetType(const byte packet[], byte length);
+    void displayTrackStats(Print * stream, unsigned long seconds);
+    uint32_t queuedPackets[PACKET_TYPES];  // by schedulePacket
+    volatile uint32_t sentPackets;         // transmissions of queued packets, including repeats
+    volatile uint32_t sentIdles;           // transmissions of the idle (or reset) packet
+    volatile uint32_t sentPoolReminders;   // speed packets from the reminder pool, in place of idles
+    static volatile unsigned int maxInterruptMicros;
+    static unsigned long statsStart;       // millis
+#endif
     static int progTripValue;
-    int maxmA;
-    int tripmA;
-    
-    // current sampling
-    POWERMODE powerMode;
-    unsigned long lastSampleTaken;
-    unsigned int sampleDelay;
     // Trip current for programming track, 250mA. Change only if you really
     // need to be non-NMRA-compliant because of decoders that are not either.
     static const int TRIP_CURRENT_PROG=250;
-    unsigned long power_sample_overload_wait = POWER_SAMPLE_OVERLOAD_WAIT;
-    unsigned int power_good_counter = 0;
 
     // ACK management (Prog track only)  
     volatile bool ackPending;
@@ -168,6 +346,16 @@ class DCCWaveform {
     unsigned int minAckPulseDuration = 2000; // micros
     unsigned int maxAckPulseDuration = 20000; // micros
 
+    // Adaptive ACK, learnt from the ACKs of the decoder on the prog track
+    void learnAck();
+    byte ackLearnCount = 0;          // genuine ACKs seen since prog power on
+    unsigned int ackLearnPulse;      // micros, running average pulse width
+    int ackLearnHeight;              // raw, running average pulse height over baseline
+    unsigned int ackBaseline32;      // baseline*32, tracked by checkAck between pulses
+    int ackLimitRaw;                 // threshold over baseline
+    unsigned int ackMinWindow;       // pulse duration window in use by checkAck
+    unsigned int ackMaxWindow;
+
     volatile static uint8_t numAckGaps;
     volatile static uint8_t numAckSamples;
     static uint8_t trailingEdgeCounter;
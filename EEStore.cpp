@@ -35,10 +35,23 @@
 ExternalEEPROM EEPROM;
 #endif
 
+// The ESP32 EEPROM is emulated in flash and only written out on commit, which
+// erases and rewrites a whole sector.  The flash cache is off meanwhile, and the
+// system holds off the DCC interrupt, which runs from flash (see DCCTimer), so
+// the waveform stops for the duration.  Commits are therefore made once per
+// batch of writes, never per byte.
+static inline void commitEEPROM() {
+#if defined(ARDUINO_ARCH_ESP32)
+  EEPROM.commit();
+#endif
+}
+
 void EEStore::init() {
 #if defined(ARDUINO_ARCH_SAMD)
   EEPROM.begin(0x50);  // Address for Microchip 24-series EEPROM with all three
                        // A pins grounded (0b1010000 = 0x50)
+#elif defined(ARDUINO_ARCH_ESP32)
+  EEPROM.begin(EESTORE_ESP32_SIZE);
 #endif
 
   eeStore = (EEStore *)calloc(1, sizeof(EEStore));
@@ -54,12 +67,42 @@ void EEStore::init() {
     eeStore->data.nSensors = 0;
     eeStore->data.nOutputs = 0;
     EEPROM.put(0, eeStore->data);
+    commitEEPROM();
   }
 
   reset();          // set memory pointer to first free EEPROM space
+  // Read the definitions in blocks, rather than one EEPROM access per field.
+  readBuffer = (byte *)malloc(EESTORE_READ_BUFFER);
+  readBufferLength = 0;
   Turnout::load();  // load turnout definitions
   Sensor::load();   // load sensor definitions
   Output::load();   // load output definitions
+  free(readBuffer);
+  readBuffer = NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+void EEStore::getBytes(int address, byte *data, int size) {
+  if (!readBuffer) {
+    for (int i = 0; i < size; i++) EEPROM.get(address + i, data[i]);
+    return;
+  }
+  for (int i = 0; i < size; i++, address++) {
+    if (address < readBufferAddress || address >= readBufferAddress + readBufferLength) {
+      // Refill the buffer from this address
+      readBufferAddress = address;
+      readBufferLength = EESTORE_READ_BUFFER;
+      if (readBufferAddress + readBufferLength > (int)EEPROM.length()) 
+        readBufferLength = EEPROM.length() - readBufferAddress;
+#if defined(ARDUINO_ARCH_SAMD)
+      EEPROM.read(readBufferAddress, readBuffer, readBufferLength);  // One I2C transfer
+#else
+      for (int j = 0; j < readBufferLength; j++) EEPROM.get(readBufferAddress + j, readBuffer[j]);
+#endif
+    }
+    data[i] = readBuffer[address - readBufferAddress];
+  }
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -72,16 +115,22 @@ void EEStore::clear() {
   eeStore->data.nSensors = 0;
   eeStore->data.nOutputs = 0;
   EEPROM.put(0, eeStore->data);
+  commitEEPROM();
+  pendingCount = 0;  // The addresses are no longer in use
+  uncommitted = false;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 
 void EEStore::store() {
+  pendingCount = 0;  // All states are about to be written
   reset();
   Turnout::store();
   Sensor::store();
   Output::store();
   EEPROM.put(0, eeStore->data);
+  commitEEPROM();
+  uncommitted = false;
   DIAG(F("EEPROM used: %d/%d bytes"), EEStore::pointer(), EEPROM.length());
 }
 
@@ -107,6 +156,56 @@ void EEStore::dump(int num) {
 }
 ///////////////////////////////////////////////////////////////////////////////
 
+void EEStore::writeLater(int address, byte value) {
+  if (pendingCount == 0) firstPendingTime = millis();
+  for (byte i = 0; i < pendingCount; i++) {
+    if (pending[i].address == address) {
+      pending[i].value = value;
+      return;
+    }
+  }
+  if (pendingCount == EESTORE_PENDING_SIZE) writePending(0);  // Make room
+  pending[pendingCount].address = address;
+  pending[pendingCount].value = value;
+  pendingCount++;
+}
+
+// Once the oldest pending byte has waited long enough, write one pending byte per entry
+// until the list is empty.  Timing from the oldest, not the latest, change means a steady
+// stream of changes (eg a running EXRAIL sequence) can't hold off the writes indefinitely.
+void EEStore::loop() {
+  if (pendingCount == 0) return;
+  if (millis() - firstPendingTime < EESTORE_WRITE_DELAY) return;
+  writePending(pendingCount - 1);
+  // Commit the batch once it has all been written
+  if (pendingCount == 0 && uncommitted) {
+    commitEEPROM();
+    uncommitted = false;
+  }
+}
+
+// Write a pending byte, if it differs from the EEPROM contents, and remove it from the list.
+// It is committed (on ESP32) when the list is empty.
+void EEStore::writePending(byte index) {
+  byte current;
+  EEPROM.get(pending[index].address, current);
+  if (current != pending[index].value) {
+    EEPROM.put(pending[index].address, pending[index].value);
+    uncommitted = true;
+  }
+  pendingCount--;
+  for (byte i = index; i < pendingCount; i++) pending[i] = pending[i+1];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
 EEStore *EEStore::eeStore = NULL;
 int EEStore::eeAddress = 0;
+EEStore::PendingWrite EEStore::pending[EESTORE_PENDING_SIZE];
+byte EEStore::pendingCount = 0;
+byte *EEStore::readBuffer = NULL;
+int EEStore::readBufferAddress = 0;
+int EEStore::readBufferLength = 0;
+unsigned long EEStore::firstPendingTime = 0;
+bool EEStore::uncommitted = false;
 #endif
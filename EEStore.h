@@ -26,6 +26,11 @@
 
 #include <Arduino.h>
 
+// Size of the flash area that emulates EEPROM on the ESP32.
+#ifndef EESTORE_ESP32_SIZE
+#define EESTORE_ESP32_SIZE 4096
+#endif
+
 #if defined(ARDUINO_ARCH_SAMD)
 #include <SparkFun_External_EEPROM.h>
 extern ExternalEEPROM EEPROM;
@@ -35,6 +40,25 @@ extern ExternalEEPROM EEPROM;
 
 #define EESTORE_ID "DCC++1"
 
+// Define symbol EESTORE_LOAD_AFTER_WAVEFORM to start the DCC waveform before loading
+// turnouts, sensors and outputs from EEPROM, where loading them takes a long time.
+//#define EESTORE_LOAD_AFTER_WAVEFORM
+
+// Size of the buffer used to read EEPROM in blocks while loading.
+#ifndef EESTORE_READ_BUFFER
+#define EESTORE_READ_BUFFER 64
+#endif
+
+// Number of state bytes (turnout and output states) that can wait to be written.
+#ifndef EESTORE_PENDING_SIZE
+#define EESTORE_PENDING_SIZE 8
+#endif
+// Time in milliseconds from the oldest pending change before pending state bytes
+// are written, so that a turnout or output switched back and forth is written once.
+#ifndef EESTORE_WRITE_DELAY
+#define EESTORE_WRITE_DELAY 2000
+#endif
+
 struct EEStoreData{
   char id[sizeof(EESTORE_ID)];
   uint16_t nTurnouts;
@@ -53,6 +77,27 @@ struct EEStore{
   static void store();
   static void clear();
   static void dump(int);
+  // Write a state byte later, from loop(), coalescing repeated changes.
+  static void writeLater(int address, byte value);
+  static void loop();
+  // Read an object from EEPROM at pointer(), through the read buffer during init().
+  template <class T> static void get(T &t) { 
+    getBytes(pointer(), (byte *)&t, sizeof(T)); 
+  }
+private:
+  static void getBytes(int address, byte *data, int size);
+  static byte *readBuffer;
+  static int readBufferAddress;
+  static int readBufferLength;
+  struct PendingWrite {
+    int address;
+    byte value;
+  };
+  static void writePending(byte index);
+  static PendingWrite pending[EESTORE_PENDING_SIZE];
+  static byte pendingCount;
+  static unsigned long firstPendingTime;  // when the oldest pending byte was queued
+  static bool uncommitted;  // pending bytes written but not yet committed (ESP32)
 };
 
 #endif
@@ -49,12 +49,15 @@
 #include "DCCEXParser.h"
 #include "Turnouts.h"
 #include "CommandDistributor.h"
+#include "MemoryPool.h"
 
 
 // Command parsing keywords
 const int16_t HASH_KEYWORD_EXRAIL=15435;    
 const int16_t HASH_KEYWORD_ON = 2657;
 const int16_t HASH_KEYWORD_START=23232;
+const int16_t HASH_KEYWORD_STATS=23041;
+const int16_t HASH_KEYWORD_RESET=26133;
 const int16_t HASH_KEYWORD_RESERVE=11392;
 const int16_t HASH_KEYWORD_FREE=-23052;
 const int16_t HASH_KEYWORD_LATCH=1618;  
@@ -67,26 +70,59 @@ const int16_t HASH_KEYWORD_ROUTES=-3702;
 const int16_t HASH_KEYWORD_RED=26099;
 const int16_t HASH_KEYWORD_AMBER=18713;
 const int16_t HASH_KEYWORD_GREEN=-31493;
+CHECK_KEYWORD(EXRAIL);
+CHECK_KEYWORD(ON);
+CHECK_KEYWORD(START);
+CHECK_KEYWORD(STATS);
+CHECK_KEYWORD(RESET);
+CHECK_KEYWORD(RESERVE);
+CHECK_KEYWORD(FREE);
+CHECK_KEYWORD(LATCH);
+CHECK_KEYWORD(UNLATCH);
+CHECK_KEYWORD(PAUSE);
+CHECK_KEYWORD(RESUME);
+CHECK_KEYWORD(KILL);
+CHECK_KEYWORD(ALL);
+CHECK_KEYWORD(ROUTES);
+CHECK_KEYWORD(RED);
+CHECK_KEYWORD(AMBER);
+CHECK_KEYWORD(GREEN);
 
 // One instance of RMFT clas is used for each "thread" in the automation.
 // Each thread manages a loco on a journey through the layout, and/or may manage a scenery automation.
-// The threads exist in a ring, each time through loop() the next thread in the ring is serviced.
+// The threads exist in a ring, which is used to find them all.
+// Each time through loop() the next thread in the ready queue is serviced. Threads in a delay
+// wait in a list sorted by wakeup time and are only put back on the ready queue when it expires.
 
 // Statics 
 const int16_t LOCO_ID_WAITING=-99; // waiting for loco id from prog track
+const unsigned long SENSOR_WAIT_MAX=1000; // re-check a notifying input at least this often (mS)
 int16_t RMFT2::progtrackLocoId;  // used for callback when detecting a loco on prog track
 bool RMFT2::diag=false;      // <D EXRAIL ON>  
 RMFT2 * RMFT2::loopTask=NULL; // loopTask contains the address of ONE of the tasks in a ring.
+RMFT2 * RMFT2::readyHead=NULL;
+RMFT2 * RMFT2::readyTail=NULL;
+RMFT2 * RMFT2::sleepingTasks=NULL;
+RMFT2 * RMFT2::runningTask=NULL;
 RMFT2 * RMFT2::pausingTask=NULL; // Task causing a PAUSE.
  // when pausingTask is set, that is the ONLY task that gets any service,
  // and all others will have their locos stopped, then resumed after the pausing task resumes.
 byte RMFT2::flags[MAX_FLAGS];
+FlagSet<MAX_LATCHES> RMFT2::latches;
+FlagSet<MAX_TASK_IDS> RMFT2::taskIds;
 
 LookList *  RMFT2::sequenceLookup=NULL;
 LookList *  RMFT2::onThrowLookup=NULL;
 LookList *  RMFT2::onCloseLookup=NULL;
 LookList *  RMFT2::onActivateLookup=NULL;
 LookList *  RMFT2::onDeactivateLookup=NULL;
+LookList *  RMFT2::signalLookup=NULL;
+LookList *  RMFT2::ifJumpLookup=NULL;
+#ifdef EXRAIL_STATS
+unsigned long RMFT2::opcodeCounts[OPCODE_IFTHROWN+1];
+unsigned long RMFT2::maxRunMicros=0;
+int RMFT2::maxRunPc=0;
+#endif
 
 #define GET_OPCODE GETFLASH(RMFT2::RouteCode+progCounter)
 #define GET_OPERAND(n) GETFLASHW(RMFT2::RouteCode+progCounter+1+(n*3))
@@ -102,23 +138,41 @@ LookList::LookList(int16_t size) {
   }
 }
 
+// The list is kept sorted by lookup value so that find can use a binary search.
+// It is only added to during begin(), so the insertion cost doesn't matter.
 void LookList::add(int16_t lookup, int16_t result) {
   if (m_loaded==m_size) return; // and forget
-  m_lookupArray[m_loaded]=lookup;
-  m_resultArray[m_loaded]=result;
+  int16_t i=m_loaded;
+  // duplicates go after the existing entry so the first one defined still wins
+  while (i>0 && m_lookupArray[i-1]>lookup) {
+    m_lookupArray[i]=m_lookupArray[i-1];
+    m_resultArray[i]=m_resultArray[i-1];
+    i--;
+  }
+  m_lookupArray[i]=lookup;
+  m_resultArray[i]=result;
   m_loaded++;
 }
 
 int16_t LookList::find(int16_t value) {
-  for (int16_t i=0;i<m_size;i++) {
-    if (m_lookupArray[i]==value) return m_resultArray[i];
+  // find the first entry not less than value
+  int16_t low=0;
+  int16_t high=m_loaded;
+  while (low<high) {
+    int16_t mid=(low+high)/2;
+    if (m_lookupArray[mid]<value) low=mid+1;
+    else high=mid;
   }
+  if (low<m_loaded && m_lookupArray[low]==value) return m_resultArray[low];
   return -1;
 }
 
 /* static */ void RMFT2::begin() {
   DCCEXParser::setRMFTFilter(RMFT2::ComandFilter);
+  IONotifyCallback::add(sensorChangeCallback);
   for (int f=0;f<MAX_FLAGS;f++) flags[f]=0;
+  latches.clear();
+  taskIds.clear();
   int progCounter;
 
   // counters to create lookup arrays
@@ -127,6 +181,7 @@ int16_t LookList::find(int16_t value) {
   int onCloseCount=0;
   int onActivateCount=0;
   int onDeactivateCount=0;
+  int ifCount=0;
 
   // first pass count sizes for fast lookup arrays
   for (progCounter=0;; SKIPOP) {
@@ -155,7 +210,12 @@ int16_t LookList::find(int16_t value) {
       onDeactivateCount++;
       break;
 
+    case OPCODE_ELSE:
+      ifCount++;
+      break;
+
     default: // Ignore
+      if (opcode>IF_TYPE_OPCODES) ifCount++;
       break;
     }
   }
@@ -166,6 +226,16 @@ int16_t LookList::find(int16_t value) {
   onCloseLookup=new LookList(onCloseCount);
   onActivateLookup=new LookList(onActivateCount);
   onDeactivateLookup=new LookList(onDeactivateCount);
+  ifJumpLookup=new LookList(ifCount);
+
+  // signal id to slot in SignalDefinitions
+  int signalCount=0;
+  while (GETFLASHW(RMFT2::SignalDefinitions+signalCount*4)!=0) signalCount++;
+  signalLookup=new LookList(signalCount);
+  for (int sigslot=0;sigslot<signalCount;sigslot++) {
+    VPIN sigid=GETFLASHW(RMFT2::SignalDefinitions+sigslot*4);
+    signalLookup->add(sigid & SIGNAL_ID_MASK, sigslot);
+  }
 
   // Second pass startup, define any turnouts or servos, set signals red
   // add sequences onRoutines to the lookups
@@ -179,6 +249,13 @@ int16_t LookList::find(int16_t value) {
     byte opcode=GET_OPCODE;
     if (opcode==OPCODE_ENDEXRAIL) break;
     VPIN operand=GET_OPERAND(0);
+
+    // Where a failing IF, or an ELSE, skips to.  Entries come in 
+    // progCounter order, so adding them is cheap.
+    if (opcode>IF_TYPE_OPCODES || opcode==OPCODE_ELSE) {
+      int16_t target=findIfBlockEnd(progCounter);
+      if (target>=0) ifJumpLookup->add(progCounter,target);
+    }
     
     switch (opcode) {
     case OPCODE_AT:
@@ -191,14 +268,6 @@ int16_t LookList::find(int16_t value) {
       break;
     }
 
-    case OPCODE_TURNOUT: {
-      VPIN id=operand;
-      int addr=GET_OPERAND(1);
-      byte subAddr=GET_OPERAND(2);
-      setTurnoutHiddenState(DCCTurnout::create(id,addr,subAddr));
-      break;
-    }
-
     case OPCODE_SERVOTURNOUT: {
       VPIN id=operand;
       VPIN pin=GET_OPERAND(1);
@@ -257,7 +326,27 @@ int16_t LookList::find(int16_t value) {
 }
 
 void RMFT2::setTurnoutHiddenState(Turnout * t) {
-  t->setHidden(GETFLASH(getTurnoutDescription(t->getId()))==0x01);     
+  t->setHidden(isTurnoutHidden(t->getId()));     
+}
+
+bool RMFT2::isTurnoutHidden(int16_t id) {
+  const FSH * desc=getTurnoutDescription(id);
+  return desc && GETFLASH(desc)==0x01;
+}
+
+int16_t RMFT2::findDCCTurnout(int16_t id) {
+  for (int16_t i=0;i<dccTurnoutCount;i++)
+    if (GETFLASHW(dccTurnoutList+3*i)==id) return i;
+  return -1;
+}
+
+// A TURNOUT is thrown until first used, so it only needs an object when it is changed.
+Turnout * RMFT2::createTurnout(int16_t id) {
+  int16_t i=findDCCTurnout(id);
+  if (i<0) return NULL;
+  Turnout * t=DCCTurnout::create(id,GETFLASHW(dccTurnoutList+3*i+1),GETFLASHW(dccTurnoutList+3*i+2));
+  setTurnoutHiddenState(t);
+  return t;
 }
 
 char RMFT2::getRouteType(int16_t id) {
@@ -319,13 +408,10 @@ bool RMFT2::parseSlash(Print * stream, byte & paramCount, int16_t p[]) {
     }
     // Now stream the flags
     for (int id=0;id<MAX_FLAGS; id++) {
-      byte flag=flags[id];
-      if (flag & ~TASK_FLAG & ~SIGNAL_MASK) { // not interested in TASK_FLAG only. Already shown above
-	      StringFormatter::send(stream,F("\nflags[%d] "),id);
-	      if (flag & SECTION_FLAG) StringFormatter::send(stream,F(" RESERVED"));
-	      if (flag & LATCH_FLAG) StringFormatter::send(stream,F(" LATCHED"));
-      }
+      if (flags[id] & SECTION_FLAG) StringFormatter::send(stream,F("\nflags[%d]  RESERVED"),id);
     }
+    for (int16_t id=latches.nextSet(0); id>=0; id=latches.nextSet(id+1))
+      StringFormatter::send(stream,F("\nflags[%d]  LATCHED"),id);
     // do the signals
     // flags[n] represents the state of the nth signal in the table 
     for (int sigslot=0;;sigslot++) {
@@ -361,6 +447,26 @@ bool RMFT2::parseSlash(Print * stream, byte & paramCount, int16_t p[]) {
     return true;
     
     
+#ifdef EXRAIL_STATS
+  case HASH_KEYWORD_STATS: // </ STATS [RESET]>
+    if (paramCount==2 && p[1]==HASH_KEYWORD_RESET) {
+      for (int op=0;op<=OPCODE_IFTHROWN;op++) opcodeCounts[op]=0;
+      maxRunMicros=0;
+      RMFT2 * task=loopTask;
+      while(task) {
+        task->runCount=0;
+        task->runMicros=0;
+        for (byte r=0;r<WAIT_REASONS;r++) task->waitCounts[r]=0;
+        task=task->next;
+        if (task==loopTask) break;
+      }
+      return true;
+    }
+    if (paramCount!=1) return false;
+    streamStats(stream);
+    return true;
+#endif
+
   case HASH_KEYWORD_START: // </ START [cab] route >
     if (paramCount<2 || paramCount>3) return false;
     {
@@ -410,11 +516,12 @@ bool RMFT2::parseSlash(Print * stream, byte & paramCount, int16_t p[]) {
     return true;
     
   case HASH_KEYWORD_LATCH:
-    setFlag(p[1], LATCH_FLAG);
+    setLatch(p[1], true);
+    sensorChangeCallback(p[1],1); // wake anything waiting on it
     return true;
     
   case HASH_KEYWORD_UNLATCH:
-    setFlag(p[1], 0, LATCH_FLAG);
+    setLatch(p[1], false);
     return true;
  
   case HASH_KEYWORD_RED:
@@ -445,15 +552,10 @@ bool RMFT2::parseSlash(Print * stream, byte & paramCount, int16_t p[]) {
 RMFT2::RMFT2(int progCtr) {
   progCounter=progCtr;
 
-  // get an unused  task id from the flags table
-  taskId=255; // in case of overflow
-  for (int f=0;f<MAX_FLAGS;f++) {
-    if (!getFlag(f,TASK_FLAG)) {
-      taskId=f;
-      setFlag(f, TASK_FLAG);
-      break;
-    }
-  }
+  // get an unused task id, 255 in case of overflow
+  int16_t id=taskIds.firstClear();
+  taskId = id<0 ? MAX_TASK_IDS : id;
+  taskIds.set(taskId, true);
   delayTime=0;
   loco=0;
   speedo=0;
@@ -471,12 +573,33 @@ RMFT2::RMFT2(int progCtr) {
     next=loopTask->next;
     loopTask->next=this;
   }
+  sleeping=false;
+  waitingVpin=VPIN_NONE;
+#ifdef EXRAIL_STATS
+  runCount=0;
+  runMicros=0;
+  for (byte r=0;r<WAIT_REASONS;r++) waitCounts[r]=0;
+#endif
+  schedule();
 }
 
+static const char taskPoolName[] FLASH = "Tasks";
+static MemoryPool taskPool((const FSH *)taskPoolName, sizeof(RMFT2), POOL_RESERVE_TASKS);
+
+void *RMFT2::operator new(size_t size) noexcept {
+  (void)size;  // always sizeof(RMFT2)
+  return taskPool.allocate();
+}
+
+void RMFT2::operator delete(void *task) {
+  taskPool.release(task);
+}
 
 RMFT2::~RMFT2() {
   driveLoco(1); // ESTOP my loco if any
-  setFlag(taskId,0,TASK_FLAG); // we are no longer using this id
+  taskIds.set(taskId, false); // we are no longer using this id
+  unschedule();
+  if (runningTask==this) runningTask=NULL;
   if (next==this)
     loopTask=NULL;
   else
@@ -495,14 +618,15 @@ void RMFT2::createNewTask(int route, uint16_t cab) {
       task->loco=cab;
 }
 
-void RMFT2::driveLoco(byte speed) {
+void RMFT2::driveLoco(byte speed, uint16_t rampMs) {
   if (loco<=0) return;  // Prevent broadcast!
   if (diag) DIAG(F("EXRAIL drive %d %d %d"),loco,speed,forward^invert);
   if (DCCWaveform::mainTrack.getPowerMode()==POWERMODE::OFF) {
     DCCWaveform::mainTrack.setPowerMode(POWERMODE::ON);
     CommandDistributor::broadcastPower();
   }
-  DCC::setThrottle(loco,speed, forward^invert);
+  if (rampMs) DCC::setThrottleRamp(loco,speed, forward^invert, rampMs);
+  else DCC::setThrottle(loco,speed, forward^invert);
   speedo=speed;
 }
 
@@ -511,7 +635,7 @@ bool RMFT2::readSensor(uint16_t sensorId) {
   int16_t sId=(int16_t) sensorId;
 
   VPIN vpin=abs(sId);
-  if (getFlag(vpin,LATCH_FLAG)) return true; // latched on
+  if (isLatched(vpin)) return true; // latched on
   
   // negative sensorIds invert the logic (e.g. for a break-beam sensor which goes OFF when detecting)
   bool s= IODevice::read(vpin) ^ (sId<0);
@@ -519,9 +643,22 @@ bool RMFT2::readSensor(uint16_t sensorId) {
   return s;
 }
 
-// This skips to the end of an if block, or to the ELSE within it.
+// This skips to the end of an if block, or to the ELSE within it, 
+// as found by begin().
 bool RMFT2::skipIfBlock() {
   // returns false if killed
+  int16_t target=ifJumpLookup->find(progCounter);
+  if (target<0) {
+    kill(F("missing ENDIF"), 1);
+    return false;
+  }
+  progCounter=target;
+  return true;
+}
+
+// Scan from an IF or ELSE to the ENDIF ending its block, or to the ELSE 
+// within it.  Returns -1 if the ENDIF is missing.
+int16_t RMFT2::findIfBlockEnd(int16_t progCounter) {
   short nest = 1;
   while (nest > 0) {
     SKIPOP;
@@ -530,8 +667,7 @@ bool RMFT2::skipIfBlock() {
     if (opcode>IF_TYPE_OPCODES) nest++;
     else switch(opcode) {
       case OPCODE_ENDEXRAIL:
-        kill(F("missing ENDIF"), nest);
-        return false;
+        return -1;
     
       case OPCODE_ENDIF:
         nest--;
@@ -545,13 +681,15 @@ bool RMFT2::skipIfBlock() {
       break;
     }
   }
-  return true;
+  return progCounter;
 }
 
 
 
 /* static */ void RMFT2::readLocoCallback(int16_t cv) {
-  if (cv & LONG_ADDR_MARKER) {               // maker bit indicates long addr
+  if (cv < 0) {                              // read failed or prog track busy
+    progtrackLocoId = -1;
+  } else if (cv & LONG_ADDR_MARKER) {        // maker bit indicates long addr
     progtrackLocoId = cv ^ LONG_ADDR_MARKER; // remove marker bit to get real long addr
     if (progtrackLocoId <= HIGHEST_SHORT_ADDR ) {     // out of range for long addr
       DIAG(F("Long addr %d <= %d unsupported\n"), progtrackLocoId, HIGHEST_SHORT_ADDR);
@@ -562,12 +700,114 @@ bool RMFT2::skipIfBlock() {
   }
 }
 
+// Add task to the end of the ready queue
+void RMFT2::schedule() {
+  nextScheduled=NULL;
+  if (readyTail) readyTail->nextScheduled=this;
+  else readyHead=this;
+  readyTail=this;
+}
+
+// Remove task from the ready queue or sleeping list, whichever it is in
+void RMFT2::unschedule() {
+  RMFT2 * prev=NULL;
+  for (RMFT2 * t= sleeping ? sleepingTasks : readyHead; t; prev=t, t=t->nextScheduled) {
+    if (t!=this) continue;
+    if (sleeping) {
+      if (prev) prev->nextScheduled=nextScheduled;
+      else sleepingTasks=nextScheduled;
+    } else {
+      if (prev) prev->nextScheduled=nextScheduled;
+      else readyHead=nextScheduled;
+      if (readyTail==this) readyTail=prev;
+    }
+    break;
+  }
+  nextScheduled=NULL;
+}
+
+// The budget is also up once the main track packet queue is full, as another
+// loco opcode would only wait for room in it.
+static inline bool outOfTime(unsigned long start) {
+  return micros()-start >= EXRAIL_LOOP_BUDGET || DCCWaveform::mainTrack.isPacketQueueFull();
+}
+
 void RMFT2::loop() {
+  // Wake any tasks whose delay has expired
+  unsigned long now=millis();
+  while (sleepingTasks && now-sleepingTasks->delayStart >= sleepingTasks->delayTime) {
+    RMFT2 * task=sleepingTasks;
+    sleepingTasks=task->nextScheduled;
+    task->sleeping=false;
+    task->schedule();
+  }
 
-  // Round Robin call to a RMFT task each time
-  if (loopTask==NULL) return;
-  loopTask=loopTask->next;
-  if (pausingTask==NULL || pausingTask==loopTask) loopTask->loop2();
+  // Each ready task in turn runs its opcodes until it gets to one that waits,
+  // while the budget lasts.  A task is run once per loop, so one waiting
+  // for a sensor polls it once.  Tasks queued behind the last one ready at
+  // the start wait for the next loop.
+  RMFT2 * last=readyTail;
+  if (last==NULL) return;
+  unsigned long start=micros();
+  for (;;) {
+    RMFT2 * task=readyHead;
+    if (task==NULL) return;
+    readyHead=task->nextScheduled;
+    if (readyHead==NULL) readyTail=NULL;
+    task->nextScheduled=NULL;
+    runningTask=task;
+    int pc;
+    do {
+      pc=task->progCounter;
+      runOpcode(task);
+      // loop2 may have killed the task or put it to sleep
+    } while (runningTask && !runningTask->sleeping && runningTask->progCounter!=pc
+             && !outOfTime(start));
+    if (runningTask && !runningTask->sleeping) runningTask->schedule();
+    runningTask=NULL;
+    if (task==last || outOfTime(start)) return;
+  }
+}
+
+// Run one opcode of the task
+void RMFT2::runOpcode(RMFT2 * task) {
+#ifdef EXRAIL_STATS
+  if (pausingTask==NULL || pausingTask==task) {
+    int pc=task->progCounter;
+    byte opcode=GETFLASH(RMFT2::RouteCode+pc);
+    unsigned long start=micros();
+    task->loop2();
+    unsigned long elapsed=micros()-start;
+    if (opcode<=OPCODE_IFTHROWN) opcodeCounts[opcode]++;
+    if (elapsed>maxRunMicros) {
+      maxRunMicros=elapsed;
+      maxRunPc=pc;
+    }
+    if (runningTask) {
+      runningTask->runCount++;
+      runningTask->runMicros+=elapsed;
+      // still on the same opcode, or put to sleep by it, means it is waiting
+      if (runningTask->sleeping || runningTask->progCounter==pc) {
+        WAIT_REASON reason;
+        switch (opcode) {
+          case OPCODE_DELAY: case OPCODE_DELAYMS: case OPCODE_DELAYMINS: case OPCODE_RANDWAIT:
+            reason=WAIT_DELAY; break;
+          case OPCODE_AT: case OPCODE_AFTER: case OPCODE_ATGTE: case OPCODE_ATLT: case OPCODE_ATTIMEOUT2:
+            reason=WAIT_SENSOR; break;
+          case OPCODE_WAITFOR:
+            reason=WAIT_TURNOUT; break;
+          case OPCODE_READ_LOCO2:
+            reason=WAIT_PROG; break;
+          default:
+            reason=WAIT_OTHER; break;
+        }
+        runningTask->waitCounts[reason]++;
+      }
+    }
+  }
+#else
+  if (pausingTask==NULL || pausingTask==task) task->loop2();
+#endif
 }
 
 
@@ -587,11 +827,8 @@ void RMFT2::loop2() {
   switch ((OPCODE)opcode) {
 
   case OPCODE_THROW:
-    Turnout::setClosed(operand, false);
-    break;
-    
   case OPCODE_CLOSE:
-    Turnout::setClosed(operand, true);
+    doTurnouts();
     break;
 
   case OPCODE_REV:
@@ -607,6 +844,10 @@ void RMFT2::loop2() {
   case OPCODE_SPEED:
     driveLoco(operand);
     break;
+
+  case OPCODE_RAMP:  // speed, ms
+    driveLoco(operand, GET_OPERAND(1));
+    break;
     
   case OPCODE_FORGET:
     if (loco!=0) {
@@ -636,7 +877,7 @@ void RMFT2::loop2() {
   case OPCODE_AT:
     timeoutFlag=false;
     if (readSensor(operand)) break;
-    delayMe(50);
+    waitForSensor(abs((int16_t)operand),50,SENSOR_WAIT_MAX);
     return;
     
   case OPCODE_ATGTE: // wait for analog sensor>= value
@@ -657,13 +898,19 @@ void RMFT2::loop2() {
     break;
     
   case OPCODE_ATTIMEOUT2:
-    if (readSensor(operand)) break; // success without timeout
-    if (millis()-timeoutStart > 100*GET_OPERAND(1)) {
-      timeoutFlag=true;
-      break; // and drop through
+    {
+      if (readSensor(operand)) break; // success without timeout
+      unsigned long waited=millis()-timeoutStart;
+      unsigned long timeout=100L*GET_OPERAND(1);
+      if (waited > timeout) {
+        timeoutFlag=true;
+        break; // and drop through
+      }
+      // a notified wait must still wake up in time for the timeout
+      unsigned long remaining=timeout-waited+1;
+      waitForSensor(abs((int16_t)operand),50,remaining<SENSOR_WAIT_MAX ? remaining : SENSOR_WAIT_MAX);
+      return;
     }
-    delayMe(50);
-    return;
     
   case OPCODE_IFTIMEOUT: // do next operand if timeout flag set
     skipIf=!timeoutFlag;
@@ -673,18 +920,24 @@ void RMFT2::loop2() {
     if (readSensor(operand)) {
       // reset timer to half a second and keep waiting
       waitAfter=millis();
-      delayMe(50);
+      waitForSensor(abs((int16_t)operand),50,SENSOR_WAIT_MAX);
+      return;
+    }
+    if (millis()-waitAfter < 500 ) {
+      // sleep out the rest of the half second unless the input hits again
+      if (IODevice::hasCallback(abs((int16_t)operand)))
+        waitForSensor(abs((int16_t)operand),0,500-(millis()-waitAfter));
       return;
     }
-    if (millis()-waitAfter < 500 ) return;
     break;
     
   case OPCODE_LATCH:
-    setFlag(operand,LATCH_FLAG);
+    setLatch(operand, true);
+    sensorChangeCallback(operand,1); // wake anything waiting on it
     break;
     
   case OPCODE_UNLATCH:
-    setFlag(operand,0,LATCH_FLAG);
+    setLatch(operand, false);
     break;
 
   case OPCODE_SET:
@@ -786,15 +1039,9 @@ void RMFT2::loop2() {
     break;
     
   case OPCODE_RED:
-    doSignal(operand,SIGNAL_RED);
-    break;
-    
   case OPCODE_AMBER:
-    doSignal(operand,SIGNAL_AMBER);
-    break;
-    
   case OPCODE_GREEN:
-    doSignal(operand,SIGNAL_GREEN);
+    doSignals();
     break;
     
   case OPCODE_FON:
@@ -881,7 +1128,8 @@ void RMFT2::loop2() {
     
   case OPCODE_READ_LOCO1: // READ_LOCO is implemented as 2 separate opcodes
     progtrackLocoId=LOCO_ID_WAITING;  // Nothing found yet
-    DCC::getLocoId(readLocoCallback);
+    // after any prog track commands already waiting
+    if (!DCCEXParser::queueLocoId(readLocoCallback)) readLocoCallback(-1);
     break;
     
   case OPCODE_READ_LOCO2:
@@ -932,7 +1180,7 @@ void RMFT2::loop2() {
     break;
     
   case OPCODE_WAITFOR: // OPCODE_SERVO,V(pin)
-    if (IODevice::isBusy(operand)) {
+    if (Turnout::isVpinQueued(operand) || IODevice::isBusy(operand)) {
       delayMe(100);
       return;
     }
@@ -968,9 +1216,47 @@ void RMFT2::loop2() {
   SKIPOP;
 }
 
+// Only called from loop2, when the task is not in the ready queue
 void RMFT2::delayMe(long delay) {
   delayTime=delay;
   delayStart=millis();
+  // keep sleeping list in wakeup order
+  unsigned long wakeup=delayStart+delayTime;
+  RMFT2 ** link=&sleepingTasks;
+  while (*link && (long)((*link)->delayStart+(*link)->delayTime-wakeup) <= 0) link=&(*link)->nextScheduled;
+  nextScheduled=*link;
+  *link=this;
+  sleeping=true;
+  waitingVpin=VPIN_NONE;
+}
+
+// Wait for an input to change. Where the device driver notifies changes the task
+// sleeps until sensorChangeCallback wakes it, otherwise it polls every pollDelay mS.
+// maxDelay limits the notified wait, so a missed notification is not fatal.
+void RMFT2::waitForSensor(VPIN vpin, unsigned long pollDelay, unsigned long maxDelay) {
+  if (!IODevice::hasCallback(vpin)) {
+    delayMe(pollDelay);
+    return;
+  }
+  delayMe(maxDelay);
+  waitingVpin=vpin;
+}
+
+// Called by the HAL when a notifying input changes, wakes the tasks waiting for it
+void RMFT2::sensorChangeCallback(VPIN vpin, int value) {
+  (void)value;
+  RMFT2 * task=sleepingTasks;
+  while (task) {
+    RMFT2 * nextTask=task->nextScheduled;
+    if (task->waitingVpin==vpin) {
+      task->unschedule();
+      task->sleeping=false;
+      task->waitingVpin=VPIN_NONE;
+      task->delayTime=0;
+      task->schedule();
+    }
+    task=nextTask;
+  }
 }
 
 void RMFT2::setFlag(VPIN id,byte onMask, byte offMask) {
@@ -993,20 +1279,38 @@ void RMFT2::kill(const FSH * reason, int operand) {
 }
 
 int16_t RMFT2::getSignalSlot(VPIN id) {
-  for (int sigpos=0;;sigpos+=4) {
-      VPIN sigid=GETFLASHW(RMFT2::SignalDefinitions+sigpos);
-      if (sigid==0) { // end of signal list 
-        DIAG(F("EXRAIL Signal %d not defined"), id);
-        return -1;
-      }
-      // sigid is the signal id used in RED/AMBER/GREEN macro
-      // for a LED signal it will be same as redpin
-      // but for a servo signal it will also have SERVO_SIGNAL_FLAG set. 
+  // signalLookup is keyed by the signal id used in RED/AMBER/GREEN macro
+  // for a LED signal it will be same as redpin
+  // but for a servo signal the definition also has SERVO_SIGNAL_FLAG set. 
+  int16_t sigslot=signalLookup->find(id);
+  if (sigslot<0) DIAG(F("EXRAIL Signal %d not defined"), id);
+  return sigslot; // relative slot in signals table
+}
 
-      if ((sigid & SIGNAL_ID_MASK)!= id) continue; // keep looking
-      return sigpos/4; // relative slot in signals table
-  }  
+// Set the signal at progCounter, and any that follow it straight away,
+// so a route setting several signals does them all in one pass.
+// Leaves progCounter on the last signal opcode.
+void RMFT2::doSignals() {
+  for (;;) {
+    byte opcode=GET_OPCODE;
+    doSignal(GET_OPERAND(0), opcode==OPCODE_RED ? SIGNAL_RED : (opcode==OPCODE_AMBER ? SIGNAL_AMBER : SIGNAL_GREEN));
+    byte nextOpcode=GETFLASH(RMFT2::RouteCode+progCounter+3);
+    if (nextOpcode!=OPCODE_RED && nextOpcode!=OPCODE_AMBER && nextOpcode!=OPCODE_GREEN) return;
+    SKIPOP;
+  }
 }
+// Queue the turnout change at progCounter, and any that follow it straight away,
+// so that a route is set in one pass with the turnouts operated in turn by Turnout::loop.
+// Leaves progCounter on the last turnout opcode.
+void RMFT2::doTurnouts() {
+  for (;;) {
+    Turnout::queueClosed(GET_OPERAND(0), GET_OPCODE==OPCODE_CLOSE);
+    byte nextOpcode=GETFLASH(RMFT2::RouteCode+progCounter+3);
+    if (nextOpcode!=OPCODE_THROW && nextOpcode!=OPCODE_CLOSE) return;
+    SKIPOP;
+  }
+}
+
 /* static */ void RMFT2::doSignal(VPIN id,char rag) {
   if (diag) DIAG(F(" doSignal %d %x"),id,rag);
   int16_t sigslot=getSignalSlot(id);
@@ -1093,6 +1397,25 @@ void RMFT2::activateEvent(int16_t addr, bool activate) {
   task=new RMFT2(pc);  // new task starts at this instruction
 }
 
+#ifdef EXRAIL_STATS
+void RMFT2::streamStats(Print * stream) {
+  StringFormatter::send(stream, F("<* EXRAIL STATS"));
+  RMFT2 * task=loopTask;
+  while(task) {
+    StringFormatter::send(stream,F("\nID=%d,PC=%d,RUNS=%l,TIME=%luS,DELAY=%d,SENSOR=%d,TURNOUT=%d,PROG=%d,OTHER=%d"),
+          (int)(task->taskId),task->progCounter,task->runCount,task->runMicros,
+          task->waitCounts[WAIT_DELAY],task->waitCounts[WAIT_SENSOR],task->waitCounts[WAIT_TURNOUT],
+          task->waitCounts[WAIT_PROG],task->waitCounts[WAIT_OTHER]);
+    task=task->next;
+    if (task==loopTask) break;
+  }
+  for (int op=0;op<=OPCODE_IFTHROWN;op++) {
+    if (opcodeCounts[op]) StringFormatter::send(stream,F("\nOPCODE[%d]=%l"),op,opcodeCounts[op]);
+  }
+  StringFormatter::send(stream,F("\nLONGEST=%luS at PC=%d *>\n"),maxRunMicros,maxRunPc);
+}
+#endif
+
 void RMFT2::printMessage2(const FSH * msg) {
   DIAG(F("EXRAIL(%d) %S"),loco,msg);
 }
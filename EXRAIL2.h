@@ -31,7 +31,7 @@
 // searching easier as a parameter can never be confused with an opcode. 
 // 
 enum OPCODE : byte {OPCODE_THROW,OPCODE_CLOSE,
-             OPCODE_FWD,OPCODE_REV,OPCODE_SPEED,OPCODE_INVERT_DIRECTION,
+             OPCODE_FWD,OPCODE_REV,OPCODE_SPEED,OPCODE_RAMP,OPCODE_INVERT_DIRECTION,
              OPCODE_RESERVE,OPCODE_FREE,
              OPCODE_AT,OPCODE_AFTER,OPCODE_AUTOSTART,
              OPCODE_ATGTE,OPCODE_ATLT,
@@ -68,9 +68,8 @@ enum OPCODE : byte {OPCODE_THROW,OPCODE_CLOSE,
 
  
   // Flag bits for status of hardware and TPL
+  // Latches and task ids are kept in FlagSets
   static const byte SECTION_FLAG = 0x80;
-  static const byte LATCH_FLAG   = 0x40;
-  static const byte TASK_FLAG    = 0x20;
   static const byte SPARE_FLAG   = 0x10;
   static const byte SIGNAL_MASK  = 0x0C;
   static const byte SIGNAL_RED   = 0x08;
@@ -78,10 +77,73 @@ enum OPCODE : byte {OPCODE_THROW,OPCODE_CLOSE,
   static const byte SIGNAL_GREEN = 0x04;
 
   static const byte  MAX_STACK_DEPTH=4;
+
+// Time in uS that one call of RMFT2::loop() may spend running opcodes that 
+// complete at once, from as many tasks as it can, before it returns.
+#ifndef EXRAIL_LOOP_BUDGET
+#define EXRAIL_LOOP_BUDGET 1000
+#endif
+
+// Uncomment to count opcode executions, task run time and waits, shown by </STATS>
+// This costs about 400 bytes of RAM and some time in every loop.
+//#define EXRAIL_STATS
+#ifdef EXRAIL_STATS
+  enum WAIT_REASON : byte {WAIT_DELAY, WAIT_SENSOR, WAIT_TURNOUT, WAIT_PROG, WAIT_OTHER, WAIT_REASONS};
+#endif
  
    static const short MAX_FLAGS=256;
   #define FLAGOVERFLOW(x) x>=MAX_FLAGS
 
+// Vpins which can be latched on, 1 bit each
+#ifndef MAX_LATCHES
+#if defined(ARDUINO_AVR_UNO) || defined(ARDUINO_AVR_NANO)
+#define MAX_LATCHES 256
+#else
+#define MAX_LATCHES 1024
+#endif
+#endif
+   static const short MAX_TASK_IDS=255;  // 255 is used when they run out
+
+// A set of bits 0 to N-1, worked on a word at a time
+template <int16_t N> class FlagSet {
+  public:
+    void clear() { memset(words, 0, sizeof(words)); }
+    bool get(uint16_t i) { return i<N && (words[i>>5] & (1UL<<(i&31))); }
+    void set(uint16_t i, bool on) {
+      if (i>=N) return;
+      if (on) words[i>>5] |= 1UL<<(i&31);
+      else words[i>>5] &= ~(1UL<<(i&31));
+    }
+    // Lowest clear bit, or -1 if they are all set
+    int16_t firstClear() {
+      for (byte w=0; w<WORDS; w++) {
+        if (words[w]==0xFFFFFFFFUL) continue;
+        int16_t i=w*32+lowestBit(~words[w]);
+        return i<N ? i : -1;
+      }
+      return -1;
+    }
+    // Lowest set bit from i on, or -1 if there are none
+    int16_t nextSet(uint16_t i) {
+      for (uint16_t w=i>>5; w<WORDS; w++) {
+        uint32_t bits=words[w];
+        if (w==(i>>5)) bits &= ~0UL<<(i&31);
+        if (bits) return w*32+lowestBit(bits);
+      }
+      return -1;
+    }
+  private:
+    static const uint16_t WORDS=(N+31)/32;
+    uint32_t words[WORDS];
+    static byte lowestBit(uint32_t bits) {
+      byte b=0;
+      if (!(bits & 0xFFFF)) { bits>>=16; b+=16; }
+      if (!(bits & 0xFF)) { bits>>=8; b+=8; }
+      while (!(bits & 1)) { bits>>=1; b++; }
+      return b;
+    }
+};
+
 class LookList {
   public: 
     LookList(int16_t size);
@@ -101,6 +163,9 @@ class LookList {
     RMFT2(int progCounter);
     RMFT2(int route, uint16_t cab);
     ~RMFT2();
+    // Tasks come from a MemoryPool, since they are created and destroyed continually.
+    static void *operator new(size_t size) noexcept;
+    static void operator delete(void *task);
     static void readLocoCallback(int16_t cv);
     static void createNewTask(int route, uint16_t cab);
     static void turnoutEvent(int16_t id, bool closed);  
@@ -119,6 +184,13 @@ class LookList {
   static const FSH *  getTurnoutDescription(int16_t id);
   static const FSH *  getRosterName(int16_t id);
   static const FSH *  getRosterFunctions(int16_t id);
+  
+  // TURNOUTs are only created as Turnout objects when first used.
+  static const int16_t dccTurnoutCount;
+  static const int16_t FLASH dccTurnoutList[];  // id, address, subaddress of each
+  static int16_t findDCCTurnout(int16_t id);   // position in dccTurnoutList, or -1
+  static Turnout * createTurnout(int16_t id);
+  static bool isTurnoutHidden(int16_t id);
     
 private: 
     static void ComandFilter(Print * stream, byte & opcode, byte & paramCount, int16_t p[]);
@@ -126,19 +198,39 @@ private:
     static void streamFlags(Print* stream);
     static void setFlag(VPIN id,byte onMask, byte OffMask=0);
     static bool getFlag(VPIN id,byte mask); 
+    static inline void setLatch(VPIN id, bool on) { latches.set(id, on); }
+    static inline bool isLatched(VPIN id) { return latches.get(id); }
     static int16_t progtrackLocoId;
     static void doSignal(VPIN id,char rag); 
     static bool isSignal(VPIN id,char rag); 
     static int16_t getSignalSlot(VPIN id);
+    void doSignals();
+    void doTurnouts();
     static void setTurnoutHiddenState(Turnout * t);
     static RMFT2 * loopTask;
     static RMFT2 * pausingTask;
+    static RMFT2 * readyHead;      // tasks able to run, in the order they will
+    static RMFT2 * readyTail;
+    static RMFT2 * sleepingTasks;  // tasks in a delay, earliest wakeup first
+    static RMFT2 * runningTask;    // cleared if the task kills itself
+    void schedule();
+    void unschedule();
     void delayMe(long millisecs);
-    void driveLoco(byte speedo);
+    void waitForSensor(VPIN vpin, unsigned long pollDelay, unsigned long maxDelay);
+    static void sensorChangeCallback(VPIN vpin, int value);
+#ifdef EXRAIL_STATS
+    static void streamStats(Print * stream);
+    static unsigned long opcodeCounts[OPCODE_IFTHROWN+1];
+    static unsigned long maxRunMicros;  // longest single loop2 call
+    static int maxRunPc;
+#endif
+    void driveLoco(byte speedo, uint16_t rampMs=0);
     bool readSensor(uint16_t sensorId);
     bool skipIfBlock();
+    static int16_t findIfBlockEnd(int16_t progCounter);
     bool readLoco();
     void loop2();
+    static void runOpcode(RMFT2 * task);
     void kill(const FSH * reason=NULL,int operand=0);          
     void printMessage(uint16_t id);  // Built by RMFTMacros.h
     void printMessage2(const FSH * msg);
@@ -148,15 +240,27 @@ private:
    static const  FLASH  byte RouteCode[];
    static const  FLASH  int16_t SignalDefinitions[];
    static byte flags[MAX_FLAGS];
+   static FlagSet<MAX_LATCHES> latches;
+   static FlagSet<MAX_TASK_IDS> taskIds;
    static LookList * sequenceLookup;
    static LookList * onThrowLookup;
    static LookList * onCloseLookup;
    static LookList * onActivateLookup;
    static LookList * onDeactivateLookup;
+   static LookList * signalLookup;
+   static LookList * ifJumpLookup;  // IF or ELSE to where a skip of its block lands
 
     
   // Local variables - exist for each instance/task 
     RMFT2 *next;   // loop chain 
+    RMFT2 *nextScheduled;  // chain in either the ready queue or the sleeping list
+    bool sleeping;
+    VPIN waitingVpin;      // sleeping until this input changes, or VPIN_NONE
+#ifdef EXRAIL_STATS
+    unsigned long runCount;
+    unsigned long runMicros;
+    unsigned int waitCounts[WAIT_REASONS];
+#endif
     int progCounter;    // Byte offset of next route opcode in ROUTES table
     unsigned long delayStart; // Used by opcodes that must be recalled before completing
     unsigned long  delayTime;
@@ -89,6 +89,7 @@
 #undef POM
 #undef POWEROFF
 #undef POWERON
+#undef RAMP
 #undef READ_LOCO 
 #undef RED 
 #undef RESERVE 
@@ -191,6 +192,7 @@
 #define POM(cv,value)
 #define POWEROFF
 #define POWERON
+#define RAMP(speed,ms)
 #define READ_LOCO 
 #define RED(signal_id) 
 #define RESERVE(blockid) 
@@ -138,6 +138,21 @@ const FSH * RMFT2::getTurnoutDescription(int16_t turnoutid) {
      return NULL;
 }
 
+// Pass 5a: DCC turnout definitions, for creating the turnouts when first used
+#include "EXRAIL2MacroReset.h"
+#undef TURNOUT
+#define TURNOUT(id,addr,subaddr,description...) +1
+const int16_t RMFT2::dccTurnoutCount=0
+   #include "myAutomation.h"
+   ;
+
+#include "EXRAIL2MacroReset.h"
+#undef TURNOUT
+#define TURNOUT(id,addr,subaddr,description...) id,addr,subaddr,
+const int16_t FLASH RMFT2::dccTurnoutList[]={
+   #include "myAutomation.h"
+   0};
+
 // Pass 6: Roster IDs (count)
 #include "EXRAIL2MacroReset.h"
 #undef ROSTER
@@ -265,6 +280,7 @@ const  FLASH  int16_t RMFT2::SignalDefinitions[] = {
 #define POWERON  OPCODE_POWERON,0,0,
 #define PRINT(msg) OPCODE_PRINT,V(__COUNTER__ - StringMacroTracker2),
 #define PARSE(msg) PRINT(msg)
+#define RAMP(speed,ms) OPCODE_RAMP,V(speed),OPCODE_PAD,V(ms),
 #define READ_LOCO OPCODE_READ_LOCO1,0,0,OPCODE_READ_LOCO2,0,0,
 #define RED(signal_id) OPCODE_RED,V(signal_id),
 #define RESERVE(blockid) OPCODE_RESERVE,V(blockid),
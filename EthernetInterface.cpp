@@ -28,6 +28,7 @@
 #include "DIAG.h"
 #include "CommandDistributor.h"
 #include "DCCTimer.h"
+#include "BinaryProtocol.h"
 
 EthernetInterface * EthernetInterface::singleton=NULL;
 /**
@@ -47,36 +48,34 @@ void EthernetInterface::setup()
 
 
 /**
- * @brief Aquire IP Address from DHCP and start server
- * 
- * @return true 
- * @return false 
+ * @brief Start the Ethernet shield and aquire an IP address.  Nothing here waits
+ *  for the link, which is picked up by checkLink() in the loop.
  */
 EthernetInterface::EthernetInterface()
 {
-    byte mac[6];
     DCCTimer::getSimulatedMacAddress(mac);
     connected=false;
+    begun=false;
+    socketsInUse=0;
    
     #ifdef IP_ADDRESS
     Ethernet.begin(mac, IP_ADDRESS);
     #else
-    if (Ethernet.begin(mac) == 0)
+    // DHCP blocks for up to ETHERNET_DHCP_TIMEOUT, so it is only tried here in setup()
+    // and never from the loop, where it would hold up DCC and the overload checks.
+    if (Ethernet.begin(mac, ETHERNET_DHCP_TIMEOUT, 1000) == 0)
     {
         DIAG(F("Ethernet.begin FAILED"));
         return;
     } 
     #endif       
+    started();
+}
+
+void EthernetInterface::started() {
+    begun=true;
     if (Ethernet.hardwareStatus() == EthernetNoHardware)
       DIAG(F("Ethernet shield not detected or is a W5100"));
-
-    unsigned long startmilli = millis();
-    while ((millis() - startmilli) < 5500) { // Loop to give time to check for cable connection
-      if (Ethernet.linkStatus() == LinkON)
-	break;
-      DIAG(F("Ethernet waiting for link (1sec) "));
-      delay(1000);
-    }
 }
 
 /**
@@ -94,7 +93,7 @@ EthernetInterface::~EthernetInterface() {
  * 
  */
 void EthernetInterface::loop() {
-  if(!singleton || (!singleton->checkLink()))
+  if (!singleton || !singleton->begun || !singleton->checkLink())
     return;
 
   switch (Ethernet.maintain()) {
@@ -131,20 +130,31 @@ bool EthernetInterface::checkLink() {
       server->begin();
       LCD(4,F("IP: %d.%d.%d.%d"), ip[0], ip[1], ip[2], ip[3]);
       LCD(5,F("Port:%d"), IP_PORT);
+#ifdef ETHERNET_MULTICAST
+      if (udp.beginMulticast(IPAddress(ETHERNET_MULTICAST), ETHERNET_MULTICAST_PORT))
+        DIAG(F("Ethernet multicast port %d"), ETHERNET_MULTICAST_PORT);
+      else
+        DIAG(F("Ethernet multicast failed"));
+#endif
       // only create a outboundRing it none exists, this may happen if the cable
       // gets disconnected and connected again
       if(!outboundRing)
 	outboundRing=new RingStream(OUTBOUND_RING_SIZE);
     }
     return true;
-  } else { // connected
+  } else if (connected) {
     DIAG(F("Ethernet cable disconnected"));
     connected=false;
     //clean up any client
     for (byte socket = 0; socket < MAX_SOCK_NUM; socket++) {
       if(clients[socket].connected())
 	clients[socket].stop();
+      CommandDistributor::forget(socket);
     }
+    socketsInUse=0;
+#ifdef ETHERNET_MULTICAST
+    udp.stop();
+#endif
     // tear down server
     delete server;
     server = nullptr;
@@ -164,25 +174,33 @@ void EthernetInterface::loop2() {
         byte socket;
         for (socket = 0; socket < MAX_SOCK_NUM; socket++)
         {
-            if (!clients[socket])
+            if (!(socketsInUse & (1<<socket)))
             {
                 // On accept() the EthernetServer doesn't track the client anymore
                 // so we store it in our client array
                 if (Diag::ETHERNET) DIAG(F("Socket %d"),socket);
                 clients[socket] = client;
+                socketsInUse |= 1<<socket;
                 break;
             }
         }
         if (socket==MAX_SOCK_NUM) DIAG(F("new Ethernet OVERFLOW")); 
     }
 
-    // check for incoming data from all possible clients
+    // Only the sockets known to be in use are polled, each status read being
+    // an SPI transfer.  Stop any that have disconnected and check the others for data.
     for (byte socket = 0; socket < MAX_SOCK_NUM; socket++)
     {
-        if (clients[socket]) {
-        
+        if (!(socketsInUse & (1<<socket))) continue;
+        if (!clients[socket].connected()) {
+          clients[socket].stop();
+          socketsInUse &= ~(1<<socket);
+          CommandDistributor::forget(socket);          
+          if (Diag::ETHERNET)  DIAG(F("Ethernet: disconnect %d "), socket);             
+          continue;
+        }
         int available=clients[socket].available();
-        if (available > 0) {
+        if (available > 0 && outboundRing->freeSpace() >= OUTBOUND_RING_RESERVE) {
             if (Diag::ETHERNET)  DIAG(F("Ethernet: available socket=%d,avail=%d"), socket, available);
             // read bytes from a client
             int count = clients[socket].read(buffer, MAX_ETH_BUFFER);
@@ -190,29 +208,54 @@ void EthernetInterface::loop2() {
             if (Diag::ETHERNET) DIAG(F(",count=%d:%e"), socket,buffer);
             // execute with data going directly back
             outboundRing->mark(socket); 
-            CommandDistributor::parse(socket,buffer,outboundRing);
+            if (buffer[0]==BINARY_START) {
+              // Any number of complete binary frames
+              for (int pos=0; pos+2<=count && buffer[pos]==BINARY_START; pos+=2+buffer[pos+1]) {
+                // a bad length drops the rest of the read, rather than taking it as text
+                if (!BinaryProtocol::validLength(buffer[pos+1]) || pos+2+buffer[pos+1] > count) break;
+                CommandDistributor::parse(socket,buffer+pos,outboundRing);
+              }
+            }
+            else CommandDistributor::parse(socket,buffer,outboundRing);
             outboundRing->commit();
             return; // limit the amount of processing that takes place within 1 loop() cycle. 
-          }
         }
     }
 
-    // stop any clients which disconnect
-   for (int socket = 0; socket<MAX_SOCK_NUM; socket++) {
-     if (clients[socket] && !clients[socket].connected()) {
-      clients[socket].stop();
-      CommandDistributor::forget(socket);          
-      if (Diag::ETHERNET)  DIAG(F("Ethernet: disconnect %d "), socket);             
-     }
-    }
-    
     // handle at most 1 outbound transmission 
-    int socketOut=outboundRing->read();
+    int socketOut=outboundRing->readClient();
     if (socketOut>=0) {
       int count=outboundRing->count();
       if (Diag::ETHERNET) DIAG(F("Ethernet reply socket=%d, count=:%d"), socketOut,count);
-      for(;count>0;count--)  clients[socketOut].write(outboundRing->read());
+      // Write straight from the ring in as few blocks as possible, as each write
+      // is a separate transfer (and packet) to the shield
+      while (count>0) {
+        const uint8_t * span;
+        int block=outboundRing->peekSpan(span, count);
+        if (block==0) break;
+        clients[socketOut].write(span, block);
+        outboundRing->consume(block);
+        count-=block;
+      }
       clients[socketOut].flush(); //maybe 
     }
 }
+
+#ifdef ETHERNET_MULTICAST
+/**
+ * @brief Send a broadcast once to every listener in the multicast group.  Each packet
+ *  starts with <N sequence>, so that a listener can tell when one has been lost and
+ *  bring itself up to date over TCP with <$ VERSION>.
+ *
+ * @return true if the packet was sent
+ */
+bool EthernetInterface::multicast(RingStream * message) {
+  if (!singleton || !singleton->connected) return false;
+  EthernetUDP & udp=singleton->udp;
+  if (!udp.beginPacket(IPAddress(ETHERNET_MULTICAST), ETHERNET_MULTICAST_PORT)) return false;
+  StringFormatter::send(&udp, F("<N %l>\n"), ++singleton->multicastSequence);
+  message->printBuffer(&udp);
+  return udp.endPacket();
+}
+#endif
 #endif
@@ -47,26 +47,50 @@
 
 #define MAX_ETH_BUFFER 512
 #define OUTBOUND_RING_SIZE 2048
+// Incoming data is left in the socket while the outbound ring has less free space than this
+#define OUTBOUND_RING_RESERVE 256
+// DHCP is attempted once, from setup(), taking up to ETHERNET_DHCP_TIMEOUT ms.
+#ifndef ETHERNET_DHCP_TIMEOUT
+#define ETHERNET_DHCP_TIMEOUT 10000
+#endif
+// With ETHERNET_MULTICAST defined, broadcasts are sent once as a UDP packet to that
+// group as well as over TCP, clients that have asked for <D MULTICAST ON> being left
+// out of the TCP copy.  The packet uses one of the shield's sockets.
+#ifndef ETHERNET_MULTICAST_PORT
+#define ETHERNET_MULTICAST_PORT 2561
+#endif
 
 class EthernetInterface {
 
 public:
   static void setup();
   static void loop();
+#ifdef ETHERNET_MULTICAST
+  // Send the message to the multicast group, false if the link isn't up
+  static bool multicast(RingStream * message);
+#endif
   
 private:
   static EthernetInterface * singleton;
   bool connected;
+  bool begun;                 // Ethernet.begin has succeeded
+  byte mac[6];
+  uint16_t socketsInUse;      // bit per socket holding a client
   EthernetInterface();
   ~EthernetInterface();
   void loop2();
   bool checkLink();
+  void started();
 
   EthernetServer *server = nullptr;
   EthernetClient clients[MAX_SOCK_NUM]; // accept up to MAX_SOCK_NUM client connections at the same time
                                         // This depends on the chipset used on the Shield
   uint8_t buffer[MAX_ETH_BUFFER+1];     // buffer used by TCP for the recv
   RingStream * outboundRing = nullptr;
+#ifdef ETHERNET_MULTICAST
+  EthernetUDP udp;
+  unsigned long multicastSequence = 0;
+#endif
 };
 
 #endif
@@ -51,6 +51,14 @@ void I2CManagerClass::begin(void) {
         DIAG(F("I2C Device found at x%x"), addr);
       }
     }
+#if defined(I2C_HAS_BUS1)
+    for (byte addr=1; addr<127; addr++) {
+      if (exists(I2C_BUS1(addr))) {
+        found = true; 
+        DIAG(F("I2C Device found at x%x on bus 1"), addr);
+      }
+    }
+#endif
     if (!found) DIAG(F("No I2C Devices found"));
   }
 }
@@ -166,6 +174,32 @@ const FSH *I2CManagerClass::getErrorMessage(uint8_t status) {
   }
 }
 
+/***************************************************************************
+ * Show the transactions in each priority class and the bus utilisation
+ * since the previous call.
+ ***************************************************************************/
+void I2CManagerClass::showStats() {
+  uint32_t counts[I2C_PRIORITIES];
+  noInterrupts();
+  for (uint8_t p=0; p<I2C_PRIORITIES; p++) {
+    counts[p] = requestCount[p];
+    requestCount[p] = 0;
+  }
+  uint32_t busy = busyMicros;
+  busyMicros = 0;
+  interrupts();
+  unsigned long now = millis();
+  unsigned long elapsed = now - statsStart;
+  statsStart = now;
+  DIAG(F("I2C transactions input:%l output:%l display:%l in %lms, bus busy %l%%"),
+    counts[I2C_PRIORITY_INPUT], counts[I2C_PRIORITY_OUTPUT], counts[I2C_PRIORITY_DISPLAY],
+    elapsed, elapsed ? busy/(elapsed*10) : 0);
+}
+
+volatile uint32_t I2CManagerClass::requestCount[I2C_PRIORITIES] = {0, 0, 0};
+volatile uint32_t I2CManagerClass::busyMicros = 0;
+unsigned long I2CManagerClass::statsStart = 0;
+
 /***************************************************************************
  *  Declare singleton class instance.
  ***************************************************************************/
@@ -190,9 +224,9 @@ uint8_t I2CRB::wait() {
     // Rather than looping indefinitely, let's set a very high timeout (1s).
     if ((millis() - waitStart) > 1000UL) { 
       DIAG(F("I2C TIMEOUT I2C:x%x I2CRB:x%x"), i2cAddress, this);
-      status = I2C_STATUS_TIMEOUT;
-      // Note that, although the timeout is posted, the request may yet complete.
-      // TODO: Ideally we would like to cancel the request.
+      // Take the request off the queue, resetting the interface if it is 
+      // the one in progress, so that the requests behind it can proceed.
+      I2CManager.cancelRequest(this);
       return status;
     }
   } while (status==I2C_STATUS_PENDING);
@@ -154,6 +154,28 @@ typedef enum : uint8_t
 } OperationEnum;
 
 
+// Priority classes for queued requests.  Queued requests are started in order
+// of class, inputs first, except that a class that has been passed over 
+// I2C_MAX_SKIPS times goes next, so that none waits longer than that number of 
+// transactions from the others.
+enum : uint8_t {
+  I2C_PRIORITY_INPUT=0,    // sensor and occupancy reads
+  I2C_PRIORITY_OUTPUT=1,   // servo and GPIO writes, and anything not set otherwise
+  I2C_PRIORITY_DISPLAY=2,  // display refresh
+  I2C_PRIORITIES=3,
+};
+
+#ifndef I2C_MAX_SKIPS
+#define I2C_MAX_SKIPS 4
+#endif
+
+// On boards with a second I2C bus (Wire1) used through the Wire library, a
+// device is put on that bus by marking its address in myHal.cpp, e.g.
+//    PCA9685::create(100, 16, I2C_BUS1(0x40));
+// so that displays or servos can be kept off the sensor bus.  Elsewhere the
+// mark is ignored and the device is on the only bus.
+#define I2C_BUS1(address) ((uint8_t)((address) | 0x80))
+
 // Default I2C frequency
 #ifndef I2C_FREQ
 #define I2C_FREQ    400000L
@@ -165,7 +187,7 @@ public:
   volatile uint8_t status; // Completion status, or pending flag (updated from IRC)
   volatile uint8_t nBytes; // Number of bytes read (updated from IRC)
 
-  inline I2CRB() { status = I2C_STATUS_OK; };
+  inline I2CRB() { status = I2C_STATUS_OK; priority = I2C_PRIORITY_OUTPUT; completion = NULL; };
   uint8_t wait();
   bool isBusy();
 
@@ -177,10 +199,17 @@ public:
   uint8_t readLen;
   uint8_t operation;
   uint8_t i2cAddress;
+  uint8_t priority;  // I2C_PRIORITY_xxx
   uint8_t *readBuffer;
   const uint8_t *writeBuffer;
+  // If set, called from I2CManager.loop() (never from an interrupt) when the
+  // request has completed, with status already posted, so that a device can 
+  // start its next transfer without waiting for it.
+  void (*completion)(I2CRB *rb, void *context);
+  void *context;
 #if !defined(I2C_USE_WIRE)
   I2CRB *nextRequest;
+  uint8_t completedStatus;  // held here until the completion function is called
 #endif
 };
 
@@ -216,6 +245,9 @@ public:
   uint8_t read(uint8_t address, uint8_t readBuffer[], uint8_t readSize, 
     uint8_t writeSize, ...);
   void queueRequest(I2CRB *req);
+  // Abandon a request, whether waiting, in progress or completed with its
+  // completion function still to be called, posting I2C_STATUS_TIMEOUT.
+  void cancelRequest(I2CRB *req);
 
   // Function to abort long-running operations.
   void checkForTimeout();
@@ -227,6 +259,10 @@ public:
   // need to be printed using FSH.
   static const FSH *getErrorMessage(uint8_t status);
 
+  // Show the number of transactions in each priority class and the percentage 
+  // of the time the bus was busy, since the last call.
+  void showStats();
+
 private:
   bool _beginCompleted = false;
   bool _clockSpeedFixed = false;
@@ -238,8 +274,18 @@ private:
   void _initialise();
   void _setClock(unsigned long);
 
+  // Statistics, updated as each transaction completes
+  static volatile uint32_t requestCount[I2C_PRIORITIES];
+  static volatile uint32_t busyMicros;
+  static unsigned long statsStart;  // millis
+  static inline void recordTransaction(uint8_t priority, unsigned long micros) {
+    requestCount[priority]++;
+    busyMicros += micros;
+  }
+
 #if !defined(I2C_USE_WIRE)
-    // I2CRB structs are queued on the following two links.
+    // I2CRB structs are queued on the following two links, one pair for 
+    // each priority class.
     // If there are no requests, both are NULL.
     // If there is only one request, then queueHead and queueTail both point to it.
     // Otherwise, queueHead is the pointer to the first request in the queue and
@@ -247,8 +293,13 @@ private:
     // Within the queue, each request's nextRequest field points to the 
     // next request, or NULL.
     // Mark volatile as they are updated by IRC and read/written elsewhere.
-    static I2CRB * volatile queueHead;
-    static I2CRB * volatile queueTail;
+    static I2CRB * volatile queueHead[I2C_PRIORITIES];
+    static I2CRB * volatile queueTail[I2C_PRIORITIES];
+    static uint8_t skipCount[I2C_PRIORITIES];  // times passed over while waiting
+    // Requests that have completed and have a completion function to call,
+    // linked through nextRequest.
+    static I2CRB * volatile completedHead;
+    static I2CRB * volatile completedTail;
     static volatile uint8_t state;
 
     static I2CRB * volatile currentRequest;
@@ -258,6 +309,7 @@ private:
     static volatile uint8_t bytesToReceive;
     static volatile uint8_t operation;
     static volatile unsigned long startTime;
+    static volatile uint8_t currentPriority;  // class of currentRequest
 
     static unsigned long timeout; // Transaction timeout in microseconds.  0=disabled.
     
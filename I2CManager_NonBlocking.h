@@ -40,7 +40,7 @@
  ***************************************************************************/
 void I2CManagerClass::_initialise()
 {
-  queueHead = queueTail = NULL;
+  for (uint8_t p=0; p<I2C_PRIORITIES; p++) queueHead[p] = queueTail[p] = NULL;
   state = I2C_STATE_FREE;
   I2C_init();
 }
@@ -55,13 +55,26 @@ void I2CManagerClass::_setClock(unsigned long i2cClockSpeed) {
 
 /***************************************************************************
  * Helper function to start operations, if the I2C interface is free and
- * there is a queued request to be processed.
+ * there is a queued request to be processed.  The request comes from the 
+ * highest priority class with one waiting, unless a lower class has been
+ * passed over I2C_MAX_SKIPS times.
  ***************************************************************************/
 void I2CManagerClass::startTransaction() { 
   ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-    if ((state == I2C_STATE_FREE) && (queueHead != NULL)) {
+    if (state == I2C_STATE_FREE) {
+      uint8_t chosen = I2C_PRIORITIES;
+      for (uint8_t p=0; p<I2C_PRIORITIES; p++) {
+        if (queueHead[p] == NULL) continue;
+        if (chosen == I2C_PRIORITIES) chosen = p;
+        else if (skipCount[p] >= I2C_MAX_SKIPS) { chosen = p; break; }
+      }
+      if (chosen == I2C_PRIORITIES) return;  // nothing queued
+      for (uint8_t p=0; p<I2C_PRIORITIES; p++) 
+        if (queueHead[p] != NULL && p != chosen) skipCount[p]++;
+      skipCount[chosen] = 0;
+      currentPriority = chosen;
       state = I2C_STATE_ACTIVE;
-      currentRequest = queueHead;
+      currentRequest = queueHead[chosen];
       rxCount = txCount = 0;
       // Copy key fields to static data for speed.
       operation = currentRequest->operation;
@@ -78,12 +91,14 @@ void I2CManagerClass::startTransaction() {
 void I2CManagerClass::queueRequest(I2CRB *req) {
   req->status = I2C_STATUS_PENDING;
   req->nextRequest = NULL;
+  uint8_t p = req->priority;
+  if (p >= I2C_PRIORITIES) p = I2C_PRIORITY_OUTPUT;
 
   ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-    if (!queueTail) 
-      queueHead = queueTail = req;  // Only item on queue
+    if (!queueTail[p]) 
+      queueHead[p] = queueTail[p] = req;  // Only item on queue
     else
-      queueTail = queueTail->nextRequest = req; // Add to end
+      queueTail[p] = queueTail[p]->nextRequest = req; // Add to end
     startTransaction();
   }
 
@@ -137,25 +152,58 @@ uint8_t I2CManagerClass::read(uint8_t i2cAddress, uint8_t *readBuffer, uint8_t r
 void I2CManagerClass::checkForTimeout() {
   unsigned long currentMicros = micros();
   ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-    I2CRB *t = queueHead;
-    if (state==I2C_STATE_ACTIVE && t!=0 && t==currentRequest && timeout > 0) {
+    I2CRB *t = currentRequest;
+    if (state==I2C_STATE_ACTIVE && t!=0 && timeout > 0) {
       // Check for timeout
-      if (currentMicros - startTime > timeout) { 
-        // Excessive time. Dequeue request
-        queueHead = t->nextRequest;
-        if (!queueHead) queueTail = NULL;
-        currentRequest = NULL;
-        // Post request as timed out.
-        t->status = I2C_STATUS_TIMEOUT;
-        // Reset TWI interface so it is able to continue
-        // Try close and init, not entirely satisfactory but sort of works...
-        I2C_close();  // Shutdown and restart twi interface
-        I2C_init();
-        state = I2C_STATE_FREE;
-        
-        // Initiate next queued request if any.
-        startTransaction();
+      if (currentMicros - startTime > timeout) 
+        cancelRequest(t);  // Excessive time. 
+    }
+  }
+}
+
+/***************************************************************************
+ * Cancel a request.  A request still on the queue is just unlinked.  If it
+ * is the one in progress, the TWI interface is reset so that it is able to
+ * continue with the next.  A request that has completed but whose 
+ * completion function hasn't been called yet is taken off the completed
+ * list, so the function isn't called.  Either way the status is 
+ * I2C_STATUS_TIMEOUT.
+ ***************************************************************************/
+void I2CManagerClass::cancelRequest(I2CRB *req) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (req->status == I2C_STATUS_PENDING) {
+      uint8_t p = req->priority;
+      if (p >= I2C_PRIORITIES) p = I2C_PRIORITY_OUTPUT;
+      I2CRB *previous = NULL;
+      I2CRB *t;
+      for (t = queueHead[p]; t && t != req; t = t->nextRequest) previous = t;
+      if (!t) {
+        // Not queued, so it has completed: drop it from the completed list
+        previous = NULL;
+        for (t = completedHead; t && t != req; t = t->nextRequest) previous = t;
+        if (t) {
+          if (previous) previous->nextRequest = t->nextRequest;
+          else completedHead = t->nextRequest;
+          if (completedTail == t) completedTail = previous;
+        }
+      }
+      else {
+        // Dequeue request
+        if (previous) previous->nextRequest = t->nextRequest;
+        else queueHead[p] = t->nextRequest;
+        if (queueTail[p] == t) queueTail[p] = previous;
+        if (t == currentRequest) {
+          currentRequest = NULL;
+          // Reset TWI interface so it is able to continue
+          // Try close and init, not entirely satisfactory but sort of works...
+          I2C_close();  // Shutdown and restart twi interface
+          I2C_init();
+          state = I2C_STATE_FREE;
+          // Initiate next queued request if any.
+          startTransaction();
+        }
       }
+      req->status = I2C_STATUS_TIMEOUT;
     }
   }
 }
@@ -167,6 +215,18 @@ void I2CManagerClass::loop() {
 #if !defined(I2C_USE_INTERRUPTS)
   handleInterrupt();
 #endif
+  // Post the status of completed requests that have a completion function,
+  // and call it.
+  while (completedHead) {
+    I2CRB *t;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      t = completedHead;
+      completedHead = t->nextRequest;
+      if (!completedHead) completedTail = NULL;
+    }
+    t->status = t->completedStatus;
+    t->completion(t, t->context);
+  }
   // Timeout is now reported in I2CRB::wait(), not here.
   // I've left the code, commented out, as a reminder to look at this again
   // in the future.
@@ -190,12 +250,22 @@ void I2CManagerClass::handleInterrupt() {
   if (state != I2C_STATE_ACTIVE && currentRequest != NULL) {
     // Remove completed request from head of queue
     ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-      I2CRB * t = queueHead;
-      if (t == queueHead) {
-        queueHead = t->nextRequest;
-        if (!queueHead) queueTail = queueHead;
+      uint8_t p = currentPriority;
+      I2CRB * t = queueHead[p];
+      if (t == currentRequest) {
+        queueHead[p] = t->nextRequest;
+        if (!queueHead[p]) queueTail[p] = queueHead[p];
         t->nBytes = rxCount;
-        t->status = state;
+        recordTransaction(p, micros() - startTime);
+        if (t->completion) {
+          // Status stays pending until the completion function is called from
+          // loop(), so that the request block isn't reused before then.
+          t->completedStatus = state;
+          t->nextRequest = NULL;
+          if (completedTail) completedTail = completedTail->nextRequest = t;
+          else completedHead = completedTail = t;
+        } else 
+          t->status = state;
         
         // I2C state machine is now free for next request
         currentRequest = NULL;
@@ -209,8 +279,12 @@ void I2CManagerClass::handleInterrupt() {
 }
 
 // Fields in I2CManager class specific to Non-blocking implementation.
-I2CRB * volatile I2CManagerClass::queueHead = NULL;
-I2CRB * volatile I2CManagerClass::queueTail = NULL;
+I2CRB * volatile I2CManagerClass::queueHead[I2C_PRIORITIES] = {NULL, NULL, NULL};
+I2CRB * volatile I2CManagerClass::queueTail[I2C_PRIORITIES] = {NULL, NULL, NULL};
+uint8_t I2CManagerClass::skipCount[I2C_PRIORITIES] = {0, 0, 0};
+volatile uint8_t I2CManagerClass::currentPriority = 0;
+I2CRB * volatile I2CManagerClass::completedHead = NULL;
+I2CRB * volatile I2CManagerClass::completedTail = NULL;
 I2CRB * volatile I2CManagerClass::currentRequest = NULL;
 volatile uint8_t I2CManagerClass::state = I2C_STATE_FREE;
 volatile uint8_t I2CManagerClass::txCount;
@@ -30,11 +30,28 @@
 #define I2C_USE_WIRE
 #endif
 
+#if (defined(WIRE_INTERFACES_COUNT) && WIRE_INTERFACES_COUNT > 1) \
+    || defined(WIRE_IMPLEMENT_WIRE1) || defined(ARDUINO_ARCH_ESP32)
+#define I2C_HAS_BUS1
+#endif
+
+// Bus for an address, which may be marked with I2C_BUS1
+static inline TwoWire &wireFor(uint8_t address) {
+#if defined(I2C_HAS_BUS1)
+  if (address & 0x80) return Wire1;
+#endif
+  (void)address;
+  return Wire;
+}
+
 /***************************************************************************
  *  Initialise I2C interface software
  ***************************************************************************/
 void I2CManagerClass::_initialise() {
   Wire.begin();
+#if defined(I2C_HAS_BUS1)
+  Wire1.begin();
+#endif
 }
 
 /***************************************************************************
@@ -43,15 +60,21 @@ void I2CManagerClass::_initialise() {
  ***************************************************************************/
 void I2CManagerClass::_setClock(unsigned long i2cClockSpeed) {
   Wire.setClock(i2cClockSpeed);
+#if defined(I2C_HAS_BUS1)
+  Wire1.setClock(i2cClockSpeed);
+#endif
 }
 
 /***************************************************************************
  *  Initiate a write to an I2C device (blocking operation on Wire)
  ***************************************************************************/
 uint8_t I2CManagerClass::write(uint8_t address, const uint8_t buffer[], uint8_t size, I2CRB *rb) {
-  Wire.beginTransmission(address);
-  if (size > 0) Wire.write(buffer, size);
-  rb->status = Wire.endTransmission();
+  unsigned long startMicros = micros();
+  TwoWire &wire = wireFor(address);
+  wire.beginTransmission(address & 0x7F);
+  if (size > 0) wire.write(buffer, size);
+  rb->status = wire.endTransmission();
+  recordTransaction(rb->priority < I2C_PRIORITIES ? rb->priority : I2C_PRIORITY_OUTPUT, micros() - startMicros);
   return I2C_STATUS_OK;
 }
 
@@ -73,21 +96,24 @@ uint8_t I2CManagerClass::write_P(uint8_t address, const uint8_t buffer[], uint8_
 uint8_t I2CManagerClass::read(uint8_t address, uint8_t readBuffer[], uint8_t readSize,
                               const uint8_t writeBuffer[], uint8_t writeSize, I2CRB *rb)
 {
+  unsigned long startMicros = micros();
+  TwoWire &wire = wireFor(address);
   uint8_t status = I2C_STATUS_OK;
   uint8_t nBytes = 0;
   if (writeSize > 0) {
-    Wire.beginTransmission(address);
-    Wire.write(writeBuffer, writeSize);
-    status = Wire.endTransmission(false); // Don't free bus yet
+    wire.beginTransmission(address & 0x7F);
+    wire.write(writeBuffer, writeSize);
+    status = wire.endTransmission(false); // Don't free bus yet
   }
   if (status == I2C_STATUS_OK) {
-    Wire.requestFrom(address, (size_t)readSize);
-    while (Wire.available() && nBytes < readSize) 
-      readBuffer[nBytes++] = Wire.read();
+    wire.requestFrom((uint8_t)(address & 0x7F), (size_t)readSize);
+    while (wire.available() && nBytes < readSize) 
+      readBuffer[nBytes++] = wire.read();
     if (nBytes < readSize) status = I2C_STATUS_TRUNCATED;
   }
   rb->nBytes = nBytes;
   rb->status = status;
+  recordTransaction(rb->priority < I2C_PRIORITIES ? rb->priority : I2C_PRIORITY_OUTPUT, micros() - startMicros);
   return I2C_STATUS_OK;
 }
 
@@ -114,6 +140,7 @@ void I2CManagerClass::queueRequest(I2CRB *req) {
       read(req->i2cAddress, req->readBuffer, req->readLen, req->writeBuffer, req->writeLen, req);
       break;
   }
+  if (req->completion) req->completion(req, req->context);
 }
 
 /***************************************************************************
@@ -124,5 +151,8 @@ void I2CManagerClass::loop() {}
 // Loop function
 void I2CManagerClass::checkForTimeout() {}
 
+// Requests are complete before queueRequest returns, so there's nothing to cancel.
+void I2CManagerClass::cancelRequest(I2CRB *req) { (void)req; }
+
 
 #endif
\ No newline at end of file
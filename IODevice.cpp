@@ -25,6 +25,8 @@
 #include "DIAG.h" 
 #include "FSH.h"
 #include "IO_MCP23017.h"
+#include "I2CManager.h"
+#include "DCCTimer.h"
 
 #if defined(ARDUINO_ARCH_AVR) || defined(ARDUINO_ARCH_MEGAAVR)
 #define USE_FAST_IO
@@ -46,9 +48,13 @@ extern __attribute__((weak)) void mySetup();  // Deprecated function name, outpu
 
 // Create any standard device instances that may be required, such as the Arduino pins 
 // and PCA9685.
+// Not on the heap, as the Arduino pins are fixed when the code is built
+static ArduinoPins arduinoPins(2, NUM_DIGITAL_PINS-2);
+
 void IODevice::begin() {
   // Initialise the IO subsystem
-  ArduinoPins::create(2, NUM_DIGITAL_PINS-2);  // Reserve pins for direct access
+  if (_firstDevice == NULL) _arduinoPins = &arduinoPins;
+  addDevice(&arduinoPins);  // Reserve pins for direct access
   // Predefine two PCA9685 modules 0x40-0x41
   // Allocates 32 pins 100-131
   PCA9685::create(100, 16, 0x40);
@@ -73,6 +79,9 @@ void IODevice::begin() {
   //  The myHal.cpp file is a standard C++ module so has access to all of the DCC++EX APIs.
   if (halSetup)
     halSetup();
+
+  // All the standard and user devices are now known
+  buildDeviceIndex();
 }
 
 // Overarching static loop() method for the IODevice subsystem.  Works through the
@@ -82,56 +91,32 @@ void IODevice::begin() {
 // The current value of micros() is passed as a parameter, so the called loop function
 // doesn't need to invoke it.
 void IODevice::loop() {
+  // Finish I2C requests that have completed, calling their completion functions
+  I2CManager.loop();
+
   unsigned long currentMicros = micros();
   
-  IODevice *lastLoopDevice = _nextLoopDevice;  // So we know when to stop...
-  // Loop through devices until we find one ready to be serviced.
-  do {
-    if (!_nextLoopDevice) _nextLoopDevice = _firstDevice;
-    if (_nextLoopDevice) {
-      if (_nextLoopDevice->_deviceState != DEVSTATE_FAILED 
-            && ((long)(currentMicros - _nextLoopDevice->_nextEntryTime)) >= 0) {
-        // Found one ready to run, so invoke its _loop method.
-        _nextLoopDevice->_nextEntryTime = currentMicros;
-        _nextLoopDevice->_loop(currentMicros);
-        _nextLoopDevice = _nextLoopDevice->_nextDevice;
-        break;
-      }
-      // Not this one, move to next one
-      _nextLoopDevice = _nextLoopDevice->_nextDevice;
+  // Service the devices that were due when this call started, most overdue first,
+  // until the time budget is used up.  Each device runs at most once per call.
+  unsigned long now = currentMicros;
+  for (int count = 0; count < _loopQueueSize; count++) {
+    IODevice *dev = _loopQueue[0];
+    if ((long)(currentMicros - dev->_nextEntryTime) < 0) break;  // Nothing else due yet
+    if (dev->_deviceState == DEVSTATE_FAILED) {
+      // Don't call it, but look at it again in a while.
+      dev->delayUntil(now + 0x3fffffff);
+      continue;
     }
-  } while (_nextLoopDevice != lastLoopDevice); // Stop looking when we've done all.
-  
-  // Report loop time if diags enabled
-#if defined(DIAG_LOOPTIMES)
-  static unsigned long lastMicros = 0;
-  // Measure time since loop() method started.
-  unsigned long halElapsed = micros() - currentMicros;
-  // Measure time between loop() method entries.
-  unsigned long elapsed = currentMicros - lastMicros;
-  static unsigned long maxElapsed = 0, maxHalElapsed = 0;
-  static unsigned long lastOutputTime = 0;
-  static unsigned long halTotal = 0, total = 0;
-  static unsigned long count = 0;
-  const unsigned long interval = (unsigned long)5 * 1000 * 1000; // 5 seconds in microsec
-
-  // Ignore long loop counts while message is still outputting
-  if (currentMicros - lastOutputTime > 3000UL) {
-    if (elapsed > maxElapsed) maxElapsed = elapsed;
-    if (halElapsed > maxHalElapsed) maxHalElapsed = halElapsed;
-    halTotal += halElapsed;
-    total += elapsed;
-    count++;
+    dev->_nextEntryTime = now;
+    dev->_loop(now);
+    unsigned long after = micros();
+    // The device normally calls delayUntil, but if not it goes behind the others due,
+    // and is not run again in this call.
+    if (dev->_nextEntryTime == now) dev->_nextEntryTime = after + 1;
+    updateLoopQueue(dev->_loopQueuePos);
+    now = after;
+    if (now - currentMicros >= IO_LOOP_BUDGET) break;
   }
-  if (currentMicros - lastOutputTime > interval) {
-    if (lastOutputTime > 0) 
-      DIAG(F("Loop Total:%lus (%lus max) HAL:%lus (%lus max)"), 
-        total/count, maxElapsed, halTotal/count, maxHalElapsed);
-    maxElapsed = maxHalElapsed = total = halTotal = count = 0;
-    lastOutputTime = currentMicros;
-  }
-  lastMicros = currentMicros;
-#endif
 }
 
 // Display a list of all the devices on the diagnostic stream.
@@ -172,10 +157,10 @@ bool IODevice::configure(VPIN vpin, ConfigTypeEnum configType, int paramCount, i
 
 // Read value from virtual pin.
 int IODevice::read(VPIN vpin) {
-  for (IODevice *dev = _firstDevice; dev != 0; dev = dev->_nextDevice) {
-    if (dev->owns(vpin)) 
-      return dev->_read(vpin);
-  }
+  if (isArduinoPin(vpin)) return _arduinoPins->ArduinoPins::_read(vpin);
+  IODevice *dev = findDevice(vpin);
+  if (dev) 
+    return dev->_read(vpin);
 #ifdef DIAG_IO
   DIAG(F("IODevice::read(): Vpin %d not found!"), (int)vpin);
 #endif
@@ -184,10 +169,10 @@ int IODevice::read(VPIN vpin) {
 
 // Read analogue value from virtual pin.
 int IODevice::readAnalogue(VPIN vpin) {
-  for (IODevice *dev = _firstDevice; dev != 0; dev = dev->_nextDevice) {
-    if (dev->owns(vpin)) 
-      return dev->_readAnalogue(vpin);
-  }
+  if (isArduinoPin(vpin)) return _arduinoPins->ArduinoPins::_readAnalogue(vpin);
+  IODevice *dev = findDevice(vpin);
+  if (dev) 
+    return dev->_readAnalogue(vpin);
 #ifdef DIAG_IO
   DIAG(F("IODevice::readAnalogue(): Vpin %d not found!"), (int)vpin);
 #endif
@@ -197,6 +182,10 @@ int IODevice::readAnalogue(VPIN vpin) {
 // Write value to virtual pin(s).  If multiple devices are allocated the same pin
 //  then only the first one found will be used.
 void IODevice::write(VPIN vpin, int value) {
+  if (isArduinoPin(vpin)) {
+    _arduinoPins->ArduinoPins::_write(vpin, value);
+    return;
+  }
   IODevice *dev = findDevice(vpin);
   if (dev) {
     dev->_write(vpin, value);
@@ -207,6 +196,38 @@ void IODevice::write(VPIN vpin, int value) {
 #endif
 }
 
+// Write a group of digital outputs, splitting the mask at device boundaries
+// so that each device is called once for its own pins.
+void IODevice::writeMultiple(VPIN firstVpin, uint32_t mask, uint32_t values) {
+  uint8_t bit = 0;
+  while (mask) {
+    if (!(mask & 1)) {
+      mask >>= 1;
+      values >>= 1;
+      bit++;
+      continue;
+    }
+    VPIN vpin = firstVpin + bit;
+    IODevice *dev = findDevice(vpin);
+    // Number of the group's pins, from vpin on, that belong to the device
+    uint8_t width = 1;
+    if (dev) {
+      uint16_t remaining = dev->_firstVpin + dev->_nPins - vpin;
+      width = (remaining < 32U - bit) ? remaining : 32 - bit;
+      uint32_t span = (width < 32) ? (1UL << width) - 1 : 0xFFFFFFFFUL;
+      dev->_writeMultiple(vpin, mask & span, values & span);
+    } else {
+#ifdef DIAG_IO
+      DIAG(F("IODevice::writeMultiple(): Vpin ID %d not found!"), (int)vpin);
+#endif
+    }
+    if (width >= 32) break;
+    mask >>= width;
+    values >>= width;
+    bit += width;
+  }
+}
+
 // Write analogue value to virtual pin(s).  If multiple devices are allocated
 // the same pin then only the first one found will be used.
 //
@@ -245,32 +266,130 @@ void IODevice::setGPIOInterruptPin(int16_t pinNumber) {
 
 // Private helper function to add a device to the chain of devices.
 void IODevice::addDevice(IODevice *newDevice) {
-  // Link new object to the end of the chain.  Thereby, the first devices to be declared/created
-  // will be located faster by findDevice than those which are created later.
-  // Ideally declare/create the digital IO pins first, then servos, then more esoteric devices.
-  IODevice *lastDevice;
+  // Link new object to the end of the chain.  Where VPIN ranges overlap, the device
+  // declared/created first is the one that findDevice returns.
   if (_firstDevice == 0)
     _firstDevice = newDevice;
-  else {
-    for (IODevice *dev = _firstDevice; dev != 0; dev = dev->_nextDevice)
-      lastDevice = dev;
-    lastDevice->_nextDevice = newDevice;
-  }
+  else
+    _lastDevice->_nextDevice = newDevice;
+  _lastDevice = newDevice;
   newDevice->_nextDevice = 0;
+  if (++_deviceGeneration == 0) _deviceGeneration = 1;
+  newDevice->_nextEntryTime = micros();
+  addToLoopQueue(newDevice);
 
   // If the IODevice::begin() method has already been called, initialise device here.  If not,
   // the device's _begin() method will be called by IODevice::begin().
-  if (!_initPhase)
+  if (!_initPhase) {
     newDevice->_begin();
+    buildDeviceIndex();
+  }
+}
+
+// Private helper function to add a device to the loop queue.
+void IODevice::addToLoopQueue(IODevice *dev) {
+  if (_loopQueueSize == _loopQueueCapacity) {
+    // Grow the array, devices are only added during startup so this is rare.
+    int newCapacity = _loopQueueCapacity ? _loopQueueCapacity * 2 : 8;
+    IODevice **newQueue = new IODevice *[newCapacity];
+    for (int i = 0; i < _loopQueueSize; i++) newQueue[i] = _loopQueue[i];
+    if (_loopQueue) delete[] _loopQueue;
+    _loopQueue = newQueue;
+    _loopQueueCapacity = newCapacity;
+  }
+  int pos = _loopQueueSize++;
+  _loopQueue[pos] = dev;
+  dev->_loopQueuePos = pos;
+  updateLoopQueue(pos);
+}
+
+// Private helper function to restore the heap order after the entry time
+// of the device at position pos has changed.
+void IODevice::updateLoopQueue(int pos) {
+  IODevice *dev = _loopQueue[pos];
+  unsigned long entryTime = dev->_nextEntryTime;
+  // Move up while earlier than the parent
+  while (pos > 0) {
+    int parent = (pos - 1) / 2;
+    if ((long)(entryTime - _loopQueue[parent]->_nextEntryTime) >= 0) break;
+    _loopQueue[pos] = _loopQueue[parent];
+    _loopQueue[pos]->_loopQueuePos = pos;
+    pos = parent;
+  }
+  // Move down while later than the earliest child
+  for (;;) {
+    int child = 2 * pos + 1;
+    if (child >= _loopQueueSize) break;
+    if (child + 1 < _loopQueueSize 
+        && (long)(_loopQueue[child+1]->_nextEntryTime - _loopQueue[child]->_nextEntryTime) < 0)
+      child++;
+    if ((long)(_loopQueue[child]->_nextEntryTime - entryTime) >= 0) break;
+    _loopQueue[pos] = _loopQueue[child];
+    _loopQueue[pos]->_loopQueuePos = pos;
+    pos = child;
+  }
+  _loopQueue[pos] = dev;
+  dev->_loopQueuePos = pos;
+}
+
+// Private helper function to build the sorted device index used by findDevice.
+void IODevice::buildDeviceIndex() {
+  if (_deviceIndex) delete[] _deviceIndex;
+  _deviceIndex = NULL;
+  _lastFoundDevice = NULL;
+  int count = 0;
+  for (IODevice *dev = _firstDevice; dev != 0; dev = dev->_nextDevice) count++;
+  if (count == 0) return;
+  IODevice **index = new IODevice *[count];
+  // Insertion sort by first VPIN, there are only a few tens of devices.
+  int n = 0;
+  for (IODevice *dev = _firstDevice; dev != 0; dev = dev->_nextDevice) {
+    int i = n++;
+    while (i > 0 && index[i-1]->_firstVpin > dev->_firstVpin) {
+      index[i] = index[i-1];
+      i--;
+    }
+    index[i] = dev;
+  }
+  // With overlapping ranges the chain order decides, so keep to the linear search.
+  for (int i = 1; i < count; i++) {
+    if ((long)index[i-1]->_firstVpin + index[i-1]->_nPins > index[i]->_firstVpin) {
+      DIAG(F("IODevice Vpins %d-%d overlap %d"), (int)index[i-1]->_firstVpin, 
+        (int)index[i-1]->_firstVpin+index[i-1]->_nPins-1, (int)index[i]->_firstVpin);
+      delete[] index;
+      return;
+    }
+  }
+  _deviceIndex = index;
+  _deviceIndexSize = count;
 }
 
 // Private helper function to locate a device by VPIN.  Returns NULL if not found.
 //  This is performance-critical, so minimises the calculation and function calls necessary.
 IODevice *IODevice::findDevice(VPIN vpin) { 
-  for (IODevice *dev = _firstDevice; dev != 0; dev = dev->_nextDevice) {
-    VPIN firstVpin = dev->_firstVpin;
-    if (vpin >= firstVpin && vpin < firstVpin+dev->_nPins)
-      return dev;
+  if (!_deviceIndex) {
+    for (IODevice *dev = _firstDevice; dev != 0; dev = dev->_nextDevice) {
+      VPIN firstVpin = dev->_firstVpin;
+      if (vpin >= firstVpin && vpin < firstVpin+dev->_nPins)
+        return dev;
+    }
+    return NULL;
+  }
+  // Same device as last time?  Callers often use the same or neighbouring pins.
+  IODevice *dev = _lastFoundDevice;
+  if (dev && vpin >= dev->_firstVpin && vpin < dev->_firstVpin+dev->_nPins)
+    return dev;
+  // Binary search for the last device starting at or below vpin
+  int low = 0, high = _deviceIndexSize;
+  while (high - low > 1) {
+    int mid = (low + high) / 2;
+    if (_deviceIndex[mid]->_firstVpin <= vpin) low = mid;
+    else high = mid;
+  }
+  dev = _deviceIndex[low];
+  if (vpin >= dev->_firstVpin && vpin < dev->_firstVpin+dev->_nPins) {
+    _lastFoundDevice = dev;
+    return dev;
   }
   return NULL;
 }
@@ -282,15 +401,27 @@ IODevice *IODevice::findDevice(VPIN vpin) {
 // Chain of callback blocks (identifying registered callback functions for state changes)
 IONotifyCallback *IONotifyCallback::first = 0;
 
-// Start of chain of devices.
+// Start and end of chain of devices.
 IODevice *IODevice::_firstDevice = 0;
+IODevice *IODevice::_lastDevice = 0;
+
+// Sorted index of devices, see buildDeviceIndex.
+IODevice **IODevice::_deviceIndex = 0;
+int IODevice::_deviceIndexSize = 0;
+IODevice *IODevice::_lastFoundDevice = 0;
+ArduinoPins *IODevice::_arduinoPins = 0;
 
-// Reference to next device to be called on _loop() method.
-IODevice *IODevice::_nextLoopDevice = 0;
+// Queue of devices in order of next _loop() call, see updateLoopQueue.
+IODevice **IODevice::_loopQueue = 0;
+int IODevice::_loopQueueSize = 0;
+int IODevice::_loopQueueCapacity = 0;
 
 // Flag which is reset when IODevice::begin has been called.
 bool IODevice::_initPhase = true;  
 
+// Changed by addDevice, see VpinHandle.
+uint8_t IODevice::_deviceGeneration = 1;
+
 
 //==================================================================================================================
 // Instance members
@@ -301,6 +432,35 @@ bool IODevice::owns(VPIN id) {
   return (id >= _firstVpin && id < _firstVpin + _nPins);
 }
 
+//==================================================================================================================
+// VpinHandle
+//------------------------------------------------------------------------------------------------------------------
+
+// Look up the device for the handle's vpin.  Devices are never removed, so once found
+// the device is kept.  If not found, look again only after further devices have been added.
+bool VpinHandle::resolve() {
+  if (_device) return true;
+  if (_generation == IODevice::_deviceGeneration) return false;
+  _generation = IODevice::_deviceGeneration;
+  _device = IODevice::findDevice(_vpin);
+  return _device != NULL;
+}
+
+int VpinHandle::read() {
+  if (!resolve()) return false;
+  if (_device->_nativePins && ((ArduinoPins *)_device)->inputReady(_vpin))
+    return !ArduinoPins::fastReadDigital(_vpin); // Invert (5v=0, 0v=1)
+  return _device->_read(_vpin);
+}
+
+void VpinHandle::write(int value) {
+  if (!resolve()) return;
+  if (_device->_nativePins && ((ArduinoPins *)_device)->outputReady(_vpin))
+    ArduinoPins::fastWriteDigital(_vpin, value);
+  else
+    _device->_write(_vpin, value);
+}
+
 
 #else // !defined(IO_NO_HAL)
 
@@ -320,6 +480,10 @@ void IODevice::write(VPIN vpin, int value) {
   digitalWrite(vpin, value);
   pinMode(vpin, OUTPUT);
 }
+void IODevice::writeMultiple(VPIN firstVpin, uint32_t mask, uint32_t values) {
+  for (uint8_t bit = 0; mask; bit++, mask >>= 1, values >>= 1)
+    if (mask & 1) write(firstVpin + bit, values & 1);
+}
 void IODevice::writeAnalogue(VPIN, int, uint8_t, uint16_t) {}
 bool IODevice::isBusy(VPIN) { return false; }
 bool IODevice::hasCallback(VPIN) { return false; }
@@ -329,10 +493,7 @@ int IODevice::read(VPIN vpin) {
 }
 int IODevice::readAnalogue(VPIN vpin) {
   pinMode(vpin, INPUT);
-  noInterrupts();
-  int value = analogRead(vpin);
-  interrupts();
-  return value;
+  return ADCee::readPin(vpin);
 }
 void IODevice::loop() {}
 void IODevice::DumpAll() {
@@ -340,6 +501,9 @@ void IODevice::DumpAll() {
 }
 bool IODevice::exists(VPIN vpin) { return (vpin > 2 && vpin < NUM_DIGITAL_PINS); }
 void IODevice::setGPIOInterruptPin(int16_t) {}
+void IODevice::updateLoopQueue(int) {}
+int VpinHandle::read() { return IODevice::read(_vpin); }
+void VpinHandle::write(int value) { IODevice::write(_vpin, value); }
 
 // Chain of callback blocks (identifying registered callback functions for state changes)
 // Not used in IO_NO_HAL but must be declared.
@@ -354,6 +518,7 @@ IONotifyCallback *IONotifyCallback::first = 0;
 ArduinoPins::ArduinoPins(VPIN firstVpin, int nPins) {
   _firstVpin = firstVpin;
   _nPins = nPins;
+  _nativePins = true;
   int arrayLen = (_nPins+7)/8;
   _pinPullups = (uint8_t *)calloc(3, arrayLen);
   _pinModes = (&_pinPullups[0]) + arrayLen;
@@ -447,18 +612,16 @@ int ArduinoPins::_readAnalogue(VPIN vpin) {
       pinMode(pin, INPUT);
   }
 
-  // Since AnalogRead is also called from interrupt code, disable interrupts 
-  // while we're using it.  There's only one ADC shared by all analogue inputs 
-  // on the Arduino, so we don't want interruptions.
+  // The ADC is also used from interrupt code to sample track current, so
+  // the read goes through ADCee which makes sure the two don't overlap.
+  // There's only one ADC shared by all analogue inputs on the Arduino.
   //******************************************************************************
   // NOTE: If the HAL is running on a computer without the DCC signal generator,
   // then interrupts needn't be disabled.  Also, the DCC signal generator puts
   // the ADC into fast mode, so if it isn't present, analogueRead calls will be much
   // slower!!
   //******************************************************************************
-  noInterrupts();
-  int value = analogRead(pin);
-  interrupts();
+  int value = ADCee::readPin(pin);
 
   #ifdef DIAG_IO
   DIAG(F("Arduino Read Pin:%d Value:%d"), pin, value);
@@ -474,7 +637,7 @@ void ArduinoPins::_display() {
 
 
 void ArduinoPins::fastWriteDigital(uint8_t pin, uint8_t value) {
-#if defined(USE_FAST_IO)
+#if defined(USE_FAST_IO) && !defined(ARDUINO_ARCH_ESP32)
   if (pin >= NUM_DIGITAL_PINS) return;
   uint8_t mask = digitalPinToBitMask(pin);
   uint8_t port = digitalPinToPort(pin);
@@ -491,7 +654,7 @@ void ArduinoPins::fastWriteDigital(uint8_t pin, uint8_t value) {
 }
 
 bool ArduinoPins::fastReadDigital(uint8_t pin) {
-#if defined(USE_FAST_IO)
+#if defined(USE_FAST_IO) && !defined(ARDUINO_ARCH_ESP32)
   if (pin >= NUM_DIGITAL_PINS) return false;
   uint8_t mask = digitalPinToBitMask(pin);
   uint8_t port = digitalPinToPort(pin);
@@ -23,15 +23,22 @@
 // Define symbol DIAG_IO to enable diagnostic output
 //#define DIAG_IO Y
 
-// Define symbol DIAG_LOOPTIMES to enable CS loop execution time to be reported
-//#define DIAG_LOOPTIMES
-
 // Define symbol IO_NO_HAL to reduce FLASH footprint when HAL features not required
 // The HAL is disabled by default on Nano and Uno platforms, because of limited flash space.
 #if defined(ARDUINO_AVR_NANO) || defined(ARDUINO_AVR_UNO) 
 #define IO_NO_HAL
 #endif
 
+// Most PCA9685 pins written in one transfer, 4 bytes of buffer each.  The Wire 
+// library on AVR has a 32 byte buffer, so all 16 only with the native driver.
+#ifndef PCA9685_MAX_BURST
+#if (defined(ARDUINO_ARCH_AVR) || defined(ARDUINO_ARCH_MEGAAVR)) && !defined(I2C_USE_WIRE)
+#define PCA9685_MAX_BURST 16
+#else
+#define PCA9685_MAX_BURST 7
+#endif
+#endif
+
 // Define symbol IO_SWITCH_OFF_SERVO to set the PCA9685 output to 0 when an 
 // animation has completed.  This switches off the servo motor, preventing 
 // the continuous buzz sometimes found on servos, and reducing the 
@@ -39,6 +46,12 @@
 // It is recommended to enable this, unless it causes you problems.
 #define IO_SWITCH_OFF_SERVO
 
+// Time in microseconds that IODevice::loop may spend servicing devices which are due,
+// before leaving the rest to the next call.  At least one device is serviced per call.
+#ifndef IO_LOOP_BUDGET
+#define IO_LOOP_BUDGET 500
+#endif
+
 #include "DIAG.h"
 #include "FSH.h"
 #include "I2CManager.h"
@@ -58,22 +71,48 @@ typedef uint16_t VPIN;
 class IONotifyCallback {
 public: 
   typedef void IONotifyCallbackFunction(VPIN vpin, int value);
+  // Batch form, called once for up to 32 pins starting at firstVpin.  Bit n of changedMask
+  // is set if firstVpin+n has changed, and bit n of values is its new value.
+  typedef void IONotifyBatchFunction(VPIN firstVpin, uint32_t changedMask, uint32_t values);
   static void add(IONotifyCallbackFunction *function) {
-    IONotifyCallback *blk = new IONotifyCallback(function);
+    IONotifyCallback *blk = new IONotifyCallback();
+    blk->invoke = function;
+    if (first) blk->next = first;
+    first = blk;
+  }
+  static void add(IONotifyBatchFunction *function) {
+    IONotifyCallback *blk = new IONotifyCallback();
+    blk->invokeBatch = function;
     if (first) blk->next = first;
     first = blk;
   }
   static void invokeAll(VPIN vpin, int value) {
-    for (IONotifyCallback *blk = first; blk != NULL; blk = blk->next)
-      blk->invoke(vpin, value);
+    for (IONotifyCallback *blk = first; blk != NULL; blk = blk->next) {
+      if (blk->invoke) 
+        blk->invoke(vpin, value);
+      else
+        blk->invokeBatch(vpin, 1, value ? 1 : 0);
+    }
+  }
+  static void invokeAll(VPIN firstVpin, uint32_t changedMask, uint32_t values) {
+    for (IONotifyCallback *blk = first; blk != NULL; blk = blk->next) {
+      if (blk->invokeBatch) {
+        blk->invokeBatch(firstVpin, changedMask, values);
+        continue;
+      }
+      uint32_t mask = 1;
+      for (VPIN vpin = firstVpin; mask <= changedMask && mask != 0; vpin++, mask <<= 1) 
+        if (changedMask & mask) blk->invoke(vpin, (values & mask) != 0);
+    }
   }
   static bool hasCallback() {
     return first != NULL;
   }
 private:
-  IONotifyCallback(IONotifyCallbackFunction *function) { invoke = function; };
+  IONotifyCallback() {};
   IONotifyCallback *next = 0;
   IONotifyCallbackFunction *invoke = 0;
+  IONotifyBatchFunction *invokeBatch = 0;
   static IONotifyCallback *first;
 };
 
@@ -85,6 +124,8 @@ private:
  * 
  */
 
+class ArduinoPins;
+
 class IODevice {
 public:
 
@@ -128,6 +169,11 @@ public:
   // write invokes the IODevice instance's _write method.
   static void write(VPIN vpin, int value);
 
+  // writeMultiple sets the digital outputs firstVpin+n, for each bit n set in mask, to bit n
+  // of values.  Pins on the same device are passed to its _writeMultiple method together, so a
+  // GPIO extender can update a whole port in a single transfer.
+  static void writeMultiple(VPIN firstVpin, uint32_t mask, uint32_t values);
+
   // write invokes the IODevice instance's _writeAnalogue method (not applicable for digital outputs)
   static void writeAnalogue(VPIN vpin, int value, uint8_t profile=0, uint16_t duration=0);
 
@@ -184,6 +230,13 @@ protected:
     (void)vpin; (void)value;
   };
 
+  // Method to write several pins at once, as described for writeMultiple.  The default just
+  // calls _write for each pin.
+  virtual void _writeMultiple(VPIN firstVpin, uint32_t mask, uint32_t values) {
+    for (uint8_t bit = 0; mask; bit++, mask >>= 1, values >>= 1)
+      if (mask & 1) _write(firstVpin + bit, values & 1);
+  };
+
   // Method to write an 'analogue' value (optionally implemented within device class)
   virtual void _writeAnalogue(VPIN vpin, int value, uint8_t param1, uint16_t param2) {
     (void)vpin; (void)value; (void) param1; (void)param2;
@@ -203,7 +256,7 @@ protected:
 
   // Method to perform updates on an ongoing basis (optionally implemented within device class)
   virtual void _loop(unsigned long currentMicros) {
-    delayUntil(currentMicros + 0x7fffffff); // Largest time in the future!  Effectively disable _loop calls.
+    delayUntil(currentMicros + 0x3fffffff); // About 18 minutes!  Effectively disable _loop calls.
   };
 
   // Method for displaying info on DIAG output (optionally implemented within device class)
@@ -215,6 +268,7 @@ protected:
   // Non-virtual function
   void delayUntil(unsigned long futureMicrosCount) {
     _nextEntryTime = futureMicrosCount;
+    if (_loopQueuePos >= 0) updateLoopQueue(_loopQueuePos);
   }
   
   // Common object fields.
@@ -234,7 +288,11 @@ protected:
   // Current state of device
   DeviceStateEnum _deviceState = DEVSTATE_DORMANT;
 
+  // Set by devices whose pins VpinHandle may access directly (Arduino pins).
+  bool _nativePins = false;
+
 private:
+  friend class VpinHandle;
   // Method to check whether the vpin corresponds to this device
   bool owns(VPIN vpin);
   // Method to find device handling Vpin
@@ -242,10 +300,65 @@ private:
 
   IODevice *_nextDevice = 0;
   unsigned long _nextEntryTime;
+  int _loopQueuePos = -1;  // Position in _loopQueue, -1 if not queued
   static IODevice *_firstDevice;
+  static IODevice *_lastDevice;
+
+  // Index of devices sorted by first VPIN, for a binary search in findDevice.
+  // NULL before IODevice::begin() or when device VPIN ranges overlap.
+  static void buildDeviceIndex();
+  static IODevice **_deviceIndex;
+  static int _deviceIndexSize;
+  static IODevice *_lastFoundDevice;  // findDevice tries this one first
+
+  // The Arduino pins device made by begin().  Its pins are known when the code is built, 
+  // so read() and write() call it directly, without findDevice or a virtual call.
+  // NULL if another device was created first, which would own any pins they share.
+  static ArduinoPins *_arduinoPins;
+  static inline bool isArduinoPin(VPIN vpin) {
+    return vpin >= 2 && vpin < NUM_DIGITAL_PINS && _arduinoPins;
+  }
+
+  // Min-heap of devices ordered by _nextEntryTime, so that loop() finds the
+  // most overdue device first.  Times are compared as signed differences, so
+  // all entry times must be within 2^31 microseconds (35 minutes) of each other.
+  static void addToLoopQueue(IODevice *dev);
+  static void updateLoopQueue(int pos);
+  static IODevice **_loopQueue;
+  static int _loopQueueSize;
+  static int _loopQueueCapacity;
 
-  static IODevice *_nextLoopDevice;
   static bool _initPhase;
+  // Incremented whenever a device is added, so that VpinHandles which didn't
+  // find a device can try again.  Never zero.
+  static uint8_t _deviceGeneration;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+/*
+ *  VpinHandle caches the device owning a VPIN, for objects like sensors and outputs
+ *  that access the same pin repeatedly.  The device is looked up on first use; 
+ *  Arduino pins that are already in the right mode are then read and written directly.
+ */
+
+class VpinHandle {
+public:
+  VpinHandle(VPIN vpin=VPIN_NONE) { setVpin(vpin); }
+  void setVpin(VPIN vpin) {
+    _vpin = vpin;
+    _device = 0;
+    _generation = 0;
+  }
+  VPIN getVpin() { return _vpin; }
+  // Equivalent to IODevice::read(vpin) and IODevice::write(vpin, value).
+  int read();
+  void write(int value);
+
+private:
+  bool resolve();
+  IODevice *_device;
+  VPIN _vpin;
+  uint8_t _generation;  // IODevice::_deviceGeneration when last resolved, 0 if never
 };
 
 
@@ -278,8 +391,10 @@ private:
   void _writeAnalogue(VPIN vpin, int value, uint8_t profile, uint16_t duration) override;
   int _read(VPIN vpin) override; // returns the digital state or busy status of the device
   void _loop(unsigned long currentMicros) override;
-  void updatePosition(uint8_t pin);
+  void updatePosition(uint8_t pin, uint8_t steps);
   void writeDevice(uint8_t pin, int value);
+  void flushPending();
+  static void writeCompleted(I2CRB *rb, void *context);
   void _display() override;
 
   uint8_t _I2CAddress; // 0x40-0x43 possible
@@ -303,10 +418,17 @@ private:
   static const byte FLASH _bounceProfile[30];
 
   const unsigned int refreshInterval = 50; // refresh every 50ms
+  unsigned long _lastRefresh = 0;  // micros, advanced by whole refresh intervals
 
-  // structures for setting up non-blocking writes to servo controller
+  // structures for setting up non-blocking writes to servo controller.  
+  // Adjacent pins are written in one auto-increment transfer of up to 
+  // PCA9685_MAX_BURST pins.
   I2CRB requestBlock;
-  uint8_t outputBuffer[5];
+  uint8_t outputBuffer[1+4*PCA9685_MAX_BURST];
+  // Pins waiting to be written, and which of them are to be switched off 
+  // rather than set to their current position.
+  uint16_t _pendingPins = 0;
+  uint16_t _pendingOff = 0;
 };
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -324,6 +446,7 @@ private:
   // Device-specific write function.
   void _begin() override;
   void _write(VPIN vpin, int value) override;
+  void _writeAnalogue(VPIN vpin, int value, uint8_t param1, uint16_t param2) override;
   void _display() override;
   int _packedAddress;
 };
@@ -347,6 +470,20 @@ public:
   static bool fastReadDigital(uint8_t pin);
 
 private:
+  friend class VpinHandle;
+  friend class IODevice;
+  // True if the pin is configured as an input, or as an output, respectively.
+  inline bool inputReady(VPIN vpin) {
+    uint8_t mask = 1 << ((vpin-_firstVpin) % 8);
+    uint8_t index = (vpin-_firstVpin) / 8;
+    return !((_pinModes[index] | ~_pinInUse[index]) & mask);
+  }
+  inline bool outputReady(VPIN vpin) {
+    uint8_t mask = 1 << ((vpin-_firstVpin) % 8);
+    uint8_t index = (vpin-_firstVpin) / 8;
+    return _pinModes[index] & mask;
+  }
+
   // Device-specific pin configuration
   bool _configure(VPIN vpin, ConfigTypeEnum configType, int paramCount, int params[]) override;
   // Device-specific write function.
@@ -35,15 +35,17 @@
  * ADS1113 and ADS1114 are restricted to 1 input.  ADS1115 has a multiplexer which allows 
  * any of four input pins to be read by its ADC.
  * 
- * The driver polls the device in accordance with the constant 'scanInterval' below.  On first loop
- * entry, the multiplexer is set to pin A0 and the ADC is triggered.  On second and subsequent
- * entries, the analogue value is read from the conversion register and then the multiplexer and
- * ADC are set up to read the next pin.
+ * With more than one input, the driver works through the inputs in turn.  For each one, the
+ * multiplexer is set to the pin and a single-shot conversion triggered, and the result is read
+ * from the conversion register once the conversion is complete.
+ * 
+ * With one input, the ADC is set to convert continuously, so each sample is a single read of
+ * the conversion register.
  * 
  * The ADS111x is set up as follows:
- *    Single-shot scan
- *    Data rate 128 samples/sec (7.8ms/sample, but scanned every 10ms)
- *    Comparator off
+ *    Single-shot scan (more than one input) or continuous conversion (one input)
+ *    Data rate 250 samples/sec (4ms/sample, but scanned every 10ms)
+ *    Comparator off, unless thresholds are given
  *    Gain FSR=6.144V
  * The gain means that the maximum input voltage of 5V (when Vss=5V) gives a reading 
  * of 32767*(5.0/6.144) = 26666.
@@ -54,28 +56,70 @@
  *   ADS111x::create(300, 1, 0x48);  // single-input ADS1113
  *   ADS111x::create(300, 4, 0x48);  // four-input ADS1115
  * 
- * Note: The device is simple and does not need initial configuration, so it should recover from
- * temporary loss of communications or power.
+ * The module's ALERT/RDY terminal may be connected to a digital input, and its VPIN given after
+ * the address.  With more than one input, the pin signals the end of each conversion, so it is
+ * read as soon as it is ready instead of after a fixed wait.
+ *   ADS111x::create(300, 4, 0x48, 2);  // ALERT/RDY on Arduino pin 2
+ * 
+ * With one input, low and high thresholds (in ADC units) may also be given, to use the
+ * ADS111x's comparator.  A digital read of the vpin then returns 1 once the input goes above the
+ * high threshold, and 0 once it falls below the low threshold, e.g. for block occupancy 
+ * detection by current sensing.  The comparator drives ALERT/RDY, so when that is connected
+ * the digital state is read from the pin and the analogue value is only sampled every 100ms;
+ * without it, the driver compares each sample with the thresholds.
+ *   ADS111x::create(300, 1, 0x48, 2, 600, 800);
+ *   Sensor::create(300, 300, 0);  // Report occupancy through <Q 300>/<q 300>
+ * 
+ * Note: The device is simple and its configuration is rewritten on every single-shot scan, so 
+ * it should recover from temporary loss of communications or power.  Continuous conversion and
+ * thresholds are configured once, when the device is started.
  **********************************************************************************************/
 class ADS111x: public IODevice { 
 public:
-  ADS111x(VPIN firstVpin, int nPins, uint8_t i2cAddress) {
+  ADS111x(VPIN firstVpin, int nPins, uint8_t i2cAddress, VPIN alertPin=VPIN_NONE, 
+      int16_t lowThreshold=0, int16_t highThreshold=0) {
     _firstVpin = firstVpin;
     _nPins = min(nPins,4);
     _i2cAddress = i2cAddress;
+    _alertPin = alertPin;
+    _lowThreshold = lowThreshold;
+    _highThreshold = highThreshold;
     _currentPin = 0;
+    _comparatorState = false;
+    _i2crb.priority = I2C_PRIORITY_INPUT;
     for (int8_t i=0; i<_nPins; i++)
       _value[i] = -1;
     addDevice(this);
   }
-  static void create(VPIN firstVpin, int nPins, uint8_t i2cAddress) {
-    new ADS111x(firstVpin, nPins, i2cAddress);
+  static void create(VPIN firstVpin, int nPins, uint8_t i2cAddress, VPIN alertPin=VPIN_NONE,
+      int16_t lowThreshold=0, int16_t highThreshold=0) {
+    new ADS111x(firstVpin, nPins, i2cAddress, alertPin, lowThreshold, highThreshold);
   }
 private:
   void _begin() {
     // Initialise ADS device
     if (I2CManager.exists(_i2cAddress)) {
-      _nextState = STATE_STARTSCAN;
+      if (_nPins == 1) {
+        // Set the thresholds, then start continuous conversion.  The register 
+        // pointer is left on the conversion register, so it needn't be sent again.
+        if (comparatorEnabled()) {
+          writeRegister(REG_LOTHRESH, _lowThreshold);
+          writeRegister(REG_HITHRESH, _highThreshold);
+        }
+        writeRegister(REG_CONFIG, ((uint16_t)(CONFIG_AIN0) << 8)
+          | (comparatorEnabled() ? CONFIG_COMPARATOR : CONFIG_COMPARATOR_OFF));
+        _outBuffer[0] = REG_CONVERSION;
+        I2CManager.write(_i2cAddress, _outBuffer, 1);
+        _nextState = STATE_READCONTINUOUS;
+      } else {
+        // In single-shot mode, the comparator can signal the end of each conversion
+        // on the ALERT/RDY pin.
+        if (_alertPin != VPIN_NONE) {
+          writeRegister(REG_LOTHRESH, 0x0000);
+          writeRegister(REG_HITHRESH, 0x8000);
+        }
+        _nextState = STATE_STARTSCAN;
+      }
 #ifdef DIAG_IO
       _display();
 #endif
@@ -94,19 +138,24 @@ private:
         case STATE_STARTSCAN:
           // Configure ADC and multiplexer for next scan.  See ADS111x datasheet for details
           // of configuration register settings.
-          _outBuffer[0] = 0x01; // Config register address
-          _outBuffer[1] = 0xC0 + (_currentPin << 4); // Trigger single-shot, channel n
-          _outBuffer[2] = 0xA3;           // 250 samples/sec, comparator off
+          _outBuffer[0] = REG_CONFIG;
+          _outBuffer[1] = CONFIG_AIN0 + (_currentPin << 4) + CONFIG_SINGLESHOT; // Trigger single-shot, channel n
+          _outBuffer[2] = (_alertPin != VPIN_NONE) ? CONFIG_COMPARATOR : CONFIG_COMPARATOR_OFF;
           // Write command, without waiting for completion.
           I2CManager.write(_i2cAddress, _outBuffer, 3, &_i2crb);
 
-          delayUntil(currentMicros + scanInterval);
+          if (_alertPin != VPIN_NONE)
+            delayUntil(currentMicros + conversionTime);  // Check for completion after this
+          else
+            delayUntil(currentMicros + scanInterval);
           _nextState = STATE_STARTREAD;
           break;
 
         case STATE_STARTREAD:
+          // ALERT/RDY goes low when the conversion is complete
+          if (_alertPin != VPIN_NONE && IODevice::read(_alertPin)) return;
           // Reading the pin value
-          _outBuffer[0] = 0x00;  // Conversion register address
+          _outBuffer[0] = REG_CONVERSION;
           I2CManager.read(_i2cAddress, _inBuffer, 2, _outBuffer, 1, &_i2crb); // Read register
           _nextState = STATE_GETVALUE;
           break;
@@ -117,10 +166,28 @@ private:
           DIAG(F("ADS111x pin:%d value:%d"), _currentPin, _value[_currentPin]);
           #endif
 
+          if (_nPins == 1) {
+            // Continuous conversion, so just wait for the next sample.
+            if (comparatorEnabled() && _alertPin == VPIN_NONE) {
+              int16_t value = (int16_t)_value[0];
+              if (value > _highThreshold) _comparatorState = true;
+              else if (value < _lowThreshold) _comparatorState = false;
+            }
+            delayUntil(currentMicros + 
+              ((comparatorEnabled() && _alertPin != VPIN_NONE) ? comparatorScanInterval : scanInterval));
+            _nextState = STATE_READCONTINUOUS;
+            break;
+          }
           // Move to next pin
           if (++_currentPin >= _nPins) _currentPin = 0;
           _nextState = STATE_STARTSCAN;
           break;
+
+        case STATE_READCONTINUOUS:
+          // Register pointer is already on the conversion register
+          I2CManager.read(_i2cAddress, _inBuffer, 2, NULL, 0, &_i2crb);
+          _nextState = STATE_GETVALUE;
+          break;
         
         default:
           break;
@@ -135,12 +202,30 @@ private:
     int pin = vpin - _firstVpin;
     return _value[pin];
   }
+
+  // Digital read returns the comparator state, where thresholds have been given.
+  int _read(VPIN vpin) override {
+    if (vpin != _firstVpin || !comparatorEnabled()) return 0;
+    if (_alertPin != VPIN_NONE) 
+      return !IODevice::read(_alertPin);  // ALERT/RDY is active low
+    return _comparatorState;
+  }
   
   void _display() override {
     DIAG(F("ADS111x I2C:x%x Configured on Vpins:%d-%d %S"), _i2cAddress, _firstVpin, _firstVpin+_nPins-1,
       _deviceState == DEVSTATE_FAILED ? F("OFFLINE") : F(""));
   }
 
+  bool comparatorEnabled() { return _nPins == 1 && _highThreshold > _lowThreshold; }
+
+  // Blocking write of a 16-bit register, for configuration.
+  void writeRegister(uint8_t reg, uint16_t value) {
+    _outBuffer[0] = reg;
+    _outBuffer[1] = value >> 8;
+    _outBuffer[2] = value & 0xff;
+    I2CManager.write(_i2cAddress, _outBuffer, 3);
+  }
+
   // ADC conversion rate is 250SPS, or 4ms per conversion.  Set the period between updates to 10ms. 
   // This is enough to allow the conversion to reliably complete in time.
   #ifndef IO_ANALOGUE_SLOW
@@ -148,13 +233,38 @@ private:
   #else
   const unsigned long scanInterval = 1000000UL;  // Period between successive ADC scans in microseconds.
   #endif
+  // Shortest conversion time, after which ALERT/RDY is checked for completion.
+  const unsigned long conversionTime = 4000UL;
+  // Period between analogue samples when the comparator state comes from ALERT/RDY.
+  const unsigned long comparatorScanInterval = 100000UL;
   enum : uint8_t {
     STATE_STARTSCAN,
     STATE_STARTREAD, 
     STATE_GETVALUE,
+    STATE_READCONTINUOUS,
+  };
+  // Registers
+  enum : uint8_t {
+    REG_CONVERSION = 0x00,
+    REG_CONFIG = 0x01,
+    REG_LOTHRESH = 0x02,
+    REG_HITHRESH = 0x03,
+  };
+  // Configuration register values.  High byte: start conversion, channel 0 single-ended, 
+  // FSR=6.144V, and single-shot mode bit.  Low byte: 250 samples/sec, traditional comparator,
+  // active low, non-latching, asserted after one conversion; or comparator off.
+  enum : uint8_t {
+    CONFIG_AIN0 = 0xC0,
+    CONFIG_SINGLESHOT = 0x01,
+    CONFIG_COMPARATOR = 0xA0,
+    CONFIG_COMPARATOR_OFF = 0xA3,
   };
   uint16_t _value[4];
   uint8_t _i2cAddress;
+  VPIN _alertPin;
+  int16_t _lowThreshold;
+  int16_t _highThreshold;
+  bool _comparatorState;
   uint8_t _outBuffer[3];
   uint8_t _inBuffer[2];
   uint8_t _currentPin;  // ADC pin currently being scanned
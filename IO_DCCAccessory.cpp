@@ -60,6 +60,16 @@ void DCCAccessoryDecoder::_write(VPIN id, int state) {
   DCC::setAccessory(ADDRESS(packedAddress), SUBADDRESS(packedAddress), state);
 }
 
+// Analogue write sets the aspect of an extended accessory decoder, e.g. a signal head.
+void DCCAccessoryDecoder::_writeAnalogue(VPIN id, int value, uint8_t param1, uint16_t param2) {
+  (void)param1; (void)param2;  // Not used
+  int packedAddress = _packedAddress + id - _firstVpin;
+#ifdef DIAG_IO
+  DIAG(F("DCC Write Linear Address:%d Aspect:%d"), packedAddress, value);
+#endif
+  DCC::setExtendedAccessory(ADDRESS(packedAddress), SUBADDRESS(packedAddress), value);
+}
+
 void DCCAccessoryDecoder::_display() {
   int endAddress = _packedAddress + _nPins - 1;
   DIAG(F("DCCAccessoryDecoder Configured on Vpins:%d-%d Addresses %d/%d-%d/%d)"), _firstVpin, _firstVpin+_nPins-1,
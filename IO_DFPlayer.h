@@ -51,6 +51,12 @@
  *   SERVO(3500,23,30)  -- plays file 23 at volume 30 (maximum)
  *   SERVO(3501,20,0)   -- Sets the volume to 20
  * 
+ * Each DFPlayer has its own serial port, vpins and command queue, so several can be
+ * created (e.g. one for station announcements and one for ambient sound) and none
+ * holds up or loses the commands of another.  Commands are sent one at a time, each
+ * after the player has acknowledged the last.  A play or stop which is still queued
+ * is replaced by a newer play or stop, and likewise a volume setting.
+ * 
  * NB The DFPlayer's serial lines are not 5V safe, so connecting the Arduino TX directly 
  * to the DFPlayer's RX terminal will cause lots of noise over the speaker, or worse.
  * A 1k resistor in series with the module's RX terminal will alleviate this.
@@ -61,12 +67,39 @@
 
 #include "IODevice.h"
 
+#ifndef DFPLAYER_QUEUE_SIZE
+#define DFPLAYER_QUEUE_SIZE 4  // commands waiting to be sent to each player
+#endif
+#ifndef DFPLAYER_ACK_TIMEOUT
+#define DFPLAYER_ACK_TIMEOUT 200000UL  // microseconds to wait for an acknowledgement
+#endif
+
 class DFPlayer : public IODevice {
 private: 
+  // Command codes
+  enum : uint8_t {
+    DF_PLAY = 0x03,
+    DF_VOLUME = 0x06,
+    DF_STOP = 0x16,
+    DF_FINISHED = 0x3D,  // TF card track finished
+    DF_ERROR = 0x40,
+    DF_ACK = 0x41,
+    DF_QUERY = 0x42,
+  };
+  struct Command {
+    uint8_t command;
+    uint16_t arg;
+  };
+
   HardwareSerial *_serial;
   bool _playing = false;
   uint8_t _inputIndex = 0;
+  uint8_t _inputBuffer[10];
   unsigned long _commandSendTime; // Allows timeout processing
+  bool _awaitingReply = false;
+  uint8_t _sentCommand = 0;
+  Command _queue[DFPLAYER_QUEUE_SIZE];
+  uint8_t _queueCount = 0;
 
 public:
   // Constructor
@@ -87,46 +120,32 @@ protected:
     _deviceState = DEVSTATE_INITIALISING;
 
     // Send a query to the device to see if it responds
-    sendPacket(0x42); 
+    sendPacket(DF_QUERY); 
     _commandSendTime = micros();
+    _awaitingReply = true;
   }
 
   void _loop(unsigned long currentMicros) override {
-    // Check for incoming data on _serial, and update busy flag accordingly.
-    // Expected message is in the form "7F FF 06 3D xx xx xx xx xx EF"
-    while (_serial->available()) {
-      int c = _serial->read();
-      if (c == 0x7E) 
-        _inputIndex = 1;
-      else if ((c==0xFF && _inputIndex==1)
-            || (c==0x3D && _inputIndex==3) 
-            || (_inputIndex >=4 && _inputIndex <= 8))
-        _inputIndex++;
-      else if (c==0x06 && _inputIndex==2) { 
-        // Valid message prefix, so consider the device online
-        if (_deviceState==DEVSTATE_INITIALISING) {
-          _deviceState = DEVSTATE_NORMAL;
-          #ifdef DIAG_IO
-          _display();
-          #endif
-        }
-        _inputIndex++;
-      } else if (c==0xEF && _inputIndex==9) {
-        // End of play
-        if (_playing) {
-          #ifdef DIAG_IO
-          DIAG(F("DFPlayer: Finished"));
-          #endif
-          _playing = false;
-        }
-        _inputIndex = 0;
-      } else 
-        _inputIndex = 0;  // Unrecognised character sequence, start again!
+    readReplies();
+    // Check if the initial prompt to device has timed out (allow 1 second), or
+    // the last command hasn't been acknowledged.
+    if (_awaitingReply && currentMicros - _commandSendTime >
+        (_deviceState == DEVSTATE_INITIALISING ? 1000000UL : DFPLAYER_ACK_TIMEOUT)) {
+      if (_deviceState == DEVSTATE_INITIALISING) {
+        DIAG(F("DFPlayer device not responding on serial port"));
+        _deviceState = DEVSTATE_FAILED;
+        _queueCount = 0;
+      }
+      _awaitingReply = false;
     }
-    // Check if the initial prompt to device has timed out.  Allow 1 second
-    if (_deviceState == DEVSTATE_INITIALISING && currentMicros - _commandSendTime > 1000000UL) {
-      DIAG(F("DFPlayer device not responding on serial port"));
-      _deviceState = DEVSTATE_FAILED;
+    // Send the next command once the player is ready for it
+    if (!_awaitingReply && _queueCount > 0 && _deviceState == DEVSTATE_NORMAL) {
+      sendPacket(_queue[0].command, _queue[0].arg, true);
+      _sentCommand = _queue[0].command;
+      _queueCount--;
+      for (uint8_t i=0; i<_queueCount; i++) _queue[i] = _queue[i+1];
+      _awaitingReply = true;
+      _commandSendTime = currentMicros;
     }
     delayUntil(currentMicros + 10000); // Only enter every 10ms
   }
@@ -140,14 +159,14 @@ protected:
       #ifdef DIAG_IO
       DIAG(F("DFPlayer: Play %d"), pin+1);
       #endif
-      sendPacket(0x03, pin+1);
+      queueCommand(DF_PLAY, pin+1);
       _playing = true;
     } else {
       // Value 0, stop playing
       #ifdef DIAG_IO
       DIAG(F("DFPlayer: Stop"));
       #endif
-      sendPacket(0x16);
+      queueCommand(DF_STOP);
       _playing = false;
     }
   }
@@ -168,19 +187,19 @@ protected:
         #ifdef DIAG_IO
         DIAG(F("DFPlayer: Play %d"), value);
         #endif
-        sendPacket(0x03, value); // Play track
+        queueCommand(DF_PLAY, value); // Play track
         _playing = true;
         if (volume > 0) {
           #ifdef DIAG_IO
           DIAG(F("DFPlayer: Volume %d"), volume);
           #endif
-          sendPacket(0x06, volume);  // Set volume
+          queueCommand(DF_VOLUME, volume);  // Set volume
         }
       } else {
         #ifdef DIAG_IO
         DIAG(F("DFPlayer: Stop"));
         #endif
-        sendPacket(0x16); // Stop play
+        queueCommand(DF_STOP); // Stop play
         _playing = false;
       }
     } else if (pin == 1) {
@@ -190,7 +209,7 @@ protected:
       #ifdef DIAG_IO
       DIAG(F("DFPlayer: Volume %d"), value);
       #endif
-      sendPacket(0x06, value);      
+      queueCommand(DF_VOLUME, value);      
     }
   }
 
@@ -210,18 +229,90 @@ private:
   // 1	->	FF is version
   // 2	->	06 is length
   // 3	->	0F is command
-  // 4	->	00 is no receive
+  // 4	->	00 is no receive (01 to acknowledge)
   // 5~6	->	01 01 is argument
   // 7~8	->	checksum = 0 - ( FF+06+0F+00+01+01 )
   // 9	->	EF is end code
 
-  void sendPacket(uint8_t command, uint16_t arg = 0)
+  // Queue a command for the player, replacing any queued command it supersedes.
+  void queueCommand(uint8_t command, uint16_t arg = 0) {
+    if (_deviceState == DEVSTATE_FAILED) return;
+    for (uint8_t i=0; i<_queueCount; i++) {
+      if ((_queue[i].command == DF_VOLUME) == (command == DF_VOLUME)) {
+        _queue[i].command = command;
+        _queue[i].arg = arg;
+        return;
+      }
+    }
+    if (_queueCount == DFPLAYER_QUEUE_SIZE) {
+      DIAG(F("DFPlayer: Queue full, command %x dropped"), command);
+      return;
+    }
+    _queue[_queueCount].command = command;
+    _queue[_queueCount].arg = arg;
+    _queueCount++;
+  }
+
+  // Collect messages from the player, in the same form as those sent to it.
+  void readReplies() {
+    while (_serial->available()) {
+      int c = _serial->read();
+      if (_inputIndex == 0 && c != 0x7E) continue;  // Wait for a start code
+      _inputBuffer[_inputIndex++] = c;
+      if (_inputIndex < sizeof(_inputBuffer)) continue;
+      _inputIndex = 0;
+      if (_inputBuffer[1] != 0xFF || _inputBuffer[2] != 0x06 || _inputBuffer[9] != 0xEF)
+        continue;  // Unrecognised character sequence, start again!
+      processReply(_inputBuffer[3]);
+    }
+  }
+
+  void processReply(uint8_t command) {
+    // Valid message, so consider the device online
+    if (_deviceState == DEVSTATE_INITIALISING) {
+      _deviceState = DEVSTATE_NORMAL;
+      _awaitingReply = false;
+      #ifdef DIAG_IO
+      _display();
+      #endif
+    }
+    switch (command) {
+      case DF_ACK:
+        _awaitingReply = false;
+        break;
+      case DF_ERROR:
+        #ifdef DIAG_IO
+        DIAG(F("DFPlayer: Error %d"), _inputBuffer[6]);
+        #endif
+        _awaitingReply = false;
+        break;
+      case DF_FINISHED:
+        // End of play, unless another track is on its way
+        if (_playing && !playQueued()) {
+          #ifdef DIAG_IO
+          DIAG(F("DFPlayer: Finished"));
+          #endif
+          _playing = false;
+        }
+        break;
+    }
+  }
+
+  bool playQueued() {
+    if (_awaitingReply && _sentCommand == DF_PLAY) return true;
+    for (uint8_t i=0; i<_queueCount; i++)
+      if (_queue[i].command == DF_PLAY) return true;
+    return false;
+  }
+
+  // feedback asks the player to acknowledge the command.
+  void sendPacket(uint8_t command, uint16_t arg = 0, bool feedback = false)
   {
     uint8_t out[] = { 0x7E,
         0xFF,
         06,
         command,
-        00,
+        static_cast<uint8_t>(feedback),
         static_cast<uint8_t>(arg >> 8),
         static_cast<uint8_t>(arg & 0x00ff),
         00,
@@ -24,6 +24,13 @@
 #include "I2CManager.h"
 #include "DIAG.h"
 
+// Phase within the tick of the next GPIO expander's port reads, so that the reads 
+// of several expanders are spread evenly over the tick rather than bunched together.
+inline uint8_t nextGPIOReadPhase() { 
+  static uint8_t phase = 0; 
+  return phase++; 
+}
+
 // GPIOBase is defined as a class template.  This allows it to be instantiated by
 // subclasses with different types, according to the number of pins on the GPIO module.
 // For example, GPIOBase<uint8_t> for 8 pins, GPIOBase<uint16_t> for 16 pins etc.
@@ -41,6 +48,7 @@ protected:
   bool _configure(VPIN vpin, ConfigTypeEnum configType, int paramCount, int params[]) override;
   // Pin write function.
   void _write(VPIN vpin, int value) override;
+  void _writeMultiple(VPIN firstVpin, uint32_t mask, uint32_t values) override;
   // Pin read function.
   int _read(VPIN vpin) override;
   void _display() override;
@@ -54,8 +62,18 @@ protected:
   T _portMode;
   T _portPullup;
   T _portInUse;
+  // Two-bit vertical counters, one bit of each per pin, for debouncing the inputs.  
+  // A pin's state changes after it has read differently on four consecutive scans.
+  T _debounceCount0;
+  T _debounceCount1;
   // Interval between refreshes of each input port
   static const int _portTickTime = 4000;
+  // ... and after this many reads in a row with no change, a longer interval
+  static const int _quietTickTime = 8000;
+  static const uint8_t _quietReads = 125;
+  // Interval between checks of the interrupt pin, if there is one.  Checking the
+  // pin is cheap and the port is only read when the pin is active.
+  static const int _interruptTickTime = 1000;
 
   // Virtual functions for interfacing with I2C GPIO Device
   virtual void _writeGpioPort() = 0;
@@ -69,6 +87,14 @@ protected:
 
   I2CRB requestBlock;
   FSH *_deviceName;
+
+  unsigned long _nextRead;  // micros, kept to the phase set in _begin
+  uint8_t _unchangedReads;
+  // Time from queueing a port read to its completion, in microseconds
+  unsigned long _readStart;
+  uint16_t _readLatency;
+  uint16_t _maxReadLatency;
+  static void readCompleted(I2CRB *rb, void *context);
 };
 
 // Because class GPIOBase is a template, the implementation (below) must be contained within the same
@@ -83,6 +109,11 @@ GPIOBase<T>::GPIOBase(FSH *deviceName, VPIN firstVpin, uint8_t nPins, uint8_t I2
   _I2CAddress = I2CAddress;
   _gpioInterruptPin = interruptPin;
   _hasCallback = true;
+  requestBlock.priority = I2C_PRIORITY_INPUT;  // ahead of output and display traffic
+  requestBlock.completion = readCompleted;
+  requestBlock.context = this;
+  _unchangedReads = 0;
+  _readLatency = _maxReadLatency = 0;
   // Add device to list of devices.
   addDevice(this);
 }
@@ -103,8 +134,11 @@ void GPIOBase<T>::_begin() {
     _portPullup = -1; // default to pullup enabled
     _portInputState = -1;
     _portInUse = 0;
+    _debounceCount0 = _debounceCount1 = 0;
     _setupDevice();
     _deviceState = DEVSTATE_NORMAL;
+    _nextRead = micros() + (nextGPIOReadPhase() % 8) * (_portTickTime / 8);
+    delayUntil(_nextRead);
   } else {
     DIAG(F("%S I2C:x%x Device not detected"), _deviceName, _I2CAddress);
     _deviceState = DEVSTATE_FAILED;
@@ -156,19 +190,27 @@ void GPIOBase<T>::_loop(unsigned long currentMicros) {
     }
     _processCompletion(status);
   // Set unused pin and write mode pin value to 1
-    _portInputState |= ~_portInUse | _portMode;
+    T newPortStates = _portInputState | ~_portInUse | _portMode;
+
+    // Debounce all the pins of the port together.  The counters of pins that read
+    // the same as their current state are reset, the others count up, and a pin
+    // whose counter wraps round takes the new state.
+    T delta = newPortStates ^ lastPortStates;
+    if (delta) _unchangedReads = 0;
+    else if (_unchangedReads < 255) _unchangedReads++;
+    _debounceCount1 = (_debounceCount1 ^ _debounceCount0) & delta;
+    _debounceCount0 = ~_debounceCount0 & delta;
+    _portInputState = lastPortStates ^ (delta & ~(_debounceCount0 | _debounceCount1));
 
-    // Scan for changes in input states and invoke callback (if present)
+    // Scan for changes in input states and invoke callbacks (if present), 
+    // passing all the changed pins in one call, 32 at a time.
     T differences = lastPortStates ^ _portInputState;
     if (differences && IONotifyCallback::hasCallback()) {
-      // Scan for differences bit by bit
-      T mask = 1;
-      for (int pin=0; pin<_nPins; pin++) {
-        if (differences & mask) {
-          // Change detected.
-          IONotifyCallback::invokeAll(_firstVpin+pin, (_portInputState & mask) == 0);
-        }
-        mask <<= 1;
+      T activeStates = ~_portInputState;  // Invert state (5v=0, 0v=1)
+      for (uint8_t pin=0; pin<_nPins; pin+=32) {
+        uint32_t changed = (uint32_t)(differences >> pin);
+        if (changed) 
+          IONotifyCallback::invokeAll(_firstVpin+pin, changed, (uint32_t)(activeStates >> pin));
       }
     }
 
@@ -180,23 +222,47 @@ void GPIOBase<T>::_loop(unsigned long currentMicros) {
 
   // Check if interrupt configured.  If not, or if it is active (pulled down), then
   //  initiate a scan.
-  if (_gpioInterruptPin < 0 || !digitalRead(_gpioInterruptPin)) {
-    // TODO: Could suppress reads if there are no pins configured as inputs!
-
+  //  The device holds the interrupt pin active until the port has been read, so
+  //  a change can't be missed between checks.  While inputs are being debounced, keep
+  //  scanning since the device won't interrupt again unless they change again.
+  //  Don't read the port at all if there are no pins configured as inputs.
+  if ((_gpioInterruptPin < 0 || !digitalRead(_gpioInterruptPin) || (_debounceCount0 | _debounceCount1)) 
+      && (_portInUse & ~_portMode)) {
     // Read input
     if (_deviceState == DEVSTATE_NORMAL) {
+      _readStart = micros();
       _readGpioPort(false);  // Initiate non-blocking read
       _deviceState= DEVSTATE_SCANNING;
     }
   }
-  // Delay next entry until tick elapsed.
-  delayUntil(currentMicros + _portTickTime);
+  // Delay next entry until tick elapsed, keeping to the same phase unless 
+  // the loop has fallen behind.  Inputs that have been steady for a while are
+  // read less often.
+  unsigned long tick = (_gpioInterruptPin >= 0) ? _interruptTickTime
+                     : (_unchangedReads >= _quietReads) ? _quietTickTime : _portTickTime;
+  _nextRead += tick;
+  if ((long)(currentMicros - _nextRead) >= 0) _nextRead = currentMicros + tick;
+  delayUntil(_nextRead);
+}
+
+// Called by I2CManager when a non-blocking port read completes.
+template <class T>
+void GPIOBase<T>::readCompleted(I2CRB *rb, void *context) {
+  (void)rb;
+  GPIOBase<T> *device = (GPIOBase<T> *)context;
+  unsigned long latency = micros() - device->_readStart;
+  device->_readLatency = latency > 65535UL ? 65535U : latency;
+  if (device->_readLatency > device->_maxReadLatency) 
+    device->_maxReadLatency = device->_readLatency;
 }
 
 template <class T>
 void GPIOBase<T>::_display() {
   DIAG(F("%S I2C:x%x Configured on Vpins:%d-%d %S"), _deviceName, _I2CAddress, 
     _firstVpin, _firstVpin+_nPins-1, (_deviceState==DEVSTATE_FAILED) ? F("OFFLINE") : F(""));
+  if (_deviceState != DEVSTATE_FAILED && _maxReadLatency)
+    DIAG(F("%S I2C:x%x Read latency %uus, max %uus"), _deviceName, _I2CAddress, 
+      _readLatency, _maxReadLatency);
 }
 
 template <class T>
@@ -224,6 +290,27 @@ void GPIOBase<T>::_write(VPIN vpin, int value) {
   return _writeGpioPort();
 }
 
+// Write several output pins with one update of the port.
+template <class T>
+void GPIOBase<T>::_writeMultiple(VPIN firstVpin, uint32_t mask, uint32_t values) {
+  int pin = firstVpin - _firstVpin;
+  T pinMask = (T)(mask << pin);
+  T pinValues = (T)(values << pin);
+  #ifdef DIAG_IO
+  DIAG(F("%S I2C:x%x Write Pin:%d Mask:%l Val:%l"), _deviceName, _I2CAddress, pin, mask, values);
+  #endif
+
+  // Set port mode output for any pins not yet in output mode
+  if ((_portMode & pinMask) != pinMask) {
+    _portInUse |= pinMask;
+    _portMode |= pinMask;
+    _writePortModes();
+  }
+
+  _portOutputState = (_portOutputState & ~pinMask) | (pinValues & pinMask);
+  _writeGpioPort();
+}
+
 template <class T>
 int GPIOBase<T>::_read(VPIN vpin) {
   int pin = vpin - _firstVpin;
@@ -72,6 +72,22 @@ private:
   //  Based on a speed of sound of 345 metres/second.
   const uint16_t factor = 58; // ms/cm
 
+  // When the echo pin has an external interrupt, and one of the slots below is
+  // free, the echo pulse is timed by the interrupt, and _loop only starts a ping 
+  // and collects the result of the previous one.  Otherwise the pulse is timed
+  // by polling, as read_HCSR04device describes.
+  static const uint8_t _maxInterruptDevices = 4;
+  enum : uint8_t {
+    ECHO_IDLE,      // no ping sent
+    ECHO_WAITING,   // ping sent, waiting for echo pin to be set
+    ECHO_STARTED,   // timing the echo pulse
+    ECHO_DONE,      // _echoLength is the pulse length
+  };
+  bool _useInterrupt = false;
+  volatile uint8_t _echoState = ECHO_IDLE;
+  volatile unsigned long _echoStart;
+  volatile uint16_t _echoLength;
+
 public:
   // Constructor perfroms static initialisation of the device object
   HCSR04 (VPIN vpin, int trigPin, int echoPin, uint16_t onThreshold, uint16_t offThreshold) {
@@ -95,6 +111,19 @@ protected:
     pinMode(_trigPin, OUTPUT);
     pinMode(_echoPin, INPUT);
     ArduinoPins::fastWriteDigital(_trigPin, 0);
+    int interrupt = digitalPinToInterrupt(_echoPin);
+    if (interrupt != NOT_AN_INTERRUPT) {
+      HCSR04 **devices = interruptDevices();
+      for (uint8_t slot=0; slot<_maxInterruptDevices; slot++) {
+        if (devices[slot]) continue;
+        devices[slot] = this;
+        static void (* const handlers[_maxInterruptDevices])() = {
+          echoInterrupt<0>, echoInterrupt<1>, echoInterrupt<2>, echoInterrupt<3> };
+        attachInterrupt(interrupt, handlers[slot], CHANGE);
+        _useInterrupt = true;
+        break;
+      }
+    }
 #if defined(DIAG_IO)
     _display();
 #endif
@@ -113,17 +142,76 @@ protected:
 
   // _loop function - read HC-SR04 once every 50 milliseconds.
   void _loop(unsigned long currentMicros) override {
-    read_HCSR04device();
+    if (_useInterrupt) {
+      collectEcho();
+      sendPing();
+    } else
+      read_HCSR04device();
     // Delay next loop entry until 50ms have elapsed.
     delayUntil(currentMicros + 50000UL);
   }
 
   void _display() override {
-    DIAG(F("HCSR04 Configured on Vpin:%d TrigPin:%d EchoPin:%d On:%dcm Off:%dcm"),
-      _firstVpin, _trigPin, _echoPin, _onThreshold, _offThreshold);
+    DIAG(F("HCSR04 Configured on Vpin:%d TrigPin:%d EchoPin:%d On:%dcm Off:%dcm%S"),
+      _firstVpin, _trigPin, _echoPin, _onThreshold, _offThreshold, 
+      _useInterrupt ? F(" Interrupt") : F(""));
   }
 
 private:
+  // Interrupt mode.  The 50ms between pings is longer than any echo within 
+  // the off threshold (255cm is under 15ms), so the result of a ping is 
+  // complete by the next _loop call.
+  void sendPing() {
+    // If receive pin is still set on from previous ping, don't send another.
+    if (ArduinoPins::fastReadDigital(_echoPin)) return;
+    _echoState = ECHO_WAITING;
+    // Send 10us pulse to trigger transmitter
+    ArduinoPins::fastWriteDigital(_trigPin, 1);
+    delayMicroseconds(10);
+    ArduinoPins::fastWriteDigital(_trigPin, 0);
+  }
+
+  void collectEcho() {
+    noInterrupts();
+    uint8_t state = _echoState;
+    uint16_t length = _echoLength;
+    _echoState = ECHO_IDLE;
+    interrupts();
+    // No pulse at all, as with polling, leaves the state alone.
+    if (state == ECHO_IDLE || state == ECHO_WAITING) return;
+    if (state == ECHO_STARTED || length > factor * _offThreshold) {
+      // Pulse longer than maxTime, reset value.
+      _value = 0;
+      _distance = 32767;
+      return;
+    }
+    _distance = length / factor; // in centimetres
+    if (_distance < _onThreshold) 
+      _value = 1;
+  }
+
+  // Echo pin interrupt, timestamps both edges of the pulse
+  void echoChange() {
+    if (ArduinoPins::fastReadDigital(_echoPin)) {
+      if (_echoState == ECHO_WAITING) {
+        _echoStart = micros();
+        _echoState = ECHO_STARTED;
+      }
+    } else if (_echoState == ECHO_STARTED) {
+      unsigned long length = micros() - _echoStart;
+      _echoLength = length > 65535UL ? 65535U : length;
+      _echoState = ECHO_DONE;
+    }
+  }
+
+  static HCSR04 **interruptDevices() {
+    static HCSR04 *devices[_maxInterruptDevices];
+    return devices;
+  }
+  template <uint8_t slot> static void echoInterrupt() {
+    interruptDevices()[slot]->echoChange();
+  }
+
   // This polls the HC-SR04 device by sending a pulse and measuring the duration of
   //  the pulse observed on the receive pin.  In order to be kind to the rest of the CS
   //  software, no interrupts are used and interrupts are not disabled.  The pulse duration
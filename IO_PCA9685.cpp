@@ -86,6 +86,8 @@ PCA9685::PCA9685(VPIN firstVpin, int nPins, uint8_t I2CAddress) {
 
   // Initialise structure used for setting pulse rate
   requestBlock.setWriteParams(_I2CAddress, outputBuffer, sizeof(outputBuffer));
+  requestBlock.completion = writeCompleted;
+  requestBlock.context = this;
 }
 
 // Device-specific initialisation
@@ -187,15 +189,28 @@ int PCA9685::_read(VPIN vpin) {
 }
 
 void PCA9685::_loop(unsigned long currentMicros) {
+  // Advance animations by the number of refresh intervals that have passed, 
+  // so that they keep to time when the loop is slow.
+  const unsigned long interval = refreshInterval * 1000UL;
+  unsigned long elapsed = currentMicros - _lastRefresh;
+  uint8_t steps;
+  if (elapsed >= 255 * interval) {
+    steps = 1;  // first time, or after a long stall
+    _lastRefresh = currentMicros;
+  } else {
+    steps = elapsed / interval;
+    if (steps == 0) steps = 1;
+    _lastRefresh += steps * interval;
+  }
   for (int pin=0; pin<_nPins; pin++) {
-    updatePosition(pin);
+    updatePosition(pin, steps);
   }
-  delayUntil(currentMicros + refreshInterval * 1000UL);
+  flushPending();
+  delayUntil(_lastRefresh + interval);
 }
 
 // Private function to reposition servo
-// TODO: Could calculate step number from elapsed time, to allow for erratic loop timing.
-void PCA9685::updatePosition(uint8_t pin) {
+void PCA9685::updatePosition(uint8_t pin, uint8_t steps) {
   struct ServoData *s = _servoData[pin];
   
   if (s == NULL) return; // No pin configuration/state data
@@ -209,7 +224,8 @@ void PCA9685::updatePosition(uint8_t pin) {
 
   if (s->stepNumber < s->numSteps) {
     // Animation in progress, reposition servo
-    s->stepNumber++;
+    s->stepNumber += steps;
+    if (s->stepNumber > s->numSteps) s->stepNumber = s->numSteps;
     if ((s->currentProfile & ~NoPowerOff) == Bounce) {
       // Retrieve step positions from array in flash
       byte profileValue = GETFLASH(&_bounceProfile[s->stepNumber]);
@@ -222,7 +238,8 @@ void PCA9685::updatePosition(uint8_t pin) {
     writeDevice(pin, s->currentPosition);
   } else if (s->stepNumber < s->numSteps + _catchupSteps) {
     // We've finished animation, wait a little to allow servo to catch up
-    s->stepNumber++;
+    s->stepNumber += steps;
+    if (s->stepNumber > s->numSteps + _catchupSteps) s->stepNumber = s->numSteps + _catchupSteps;
   } else if (s->stepNumber == s->numSteps + _catchupSteps 
             && s->currentPosition != 0) {
 #ifdef IO_SWITCH_OFF_SERVO
@@ -237,24 +254,52 @@ void PCA9685::updatePosition(uint8_t pin) {
 
 // writeDevice takes a pin in range 0 to _nPins-1 within the device, and a value
 // between 0 and 4095 for the PWM mark-to-period ratio, with 4095 being 100%.
+// The pin is marked to be written by flushPending(), with adjacent pins in the 
+// same transfer.  A pin written again meanwhile just gets the latest value.
 void PCA9685::writeDevice(uint8_t pin, int value) {
   #ifdef DIAG_IO
   DIAG(F("PCA9685 I2C:x%x WriteDevice Pin:%d Value:%d"), _I2CAddress, pin, value);
   #endif
-  // Wait for previous request to complete
-  uint8_t status = requestBlock.wait();
+  uint16_t mask = 1 << pin;
+  _pendingPins |= mask;
+  if (value == 0) _pendingOff |= mask;
+  else _pendingOff &= ~mask;
+}
+
+// Write the first run of adjacent pending pins, unless a write is in progress,
+// in which case writeCompleted() calls here again when it finishes.
+// The value of a pin is its current position, unless it is being switched off.
+void PCA9685::flushPending() {
+  if (_pendingPins == 0 || requestBlock.status == I2C_STATUS_PENDING) return;
+  uint8_t status = requestBlock.status;
   if (status != I2C_STATUS_OK) {
     _deviceState = DEVSTATE_FAILED;
     DIAG(F("PCA9685 I2C:x%x failed %S"), _I2CAddress, I2CManager.getErrorMessage(status));
-  } else {
-    // Set up new request.
-    outputBuffer[0] = PCA9685_FIRST_SERVO + 4 * pin;
-    outputBuffer[1] = 0;
-    outputBuffer[2] = (value == 4095 ? 0x10 : 0);  // 4095=full on
-    outputBuffer[3] = value & 0xff;
-    outputBuffer[4] = value >> 8;
-    I2CManager.queueRequest(&requestBlock);
+    _pendingPins = 0;
+    return;
+  }
+  uint8_t pin = 0;
+  while (!(_pendingPins & (1 << pin))) pin++;
+  uint8_t len = 0;
+  outputBuffer[len++] = PCA9685_FIRST_SERVO + 4 * pin;
+  for ( ; pin < _nPins && (_pendingPins & (1 << pin)) && len < sizeof(outputBuffer); pin++) {
+    uint16_t mask = 1 << pin;
+    _pendingPins &= ~mask;
+    struct ServoData *s = _servoData[pin];
+    int value = (_pendingOff & mask || s == NULL) ? 0 : s->currentPosition;
+    outputBuffer[len++] = 0;
+    outputBuffer[len++] = (value == 4095 ? 0x10 : 0);  // 4095=full on
+    outputBuffer[len++] = value & 0xff;
+    outputBuffer[len++] = value >> 8;
   }
+  requestBlock.setWriteParams(_I2CAddress, outputBuffer, len);
+  I2CManager.queueRequest(&requestBlock);
+}
+
+// Called by I2CManager when a write has completed: start the next one.
+void PCA9685::writeCompleted(I2CRB *rb, void *context) {
+  (void)rb;
+  ((PCA9685 *)context)->flushPending();
 }
 
 // Display details of this device.
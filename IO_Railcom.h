@@ -0,0 +1,185 @@
+/*
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * RailCom (RCN-217) detector, connected to a hardware serial port.
+ *
+ * With RAILCOM defined in config.h, the command station opens a cutout in the
+ * main track signal after each DCC packet.  A decoder with RailCom enabled
+ * sends data during the cutout, which a detector in the feed to a block turns
+ * into 250kbaud serial data.  Each byte carries 6 bits in a 4 of 8 code.
+ *
+ * Channel 1, the first two bytes, is sent by every decoder in the block after
+ * every packet and carries its address, so the detector knows which loco is
+ * in the block.  Channel 2, the rest, is only sent by the decoder the packet
+ * was for, and answers main track CV reads (<r CAB CV>).  Answers are put in
+ * the CV cache, so a later read of the CV on the prog track doesn't need the
+ * decoder, and are broadcast as <r CAB CV VALUE>.
+ *
+ * A digital read of the vpin returns 1 while a loco is in the block, and an
+ * analogue read returns its address (0 if none).  With more than one loco in
+ * a block, their channel 1 data collides, so the block reads as empty.
+ *
+ * The driver is configured as follows:
+ *    RailcomDetector::create(vpin, Serial3);
+ * For example, in mySetup.cpp:
+ *    RailcomDetector::create(4100, Serial3);
+ *    Sensor::create(4100, 4100, 0);  // <Q 4100> and <q 4100> for block occupancy
+ *
+ * Bytes are collected in the loop, between cutouts.  If the loop is held up for
+ * longer than a packet, the bytes from two cutouts can't be told apart, so
+ * they are discarded.
+ */
+
+#ifndef IO_RAILCOM_H
+#define IO_RAILCOM_H
+
+#include "IODevice.h"
+#include "DCC.h"
+#include "DCCWaveform.h"
+#include "DIAG.h"
+#include "FSH.h"
+
+// Time after the last address is received before a block reads as empty
+#ifndef RAILCOM_DETECT_TIMEOUT
+#define RAILCOM_DETECT_TIMEOUT 500
+#endif
+
+class RailcomDetector : public IODevice {
+public:
+  static void create(VPIN vpin, HardwareSerial &serial) {
+    new RailcomDetector(vpin, serial);
+  }
+  RailcomDetector(VPIN vpin, HardwareSerial &serial) {
+    _firstVpin = vpin;
+    _nPins = 1;
+    _serial = &serial;
+    addDevice(this);
+  }
+
+  // Values returned by decode() for bytes which are not data
+  enum : uint8_t {
+    RAILCOM_ACK = 0x40,
+    RAILCOM_NACK = 0x41,
+    RAILCOM_BUSY = 0x42,
+    RAILCOM_INVALID = 0xFF,
+  };
+
+  // Decode a 4 of 8 coded byte to its 6 bit value.
+  static uint8_t decode(uint8_t code) {
+    // 4 of 8 code for each value from 0x00 to 0x3F
+    static const uint8_t FLASH encoding[64] = {
+      0xAC, 0xAA, 0xA9, 0xA5, 0xA3, 0xA6, 0x9C, 0x9A, 0x99, 0x95, 0x93, 0x96, 0x8E, 0x8D, 0x8B, 0xB1,
+      0xB2, 0xB4, 0xB8, 0x74, 0x72, 0x6C, 0x6A, 0x69, 0x65, 0x63, 0x66, 0x5C, 0x5A, 0x59, 0x55, 0x53,
+      0x56, 0x4E, 0x4D, 0x4B, 0x47, 0x71, 0xE8, 0xE4, 0xE2, 0xD1, 0xC9, 0xC5, 0xD8, 0xD4, 0xD2, 0xCA,
+      0xC6, 0xCC, 0x78, 0x17, 0x1B, 0x1D, 0x1E, 0x2E, 0x36, 0x3A, 0x27, 0x2B, 0x2D, 0x35, 0x39, 0x33,
+    };
+    for (uint8_t value = 0; value < 64; value++)
+      if (GETFLASH(encoding + value) == code) return value;
+    if (code == 0x0F || code == 0xF0) return RAILCOM_ACK;
+    if (code == 0x3C) return RAILCOM_NACK;
+    if (code == 0xE1) return RAILCOM_BUSY;
+    return RAILCOM_INVALID;
+  }
+
+private:
+  // Datagram identifiers
+  enum : uint8_t {
+    ID_POM = 0,       // channel 2, CV value
+    ID_ADR_HIGH = 1,  // channel 1, address
+    ID_ADR_LOW = 2,
+  };
+
+  void _begin() override {
+    _serial->begin(250000);  // RailCom is 250kbaud 8N1
+    _lastCutout = DCCWaveform::mainTrack.railcomCutouts;
+#if defined(DIAG_IO)
+    _display();
+#endif
+  }
+
+  void _loop(unsigned long currentMicros) override {
+    (void)currentMicros;
+    uint8_t cutouts = DCCWaveform::mainTrack.railcomCutouts;
+    if (cutouts == _lastCutout) return;
+    uint8_t newCutouts = cutouts - _lastCutout;
+    _lastCutout = cutouts;
+
+    uint8_t symbols[8];
+    uint8_t count = 0;
+    while (_serial->available()) {
+      uint8_t code = _serial->read();
+      if (count < sizeof(symbols)) symbols[count++] = decode(code);
+    }
+    if (newCutouts == 1) parse(symbols, count);
+  }
+
+  // Pick out the channel 1 and channel 2 datagrams from one cutout
+  void parse(const uint8_t *symbols, uint8_t count) {
+    uint8_t pos = 0;
+    if (count >= 2 && symbols[0] < 64 && symbols[1] < 64) {
+      uint8_t id = symbols[0] >> 2;
+      uint8_t value = (symbols[0] << 6) | symbols[1];
+      if (id == ID_ADR_HIGH || id == ID_ADR_LOW) {
+        if (id == ID_ADR_HIGH) _adrHigh = value;
+        else _adrLow = value;
+        // Short addresses have a zero high byte, long ones 10 in the top bits.
+        if (_adrHigh == 0 && _adrLow != 0) _address = _adrLow;
+        else if ((_adrHigh & 0xC0) == 0x80) _address = ((_adrHigh & 0x3F) << 8) | _adrLow;
+        _lastSeen = millis();
+        pos = 2;
+      }
+    }
+    while (pos + 1 < count) {
+      if (symbols[pos] >= 64) {  // ACK, NACK or BUSY
+        pos++;
+        continue;
+      }
+      if ((symbols[pos] >> 2) != ID_POM || symbols[pos+1] >= 64) break;  // others aren't used
+      DCC::railcomPOM((symbols[pos] << 6) | symbols[pos+1]);
+      pos += 2;
+    }
+  }
+
+  bool present() {
+    return _address != 0 && (millis() - _lastSeen) < RAILCOM_DETECT_TIMEOUT;
+  }
+
+  int _read(VPIN vpin) override {
+    (void)vpin;
+    return present();
+  }
+
+  int _readAnalogue(VPIN vpin) override {
+    (void)vpin;
+    return present() ? _address : 0;
+  }
+
+  void _display() override {
+    DIAG(F("RailcomDetector Configured on Vpin:%d Loco:%d %S"), _firstVpin, present() ? _address : 0,
+      DCCWaveform::mainTrack.isRailcom() ? F("") : F("(no cutout)"));
+  }
+
+  HardwareSerial *_serial;
+  uint8_t _lastCutout;
+  uint8_t _adrHigh = 0;
+  uint8_t _adrLow = 0;
+  uint16_t _address = 0;
+  unsigned long _lastSeen = 0;
+};
+
+#endif // IO_RAILCOM_H
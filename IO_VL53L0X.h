@@ -32,8 +32,9 @@
  * will return a value that indicates whether the object is within the threshold range (1)
  * or not (0).  An analogue read on the first pin returns the last measured distance (in mm), 
  * the second pin returns the signal strength, and the third pin returns detected 
- * ambient light level.  By default the device takes around 60ms to complete a ranging 
- * operation, so we do a 100ms cycle (10 samples per second).
+ * ambient light level.  The device ranges continuously, starting each measurement as soon
+ * as the previous one completes (around 30ms with the default timing budget), and the
+ * driver collects each result as it becomes ready.
  * 
  * The VL53L0X is initially set to respond to I2C address 0x29.  If you only have one module,
  * you can use this address.  However, the address can be modified by software.  If
@@ -72,6 +73,11 @@
  *   and xshutPin is the VPIN number corresponding to a digital output that is connected to the
  *       XSHUT terminal on the module.
  * 
+ * Optionally, a digital input VPIN connected to the module's GPIO1 terminal may be added after
+ * xshutPin (use VPIN_NONE for xshutPin if it isn't connected).  GPIO1 goes low when a new 
+ * measurement is ready, so the driver only reads the device when there is something to read;
+ * without it, the driver polls the device's interrupt status register.
+ * 
  * Example:
  *   In mySetup function within mySetup.cpp:
  *      VL53L0X::create(4000, 3, 0x29, 200, 250);
@@ -100,6 +106,7 @@ private:
   uint16_t _onThreshold;
   uint16_t _offThreshold;
   VPIN _xshutPin;
+  VPIN _gpio1Pin;
   bool _value;
   uint8_t _nextState = 0;
   I2CRB _rb;
@@ -109,37 +116,57 @@ private:
   enum : uint8_t {
     STATE_INIT = 0,
     STATE_CONFIGUREADDRESS = 1,
-    STATE_SKIP = 2,
-    STATE_CONFIGUREDEVICE = 3,
-    STATE_INITIATESCAN = 4,
-    STATE_CHECKSTATUS = 5,
-    STATE_GETRESULTS = 6,
-    STATE_DECODERESULTS = 7,
+    STATE_SETADDRESS = 2,
+    STATE_SKIP = 3,
+    STATE_CONFIGUREDEVICE = 4,
+    STATE_SETVOLTAGE = 5,
+    STATE_SETINTERRUPT = 6,
+    STATE_STARTRANGING = 7,
+    STATE_CHECKREADY = 8,
+    STATE_CHECKSTATUS = 9,
+    STATE_DECODERESULTS = 10,
   };
 
   // Register addresses
   enum : uint8_t {
     VL53L0X_REG_SYSRANGE_START=0x00,
+    VL53L0X_REG_SYSTEM_INTERRUPT_CONFIG_GPIO=0x0A,
+    VL53L0X_REG_SYSTEM_INTERRUPT_CLEAR=0x0B,
     VL53L0X_REG_RESULT_INTERRUPT_STATUS=0x13,
     VL53L0X_REG_RESULT_RANGE_STATUS=0x14,
     VL53L0X_CONFIG_PAD_SCL_SDA__EXTSUP_HV=0x89,
     VL53L0X_REG_I2C_SLAVE_DEVICE_ADDRESS=0x8A,
   };
   const uint8_t VL53L0X_I2C_DEFAULT_ADDRESS=0x29;
+  const uint8_t VL53L0X_SYSRANGE_BACKTOBACK=0x02;
+  const uint8_t VL53L0X_GPIO_NEW_SAMPLE_READY=0x04;
+  // Interval between data-ready checks while a measurement is in progress.
+  const unsigned long VL53L0X_POLL_INTERVAL=5000;
+
+  // Only one module may be released from reset at a time, since they all
+  // start on the default address.  This is the module that is doing so.
+  static VL53L0X *&addressingModule() {
+    static VL53L0X *module = NULL;
+    return module;
+  }
 
 public:
-  VL53L0X(VPIN firstVpin, int nPins, uint8_t i2cAddress, uint16_t onThreshold, uint16_t offThreshold, VPIN xshutPin = VPIN_NONE) {
+  VL53L0X(VPIN firstVpin, int nPins, uint8_t i2cAddress, uint16_t onThreshold, uint16_t offThreshold, 
+      VPIN xshutPin = VPIN_NONE, VPIN gpio1Pin = VPIN_NONE) {
     _firstVpin = firstVpin;
     _nPins = min(nPins, 3);
     _i2cAddress = i2cAddress;
     _onThreshold = onThreshold;
     _offThreshold = offThreshold;
     _xshutPin = xshutPin;
+    _gpio1Pin = gpio1Pin;
     _value = 0;
+    _rb.priority = I2C_PRIORITY_INPUT;
     addDevice(this);
   }
-  static void create(VPIN firstVpin, int nPins, uint8_t i2cAddress, uint16_t onThreshold, uint16_t offThreshold, VPIN xshutPin = VPIN_NONE) {
-    new VL53L0X(firstVpin, nPins, i2cAddress, onThreshold, offThreshold, xshutPin);
+  static void create(VPIN firstVpin, int nPins, uint8_t i2cAddress, uint16_t onThreshold, uint16_t offThreshold, 
+      VPIN xshutPin = VPIN_NONE, VPIN gpio1Pin = VPIN_NONE) {
+    new VL53L0X(firstVpin, nPins, i2cAddress, onThreshold, offThreshold, xshutPin, gpio1Pin);
   }
 
 protected:
@@ -156,7 +183,19 @@ protected:
   }
 
   void _loop(unsigned long currentMicros) override {
-    uint8_t status;
+    // Every state after the first few starts by collecting the result of the
+    // request issued by the previous one.
+    if (_nextState > STATE_CONFIGUREDEVICE || _nextState == STATE_SKIP) {
+      uint8_t status = _rb.status;
+      if (status == I2C_STATUS_PENDING) return; // try next time
+      if (status != I2C_STATUS_OK) {
+        DIAG(F("VL53L0X I2C:x%x Error:%d %S"), _i2cAddress, status, I2CManager.getErrorMessage(status));
+        if (addressingModule() == this) addressingModule() = NULL;
+        _deviceState = DEVSTATE_FAILED;
+        _value = false;
+        return;
+      }
+    }
     switch (_nextState) {
       case STATE_INIT:
         // On first entry to loop, reset this module by pulling XSHUT low.  All modules
@@ -165,19 +204,28 @@ protected:
         _nextState = STATE_CONFIGUREADDRESS;
         break;
       case STATE_CONFIGUREADDRESS:
-        // On second entry, set XSHUT pin high to allow the module to restart.
+        // Wait while another module is responding to the default address.
+        if (addressingModule() != NULL) return;
+        addressingModule() = this;
+        // Set XSHUT pin high to allow the module to restart.
         // On the module, there is a diode in series with the XSHUT pin to 
         // protect the low-voltage pin against +5V.
         if (_xshutPin != VPIN_NONE) IODevice::write(_xshutPin, 1);
         // Allow the module time to restart
-        delay(10);
-        // Then write the desired I2C address to the device, while this is the only
+        delayUntil(currentMicros + 10000);
+        _nextState = STATE_SETADDRESS;
+        break;
+      case STATE_SETADDRESS:
+        // Write the desired I2C address to the device, while this is the only
         //  module responding to the default address.
-        I2CManager.write(VL53L0X_I2C_DEFAULT_ADDRESS, 2, VL53L0X_REG_I2C_SLAVE_DEVICE_ADDRESS, _i2cAddress);
+        _outBuffer[0] = VL53L0X_REG_I2C_SLAVE_DEVICE_ADDRESS;
+        _outBuffer[1] = _i2cAddress;
+        I2CManager.write(VL53L0X_I2C_DEFAULT_ADDRESS, _outBuffer, 2, &_rb);
         _nextState = STATE_SKIP;
         break;
       case STATE_SKIP:
-        // Do nothing on the third entry.
+        // Address written, so the next module may be brought out of reset.
+        addressingModule() = NULL;
         _nextState = STATE_CONFIGUREDEVICE;
         break;
       case STATE_CONFIGUREDEVICE:
@@ -186,63 +234,71 @@ protected:
           #ifdef DIAG_IO
           _display();
           #endif
-          // Set 2.8V mode
-          write_reg(VL53L0X_CONFIG_PAD_SCL_SDA__EXTSUP_HV, 
-            read_reg(VL53L0X_CONFIG_PAD_SCL_SDA__EXTSUP_HV) | 0x01);
+          // Read the pad configuration, to set 2.8V mode
+          _outBuffer[0] = VL53L0X_CONFIG_PAD_SCL_SDA__EXTSUP_HV;
+          I2CManager.read(_i2cAddress, _inBuffer, 1, _outBuffer, 1, &_rb);
+          _nextState = STATE_SETVOLTAGE;
         } else {
           DIAG(F("VL53L0X I2C:x%x device not responding"), _i2cAddress);
           _deviceState = DEVSTATE_FAILED;
         }
-        _nextState = STATE_INITIATESCAN;
         break;
-      case STATE_INITIATESCAN:
-        // Not scanning, so initiate a scan
-        _outBuffer[0] = VL53L0X_REG_SYSRANGE_START;
-        _outBuffer[1] = 0x01;
-        I2CManager.write(_i2cAddress, _outBuffer, 2, &_rb);
-        _nextState = STATE_CHECKSTATUS;
+      case STATE_SETVOLTAGE:
+        writeRegister(VL53L0X_CONFIG_PAD_SCL_SDA__EXTSUP_HV, _inBuffer[0] | 0x01);
+        _nextState = STATE_SETINTERRUPT;
         break;
-      case STATE_CHECKSTATUS:
-        status = _rb.status;
-        if (status == I2C_STATUS_PENDING) return; // try next time
-        if (status != I2C_STATUS_OK) {
-          DIAG(F("VL53L0X I2C:x%x Error:%d %S"), _i2cAddress, status, I2CManager.getErrorMessage(status));
-          _deviceState = DEVSTATE_FAILED;
-          _value = false;
-        } else
-          _nextState = 2;
-        delayUntil(currentMicros + 95000); // wait for 95 ms before checking.
-        _nextState = STATE_GETRESULTS;
+      case STATE_SETINTERRUPT:
+        // Signal a new sample on GPIO1 (active low), and in the interrupt status register.
+        writeRegister(VL53L0X_REG_SYSTEM_INTERRUPT_CONFIG_GPIO, VL53L0X_GPIO_NEW_SAMPLE_READY);
+        _nextState = STATE_STARTRANGING;
         break;
-      case STATE_GETRESULTS:
-        // Ranging completed.  Request results
-        _outBuffer[0] = VL53L0X_REG_RESULT_RANGE_STATUS;
-        I2CManager.read(_i2cAddress, _inBuffer, 12, _outBuffer, 1, &_rb);
-        _nextState = 3;
-        delayUntil(currentMicros + 5000); // Allow 5ms to get data
-        _nextState = STATE_DECODERESULTS;
+      case STATE_STARTRANGING:
+        // Start continuous ranging.  The device starts each measurement as soon 
+        // as the previous one completes, so no further start commands are needed.
+        writeRegister(VL53L0X_REG_SYSRANGE_START, VL53L0X_SYSRANGE_BACKTOBACK);
+        _nextState = STATE_CHECKREADY;
         break;
-      case STATE_DECODERESULTS:
-        // If I2C write still busy, return.
-        status = _rb.status;
-        if (status == I2C_STATUS_PENDING) return; // try again next time
-        if (status == I2C_STATUS_OK) {
-          if (!(_inBuffer[0] & 1)) return; // device still busy
-          uint8_t deviceRangeStatus = ((_inBuffer[0] & 0x78) >> 3);
-          if (deviceRangeStatus == 0x0b) {
-            // Range status OK, so use data
-            _ambient = makeuint16(_inBuffer[7], _inBuffer[6]);
-            _signal = makeuint16(_inBuffer[9], _inBuffer[8]);
-            _distance = makeuint16(_inBuffer[11], _inBuffer[10]);
-            if (_distance <= _onThreshold) 
-              _value = true;
-            else if (_distance > _offThreshold) 
-              _value = false;
+      case STATE_CHECKREADY:
+        if (_gpio1Pin != VPIN_NONE) {
+          // GPIO1 goes low when a new measurement is available.
+          if (IODevice::read(_gpio1Pin)) {
+            delayUntil(currentMicros + VL53L0X_POLL_INTERVAL);
+            return;
           }
+          readResults();
+        } else {
+          // No interrupt line, so ask the device.
+          _outBuffer[0] = VL53L0X_REG_RESULT_INTERRUPT_STATUS;
+          I2CManager.read(_i2cAddress, _inBuffer, 1, _outBuffer, 1, &_rb);
+          _nextState = STATE_CHECKSTATUS;
+        }
+        break;
+      case STATE_CHECKSTATUS:
+        if (_inBuffer[0] & 0x07) 
+          readResults();
+        else {
+          // Measurement still in progress
+          delayUntil(currentMicros + VL53L0X_POLL_INTERVAL);
+          _nextState = STATE_CHECKREADY;
         }
-        // Completed. Restart scan on next loop entry.
-        _nextState = STATE_INITIATESCAN;
         break;
+      case STATE_DECODERESULTS: {
+        uint8_t deviceRangeStatus = ((_inBuffer[0] & 0x78) >> 3);
+        if (deviceRangeStatus == 0x0b) {
+          // Range status OK, so use data
+          _ambient = makeuint16(_inBuffer[7], _inBuffer[6]);
+          _signal = makeuint16(_inBuffer[9], _inBuffer[8]);
+          _distance = makeuint16(_inBuffer[11], _inBuffer[10]);
+          if (_distance <= _onThreshold) 
+            _value = true;
+          else if (_distance > _offThreshold) 
+            _value = false;
+        }
+        // Clear the interrupt, so that the device signals the next measurement.
+        writeRegister(VL53L0X_REG_SYSTEM_INTERRUPT_CLEAR, 0x01);
+        _nextState = STATE_CHECKREADY;
+        break;
+      }
       default:
         break;
     }
@@ -282,17 +338,17 @@ private:
   inline uint16_t makeuint16(byte lsb, byte msb) {
     return (((uint16_t)msb) << 8) | lsb;
   }
-  uint8_t write_reg(uint8_t reg, uint8_t data) {
-    // write byte to register
-    uint8_t outBuffer[2];
-    outBuffer[0] = reg;
-    outBuffer[1] = data;
-    return I2CManager.write(_i2cAddress, outBuffer, 2);
+  // Non-blocking write of one register, completion is checked on the next loop entry.
+  void writeRegister(uint8_t reg, uint8_t data) {
+    _outBuffer[0] = reg;
+    _outBuffer[1] = data;
+    I2CManager.write(_i2cAddress, _outBuffer, 2, &_rb);
   }
-  uint8_t read_reg(uint8_t reg) {
-    // read byte from register and return value
-    I2CManager.read(_i2cAddress, _inBuffer, 1, &reg, 1);
-    return _inBuffer[0];
+  // Request the latest measurement.
+  void readResults() {
+    _outBuffer[0] = VL53L0X_REG_RESULT_RANGE_STATUS;
+    I2CManager.read(_i2cAddress, _inBuffer, 12, _outBuffer, 1, &_rb);
+    _nextState = STATE_DECODERESULTS;
   }
 };
 
@@ -29,8 +29,13 @@
  *  4) If there are fewer non-blank rows than screen lines,
  *     then a scrolling strategy is adopted so that, on each screen
  *     refresh, a different subset of the rows is presented.
- *  5) On each entry into loop2(), a single operation is sent to the 
- *     screen; this may be a position command or a character for
+ *  5) Each screen line is compared with what is already displayed
+ *     there, and only the characters that differ are redrawn, as runs
+ *     of adjacent characters sent together.  A screen line still 
+ *     showing the same row is skipped altogether, unless that row 
+ *     has been written to since.
+ *  6) On each entry into loop2(), a single operation is sent to the 
+ *     screen; this may be a position command or a run of characters for
  *     display.  This spreads the onerous work of updating the screen
  *     and ensures that other loop() functions in the application are
  *     not held up significantly.  The exception to this is when 
@@ -49,7 +54,12 @@
 
 void LCDDisplay::clear() {
   clearNative();
-  for (byte row = 0; row < MAX_LCD_ROWS; row++) rowBuffer[row][0] = '\0';
+  for (byte row = 0; row < MAX_LCD_ROWS; row++) {
+    rowBuffer[row][0] = '\0';
+    memset(screen[row], ' ', MAX_LCD_COLS);
+    slotRow[row] = BLANK_ROW;
+  }
+  rowDirty = 0;
   topRow = -1;  // loop2 will fill from row 0
 }
 
@@ -63,6 +73,7 @@ size_t LCDDisplay::write(uint8_t b) {
   rowBuffer[hotRow][hotCol] = b;
   hotCol++;
   rowBuffer[hotRow][hotCol] = 0;
+  bitSet(rowDirty, hotRow);
   return 1;
 }
 
@@ -88,61 +99,74 @@ LCDDisplay *LCDDisplay::loop2(bool force) {
     // force full screen update from the beginning.
     rowFirst = -1;
     rowNext = 0;
-    bufferPointer = 0;
+    lineReady = false;
+    runLength = 0;
     done = false;
     slot = 0;
   }
 
   do {
-    if (bufferPointer == 0) {
+    if (runLength > 0) {
+      // Position has been set, so write the changed characters.
+      writeNative(&buffer[charIndex], runLength);
+      memcpy(&screen[slot][charIndex], &buffer[charIndex], runLength);
+      charIndex += runLength;
+      runLength = 0;
+
+    } else if (!lineReady) {
       // Find a line of data to write to the screen.
       if (rowFirst < 0) rowFirst = rowNext;
       skipBlankRows();
-      if (!done) {
-        // Non-blank line found, so copy it.
-        for (uint8_t i = 0; i < sizeof(buffer); i++)
-          buffer[i] = rowBuffer[rowNext][i];
-      } else
-        buffer[0] = '\0';  // Empty line
-      setRowNative(slot);  // Set position for display
-      charIndex = 0;
-      bufferPointer = &buffer[0];
+      int8_t row = done ? BLANK_ROW : rowNext;
+      if (row == slotRow[slot] && (row == BLANK_ROW || !bitRead(rowDirty, row))) {
+        // Already on the screen, so nothing to do for this line.
+        charIndex = MAX_LCD_COLS;
+      } else {
+        // Copy the line, padded with spaces to erase the rest of the screen line.
+        const char *text = (row == BLANK_ROW) ? "" : rowBuffer[row];
+        uint8_t i = 0;
+        for (; i < MAX_LCD_COLS && text[i]; i++) buffer[i] = text[i];
+        for (; i < MAX_LCD_COLS; i++) buffer[i] = ' ';
+        if (row != BLANK_ROW) bitClear(rowDirty, row);
+        slotRow[slot] = row;
+        charIndex = 0;
+      }
+      lineReady = true;
 
     } else {
-
-      // Write next character, or a space to erase current position.
-      char ch = *bufferPointer;
-      if (ch) {
-        writeNative(ch);
-        bufferPointer++;
-      } else
-        writeNative(' ');
-
-      if (++charIndex >= MAX_LCD_COLS) {
+      // Find the next characters that differ from those on the screen.
+      char *shown = screen[slot];
+      while (charIndex < MAX_LCD_COLS && buffer[charIndex] == shown[charIndex]) charIndex++;
+      if (charIndex < MAX_LCD_COLS) {
+        while (charIndex + runLength < MAX_LCD_COLS && runLength < maxRun
+            && buffer[charIndex + runLength] != shown[charIndex + runLength]) 
+          runLength++;
+        setPositionNative(slot, charIndex);  // Set position for display
+      } else {
         // Screen slot completed, move to next slot on screen
         slot++;
-        bufferPointer = 0;
+        lineReady = false;
         if (!done) {
           moveToNextRow();
           skipBlankRows();
         }
-      }
 
-      if (slot >= lcdRows) {
-        // Last slot finished, reset ready for next screen update.
+        if (slot >= lcdRows) {
+          // Last slot finished, reset ready for next screen update.
 #if SCROLLMODE==2
-        if (!done) {
-          // On next refresh, restart one row on from previous start.
-          rowNext = rowFirst;
-          moveToNextRow();
-          skipBlankRows();
-        }
+          if (!done) {
+            // On next refresh, restart one row on from previous start.
+            rowNext = rowFirst;
+            moveToNextRow();
+            skipBlankRows();
+          }
 #endif
-        done = false;
-        slot = 0;
-        rowFirst = -1;
-        lastScrollTime = currentMillis;
-        return NULL;
+          done = false;
+          slot = 0;
+          rowFirst = -1;
+          lastScrollTime = currentMillis;
+          return NULL;
+        }
       }
     }
   } while (force);
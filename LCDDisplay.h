@@ -52,6 +52,8 @@ class LCDDisplay : public DisplayInterface {
 protected:
   uint8_t lcdRows;
   uint8_t lcdCols;
+  // Most characters the driver can write in one writeNative call
+  uint8_t maxRun = MAX_LCD_COLS;
 
  private:
   void moveToNextRow();
@@ -59,8 +61,13 @@ protected:
 
   // Relay functions to the live driver in the subclass
   virtual void clearNative() = 0;
-  virtual void setRowNative(byte line) = 0;
+  virtual void setPositionNative(byte line, byte column) = 0;
   virtual size_t writeNative(uint8_t b) = 0;
+  // Write several characters from the current position
+  virtual size_t writeNative(const char *s, uint8_t length) {
+    for (uint8_t i = 0; i < length; i++) writeNative(s[i]);
+    return length;
+  }
   virtual bool isBusy() = 0;
 
   unsigned long lastScrollTime = 0;
@@ -71,11 +78,18 @@ protected:
   int8_t rowFirst = -1;
   int8_t rowNext = 0;
   int8_t charIndex = 0;
+  int8_t runLength = 0;   // characters to write once the position has been set
   char buffer[MAX_LCD_COLS + 1];
-  char* bufferPointer = 0;
+  bool lineReady = false;
   bool done = false;
 
   char rowBuffer[MAX_LCD_ROWS][MAX_LCD_COLS + 1];
+  // Rows written to since they were last copied to the screen
+  uint8_t rowDirty = 0;
+  // What is on the screen, and which row is shown in each screen line
+  static const int8_t BLANK_ROW = -1;
+  char screen[MAX_LCD_ROWS][MAX_LCD_COLS];
+  int8_t slotRow[MAX_LCD_ROWS];
 };
 
 #endif
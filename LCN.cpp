@@ -21,10 +21,18 @@
 #include "DIAG.h"
 #include "Turnouts.h"
 #include "Sensors.h"
+#include "BinaryProtocol.h"
 
 int  LCN::id = 0;
 Stream * LCN::stream=NULL;
 bool LCN::firstLoop=true;
+byte LCN::frame[LCN_MAX_FRAME];
+byte LCN::frameLength=0;
+byte LCN::frameSkip=0;
+#if defined(LCN_BINARY)
+byte LCN::batch[LCN_BATCH_SIZE*4];
+byte LCN::batchCount=0;
+#endif
 
 void LCN::init(Stream & lcnstream) {
   stream=&lcnstream; 
@@ -32,45 +40,131 @@ void LCN::init(Stream & lcnstream) {
 }
 
 
-// Inbound LCN traffic is postfix notation...   nnnX  where nnn is an id, X is the opcode
 void LCN::loop() {
   if (!stream) return;
   if (firstLoop) {
     firstLoop=false;
+#if defined(LCN_BINARY)
+    stream->write(BINARY_START);
+    stream->write(1);
+    stream->write('?');
+#else
     stream->println('X');
+#endif
     return; 
   }
+#if defined(LCN_BINARY)
+  flush();  // turnout changes made since the last loop
+#endif
   
   while (stream->available()) {
     int ch = stream->read();
-    if (ch >= '0' && ch <= '9') {  // accumulate id value
-      id = 10 * id + ch - '0';
+    if (frameSkip) {  // rest of a dropped frame, not text
+      frameSkip--;
+      continue;
+    }
+    if (frameLength==0 && ch!=BINARY_START) {
+      parseText(ch);
+      continue;
     }
-    else if (ch == 't' || ch == 'T') { // Turnout opcodes
-      if (Diag::LCN) DIAG(F("LCN IN %d%c"),id,(char)ch);
-      if (!Turnout::exists(id)) LCNTurnout::create(id);
-      Turnout::setClosedStateOnly(id,ch=='t');
-      id = 0;
+    frame[frameLength++]=ch;
+    if (frameLength<2) continue;
+    if (frame[1]==0 || frame[1]+2 > LCN_MAX_FRAME) {
+      DIAG(F("LCN frame length %d dropped"), frame[1]);
+      frameSkip=frame[1];
+      frameLength=0;
     }
-    else if (ch == 'y' || ch == 'Y') { // Turnout opcodes
-      if (Diag::LCN) DIAG(F("LCN IN %d%c"),id,(char)ch);
-      Turnout::setClosed(id,ch=='y');
-      id = 0;
+    else if (frameLength==frame[1]+2) {
+      parseFrame();
+      frameLength=0;
     }
-    else if (ch == 'S' || ch == 's') {
-      if (Diag::LCN) DIAG(F("LCN IN %d%c"),id,(char)ch);
-      Sensor * ss = Sensor::get(id);
-      if (!ss) ss = Sensor::create(id, VPIN_NONE, 0); // impossible pin
-      ss->setState(ch == 'S');
-      id = 0;
+  }
+}
+
+// Inbound LCN traffic is postfix notation...   nnnX  where nnn is an id, X is the opcode
+void LCN::parseText(int ch) {
+  if (ch >= '0' && ch <= '9') {  // accumulate id value
+    id = 10 * id + ch - '0';
+    return;
+  }
+  if (ch == 't' || ch == 'T') { // Turnout opcodes
+    if (Diag::LCN) DIAG(F("LCN IN %d%c"),id,(char)ch);
+    setTurnout(id,ch=='t');
+  }
+  else if (ch == 'y' || ch == 'Y') { // Turnout opcodes
+    if (Diag::LCN) DIAG(F("LCN IN %d%c"),id,(char)ch);
+    Turnout::setClosed(id,ch=='y');
+  }
+  else if (ch == 'S' || ch == 's') {
+    if (Diag::LCN) DIAG(F("LCN IN %d%c"),id,(char)ch);
+    setSensor(id, ch == 'S');
+  }
+  id = 0; // ignore any other garbage from LCN
+}
+
+// Frames are described in LCN.h
+void LCN::parseFrame() {
+  byte length=frame[1];
+  byte opcode=frame[2];
+  byte * p=frame+3;  // payload
+  int first=p[0] | (p[1]<<8);
+  if (Diag::LCN) DIAG(F("LCN IN BINARY:%c length %d"), opcode, length);
+
+  switch (opcode) {
+  case 'S':  // sensor states
+  case 'T':  // turnout states
+    if (length<4 || length!=4+(p[2]+7)/8) break;
+    for (byte i=0; i<p[2]; i++) {
+      bool on=p[3+i/8] & (1<<(i%8));
+      if (opcode=='S') setSensor(first+i, on);
+      else setTurnout(first+i, !on);
     }
-    else  id = 0; // ignore any other garbage from LCN
+    return;
+
+  case 'Y':  // operate turnout
+    if (length!=4) break;
+    Turnout::setClosed(first, p[2]);
+    return;
   }
+  DIAG(F("LCN frame %c length %d not understood"), opcode, length);
+}
+
+void LCN::setSensor(int id, bool active) {
+  Sensor * ss = Sensor::get(id);
+  if (!ss) ss = Sensor::create(id, VPIN_NONE, 0); // impossible pin
+  if (ss) ss->setState(active);
+}
+
+// Turnouts are created on first sight, and nobody is told about one that hasn't changed.
+void LCN::setTurnout(int id, bool closed) {
+  if (!Turnout::exists(id)) LCNTurnout::create(id);
+  else if (Turnout::isClosed(id)==closed) return;
+  Turnout::setClosedStateOnly(id,closed);
 }
 
 void LCN::send(char opcode, int id, bool state) {
    if (stream) {
+#if defined(LCN_BINARY)
+      if (batchCount==LCN_BATCH_SIZE) flush();
+      byte * entry=batch+4*batchCount++;
+      entry[0]=opcode;
+      entry[1]=lowByte(id);
+      entry[2]=highByte(id);
+      entry[3]=state;
+#else
       StringFormatter::send(stream,F("%c/%d/%d"), opcode, id , state);
+#endif
       if (Diag::LCN) DIAG(F("LCN OUT %c/%d/%d"), opcode, id , state);
    }
 }
+
+#if defined(LCN_BINARY)
+void LCN::flush() {
+  if (batchCount==0) return;
+  stream->write(BINARY_START);
+  stream->write(1+4*batchCount);
+  stream->write('C');
+  stream->write(batch, 4*batchCount);
+  batchCount=0;
+}
+#endif
@@ -21,6 +21,34 @@
 #ifndef LCN_h
 #define LCN_h
 #include <Arduino.h>
+#include "defines.h"
+
+// The LCN link carries postfix text, nnnX where nnn is an id and X the opcode.
+// It also accepts frames laid out as in BinaryProtocol.h,
+//
+//    BINARY_START, length, opcode, payload (length-1 bytes)
+//
+// which let the LCN master set the state of a whole range of ids at once:
+//
+//   'S' firstId(2) count(1) states(1 bit per id)   sensors, 1 for active
+//   'T' firstId(2) count(1) states(1 bit per id)   turnouts, 1 for thrown
+//   'Y' id(2) closed(1)                            operate a turnout
+//
+// With LCN_BINARY defined, the command station talks frames too.  It asks for
+// everything at startup with '?', instead of X, and the turnout changes made
+// in each loop go together in a 'C' frame of opcode(1) id(2) state(1) entries.
+
+#ifndef LCN_MAX_FRAME
+#define LCN_MAX_FRAME 40  // largest inbound frame, including start and length bytes
+#endif
+
+#ifndef LCN_BATCH_SIZE
+#if defined(ARDUINO_AVR_UNO) || defined(ARDUINO_AVR_NANO)
+#define LCN_BATCH_SIZE 4
+#else
+#define LCN_BATCH_SIZE 16
+#endif
+#endif
 
 class LCN {
   public: 
@@ -28,9 +56,21 @@ class LCN {
     static void loop();
     static void send(char opcode, int id, bool state);
   private :
+    static void parseText(int ch);
+    static void parseFrame();
+    static void setSensor(int id, bool active);
+    static void setTurnout(int id, bool closed);
+    static void flush();
     static bool firstLoop; 
     static Stream * stream; 
     static int id;
+    static byte frame[LCN_MAX_FRAME];
+    static byte frameLength;
+    static byte frameSkip;   // bytes left of a dropped frame
+#if defined(LCN_BINARY)
+    static byte batch[LCN_BATCH_SIZE*4];
+    static byte batchCount;
+#endif
 };
 
 #endif
@@ -108,7 +108,7 @@ void LiquidCrystal_I2C::begin() {
   // set the entry mode
   command(LCD_ENTRYMODESET | _displaymode);
 
-  setRowNative(0);
+  setPositionNative(0, 0);
 }
 
 /********** high level commands, for the user! */
@@ -117,12 +117,12 @@ void LiquidCrystal_I2C::clearNative() {
   delayMicroseconds(2000);    // this command takes 1.52ms
 }
 
-void LiquidCrystal_I2C::setRowNative(byte row) {
+void LiquidCrystal_I2C::setPositionNative(byte row, byte column) {
   int row_offsets[] = {0x00, 0x40, 0x14, 0x54};
   if (row >= lcdRows) {
     row = lcdRows - 1;  // we count rows starting w/0
   }
-  command(LCD_SETDDRAMADDR | (row_offsets[row]));
+  command(LCD_SETDDRAMADDR | (row_offsets[row] + column));
 }
 
 void LiquidCrystal_I2C::display() {
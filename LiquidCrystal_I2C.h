@@ -67,7 +67,7 @@ public:
   LiquidCrystal_I2C(uint8_t lcd_Addr,uint8_t lcd_cols,uint8_t lcd_rows);
   void begin();
   void clearNative() override;
-  void setRowNative(byte line) override;
+  void setPositionNative(byte line, byte column) override;
   size_t writeNative(uint8_t c) override;
   
   void display();
@@ -0,0 +1,102 @@
+/*
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "LoopScheduler.h"
+#include "StringFormatter.h"
+#include "DIAG.h"
+
+LoopScheduler::Task LoopScheduler::tasks[LOOP_MAX_TASKS];
+byte LoopScheduler::taskCount = 0;
+unsigned long LoopScheduler::passes = 0;
+unsigned long LoopScheduler::statsStart = 0;
+
+bool LoopScheduler::add(const FSH *name, TaskFunction function, LoopPriority priority,
+                        uint16_t periodMs, uint16_t budgetMicros, LoopStep step) {
+  if (taskCount == LOOP_MAX_TASKS) {
+    DIAG(F("Too many loop tasks for %S"), name);
+    return false;
+  }
+  // After those of the same priority, so they run in the order added
+  byte i = taskCount;
+  for ( ; i > 0 && tasks[i-1].priority > priority; i--) tasks[i] = tasks[i-1];
+  Task *t = &tasks[i];
+  t->name = name;
+  t->function = function;
+  t->priority = priority;
+  t->step = step;
+  t->periodMs = periodMs;
+  t->budgetMicros = budgetMicros;
+  t->lastRun = millis();
+  t->maxMicros = 0;
+  t->overruns = 0;
+  t->busyMicros = 0;
+  taskCount++;
+  if (statsStart == 0) statsStart = millis();
+  return true;
+}
+
+void LoopScheduler::loop() {
+  LoopTimes::start();
+  passes++;
+  runUrgent();
+  for (byte i = 0; i < taskCount; i++) {
+    Task *t = &tasks[i];
+    if (t->priority == LOOP_URGENT) continue;
+    uint16_t now = millis();
+    if (t->periodMs != 0 && (uint16_t)(now - t->lastRun) < t->periodMs) continue;
+    t->lastRun = now;
+    run(t);
+    runUrgent();
+  }
+}
+
+void LoopScheduler::runUrgent() {
+  for (byte i = 0; i < taskCount && tasks[i].priority == LOOP_URGENT; i++)
+    run(&tasks[i]);
+}
+
+void LoopScheduler::run(Task *t) {
+  unsigned long start = micros();
+  t->function();
+  unsigned long elapsed = micros() - start;
+  // Saturate rather than wrap, if the figures go unread for long enough
+  if (t->busyMicros > 0xFFFFFFFFUL - elapsed) t->busyMicros = 0xFFFFFFFFUL;
+  else t->busyMicros += elapsed;
+  if (elapsed > t->maxMicros) t->maxMicros = elapsed < 0xffff ? elapsed : 0xffff;
+  if (elapsed > t->budgetMicros && t->overruns != 0xffff) t->overruns++;
+  if (t->step < LOOP_STEPS) LoopTimes::record(t->step, elapsed);
+}
+
+void LoopScheduler::display(Print *stream) {
+  unsigned long elapsedMs = millis() - statsStart;
+  if (elapsedMs == 0) elapsedMs = 1;
+  // 64 bits, as passes*1000 overflows after a few seconds of a fast loop
+  unsigned long perSecond = (unsigned long)((uint64_t)passes * 1000 / elapsedMs);
+  StringFormatter::send(stream, F("Loop passes=%l/s over %lms\n"), perSecond, elapsedMs);
+  for (byte i = 0; i < taskCount; i++) {
+    Task *t = &tasks[i];
+    // tenths of a percent
+    unsigned long duty = t->busyMicros / elapsedMs;
+    StringFormatter::send(stream, F("%S pri=%d duty=%l.%d%% max=%uuS budget=%uuS over=%u\n"),
+      t->name, t->priority, duty / 10, (int)(duty % 10), t->maxMicros, t->budgetMicros, t->overruns);
+    t->busyMicros = 0;
+    t->maxMicros = 0;
+    t->overruns = 0;
+  }
+  passes = 0;
+  statsStart = millis();
+}
@@ -0,0 +1,78 @@
+/*
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef LoopScheduler_h
+#define LoopScheduler_h
+#include <Arduino.h>
+#include "FSH.h"
+#include "LoopTimes.h"
+
+// Cooperative scheduler for the main loop().  Each part of the command station is
+// added in setup() as a task with a priority, a period and a time budget, e.g.
+//
+//    LoopScheduler::add(F("LCD"), LCDDisplay::loop, LOOP_BACKGROUND, 10, 2000, LOOP_LCD);
+//
+// Each pass runs the tasks that are due in priority order.  LOOP_URGENT tasks (DCC 
+// reminders and the prog track ack manager) run at the start of the pass and again 
+// after each other task, so a slow network or display task holds them up for no more 
+// than its own run.  A task with a period runs at most once in that many milliseconds.
+// A run that takes longer than the task's budget is counted as an overrun.
+// <D TASKS> lists each task's share of the time (its duty cycle), longest run and 
+// overruns since the last <D TASKS>.
+
+#ifndef LOOP_MAX_TASKS
+#define LOOP_MAX_TASKS 14
+#endif
+
+enum LoopPriority : byte {
+  LOOP_URGENT,      // every pass, and between other tasks
+  LOOP_HIGH,        // commands from throttles and JMRI
+  LOOP_NORMAL,      // automation, IO and sensors
+  LOOP_BACKGROUND,  // display and housekeeping
+};
+
+class LoopScheduler {
+public:
+  typedef void (*TaskFunction)();
+  // step is the <D LOOP> histogram for the task, LOOP_STEPS for none.
+  // Returns false if there are already LOOP_MAX_TASKS.
+  static bool add(const FSH *name, TaskFunction function, LoopPriority priority,
+                  uint16_t periodMs, uint16_t budgetMicros, LoopStep step=LOOP_STEPS);
+  static void loop();
+  // Print the figures for each task and start again
+  static void display(Print *stream);
+
+private:
+  struct Task {
+    const FSH *name;
+    TaskFunction function;
+    LoopPriority priority;
+    LoopStep step;
+    uint16_t periodMs;
+    uint16_t budgetMicros;
+    uint16_t lastRun;       // millis
+    uint16_t maxMicros;
+    uint16_t overruns;
+    unsigned long busyMicros;  // sticks at its maximum after about 71 minutes busy
+  };
+  static void run(Task *task);
+  static void runUrgent();
+  static Task tasks[LOOP_MAX_TASKS];  // sorted by priority
+  static byte taskCount;
+  static unsigned long passes;
+  static unsigned long statsStart;  // millis
+};
+#endif
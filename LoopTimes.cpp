@@ -0,0 +1,75 @@
+/*
+ *  This file is part of DCC-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "LoopTimes.h"
+#ifdef DIAG_LOOPTIMES
+#include "StringFormatter.h"
+
+uint16_t LoopTimes::histogram[LOOP_STEPS][BUCKETS];
+unsigned long LoopTimes::maxMicros[LOOP_STEPS];
+unsigned long LoopTimes::loopStart = 0;
+
+void LoopTimes::start() {
+  unsigned long now = micros();
+  if (loopStart != 0) record(LOOP_TOTAL, now - loopStart);
+  loopStart = now;
+}
+
+void LoopTimes::record(LoopStep step, unsigned long elapsed) {
+  if (elapsed > maxMicros[step]) maxMicros[step] = elapsed;
+  byte bucket = 0;
+  for (unsigned long t = elapsed; t > 1 && bucket < BUCKETS-1; t >>= 1) bucket++;
+  if (histogram[step][bucket] != 0xffff) histogram[step][bucket]++;
+}
+
+static const FSH * stepName(byte step) {
+  switch (step) {
+    case LOOP_DCC: return F("DCC");
+    case LOOP_SERIAL: return F("Serial");
+    case LOOP_NETWORK: return F("Network");
+    case LOOP_RMFT: return F("RMFT");
+    case LOOP_LCD: return F("LCD");
+    case LOOP_IO: return F("IO");
+    case LOOP_SENSORS: return F("Sensors");
+    default: return F("Total");
+  }
+}
+
+void LoopTimes::display(Print *stream) {
+  for (byte step = 0; step < LOOP_STEPS; step++) {
+    unsigned long count = 0;
+    for (byte b = 0; b < BUCKETS; b++) count += histogram[step][b];
+    // 99th percentile, as the upper limit of the bucket that contains it
+    unsigned long limit = count - count / 100;
+    unsigned long sum = 0;
+    byte p99 = 0;
+    for (; p99 < BUCKETS-1; p99++) {
+      sum += histogram[step][p99];
+      if (sum >= limit) break;
+    }
+    StringFormatter::send(stream, F("%S n=%l p99<%luS max=%luS :"), 
+      stepName(step), count, 2UL << p99, maxMicros[step]);
+    for (byte b = 0; b < BUCKETS; b++) 
+      StringFormatter::send(stream, F(" %u"), histogram[step][b]);
+    StringFormatter::send(stream, F("\n"));
+    for (byte b = 0; b < BUCKETS; b++) histogram[step][b] = 0;
+    maxMicros[step] = 0;
+  }
+  // Don't count the time taken by this command
+  loopStart = 0;
+}
+#endif
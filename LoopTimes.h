@@ -0,0 +1,59 @@
+/*
+ *  This file is part of DCC-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LoopTimes_h
+#define LoopTimes_h
+#include <Arduino.h>
+
+// Define symbol DIAG_LOOPTIMES to record the execution time of each step of the 
+// main loop(), each run of the LoopScheduler task (or tasks) for that step and each
+// pass as the total.  The histograms are printed and cleared by the <D LOOP> command.
+//#define DIAG_LOOPTIMES
+
+// Steps of the main loop
+enum LoopStep : byte {
+  LOOP_DCC,
+  LOOP_SERIAL,
+  LOOP_NETWORK,  // WiFi and Ethernet
+  LOOP_RMFT,
+  LOOP_LCD,      // LCN and LCDDisplay
+  LOOP_IO,
+  LOOP_SENSORS,
+  LOOP_TOTAL,    // the whole of loop()
+  LOOP_STEPS
+};
+
+class LoopTimes {
+public:
+#ifdef DIAG_LOOPTIMES
+  // Call start() at the top of loop(), and record() with the time a step took.
+  static void start();
+  static void record(LoopStep step, unsigned long elapsed);
+  // Print the histograms and start again
+  static void display(Print *stream);
+private:
+  // Bucket n counts times from 2^n to 2^(n+1)-1 microseconds, the last one everything longer.
+  static const byte BUCKETS = 16;
+  static uint16_t histogram[LOOP_STEPS][BUCKETS];
+  static unsigned long maxMicros[LOOP_STEPS];
+  static unsigned long loopStart;
+#else
+  static inline void start() {}
+  static inline void record(LoopStep, unsigned long) {}
+#endif
+};
+#endif
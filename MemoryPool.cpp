@@ -0,0 +1,102 @@
+/*
+ *  This file is part of DCC-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "MemoryPool.h"
+#include "StringFormatter.h"
+
+MemoryPool *MemoryPool::first = NULL;
+int MemoryPool::tagBytes[MEMORY_TAGS];
+uint16_t MemoryPool::tagBlocks[MEMORY_TAGS];
+
+MemoryPool::MemoryPool(const FSH *name, size_t slotSize, uint16_t reserve) {
+  this->name = name;
+  // Slots must be big enough to hold the free list link.
+  this->slotSize = slotSize < sizeof(FreeSlot) ? sizeof(FreeSlot) : slotSize;
+  this->reserve = reserve;
+  next = first;
+  first = this;
+}
+
+void *MemoryPool::allocate() {
+  if (!freeList && allocated == 0 && reserve > 0) {
+    // First use, so allocate the reserved slots in one block.
+    byte *block = (byte *)malloc(slotSize * reserve);
+    if (block) {
+      for (uint16_t i = 0; i < reserve; i++) {
+        FreeSlot *fs = (FreeSlot *)(block + i * slotSize);
+        fs->next = freeList;
+        freeList = fs;
+      }
+      allocated = reserve;
+    }
+  }
+  void *slot;
+  if (freeList) {
+    slot = freeList;
+    freeList = freeList->next;
+  } else {
+    slot = malloc(slotSize);
+    if (!slot) return NULL;
+    allocated++;
+  }
+  memset(slot, 0, slotSize);
+  if (++inUse > maxInUse) maxInUse = inUse;
+  return slot;
+}
+
+void MemoryPool::release(void *slot) {
+  if (!slot) return;
+  FreeSlot *fs = (FreeSlot *)slot;
+  fs->next = freeList;
+  freeList = fs;
+  inUse--;
+}
+
+void MemoryPool::count(MemoryTag tag, int size) {
+  tagBytes[tag] += size;
+  if (size > 0) tagBlocks[tag]++;
+  else if (size < 0) tagBlocks[tag]--;
+}
+
+void *MemoryPool::allocate(MemoryTag tag, size_t size) {
+  void *p = malloc(size);
+  if (p) count(tag, size);
+  return p;
+}
+
+void MemoryPool::release(MemoryTag tag, void *p, size_t size) {
+  if (!p) return;
+  free(p);
+  count(tag, -(int)size);
+}
+
+static const FSH *tagName(byte tag) {
+  switch (tag) {
+    case MEMORY_RINGSTREAMS: return F("RingStreams");
+    case MEMORY_WITHROTTLES: return F("WiThrottles");
+    case MEMORY_TURNOUTS: return F("Turnouts");
+  }
+  return F("?");
+}
+
+void MemoryPool::displayAll(Print *stream) {
+  for (MemoryPool *pool = first; pool; pool = pool->next) 
+    StringFormatter::send(stream, F("%S size=%d used=%d max=%d allocated=%d\n"), 
+      pool->name, (int)pool->slotSize, pool->inUse, pool->maxInUse, pool->allocated);
+  for (byte tag = 0; tag < MEMORY_TAGS; tag++)
+    StringFormatter::send(stream, F("%S bytes=%d blocks=%d\n"), tagName(tag), tagBytes[tag], tagBlocks[tag]);
+}
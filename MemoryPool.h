@@ -0,0 +1,71 @@
+/*
+ *  This file is part of DCC-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef MemoryPool_h
+#define MemoryPool_h
+#include <Arduino.h>
+#include "FSH.h"
+
+// Numbers of objects of each kind to allocate in one block at startup.  Further objects
+// are taken from the heap as needed.  Either way, released objects are kept on a free
+// list for reuse and not returned to the heap, so that objects created and destroyed
+// continually (e.g. EXRAIL tasks) don't fragment it.
+#ifndef POOL_RESERVE_SENSORS
+#define POOL_RESERVE_SENSORS 0
+#endif
+#ifndef POOL_RESERVE_OUTPUTS
+#define POOL_RESERVE_OUTPUTS 0
+#endif
+#ifndef POOL_RESERVE_TASKS
+#define POOL_RESERVE_TASKS 0
+#endif
+
+// Subsystems whose heap blocks aren't from a pool, but are counted for <D RAM>.
+enum MemoryTag : byte {
+  MEMORY_RINGSTREAMS,
+  MEMORY_WITHROTTLES,
+  MEMORY_TURNOUTS,   // turnout objects and index
+  MEMORY_TAGS
+};
+
+class MemoryPool {
+public:
+  MemoryPool(const FSH *name, size_t slotSize, uint16_t reserve);
+  // Returns a zeroed slot, or NULL if out of memory.
+  void *allocate();
+  void release(void *slot);
+  static void displayAll(Print *stream);
+  // Count a heap block taken for a subsystem, or given back if size is negative.
+  static void count(MemoryTag tag, int size);
+  // Counted allocation, for a class's operator new and delete.
+  static void *allocate(MemoryTag tag, size_t size);
+  static void release(MemoryTag tag, void *p, size_t size);
+private:
+  struct FreeSlot { FreeSlot *next; };
+  const FSH *name;
+  size_t slotSize;
+  uint16_t reserve;
+  uint16_t inUse = 0;
+  uint16_t maxInUse = 0;
+  uint16_t allocated = 0;  // slots taken from the heap, including those reserved
+  FreeSlot *freeList = NULL;
+  MemoryPool *next;
+  static MemoryPool *first;
+  static int tagBytes[MEMORY_TAGS];
+  static uint16_t tagBlocks[MEMORY_TAGS];
+};
+#endif
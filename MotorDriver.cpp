@@ -62,9 +62,11 @@ MotorDriver::MotorDriver(byte power_pin, byte signal_pin, byte signal_pin2, int8
   else brakePin=UNUSED_PIN;
   
   currentPin=current_pin;
+  adcSlot=-1;
   if (currentPin!=UNUSED_PIN) {
     pinMode(currentPin, INPUT);
     senseOffset=analogRead(currentPin); // value of sensor at zero current
+    adcSlot=ADCee::init(currentPin);
   }
 
   faultPin=fault_pin;
@@ -148,10 +150,16 @@ bool MotorDriver::canMeasureCurrent() {
 int MotorDriver::getCurrentRaw() {
   if (currentPin==UNUSED_PIN) return 0; 
   int current;
+  if (adcSlot>=0) {
+    // sampled in the background by the DCC interrupt
+    current = ADCee::read(adcSlot)-senseOffset;
+  } else {
 #if defined(ARDUINO_TEENSY40) || defined(ARDUINO_TEENSY41)
   bool irq = disableInterrupts();
   current = analogRead(currentPin)-senseOffset;
   enableInterrupts(irq);
+#elif defined(ARDUINO_ARCH_ESP32)
+  current = analogRead(currentPin)-senseOffset;
 #else // Uno, Mega and all the TEENSY3* but not TEENSY4* 
   unsigned char sreg_backup;
   sreg_backup = SREG;   /* save interrupt enable/disable state */
@@ -162,6 +170,7 @@ int MotorDriver::getCurrentRaw() {
 #endif
   if (sreg_backup & 128) sei();  /* restore interrupt state */
 #endif // outer #
+  }
   if (current<0) current=0-current;
   if ((faultPin != UNUSED_PIN)  && isLOW(fastFaultPin) && isHIGH(fastPowerPin))
       return (current == 0 ? -1 : -current);
@@ -169,6 +178,24 @@ int MotorDriver::getCurrentRaw() {
   // IMPORTANT:  This function can be called in Interrupt() time within the 56uS timer
   //             The default analogRead takes ~100uS which is catastrphic
   //             so DCCTimer has set the sample time to be much faster.  
+  //             Where ADCee scans the pin in the background no ADC wait is needed at all.
+}
+
+// As getCurrentRaw but each sample in the background ADC ring taken since seen,
+// if the pin has one, so that short peaks aren't averaged away.  Returns how many.
+byte MotorDriver::getCurrentSamples(int *values, byte &seen) {
+  if (currentPin==UNUSED_PIN) return 0;
+  if (adcSlot<0) {
+    int current=getCurrentRaw();
+    values[0]=current<0 ? -current : current;
+    return 1;
+  }
+  byte n=ADCee::readSamples(adcSlot, values, seen);
+  for (byte i=0; i<n; i++) {
+    values[i]-=senseOffset;
+    if (values[i]<0) values[i]=-values[i];
+  }
+  return n;
 }
 
 unsigned int MotorDriver::raw2mA( int raw) {
@@ -29,7 +29,7 @@
 #define UNUSED_PIN 127 // inside int8_t
 #endif
 
-#if defined(__IMXRT1062__)
+#if defined(__IMXRT1062__) || defined(ARDUINO_ARCH_ESP32)
 struct FASTPIN {
   volatile uint32_t *inout;
   uint32_t maskHIGH;  
@@ -51,6 +51,8 @@ class MotorDriver {
     virtual void setSignal( bool high);
     virtual void setBrake( bool on);
     virtual int  getCurrentRaw();
+    // The raw samples since seen, for telemetry.  values must hold ADC_RING_SIZE.
+    byte getCurrentSamples(int *values, byte &seen);
     virtual unsigned int raw2mA( int raw);
     virtual int mA2raw( unsigned int mA);
     inline int getRawCurrentTripValue() {
@@ -58,6 +60,12 @@ class MotorDriver {
     }
     bool isPWMCapable();
     bool canMeasureCurrent();
+    inline bool isSampledInBackground() {
+	return adcSlot >= 0;
+    }
+    inline bool canBrake() {
+	return brakePin != UNUSED_PIN;
+    }
     static bool usePWM;
     static bool commonFaultPin; // This is a stupid motor shield which has only a common fault pin for both outputs
     inline byte getFaultPin() {
@@ -74,6 +82,7 @@ class MotorDriver {
     bool invertBrake;       // brake pin passed as negative means pin is inverted
     float senseFactor;
     int senseOffset;
+    int8_t adcSlot;        // background ADC sample slot, -1 if read directly
     unsigned int tripMilliamps;
     int rawCurrentTripValue;
 #if defined(ARDUINO_TEENSY40) || defined(ARDUINO_TEENSY41)
@@ -88,4 +97,63 @@ class MotorDriver {
     }
 #endif
 };
+
+#if defined(ARDUINO_AVR_UNO) || defined(ARDUINO_AVR_NANO) || defined(ARDUINO_AVR_MEGA) || defined(ARDUINO_AVR_MEGA2560)
+#include "DCCTimer.h"
+#define MOTOR_DRIVER_FIXED_PINS
+
+// Output register address and bit of each Arduino pin, known when the code is built,
+// so that setting a pin in FixedPin compiles to a single sbi or cbi instruction.
+// Registers above 0x3F (ports H to L on a Mega) take a read, modify and write.
+#if defined(ARDUINO_AVR_UNO) || defined(ARDUINO_AVR_NANO)
+constexpr uint16_t fixedPinPort(byte pin) {
+  return pin < 8 ? 0x2B : pin < 14 ? 0x25 : pin < 20 ? 0x28 : 0;  // D, B, C
+}
+constexpr uint8_t fixedPinMask(byte pin) {
+  return 1 << (pin < 8 ? pin : pin < 14 ? pin-8 : pin-14);
+}
+#else
+constexpr uint16_t fixedPortAddress(char port) {
+  return port=='A' ? 0x22 : port=='B' ? 0x25 : port=='C' ? 0x28 : port=='D' ? 0x2B
+    : port=='E' ? 0x2E : port=='F' ? 0x31 : port=='G' ? 0x34 : port=='H' ? 0x102
+    : port=='J' ? 0x105 : port=='K' ? 0x108 : port=='L' ? 0x10B : 0;
+}
+constexpr uint16_t fixedPinPort(byte pin) {
+  return pin < 70 ? fixedPortAddress("EEEEGEHHHHBBBBJJHHDDDDAAAAAAAACCCCCCCCDGGGLLLLLLLLBBBBFFFFFFFFKKKKKKKK"[pin]) : 0;
+}
+constexpr uint8_t fixedPinMask(byte pin) {
+  return 1 << ("0145533456456710103210012345677654321072107654321032100123456701234567"[pin] - '0');
+}
+#endif
+
+template <byte PIN> struct FixedPin {
+  static_assert(fixedPinPort(PIN) != 0, "FixedPin used for a pin this board hasn't got");
+  static inline void write(bool high) {
+    if (high) *(volatile uint8_t *)fixedPinPort(PIN) |= fixedPinMask(PIN);
+    else *(volatile uint8_t *)fixedPinPort(PIN) &= ~fixedPinMask(PIN);
+  }
+};
+template <> struct FixedPin<UNUSED_PIN> {
+  static inline void write(bool) {}
+};
+
+// A motor driver whose signal pins are fixed when the code is built, for the shields in
+// MotorDrivers.h.  setSignal, called by the waveform interrupt on every half bit, then
+// has no pointers to follow or dual signal test to make.  MotorDriver does the rest.
+template <byte SIGNAL_PIN, byte SIGNAL_PIN2>
+class FixedSignalMotorDriver : public MotorDriver {
+  public:
+    FixedSignalMotorDriver(byte power_pin, int8_t brake_pin, byte current_pin,
+                           float senseFactor, unsigned int tripMilliamps, byte faultPin) :
+      MotorDriver(power_pin, SIGNAL_PIN, SIGNAL_PIN2, brake_pin, current_pin, senseFactor, tripMilliamps, faultPin) {}
+    void setSignal(bool high) override {
+      if (usePWM) {
+        DCCTimer::setPWM(SIGNAL_PIN, high);
+        return;
+      }
+      FixedPin<SIGNAL_PIN>::write(high);
+      FixedPin<SIGNAL_PIN2>::write(!high);
+    }
+};
+#endif
 #endif
@@ -24,6 +24,7 @@
 #ifndef MotorDrivers_h
 #define MotorDrivers_h
 #include <Arduino.h>
+#include "MotorDriver.h"
 
 // *** PLEASE NOTE *** THIS FILE IS  **NOT**  INTENDED TO BE EDITED WHEN CONFIGURING A SYSTEM.
 // It will be overwritten if the library is updated.
@@ -45,15 +46,27 @@
 // of the brake pin on the motor bridge is inverted
 // (HIGH == release brake)
 //
+// The STANDARD, POLOLU and FIREBOX shields below use FixedSignalMotorDriver (see
+// MotorDriver.h) on the boards which support it, so the signal pins are set
+// through constant port addresses.  NEW_FIXED_MOTOR_DRIVER takes the same
+// parameters as MotorDriver, with the signal pins as constants.
+#if defined(MOTOR_DRIVER_FIXED_PINS)
+#define NEW_FIXED_MOTOR_DRIVER(power_pin, signal_pin, signal_pin2, brake_pin, current_pin, senseFactor, tripMilliamps, faultPin) \
+  new FixedSignalMotorDriver<signal_pin, signal_pin2>(power_pin, brake_pin, current_pin, senseFactor, tripMilliamps, faultPin)
+#else
+#define NEW_FIXED_MOTOR_DRIVER(power_pin, signal_pin, signal_pin2, brake_pin, current_pin, senseFactor, tripMilliamps, faultPin) \
+  new MotorDriver(power_pin, signal_pin, signal_pin2, brake_pin, current_pin, senseFactor, tripMilliamps, faultPin)
+#endif
+//
 // Arduino standard Motor Shield
 #define STANDARD_MOTOR_SHIELD F("STANDARD_MOTOR_SHIELD"),                                                 \
-                              new MotorDriver(3, 12, UNUSED_PIN, UNUSED_PIN, A0, 2.99, 2000, UNUSED_PIN), \
-                              new MotorDriver(11, 13, UNUSED_PIN, UNUSED_PIN, A1, 2.99, 2000, UNUSED_PIN)
+                              NEW_FIXED_MOTOR_DRIVER(3, 12, UNUSED_PIN, UNUSED_PIN, A0, 2.99, 2000, UNUSED_PIN), \
+                              NEW_FIXED_MOTOR_DRIVER(11, 13, UNUSED_PIN, UNUSED_PIN, A1, 2.99, 2000, UNUSED_PIN)
 
 // Pololu Motor Shield
 #define POLOLU_MOTOR_SHIELD F("POLOLU_MOTOR_SHIELD"),                                                 \
-                            new MotorDriver( 9, 7, UNUSED_PIN,         -4, A0, 18, 3000, 12), \
-                            new MotorDriver(10, 8, UNUSED_PIN, UNUSED_PIN, A1, 18, 3000, 12)
+                            NEW_FIXED_MOTOR_DRIVER( 9, 7, UNUSED_PIN,         -4, A0, 18, 3000, 12), \
+                            NEW_FIXED_MOTOR_DRIVER(10, 8, UNUSED_PIN, UNUSED_PIN, A1, 18, 3000, 12)
 //
 // Actually, on the Pololu MC33926 shield the enable lines are tied together on pin 4 and the
 // pins 9 and 10 work as "inverted brake" but as we turn on and off the tracks individually
@@ -67,13 +80,13 @@
 
 // Firebox Mk1
 #define FIREBOX_MK1 F("FIREBOX_MK1"),                                                  \
-                    new MotorDriver(3, 6, 7, UNUSED_PIN, A5, 9.766, 5500, UNUSED_PIN), \
-                    new MotorDriver(4, 8, 9, UNUSED_PIN, A1, 5.00, 1000, UNUSED_PIN)
+                    NEW_FIXED_MOTOR_DRIVER(3, 6, 7, UNUSED_PIN, A5, 9.766, 5500, UNUSED_PIN), \
+                    NEW_FIXED_MOTOR_DRIVER(4, 8, 9, UNUSED_PIN, A1, 5.00, 1000, UNUSED_PIN)
 
 // Firebox Mk1S
 #define FIREBOX_MK1S F("FIREBOX_MK1A"),                                            \
-                     new MotorDriver(24, 21, 22, 25, 23, 9.766, 5500, UNUSED_PIN), \
-                     new MotorDriver(30, 27, 28, 31, 29, 5.00, 1000, UNUSED_PIN)
+                     NEW_FIXED_MOTOR_DRIVER(24, 21, 22, 25, 23, 9.766, 5500, UNUSED_PIN), \
+                     NEW_FIXED_MOTOR_DRIVER(30, 27, 28, 31, 29, 5.00, 1000, UNUSED_PIN)
 
 // FunduMoto Motor Shield
 #define FUNDUMOTO_SHIELD F("FUNDUMOTO_SHIELD"),                                              \
@@ -90,7 +90,12 @@ the state of any outputs being monitored or controlled by a separate interface o
 #include "EEStore.h"
 #endif
 #include "StringFormatter.h"
+#include "CommandDistributor.h"
 #include "IODevice.h"
+#include "MemoryPool.h"
+
+static const char outputPoolName[] FLASH = "Outputs";
+static MemoryPool outputPool((const FSH *)outputPoolName, sizeof(Output), POOL_RESERVE_OUTPUTS);
 
 ///////////////////////////////////////////////////////////////////////////////
 // Static function to print all output states to stream in the form "<Y id state>"
@@ -106,13 +111,61 @@ void Output::printAll(Print *stream){
 void  Output::activate(uint16_t s){
   s = (s>0);  // Make 0 or 1
   data.active = s;                     // if s>0, set status to active, else inactive
-  // set state of output pin to HIGH or LOW depending on whether bit zero of iFlag is set to 0 (ACTIVE=HIGH) or 1 (ACTIVE=LOW)
-  IODevice::write(data.pin, s ^ data.invert);  
+  version = CommandDistributor::newVersion();
 #ifndef DISABLE_EEPROM
   // Update EEPROM if output has been stored.    
   if(EEStore::eeStore->data.nOutputs > 0 && num > 0)
-    EEPROM.put(num, data.oStatus);
+    EEStore::writeLater(num, data.oStatus);
 #endif
+  if (batching) {
+    for (uint16_t i=0; i<batchSize; i++)
+      if (batch[i]==this) return;  // already waiting
+    if (batchSize==batchCapacity) {
+      Output **newBatch=(Output **)realloc(batch, (batchCapacity+16) * sizeof(Output *));
+      if (newBatch) {
+        batch=newBatch;
+        batchCapacity+=16;
+      }
+    }
+    if (batchSize<batchCapacity) {
+      batch[batchSize++]=this;
+      return;
+    }
+    // No room to defer the write, so do it now.
+  }
+  // set state of output pin to HIGH or LOW depending on whether bit zero of iFlag is set to 0 (ACTIVE=HIGH) or 1 (ACTIVE=LOW)
+  vpinHandle.write(s ^ data.invert);  
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Static functions to group the pin writes of several activate() calls.
+
+void Output::beginBatch() {
+  batching=true;
+}
+
+void Output::endBatch() {
+  batching=false;
+  // Sort the waiting outputs by pin, so each device's pins are together
+  for (uint16_t i=1; i<batchSize; i++) {
+    Output *tt=batch[i];
+    uint16_t j=i;
+    for (; j>0 && batch[j-1]->data.pin > tt->data.pin; j--) batch[j]=batch[j-1];
+    batch[j]=tt;
+  }
+  // Write the pins within each run of 32 vpins together
+  uint16_t i=0;
+  while (i<batchSize) {
+    VPIN firstPin=batch[i]->data.pin;
+    uint32_t mask=0, values=0;
+    for (; i<batchSize && batch[i]->data.pin - firstPin < 32; i++) {
+      uint32_t bit=1UL << (batch[i]->data.pin - firstPin);
+      mask|=bit;
+      if (batch[i]->data.active ^ batch[i]->data.invert) values|=bit;
+    }
+    IODevice::writeMultiple(firstPin, mask, values);
+  }
+  batchSize=0;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -120,9 +173,9 @@ void  Output::activate(uint16_t s){
 //   Return NULL if not found.
 
 Output* Output::get(uint16_t n){
-  Output *tt;
-  for(tt=firstOutput;tt!=NULL && tt->data.id!=n;tt=tt->nextOutput);
-  return(tt);
+  uint16_t i=findId(n);
+  if (i<indexSize && idIndex[i]->data.id==n) return idIndex[i];
+  return NULL;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -132,6 +185,7 @@ Output* Output::get(uint16_t n){
 bool Output::remove(uint16_t n){
   Output *tt,*pp=NULL;
 
+  if (get(n)==NULL) return false;
   for(tt=firstOutput;tt!=NULL && tt->data.id!=n;pp=tt,tt=tt->nextOutput);
 
   if(tt==NULL) return false;
@@ -141,10 +195,54 @@ bool Output::remove(uint16_t n){
   else
     pp->nextOutput=tt->nextOutput;
 
-  free(tt);
+  removeFromIndex(tt);
+  for (uint16_t i=0; i<batchSize; i++) {
+    if (batch[i]==tt) {
+      memmove(&batch[i], &batch[i+1], (batchSize-i-1) * sizeof(Output *));
+      batchSize--;
+      break;
+    }
+  }
+  outputPool.release(tt);
+
+  return true;
+  }
+
+///////////////////////////////////////////////////////////////////////////////
+// Static functions to maintain the index of outputs by id.
+
+uint16_t Output::findId(uint16_t id) {
+  uint16_t low = 0, high = indexSize;
+  while (low < high) {
+    uint16_t mid = (low + high) / 2;
+    if (idIndex[mid]->data.id < id) low = mid + 1;
+    else high = mid;
+  }
+  return low;
+}
 
+bool Output::addToIndex(Output *tt) {
+  if (indexSize == indexCapacity) {
+    uint16_t newCapacity = indexCapacity + 16;
+    Output **newIdIndex = (Output **)realloc(idIndex, newCapacity * sizeof(Output *));
+    if (!newIdIndex) return false;
+    idIndex = newIdIndex;
+    indexCapacity = newCapacity;
+  }
+  uint16_t i = findId(tt->data.id);
+  memmove(&idIndex[i+1], &idIndex[i], (indexSize-i) * sizeof(Output *));
+  idIndex[i] = tt;
+  indexSize++;
   return true;
+}
+
+void Output::removeFromIndex(Output *tt) {
+  uint16_t i = findId(tt->data.id);
+  if (i < indexSize && idIndex[i] == tt) {
+    memmove(&idIndex[i], &idIndex[i+1], (indexSize-i-1) * sizeof(Output *));
+    indexSize--;
   }
+}
 
 ///////////////////////////////////////////////////////////////////////////////
 // Static function to load configuration and state of all Outputs from EEPROM
@@ -153,16 +251,19 @@ void Output::load(){
   struct OutputData data;
   Output *tt;
 
+  // Write the restored states together once they are all known
+  beginBatch();
   for(uint16_t i=0;i<EEStore::eeStore->data.nOutputs;i++){
-    EEPROM.get(EEStore::pointer(),data);
+    EEStore::get(data);
     // Create new object, set current state to default or to saved state from eeprom.
     tt=create(data.id, data.pin, data.flags);
-    uint8_t state = data.setDefault ? data.defaultValue : data.active;
-    tt->activate(state);
-
-    if (tt) tt->num=EEStore::pointer() + offsetof(OutputData, oStatus); // Save pointer to flags within EEPROM
+    if (tt) {
+      tt->activate(data.setDefault ? data.defaultValue : data.active);
+      tt->num=EEStore::pointer() + offsetof(OutputData, oStatus); // Save pointer to flags within EEPROM
+    }
     EEStore::advance(sizeof(tt->data));
   }
+  endBatch();
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -195,21 +296,27 @@ Output *Output::create(uint16_t id, VPIN pin, int iFlag, int v){
 
   if (pin > VPIN_MAX) return NULL;
   
-  if(firstOutput==NULL){
-    firstOutput=(Output *)calloc(1,sizeof(Output));
-    tt=firstOutput;
-  } else if((tt=get(id))==NULL){
-    tt=firstOutput;
-    while(tt->nextOutput!=NULL)
-      tt=tt->nextOutput;
-    tt->nextOutput=(Output *)calloc(1,sizeof(Output));
-    tt=tt->nextOutput;
+  if((tt=get(id))==NULL){
+    tt=(Output *)outputPool.allocate();
+    if(tt==NULL) return tt;
+    tt->data.id=id;
+    if (!addToIndex(tt)) {
+      outputPool.release(tt);
+      return NULL;
+    }
+    if(firstOutput==NULL)
+      firstOutput=tt;
+    else {
+      Output *pp=firstOutput;
+      while(pp->nextOutput!=NULL)
+        pp=pp->nextOutput;
+      pp->nextOutput=tt;
+    }
   }
 
-  if(tt==NULL) return tt;
   tt->num = 0; // make sure new object doesn't get written to EEPROM until store() command
-  tt->data.id=id;
   tt->data.pin=pin;
+  tt->vpinHandle.setVpin(pin);
   tt->data.flags=iFlag;
 
   if(v==1){
@@ -219,7 +326,7 @@ Output *Output::create(uint16_t id, VPIN pin, int iFlag, int v){
     else
       tt->data.active = 0;
   }
-  IODevice::write(tt->data.pin, tt->data.active ^ tt->data.invert);
+  tt->activate(tt->data.active);
 
   return(tt);
 }
@@ -227,3 +334,10 @@ Output *Output::create(uint16_t id, VPIN pin, int iFlag, int v){
 ///////////////////////////////////////////////////////////////////////////////
 
 Output *Output::firstOutput=NULL;
+Output **Output::idIndex=NULL;
+uint16_t Output::indexSize=0;
+uint16_t Output::indexCapacity=0;
+bool Output::batching=false;
+Output **Output::batch=NULL;
+uint16_t Output::batchSize=0;
+uint16_t Output::batchCapacity=0;
@@ -56,12 +56,32 @@ public:
   static void store();
 #endif
   static Output *create(uint16_t, VPIN, int, int=0);
+  // Between beginBatch and endBatch, activate() only records the new states, and endBatch
+  // writes them together, one call per device, so an I/O extender port is written once.
+  static void beginBatch();
+  static void endBatch();
   static Output *firstOutput;
   struct OutputData data;
+  VpinHandle vpinHandle;  // caches the device for data.pin
   Output *nextOutput;
+  uint16_t version;  // CommandDistributor::stateVersion when created or last changed
   static void printAll(Print *);
 private:
   uint16_t num;  // EEPROM address of oStatus in OutputData struct, or zero if not stored.
+
+  // Outputs in order of data.id, for get() and remove()
+  static Output **idIndex;
+  static uint16_t indexSize;
+  static uint16_t indexCapacity;
+  static uint16_t findId(uint16_t id);  // position of first output with data.id >= id
+  static bool addToIndex(Output *tt);
+  static void removeFromIndex(Output *tt);
+
+  // Outputs activated since beginBatch, waiting to be written
+  static bool batching;
+  static Output **batch;
+  static uint16_t batchSize;
+  static uint16_t batchCapacity;
   
 }; // Output
   
@@ -23,22 +23,34 @@
 
 RingStream::RingStream( const uint16_t len)
 {
-  _len=len;
-  _buffer=new byte[len];
+  // Round up to a power of two so that positions wrap with a mask
+  _len=1;
+  while (_len<len) _len<<=1;
+  _mask=_len-1;
+  _buffer=new byte[_len];
+  if (_buffer) MemoryPool::count(MEMORY_RINGSTREAMS, _len);
   _pos_write=0;
   _pos_read=0;
   _buffer[0]=0;
   _overflow=false;
   _mark=0;
+  _markCountOffset=1;
   _count=0; 
+  _replay=false;
+  _replayStart=0;
+}
+
+// Oldest position that must not be overwritten.  A broadcast message being replayed
+// for further clients is kept until the last one has read it.
+int RingStream::holdPosition() {
+  return _replay ? _replayStart : _pos_read;
 }
 
 size_t RingStream::write(uint8_t b) {
   if (_overflow) return 0;
   _buffer[_pos_write] = b;
-  ++_pos_write;
-  if (_pos_write==_len) _pos_write=0;
-  if (_pos_write==_pos_read) {
+  _pos_write=(_pos_write+1) & _mask;
+  if (_pos_write==holdPosition()) {
     _overflow=true; 
     return 0;
   }
@@ -46,15 +58,48 @@ size_t RingStream::write(uint8_t b) {
   return 1;
 }
 
+size_t RingStream::write(const uint8_t * buffer, size_t size) {
+  if (_overflow) return 0;
+  int hold=holdPosition();
+  size_t space = (hold-_pos_write-1) & _mask;
+  size_t length = (size>space) ? space : size;
+  // Copy up to the end of the buffer, then any remainder from the start
+  size_t first = _len-_pos_write;
+  if (first>length) first=length;
+  memcpy(_buffer+_pos_write, buffer, first);
+  memcpy(_buffer, buffer+first, length-first);
+  _pos_write=(_pos_write+length) & _mask;
+  _count+=length;
+  if (size>length) {
+    // As write(b), the byte that reaches the hold position overflows
+    _buffer[_pos_write]=buffer[length];
+    _pos_write=hold;
+    _overflow=true;
+  }
+  return length;
+}
+
 int RingStream::read() {
   if ((_pos_read==_pos_write) && !_overflow) return -1;  // empty  
   byte b=_buffer[_pos_read];
-  _pos_read++;
-  if (_pos_read==_len) _pos_read=0;
+  _pos_read=(_pos_read+1) & _mask;
   _overflow=false;
   return b;
 }
 
+int RingStream::peekSpan(const uint8_t * & span, int limit) {
+  if ((_pos_read==_pos_write) && !_overflow) return 0;  // empty
+  int length = (_pos_write>_pos_read) ? _pos_write-_pos_read : _len-_pos_read;
+  span=_buffer+_pos_read;
+  return (length<limit) ? length : limit;
+}
+
+void RingStream::consume(int length) {
+  if (length<=0) return;
+  _pos_read=(_pos_read+length) & _mask;
+  _overflow=false;
+}
+
 
 int RingStream::count() {
   return (read()<<8) | read(); 
@@ -62,8 +107,7 @@ int RingStream::count() {
 
 int RingStream::freeSpace() {
   // allow space for client flag and length bytes
-  if (_pos_read>_pos_write) return _pos_read-_pos_write-3;
-  else return _len - _pos_write + _pos_read-3;  
+  return ((holdPosition()-_pos_write-1) & _mask) - 2;
 }
 
 
@@ -73,9 +117,63 @@ void RingStream::mark(uint8_t b) {
     write(b); // client id
     write((uint8_t)0);  // count MSB placemarker
     write((uint8_t)0);  // count LSB placemarker
+    _markCountOffset=1;
+    _count=0;
+}
+
+void RingStream::markBroadcast(uint8_t clientMask) {
+    _mark=_pos_write;
+    write(BROADCAST_MARK);
+    write(clientMask);
+    write((uint8_t)0);  // count MSB placemarker
+    write((uint8_t)0);  // count LSB placemarker
+    _markCountOffset=2;
     _count=0;
 }
 
+int RingStream::readClient() {
+  for (;;) {
+    if (_replay) {
+      // Last client has finished with the broadcast, go back for the next one.
+      _pos_read=_replayStart;
+      _overflow=false;
+      _replay=false;
+    }
+    int client=read();
+    if (client!=BROADCAST_MARK) return client;
+    int maskPos=_pos_read;
+    uint8_t mask=read();
+    if (mask==0) {
+      // Everyone has had it, so skip the message.
+      for (int count=this->count(); count>0; count--) read();
+      continue;
+    }
+    client=0;
+    while (!(mask & (1<<client))) client++;
+    mask &= ~(1<<client);
+    _buffer[maskPos]=mask;
+    // Keep the message.  Start it again on the next call, for the remaining clients
+    // or just to move past it.
+    _replay=true;
+    _replayStart=(maskPos-1) & _mask;
+    return client;
+  }
+}
+
+int RingStream::peekCount(uint8_t client, int offset) {
+  if (_replay || _overflow) return -1;
+  int used=(_pos_write-_pos_read) & _mask;
+  if (offset+3>used) return -1;
+  int pos=(_pos_read+offset) & _mask;
+  if (_buffer[pos]!=client) return -1;
+  pos=(pos+1) & _mask;
+  int count=_buffer[pos]<<8;
+  pos=(pos+1) & _mask;
+  count|=_buffer[pos];
+  if (offset+3+count>used) return -1;
+  return count;
+}
+
 // peekTargetMark is used by the parser stash routines to know which client
 // to send a callback response to some time later. 
 uint8_t RingStream::peekTargetMark() {
@@ -95,21 +193,26 @@ bool RingStream::commit() {
     _pos_write=_mark;
     return true; // true=commit ok
   }
-  // Go back to the _mark and inject the count 1 byte later
-  _mark++;
-  if (_mark==_len) _mark=0;
+  // Go back to the _mark and inject the count after the header
+  _mark=(_mark+_markCountOffset) & _mask;
   _buffer[_mark]=highByte(_count);
-  _mark++;
-  if (_mark==_len) _mark=0;
+  _mark=(_mark+1) & _mask;
   _buffer[_mark]=lowByte(_count);
   return true; // commit worked
 }
+void RingStream::discard() {
+  _pos_write=_mark;
+  _overflow=false;
+  _count=0;
+}
 void RingStream::flush() {
   _pos_write=0;
   _pos_read=0;
+  _replay=false;
   _buffer[0]=0;
 }
 void RingStream::printBuffer(Print * stream) {
+  // Used for a buffer that is flushed after each message, so never wraps
   _buffer[_pos_write]='\0';
-  stream->print((char *)_buffer);
+  stream->write(_buffer, strlen((char *)_buffer));
 }
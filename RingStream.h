@@ -21,29 +21,58 @@
  */
 
 #include <Arduino.h>
+#include "MemoryPool.h"
   
 class RingStream : public Print {
 
   public:
+    // len is rounded up to a power of two
     RingStream( const uint16_t len);
+    // Heap use is counted for <D RAM>
+    static void *operator new(size_t size) noexcept { return MemoryPool::allocate(MEMORY_RINGSTREAMS, size); }
+    static void operator delete(void *p, size_t size) { MemoryPool::release(MEMORY_RINGSTREAMS, p, size); }
   
     virtual size_t write(uint8_t b);
+    // Block copy, with the same overflow behaviour as writing each byte
+    virtual size_t write(const uint8_t * buffer, size_t size);
     using Print::write;
     int read();
     int count();
     int freeSpace();
+    int capacity() { return _len-3; }  // freeSpace() when the ring is empty
     void mark(uint8_t b);
+    // Mark the start of a message for several clients (bit n of clientMask for client n, 0..7).
+    // The message is stored once and readClient() returns it once for each client.
+    void markBroadcast(uint8_t clientMask);
     bool commit();
+    void discard();  // throw away the message started by mark()
     uint8_t peekTargetMark();
+    // Use in place of read() to get the client id at the start of a message, 
+    // then count() and read() as usual.  Returns -1 if there is no message.
+    int readClient();
+    // Returns the count of the committed message starting offset bytes after the
+    // read position if it is a plain message for client, otherwise -1.
+    int peekCount(uint8_t client, int offset);
+    // Zero copy reading: peekSpan points span at up to limit bytes that can be
+    // read() next and are contiguous in the buffer, and returns how many (0 when
+    // empty).  consume then moves past those that have been used.
+    int peekSpan(const uint8_t * & span, int limit);
+    void consume(int length);
     void printBuffer(Print * streamer);
     void flush();
  private:
+   static const uint8_t BROADCAST_MARK=0xFE;
+   int holdPosition();
    int _len;
+   int _mask;  // _len-1
    int _pos_write;
    int _pos_read;
    bool _overflow;
    int _mark;
+   uint8_t _markCountOffset;  // Position of the count bytes after _mark
    int _count;
+   bool _replay;     // reading a broadcast message that other clients still need
+   int _replayStart; // ... which starts here
    byte * _buffer;
 };
 
@@ -150,9 +150,11 @@ SSD1306AsciiWire::SSD1306AsciiWire(int width, int height) {
   // Set size in characters in base class
   lcdRows = height / 8;
   lcdCols = width / 6;
+  maxRun = SSD1306_MAX_BURST;
   m_col = 0;
   m_row = 0;
   m_colOffset = 0;
+  requestBlock.priority = I2C_PRIORITY_DISPLAY;  // behind sensor and output traffic
 
   I2CManager.begin();
   I2CManager.setClock(400000L);  // Set max supported I2C speed
@@ -189,7 +191,7 @@ SSD1306AsciiWire::SSD1306AsciiWire(int width, int height) {
 void SSD1306AsciiWire::clearNative() {
   const int maxBytes = sizeof(blankPixels);  // max number of bytes sendable over Wire
   for (uint8_t r = 0; r <= m_displayHeight/8 - 1; r++) {
-    setRowNative(r);   // Position at start of row to be erased
+    setPositionNative(r, 0);   // Position at start of row to be erased
     for (uint8_t c = 0; c <= m_displayWidth - 1; c += maxBytes-1) {
       uint8_t len = min(m_displayWidth-c, maxBytes-1) + 1;
       I2CManager.write_P(m_i2cAddr, blankPixels, len);  // Write a number of blank columns
@@ -199,13 +201,13 @@ void SSD1306AsciiWire::clearNative() {
 
 //------------------------------------------------------------------------------
 
-// Set cursor position (by text line)
-void SSD1306AsciiWire::setRowNative(uint8_t line) {
+// Set cursor position (by text line and character column)
+void SSD1306AsciiWire::setPositionNative(uint8_t line, uint8_t column) {
   // Calculate pixel position from line number
   uint8_t row = line*8;
   if (row < m_displayHeight) {
     m_row = row;
-    m_col = m_colOffset;
+    m_col = m_colOffset + column * (fontWidth + letterSpacing);
     // Before using buffer, wait for last request to complete
     requestBlock.wait();
     // Build output buffer for I2C
@@ -221,40 +223,50 @@ void SSD1306AsciiWire::setRowNative(uint8_t line) {
 
 // Write a character to the OLED
 size_t SSD1306AsciiWire::writeNative(uint8_t ch) {
-  const uint8_t* base = m_font;
+  char c = ch;
+  return writeNative(&c, 1);
+}
 
-  if (ch < m_fontFirstChar || ch >= (m_fontFirstChar + m_fontCharCount))
-    return 0;
-  // Check if character would be partly or wholly off the display
-  if (m_col + fontWidth > m_displayWidth)
-    return 0;
-#if defined(NOLOWERCASE)
-  // Adjust if lowercase is missing
-  if (ch >= 'a') {
-    if (ch <= 'z')
-      ch = ch - 'a' + 'A';  // Capitalise
-    else
-      ch -= 26; // Allow for missing lowercase letters
-  }
-#endif
-  ch -= m_fontFirstChar;
-  base += fontWidth * ch;
+// Write a run of characters to the OLED.  The page addressing mode moves the 
+// column on after each byte, so adjacent characters go in one transfer.
+size_t SSD1306AsciiWire::writeNative(const char *s, uint8_t length) {
   // Before using buffer, wait for last request to complete
   requestBlock.wait();
   // Build output buffer for I2C
   outputBuffer[0] = 0x40;     // set SSD1306 controller to data mode
   uint8_t bufferPos = 1;
-  // Copy character pixel columns
-  for (uint8_t i = 0; i < fontWidth; i++) 
-    outputBuffer[bufferPos++] = GETFLASH(base++);
-  // Add blank pixels between letters
-  for (uint8_t i = 0; i < letterSpacing; i++) 
-    outputBuffer[bufferPos++] = 0;
+  uint8_t count = 0;
+  for (; count < length && count < SSD1306_MAX_BURST; count++) {
+    uint8_t ch = s[count];
+    if (ch < m_fontFirstChar || ch >= (m_fontFirstChar + m_fontCharCount))
+      ch = ' ';  // Not in font, so leave it blank
+    // Check if character would be partly or wholly off the display
+    if (m_col + fontWidth > m_displayWidth)
+      break;
+#if defined(NOLOWERCASE)
+    // Adjust if lowercase is missing
+    if (ch >= 'a') {
+      if (ch <= 'z')
+        ch = ch - 'a' + 'A';  // Capitalise
+      else
+        ch -= 26; // Allow for missing lowercase letters
+    }
+#endif
+    ch -= m_fontFirstChar;
+    const uint8_t* base = m_font + fontWidth * ch;
+    // Copy character pixel columns
+    for (uint8_t i = 0; i < fontWidth; i++) 
+      outputBuffer[bufferPos++] = GETFLASH(base++);
+    // Add blank pixels between letters
+    for (uint8_t i = 0; i < letterSpacing; i++) 
+      outputBuffer[bufferPos++] = 0;
+    m_col += fontWidth + letterSpacing;
+  }
 
   // Write the data to I2C display
-  I2CManager.write(m_i2cAddr, outputBuffer, bufferPos, &requestBlock);
-  m_col += fontWidth + letterSpacing;
-  return 1;
+  if (count > 0)
+    I2CManager.write(m_i2cAddr, outputBuffer, bufferPos, &requestBlock);
+  return count;
 }
 
 
@@ -31,6 +31,17 @@
 // Uncomment to remove lower-case letters to save 108 bytes of flash
 //#define NOLOWERCASE
 
+// Most characters written to the display in one transfer, 6 bytes of buffer each.
+// The Wire library on AVR has a 32 byte buffer, so a whole line only with the 
+// native driver.
+#ifndef SSD1306_MAX_BURST
+#if (defined(ARDUINO_ARCH_AVR) || defined(ARDUINO_ARCH_MEGAAVR)) && !defined(I2C_USE_WIRE)
+#define SSD1306_MAX_BURST 21
+#else
+#define SSD1306_MAX_BURST 5
+#endif
+#endif
+
 //------------------------------------------------------------------------------
 // Constructor
 class SSD1306AsciiWire : public LCDDisplay {
@@ -45,12 +56,15 @@ class SSD1306AsciiWire : public LCDDisplay {
   // Clear the display and set the cursor to (0, 0).
   void clearNative() override;
 
-  // Set cursor to start of specified text line
-  void setRowNative(byte line) override;
+  // Set cursor to specified text line and character column
+  void setPositionNative(byte line, byte column) override;
   
   // Write one character to OLED
   size_t writeNative(uint8_t c) override;
 
+  // Write up to SSD1306_MAX_BURST characters to OLED in one transfer
+  size_t writeNative(const char *s, uint8_t length) override;
+
   bool isBusy() override { return requestBlock.isBusy(); }
 
  private:
@@ -77,7 +91,7 @@ class SSD1306AsciiWire : public LCDDisplay {
   uint8_t m_i2cAddr;
 
   I2CRB requestBlock;
-  uint8_t outputBuffer[fontWidth+letterSpacing+1];
+  uint8_t outputBuffer[(fontWidth+letterSpacing)*SSD1306_MAX_BURST+1];
 
   static const uint8_t blankPixels[];
 
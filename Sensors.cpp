@@ -75,6 +75,10 @@ decide to ignore the <q ID> return and only react to <Q ID> triggers.
 #include "EEStore.h"
 #endif
 #include "IODevice.h"
+#include "MemoryPool.h"
+
+static const char sensorPoolName[] FLASH = "Sensors";
+static MemoryPool sensorPool((const FSH *)sensorPoolName, sizeof(Sensor), POOL_RESERVE_SENSORS);
 
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -109,6 +113,23 @@ void Sensor::checkAll(){
       // so initiate new scan through the sensor list
       readingSensor = firstSensor;
       lastReadCycle = thisTime;
+
+      // Process all queued changes.  Those still being debounced stay in the queue.
+      uint8_t keep = 0;
+      for (uint8_t i=0; i<changeQueueCount; i++) {
+        Sensor *tt = changeQueue[i];
+        if (tt == NULL) continue;  // removed
+        if (tt->debounce())
+          CommandDistributor::broadcastSensor(tt->data.snum,tt->active);
+        if (tt->inputState != tt->active) 
+          changeQueue[keep++] = tt;
+        else
+          tt->queued = false;
+      }
+      changeQueueCount = keep;
+      // If changes have been lost, check every sensor during this cycle.
+      scanAll = changeQueueOverflow;
+      changeQueueOverflow = false;
     }
   }
 
@@ -122,22 +143,17 @@ void Sensor::checkAll(){
     // Also, on HAL drivers that support change notifications, the driver calls the notification callback
     // routine when an input signal change is detected, and this updates the inputState directly,
     // so these inputs don't need to be polled here.
+    // Sensors which aren't polled are handled through the change queue.
+    if (!readingSensor->pollingRequired && !scanAll) {
+      readingSensor = readingSensor->nextSensor;
+      continue;
+    }
     VPIN pin = readingSensor->data.pin;
     if (readingSensor->pollingRequired && pin != VPIN_NONE)
-      readingSensor->inputState = IODevice::read(pin);
+      readingSensor->inputState = readingSensor->vpinHandle.read();
 
     // Check if changed since last time, and process changes.
-    if (readingSensor->inputState == readingSensor->active) {
-      // no change
-      readingSensor->latchDelay = minReadCount; // Reset counter
-    } else if (readingSensor->latchDelay > 0) {
-      // change detected, but first decrement delay
-      readingSensor->latchDelay--;
-    } else { 
-      // change validated, act on it.
-      readingSensor->active = readingSensor->inputState;
-      readingSensor->latchDelay = minReadCount;  // Reset counter
-      
+    if (readingSensor->debounce()) {
       CommandDistributor::broadcastSensor(readingSensor->data.snum,readingSensor->active);
       pause = true;  // Don't check any more sensors on this entry
     }
@@ -155,21 +171,55 @@ void Sensor::checkAll(){
 
 } // Sensor::checkAll
 
+///////////////////////////////////////////////////////////////////////////////
+// Apply the anti-jitter logic to the latest inputState.  Returns true
+// if a change of the active state has been validated.
+
+bool Sensor::debounce() {
+  if (inputState == active) {
+    // no change
+    latchDelay = minReadCount; // Reset counter
+  } else if (latchDelay > 0) {
+    // change detected, but first decrement delay
+    latchDelay--;
+  } else { 
+    // change validated, act on it.
+    active = inputState;
+    version = CommandDistributor::newVersion();
+    latchDelay = minReadCount;  // Reset counter
+    return true;
+  }
+  return false;
+}
+
+// Put a sensor whose inputState has changed into the change queue.
+void Sensor::queueChange() {
+  if (queued) return;
+  if (changeQueueCount < changeQueueSize) {
+    changeQueue[changeQueueCount++] = this;
+    queued = true;
+  } else
+    changeQueueOverflow = true;
+}
+
 
 #ifdef USE_NOTIFY
-// Callback from HAL (IODevice class) when a digital input change is recognised.
+// Callback from HAL (IODevice class) when digital input changes are recognised.
 // Updates the inputState field, which is subsequently scanned for changes in the checkAll 
 // method.  Ideally the <Q>/<q> message should be sent from here, instead of waiting for
 // the checkAll method, but the output stream is not available at this point.
-void Sensor::inputChangeCallback(VPIN vpin, int state) {
-  Sensor *tt;
-  // This bit is not ideal since it has, potentially, to look through the entire list of
-  // sensors to find the one that has changed.  Ideally this should be improved somehow.
-  for (tt=firstSensor; tt!=NULL ; tt=tt->nextSensor) {
-    if (tt->data.pin == vpin) break;
-  }
-  if (tt != NULL) { // Sensor found
-    tt->inputState = (state != 0); 
+// The changes for a whole port arrive together, so the sensor list is only searched once.
+void Sensor::inputChangeCallback(VPIN firstVpin, uint32_t changedMask, uint32_t states) {
+  // Sensors on the pins concerned are together in the pin index.
+  for (uint16_t i=findPin(firstVpin); i<indexSize; i++) {
+    Sensor *tt = pinIndex[i];
+    VPIN offset = tt->data.pin - firstVpin;
+    if (offset >= 32) break;
+    if (changedMask & ((uint32_t)1 << offset)) {
+      tt->inputState = (states >> offset) & 1; 
+      tt->latchDelay = 0;  // Already debounced by the device
+      tt->queueChange();
+    }
   }
 }
 #endif
@@ -199,7 +249,7 @@ Sensor *Sensor::create(int snum, VPIN pin, int pullUp){
 
   remove(snum);  // Unlink and free any existing sensor with the same id, before creating the new one.
 
-  tt = (Sensor *)calloc(1,sizeof(Sensor));
+  tt = (Sensor *)sensorPool.allocate();
   if (!tt) return tt;     // memory allocation failure
 
   if (pin == VPIN_NONE) 
@@ -218,9 +268,17 @@ Sensor *Sensor::create(int snum, VPIN pin, int pullUp){
   tt->data.snum = snum;
   tt->data.pin = pin;
   tt->data.pullUp = pullUp;
+  tt->vpinHandle.setVpin(pin);
   tt->active = 0;
   tt->inputState = 0;
   tt->latchDelay = minReadCount;
+  tt->version = CommandDistributor::newVersion();
+  if (!addToIndex(tt)) {
+    // No room in the index, so undo.
+    firstSensor = tt->nextSensor;
+    sensorPool.release(tt);
+    return NULL;
+  }
 
   if (pin != VPIN_NONE) 
     IODevice::configureInput(pin, pullUp);   
@@ -238,20 +296,78 @@ void Sensor::setState(int value) {
   // Trigger sensor change to be reported on next checkAll loop.
   inputState = (value != 0);
   latchDelay = 0; // Don't wait for anti-jitter logic
+  if (!pollingRequired) queueChange();
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 
 Sensor* Sensor::get(int n){
-  Sensor *tt;
-  for(tt=firstSensor;tt!=NULL && tt->data.snum!=n;tt=tt->nextSensor);
-  return tt ;
+  uint16_t i = findId(n);
+  if (i < indexSize && idIndex[i]->data.snum == n) return idIndex[i];
+  return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Sensor index functions.  Sensors are normally created at startup, so
+// inserting into sorted arrays is cheap enough, and lookups are binary searches.
+
+uint16_t Sensor::findId(int id) {
+  uint16_t low = 0, high = indexSize;
+  while (low < high) {
+    uint16_t mid = (low + high) / 2;
+    if (idIndex[mid]->data.snum < id) low = mid + 1;
+    else high = mid;
+  }
+  return low;
+}
+
+uint16_t Sensor::findPin(VPIN pin) {
+  uint16_t low = 0, high = indexSize;
+  while (low < high) {
+    uint16_t mid = (low + high) / 2;
+    if (pinIndex[mid]->data.pin < pin) low = mid + 1;
+    else high = mid;
+  }
+  return low;
+}
+
+bool Sensor::addToIndex(Sensor *tt) {
+  if (indexSize == indexCapacity) {
+    uint16_t newCapacity = indexCapacity + 16;
+    Sensor **newIdIndex = (Sensor **)realloc(idIndex, newCapacity * sizeof(Sensor *));
+    if (!newIdIndex) return false;
+    idIndex = newIdIndex;
+    Sensor **newPinIndex = (Sensor **)realloc(pinIndex, newCapacity * sizeof(Sensor *));
+    if (!newPinIndex) return false;
+    pinIndex = newPinIndex;
+    indexCapacity = newCapacity;
+  }
+  uint16_t i = findId(tt->data.snum);
+  memmove(&idIndex[i+1], &idIndex[i], (indexSize-i) * sizeof(Sensor *));
+  idIndex[i] = tt;
+  i = findPin(tt->data.pin);
+  memmove(&pinIndex[i+1], &pinIndex[i], (indexSize-i) * sizeof(Sensor *));
+  pinIndex[i] = tt;
+  indexSize++;
+  return true;
+}
+
+void Sensor::removeFromIndex(Sensor *tt) {
+  uint16_t i = findId(tt->data.snum);
+  if (i < indexSize && idIndex[i] == tt) 
+    memmove(&idIndex[i], &idIndex[i+1], (indexSize-i-1) * sizeof(Sensor *));
+  // Several sensors may share a pin, so look for this one.
+  for (i = findPin(tt->data.pin); i < indexSize && pinIndex[i] != tt; i++) {}
+  if (i < indexSize) 
+    memmove(&pinIndex[i], &pinIndex[i+1], (indexSize-i-1) * sizeof(Sensor *));
+  indexSize--;
 }
 ///////////////////////////////////////////////////////////////////////////////
 
 bool Sensor::remove(int n){
   Sensor *tt,*pp=NULL;
 
+  if (get(n)==NULL) return false;  // Quick check, avoids walking the list
   for(tt=firstSensor;tt!=NULL && tt->data.snum!=n;pp=tt,tt=tt->nextSensor);
 
   if (tt==NULL)  return false;
@@ -272,7 +388,12 @@ bool Sensor::remove(int n){
   // make the following one the next one to be read.
   if (readingSensor==tt) readingSensor=tt->nextSensor;
 
-  free(tt);
+  removeFromIndex(tt);
+  if (tt->queued) {
+    for (uint8_t i=0; i<changeQueueCount; i++)
+      if (changeQueue[i]==tt) changeQueue[i]=NULL;
+  }
+  sensorPool.release(tt);
 
   return true;
 }
@@ -285,7 +406,7 @@ void Sensor::load(){
 
   uint16_t i=EEStore::eeStore->data.nSensors;
   while(i--){
-    EEPROM.get(EEStore::pointer(),data);
+    EEStore::get(data);
     tt=create(data.snum, data.pin, data.pullUp);
     EEStore::advance(sizeof(tt->data));
   }
@@ -312,6 +433,14 @@ void Sensor::store(){
 Sensor *Sensor::firstSensor=NULL;
 Sensor *Sensor::readingSensor=NULL;
 unsigned long Sensor::lastReadCycle=0;
+Sensor **Sensor::idIndex=NULL;
+Sensor **Sensor::pinIndex=NULL;
+uint16_t Sensor::indexSize=0;
+uint16_t Sensor::indexCapacity=0;
+Sensor *Sensor::changeQueue[Sensor::changeQueueSize];
+uint8_t Sensor::changeQueueCount=0;
+bool Sensor::changeQueueOverflow=false;
+bool Sensor::scanAll=false;
 
 #ifdef USE_NOTIFY
 Sensor *Sensor::firstPollSensor = NULL;
@@ -51,6 +51,7 @@ class Sensor{
 
 public:
   SensorData data;
+  VpinHandle vpinHandle;  // caches the device for data.pin
   struct {
     uint8_t active:1;
     uint8_t inputState:1;
@@ -69,6 +70,7 @@ public:
   // Constructor
   Sensor(); 
   Sensor *nextSensor;
+  uint16_t version;  // CommandDistributor::stateVersion when created or last changed
 
   void setState(int state);
 #ifndef DISABLE_EEPROM
@@ -88,8 +90,33 @@ public:
                                         // Max value is 63
   bool pollingRequired = true;
 
+  // Sensors that aren't polled (notified by the HAL, or set by setState) are put into
+  // a queue when they change.  checkAll works through the whole queue at the start 
+  // of each read cycle, so that a burst of changes is reported together.
+  static const uint8_t changeQueueSize = 16;
+
+private:
+  bool debounce();
+  void queueChange();
+  bool queued;  // true while in changeQueue
+  static Sensor *changeQueue[changeQueueSize];
+  static uint8_t changeQueueCount;
+  static bool changeQueueOverflow;  // so scan all sensors 
+  static bool scanAll;
+
+  // Arrays of all sensors, one sorted by id and one by pin, for binary searches.
+  static Sensor **idIndex;
+  static Sensor **pinIndex;
+  static uint16_t indexSize;
+  static uint16_t indexCapacity;
+  static uint16_t findId(int id);     // position of first sensor with data.snum >= id
+  static uint16_t findPin(VPIN pin);  // position of first sensor with data.pin >= pin
+  static bool addToIndex(Sensor *tt);
+  static void removeFromIndex(Sensor *tt);
+
+public:
 #ifdef USE_NOTIFY
-  static void inputChangeCallback(VPIN vpin, int state);
+  static void inputChangeCallback(VPIN firstVpin, uint32_t changedMask, uint32_t states);
   static bool inputChangeCallbackRegistered;
 #endif
   
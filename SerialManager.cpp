@@ -21,30 +21,36 @@
 
 #include "SerialManager.h"
 #include "DCCEXParser.h"
+#include "BinaryProtocol.h"
 SerialManager * SerialManager::first=NULL;
+SerialManager * SerialManager::turn=NULL;
 
 SerialManager::SerialManager(Stream * myserial) {
   serial=myserial;
   next=first;
   first=this;
+  turn=this;
   bufferLength=0;
   inCommandPayload=false; 
+  binaryRemaining=0;
+  binaryWantLength=false;
+  binaryValid=false;
 } 
 
 void SerialManager::init() {
   while (!Serial && millis() < 5000); // wait max 5s for Serial to start
-  Serial.begin(115200);
+  Serial.begin(SERIAL_BAUD);
   new SerialManager(&Serial);
 #ifdef SERIAL3_COMMANDS
-  Serial3.begin(115200);
+  Serial3.begin(SERIAL3_BAUD);
   new SerialManager(&Serial3);
 #endif
 #ifdef SERIAL2_COMMANDS
-  Serial2.begin(115200);
+  Serial2.begin(SERIAL2_BAUD);
   new SerialManager(&Serial2);
 #endif
 #ifdef SERIAL1_COMMANDS
-  Serial1.begin(115200);
+  Serial1.begin(SERIAL1_BAUD);
   new SerialManager(&Serial1);
 #endif
 }
@@ -56,14 +62,48 @@ void SerialManager::broadcast2(RingStream * ring) {
     ring->printBuffer(serial);
 }
 
+// Several commands are taken from each serial in a loop, so that a burst from
+// JMRI doesn't take a loop per command, within a time limit so that the other
+// serials and the network aren't held up.  When the time runs out, the next 
+// loop starts with the serial that missed out.
 void SerialManager::loop() {
-    for (SerialManager * s=first;s;s=s->next) s->loop2();
+    if (!turn) return;
+    unsigned long startTime=micros();
+    SerialManager * s=turn;
+    do {
+        s->loop2(startTime);
+        s = s->next ? s->next : first;
+        if (micros()-startTime >= SERIAL_LOOP_MICROS) break;
+    } while (s!=turn);
+    turn=s;
 }
 
-void SerialManager::loop2() {
+void SerialManager::loop2(unsigned long startTime) {
+    byte commands=0;
     while (serial->available()) {
-        char ch = serial->read();
-        if (ch == '<') {
+        byte ch = serial->read();
+        if (binaryWantLength) {
+            binaryWantLength=false;
+            binaryRemaining=ch;
+            binaryValid=BinaryProtocol::validLength(ch);
+            buffer[1]=ch;
+            bufferLength=2;
+            continue;
+        }
+        if (binaryRemaining) {
+            // collecting a binary frame, or skipping one with a bad length
+            if (binaryValid) buffer[bufferLength++]=ch;
+            if (--binaryRemaining==0 && binaryValid) {
+                BinaryProtocol::parse(serial, buffer);
+                if (++commands>=SERIAL_LOOP_COMMANDS || micros()-startTime >= SERIAL_LOOP_MICROS) break;
+            }
+            continue;
+        }
+        if (ch == BINARY_START && !inCommandPayload) {
+            buffer[0] = ch;
+            binaryWantLength = true;
+        }
+        else if (ch == '<') {
             inCommandPayload = true;
             bufferLength = 0;
             buffer[0] = '\0';
@@ -72,7 +112,7 @@ void SerialManager::loop2() {
             buffer[bufferLength] = '\0';
             DCCEXParser::parse(serial, buffer, NULL); 
             inCommandPayload = false;
-            break;
+            if (++commands>=SERIAL_LOOP_COMMANDS || micros()-startTime >= SERIAL_LOOP_MICROS) break;
         }
         else if (inCommandPayload) {
             if (bufferLength <  (COMMAND_BUFFER_SIZE-1)) buffer[bufferLength++] = ch;
@@ -28,6 +28,27 @@
 #ifndef COMMAND_BUFFER_SIZE
  #define COMMAND_BUFFER_SIZE 100
 #endif
+// Baud rates.  A native USB serial runs at USB speed whatever the setting.
+#ifndef SERIAL_BAUD
+ #define SERIAL_BAUD 115200
+#endif
+#ifndef SERIAL1_BAUD
+ #define SERIAL1_BAUD 115200
+#endif
+#ifndef SERIAL2_BAUD
+ #define SERIAL2_BAUD 115200
+#endif
+#ifndef SERIAL3_BAUD
+ #define SERIAL3_BAUD 115200
+#endif
+#ifndef SERIAL_LOOP_COMMANDS
+ // Most commands taken from one serial in a loop
+ #define SERIAL_LOOP_COMMANDS 8
+#endif
+#ifndef SERIAL_LOOP_MICROS
+ // No further commands are started after this long in one loop
+ #define SERIAL_LOOP_MICROS 2000
+#endif
 
 class SerialManager {
 public:
@@ -37,13 +58,17 @@ public:
   
 private:  
   static SerialManager * first;
+  static SerialManager * turn;  // first to be read in the next loop
   SerialManager(Stream * myserial);
-  void loop2();
+  void loop2(unsigned long startTime);
   void broadcast2(RingStream * ring);
   Stream * serial;
   SerialManager * next;
   byte bufferLength;
   byte buffer[COMMAND_BUFFER_SIZE]; 
   bool inCommandPayload;
+  byte binaryRemaining;  // bytes still to come of a binary frame
+  bool binaryWantLength; // the next byte is a binary frame's length
+  bool binaryValid;      // false while skipping a frame with a bad length
 };
 #endif
@@ -73,15 +73,40 @@ void StringFormatter::send(Print & stream, const FSH* input...) {
   send2(&stream,input,args);
 }
 
+void FormatBuffer::putNumber(long value, byte width, bool formatLeft) {
+  char digits[10];
+  byte count=0;
+  unsigned long v= (value<0) ? -(unsigned long)value : value;
+  do {
+    digits[count++]='0' + v%10;
+    v/=10;
+  } while (v);
+  byte length= count + (value<0 ? 1 : 0);
+  if (!formatLeft) for (;length<width;length++) put(' ');
+  if (value<0) put('-');
+  while (count) put(digits[--count]);
+  if (formatLeft) for (;length<width;length++) put(' ');
+}
+
+void FormatBuffer::put(const FSH * text) {
+  char* flash=(char*)text;
+  for (char c; (c=GETFLASH(flash)); flash++) put(c);
+}
+
+void FormatBuffer::put(const char * text) {
+  while (*text) put(*text++);
+}
+
 void StringFormatter::send2(Print * stream,const FSH* format, va_list args) {
     
   // thanks to Jan Turoň  https://arduino.stackexchange.com/questions/56517/formatting-strings-in-arduino-for-output
 
+  FormatBuffer out(stream);
   char* flash=(char*)format;
   for(int i=0; ; ++i) {
     char c=GETFLASH(flash+i);
-    if (c=='\0') return;
-    if(c!='%') { stream->print(c); continue; }
+    if (c=='\0') break;
+    if(c!='%') { out.put(c); continue; }
 
     bool formatContinues=false;
     byte formatWidth=0;
@@ -92,19 +117,19 @@ void StringFormatter::send2(Print * stream,const FSH* format, va_list args) {
     i++;
     c=GETFLASH(flash+i);
     switch(c) {
-      case '%': stream->print('%'); break;
-      case 'c': stream->print((char) va_arg(args, int)); break;
-      case 's': stream->print(va_arg(args, char*)); break;
-      case 'e': printEscapes(stream,va_arg(args, char*)); break;
-      case 'E': printEscapes(stream,(const FSH*)va_arg(args, char*)); break;
-      case 'S': stream->print((const FSH*)va_arg(args, char*)); break;
-      case 'd': printPadded(stream,va_arg(args, int), formatWidth, formatLeft); break;
-      case 'u': printPadded(stream,va_arg(args, unsigned int), formatWidth, formatLeft); break;
-      case 'l': printPadded(stream,va_arg(args, long), formatWidth, formatLeft); break;
-      case 'b': stream->print(va_arg(args, int), BIN); break;
-      case 'o': stream->print(va_arg(args, int), OCT); break;
-      case 'x': stream->print(va_arg(args, int), HEX); break;
-      case 'f': stream->print(va_arg(args, double), 2); break;
+      case '%': out.put('%'); break;
+      case 'c': out.put((char) va_arg(args, int)); break;
+      case 's': out.stream()->print(va_arg(args, char*)); break;
+      case 'e': printEscapes(out.stream(),va_arg(args, char*)); break;
+      case 'E': printEscapes(out.stream(),(const FSH*)va_arg(args, char*)); break;
+      case 'S': out.stream()->print((const FSH*)va_arg(args, char*)); break;
+      case 'd': out.putNumber(va_arg(args, int), formatWidth, formatLeft); break;
+      case 'u': out.putNumber(va_arg(args, unsigned int), formatWidth, formatLeft); break;
+      case 'l': out.putNumber(va_arg(args, long), formatWidth, formatLeft); break;
+      case 'b': out.stream()->print(va_arg(args, int), BIN); break;
+      case 'o': out.stream()->print(va_arg(args, int), OCT); break;
+      case 'x': out.stream()->print(va_arg(args, int), HEX); break;
+      case 'f': out.stream()->print(va_arg(args, double), 2); break;
       //format width prefix
       case '-': 
             formatLeft=true;
@@ -164,27 +189,3 @@ void StringFormatter::printEscape(Print * stream, char c) {
      default: stream->print(c);
   }
  }
-
- 
-void StringFormatter::printPadded(Print* stream, long value, byte width, bool formatLeft) {
-  if (width==0) {
-    stream->print(value, DEC);
-    return;
-  }
-  
-    int digits=(value <= 0)? 1: 0;  // zero and negative need extra digot
-    long v=value;
-    while (v) {
-        v /= 10;
-        digits++;
-    }
-    
-    if (formatLeft) stream->print(value, DEC);
-    while(digits<width) {
-      stream->print(' ');
-      digits++;
-    }
-    if (!formatLeft) stream->print(value, DEC);    
-  }
-
- 
@@ -37,11 +37,50 @@ class Diag {
   
 };
 
+// Collects formatted output so that it reaches the stream in blocks through
+// write(buffer,size), rather than as a virtual write call for each character.
+class FormatBuffer {
+  public:
+    FormatBuffer(Print * stream) { _stream=stream; _used=0; }
+    ~FormatBuffer() { flush(); }
+    void put(char c) {
+      if (_used==sizeof(_buffer)) flush();
+      _buffer[_used++]=c;
+    }
+    void put(const FSH * text);
+    void put(const char * text);
+    void put(byte value) { putNumber(value,0,false); }
+    void put(int value) { putNumber(value,0,false); }
+    void put(unsigned int value) { putNumber(value,0,false); }
+    void put(long value) { putNumber(value,0,false); }
+    void putNumber(long value, byte width, bool formatLeft);
+    // For output that is printed directly to the stream
+    Print * stream() { flush(); return _stream; }
+  private:
+    void flush() {
+      if (_used) _stream->write((const uint8_t *)_buffer, _used);
+      _used=0;
+    }
+    Print * _stream;
+    byte _used;
+    char _buffer[32];
+};
+
 class StringFormatter
 {
   public:
     static void send(Print * serial, const FSH* input...);
     static void send(Print & serial, const FSH* input...);
+
+    // For the busiest messages: the items are printed according to their type,
+    // char as a character, strings as text, and byte, int or long as a decimal
+    // number, with no format string to interpret.  A type with no match
+    // (such as unsigned long) is a compile error rather than garbled output.
+    //    StringFormatter::emit(stream, F("<H "), id, ' ', state, F(">\n"));
+    template<typename... Items> static void emit(Print * stream, Items... items) {
+      FormatBuffer out(stream);
+      emitItems(out, items...);
+    }
     
     static void printEscapes(Print * serial,char * input);
     static void printEscapes(Print * serial,const FSH* input);
@@ -55,8 +94,13 @@ class StringFormatter
     static void printEscape( char c);
 
     private: 
+    static void emitItems(FormatBuffer & out) { (void)out; }
+    template<typename First, typename... Rest> 
+    static void emitItems(FormatBuffer & out, First first, Rest... rest) {
+      out.put(first);
+      emitItems(out, rest...);
+    }
     static void send2(Print * serial, const FSH* input,va_list args);
-    static void printPadded(Print* stream, long value, byte width, bool formatLeft);
 
 };
 #endif
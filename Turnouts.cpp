@@ -33,6 +33,7 @@
 #include "EXRAIL2.h"
 #include "Turnouts.h"
 #include "DCC.h"
+#include "DCCWaveform.h"
 #include "LCN.h"
 #ifdef EESTOREDEBUG
 #include "DIAG.h"
@@ -43,6 +44,14 @@
    */ 
 
   /* static */ Turnout *Turnout::_firstTurnout = 0;
+  /* static */ Turnout **Turnout::_turnoutIndex = 0;
+  /* static */ uint16_t Turnout::_turnoutIndexSize = 0;
+  /* static */ uint16_t Turnout::_turnoutIndexCapacity = 0;
+  /* static */ bool Turnout::_turnoutIndexFailed = false;
+  /* static */ Turnout::QueuedChange Turnout::_queue[TURNOUT_QUEUE_SIZE];
+  /* static */ uint8_t Turnout::_queueHead = 0;
+  /* static */ uint8_t Turnout::_queueCount = 0;
+  /* static */ unsigned long Turnout::_lastStaggeredTime = 0;
 
   /* 
    * Public static data
@@ -54,14 +63,44 @@
    */
 
   /* static */ Turnout *Turnout::get(uint16_t id) {
-    // Find turnout object from list.
-    for (Turnout *tt = _firstTurnout; tt != NULL; tt = tt->_nextTurnout)
-      if (tt->_turnoutData.id == id) return tt;
+    Turnout *tt = find(id);
+#if defined(EXRAIL_ACTIVE)
+    if (!tt) {
+      // Throttles have already been sent this turnout in the list, so it hasn't changed.
+      int hash = turnoutlistHash;
+      tt = RMFT2::createTurnout(id);
+      turnoutlistHash = hash;
+    }
+#endif
+    return tt;
+  }
+
+  /* static */ Turnout *Turnout::find(uint16_t id) {
+    if (_turnoutIndexFailed) {
+      // Find turnout object from list.
+      for (Turnout *tt = _firstTurnout; tt != NULL; tt = tt->_nextTurnout)
+        if (tt->_turnoutData.id == id) return tt;
+      return NULL;
+    }
+    uint16_t i = findIndex(id);
+    if (i < _turnoutIndexSize && _turnoutIndex[i]->_turnoutData.id == id) 
+      return _turnoutIndex[i];
     return NULL;
   }
 
+  /* static */ uint16_t Turnout::findIndex(uint16_t id) {
+    uint16_t low = 0, high = _turnoutIndexSize;
+    while (low < high) {
+      uint16_t mid = (low + high) / 2;
+      if (_turnoutIndex[mid]->_turnoutData.id < id) low = mid + 1;
+      else high = mid;
+    }
+    return low;
+  }
+
   // Add new turnout to end of chain
   /* static */ void Turnout::add(Turnout *tt) {
+    tt->_version = CommandDistributor::newVersion();
     if (!_firstTurnout) 
       _firstTurnout = tt;
     else {
@@ -72,6 +111,31 @@
       ptr->_nextTurnout = tt;
     }
     turnoutlistHash++;
+
+    // Add to index, after any with the same id so that get() finds 
+    // the one earliest in the chain, as the list search would.
+    if (_turnoutIndexFailed) return;
+    if (_turnoutIndexSize == _turnoutIndexCapacity) {
+      uint16_t newCapacity = _turnoutIndexCapacity + 16;
+      Turnout **newIndex = new Turnout *[newCapacity];
+      if (_turnoutIndex) MemoryPool::count(MEMORY_TURNOUTS, -(int)(_turnoutIndexCapacity * sizeof(Turnout *)));
+      if (!newIndex) {
+        delete[] _turnoutIndex;
+        _turnoutIndex = 0;
+        _turnoutIndexFailed = true;
+        return;
+      }
+      MemoryPool::count(MEMORY_TURNOUTS, newCapacity * sizeof(Turnout *));
+      for (uint16_t i = 0; i < _turnoutIndexSize; i++) newIndex[i] = _turnoutIndex[i];
+      delete[] _turnoutIndex;
+      _turnoutIndex = newIndex;
+      _turnoutIndexCapacity = newCapacity;
+    }
+    uint16_t i = findIndex(tt->_turnoutData.id + 1);
+    if (tt->_turnoutData.id == 0xffff) i = _turnoutIndexSize;
+    for (uint16_t j = _turnoutIndexSize; j > i; j--) _turnoutIndex[j] = _turnoutIndex[j-1];
+    _turnoutIndex[i] = tt;
+    _turnoutIndexSize++;
   }
   
   
@@ -88,6 +152,15 @@
     else
       pp->_nextTurnout = tt->_nextTurnout;
 
+    if (!_turnoutIndexFailed) {
+      uint16_t i = findIndex(id);
+      while (i < _turnoutIndexSize && _turnoutIndex[i] != tt) i++;
+      if (i < _turnoutIndexSize) {
+        _turnoutIndexSize--;
+        for ( ; i < _turnoutIndexSize; i++) _turnoutIndex[i] = _turnoutIndex[i+1];
+      }
+    }
+
     delete (ServoTurnout *)tt;
 
     turnoutlistHash++;
@@ -99,8 +172,58 @@
    * Public static functions
    */
 
+  /* static */ bool Turnout::exists(uint16_t id) {
+    if (find(id)) return true;
+#if defined(EXRAIL_ACTIVE)
+    return RMFT2::findDCCTurnout(id) >= 0;
+#else
+    return false;
+#endif
+  }
+
+  /* static */ bool Turnout::isHidden(uint16_t id) {
+    Turnout *tt = find(id);
+    if (tt) return tt->isHidden();
+#if defined(EXRAIL_ACTIVE)
+    return RMFT2::isTurnoutHidden(id);
+#else
+    return false;
+#endif
+  }
+
+  /* static */ bool Turnout::nextUnused(uint16_t &pos, uint16_t &id, bool includeHidden) {
+#if defined(EXRAIL_ACTIVE)
+    while (pos < (uint16_t)RMFT2::dccTurnoutCount) {
+      id = GETFLASHW(RMFT2::dccTurnoutList + 3 * pos++);
+      if (find(id)) continue;
+      if (!includeHidden && RMFT2::isTurnoutHidden(id)) continue;
+      return true;
+    }
+#else
+    (void)pos; (void)id; (void)includeHidden;
+#endif
+    return false;
+  }
+
+  /* static */ void Turnout::printUnused(Print *stream) {
+#if defined(EXRAIL_ACTIVE)
+    for (uint16_t pos=0, id; nextUnused(pos, id, true); ) {
+      const int16_t *def = RMFT2::dccTurnoutList + 3 * (pos-1);
+      StringFormatter::send(stream, F("<H %d DCC %d %d 1>\n"), id, GETFLASHW(def+1), GETFLASHW(def+2));
+      StringFormatter::send(stream, F("<H %d %d %d 1>\n"), id, GETFLASHW(def+1), GETFLASHW(def+2));
+    }
+#else
+    (void)stream;
+#endif
+  }
+
   /* static */ bool Turnout::isClosed(uint16_t id) {
-    Turnout *tt = get(id);
+    // A queued change is reported as made, so that scripts see the route they set.
+    for (uint8_t i=0; i<_queueCount; i++) {
+      QueuedChange *qc = &_queue[(_queueHead+i) % TURNOUT_QUEUE_SIZE];
+      if (qc->id == id) return qc->closed;
+    }
+    Turnout *tt = find(id);
     if (tt) 
       return tt->isClosed();
     else
@@ -118,6 +241,7 @@
       RMFT2::turnoutEvent(id, closeFlag);
     #endif
 
+    tt->_version = CommandDistributor::newVersion();
     CommandDistributor::broadcastTurnout(id, closeFlag);
     return true;
   }
@@ -136,6 +260,7 @@
   #endif
     Turnout *tt = Turnout::get(id);
     if (!tt) return false;
+    unqueue(id);  // this change overrides one still waiting in the route queue
     bool ok = tt->setClosedInternal(closeFlag);
 
     if (ok) {
@@ -144,7 +269,7 @@
       // Write byte containing new closed/thrown state to EEPROM if required.  Note that eepromAddress
       // is always zero for LCN turnouts.
       if (EEStore::eeStore->data.nTurnouts > 0 && tt->_eepromAddress > 0) 
-        EEPROM.put(tt->_eepromAddress, tt->_turnoutData.flags);
+        EEStore::writeLater(tt->_eepromAddress, tt->_turnoutData.flags);
 #endif
 
     #if defined(EXRAIL_ACTIVE)
@@ -152,11 +277,69 @@
     #endif
 
       // Send message to JMRI etc.
+      tt->_version = CommandDistributor::newVersion();
       CommandDistributor::broadcastTurnout(id, closeFlag);
     }
     return ok;
   }
 
+  /* static */ bool Turnout::queueClosed(uint16_t id, bool closeFlag) {
+    if (!exists(id)) return false;
+    // If the turnout is already queued, just change what it is to be set to.
+    for (uint8_t i=0; i<_queueCount; i++) {
+      QueuedChange *qc = &_queue[(_queueHead+i) % TURNOUT_QUEUE_SIZE];
+      if (qc->id == id) {
+        qc->closed = closeFlag;
+        return true;
+      }
+    }
+    if (_queueCount == TURNOUT_QUEUE_SIZE) 
+      return setClosed(id, closeFlag);
+    QueuedChange *qc = &_queue[(_queueHead+_queueCount) % TURNOUT_QUEUE_SIZE];
+    qc->id = id;
+    qc->closed = closeFlag;
+    _queueCount++;
+    return true;
+  }
+
+  /* static */ void Turnout::unqueue(uint16_t id) {
+    for (uint8_t i=0; i<_queueCount; i++) {
+      if (_queue[(_queueHead+i) % TURNOUT_QUEUE_SIZE].id != id) continue;
+      // Close the gap, keeping the order of the rest
+      for (uint8_t j=i+1; j<_queueCount; j++)
+        _queue[(_queueHead+j-1) % TURNOUT_QUEUE_SIZE] = _queue[(_queueHead+j) % TURNOUT_QUEUE_SIZE];
+      _queueCount--;
+      return;  // queueClosed never holds an id twice
+    }
+  }
+
+  /* static */ bool Turnout::isVpinQueued(VPIN vpin) {
+    for (uint8_t i=0; i<_queueCount; i++) {
+      Turnout *tt = find(_queue[(_queueHead+i) % TURNOUT_QUEUE_SIZE].id);
+      if (tt && tt->getVpin() == vpin) return true;
+    }
+    return false;
+  }
+
+  // Make queued turnout changes, called from the main loop.
+  /* static */ void Turnout::loop() {
+    while (_queueCount > 0) {
+      QueuedChange *qc = &_queue[_queueHead];
+      Turnout *tt = get(qc->id);
+      if (tt && tt->isType(TURNOUT_DCC)) {
+        // Don't wait for room in the packet queue.
+        if (DCCWaveform::mainTrack.isPacketQueueFull()) return;
+      } else if (tt) {
+        unsigned long now = millis();
+        if (now - _lastStaggeredTime < TURNOUT_STAGGER_MS) return;
+        _lastStaggeredTime = now;
+      }
+      _queueHead = (_queueHead+1) % TURNOUT_QUEUE_SIZE;
+      _queueCount--;
+      if (tt) setClosed(qc->id, qc->closed);
+    }
+  }
+
 #ifndef DISABLE_EEPROM
   // Load all turnout objects
   /* static */ void Turnout::load() {
@@ -180,7 +363,7 @@
     // Read turnout type from EEPROM
     struct TurnoutData turnoutData;
     int eepromAddress = EEStore::pointer() + offsetof(struct TurnoutData, flags); // Address of byte containing the closed flag.
-    EEPROM.get(EEStore::pointer(), turnoutData);
+    EEStore::get(turnoutData);
     EEStore::advance(sizeof(turnoutData));
 
     switch (turnoutData.turnoutType) {
@@ -231,7 +414,7 @@
   // Create function
   /* static */ Turnout *ServoTurnout::create(uint16_t id, VPIN vpin, uint16_t thrownPosition, uint16_t closedPosition, uint8_t profile, bool closed) {
 #ifndef IO_NO_HAL
-    Turnout *tt = get(id);
+    Turnout *tt = find(id);
     if (tt) { 
       // Object already exists, check if it is usable
       if (tt->isType(TURNOUT_SERVO)) {
@@ -273,7 +456,7 @@
 #ifndef DISABLE_EEPROM
     ServoTurnoutData servoTurnoutData;
     // Read class-specific data from EEPROM
-    EEPROM.get(EEStore::pointer(), servoTurnoutData);
+    EEStore::get(servoTurnoutData);
     EEStore::advance(sizeof(servoTurnoutData));
     
     // Create new object
@@ -346,7 +529,7 @@
 
   // Create function
   /* static */ Turnout *DCCTurnout::create(uint16_t id, uint16_t add, uint8_t subAdd) {
-    Turnout *tt = get(id);
+    Turnout *tt = find(id);
     if (tt) { 
       // Object already exists, check if it is usable
       if (tt->isType(TURNOUT_DCC)) {
@@ -370,7 +553,7 @@
 #ifndef DISABLE_EEPROM
     DCCTurnoutData dccTurnoutData;
     // Read class-specific data from EEPROM
-    EEPROM.get(EEStore::pointer(), dccTurnoutData);
+    EEStore::get(dccTurnoutData);
     EEStore::advance(sizeof(dccTurnoutData));
     
     // Create new object
@@ -421,20 +604,22 @@
 
   // Constructor
   VpinTurnout::VpinTurnout(uint16_t id, VPIN vpin, bool closed) :
-    Turnout(id, TURNOUT_VPIN, closed)
+    Turnout(id, TURNOUT_VPIN, closed),
+    _vpinHandle(vpin)
   {
     _vpinTurnoutData.vpin = vpin;
   }
 
   // Create function
   /* static */ Turnout *VpinTurnout::create(uint16_t id, VPIN vpin, bool closed) {
-    Turnout *tt = get(id);
+    Turnout *tt = find(id);
     if (tt) { 
       // Object already exists, check if it is usable
       if (tt->isType(TURNOUT_VPIN)) {
         // Yes, so set parameters
         VpinTurnout *vt = (VpinTurnout *)tt;
         vt->_vpinTurnoutData.vpin = vpin;
+        vt->_vpinHandle.setVpin(vpin);
         // Don't touch the _closed parameter, retain the original value.
         return tt;
       } else {
@@ -451,7 +636,7 @@
 #ifndef DISABLE_EEPROM
     VpinTurnoutData vpinTurnoutData;
     // Read class-specific data from EEPROM
-    EEPROM.get(EEStore::pointer(), vpinTurnoutData);
+    EEStore::get(vpinTurnoutData);
     EEStore::advance(sizeof(vpinTurnoutData));
     
     // Create new object
@@ -471,7 +656,7 @@
   }
 
   bool VpinTurnout::setClosedInternal(bool close) {
-    IODevice::write(_vpinTurnoutData.vpin, close);
+    _vpinHandle.write(close);
     _turnoutData.closed = close;
     return true;
   }
@@ -505,7 +690,7 @@
 
   // Create function
   /* static */ Turnout *LCNTurnout::create(uint16_t id, bool closed) {
-    Turnout *tt = get(id);
+    Turnout *tt = find(id);
     if (tt) { 
       // Object already exists, check if it is usable
       if (tt->isType(TURNOUT_LCN)) {
@@ -30,6 +30,17 @@
 #include "Arduino.h"
 #include "IODevice.h"
 #include "StringFormatter.h"
+#include "MemoryPool.h"
+
+// Number of turnout changes that can wait in the route queue, see Turnout::queueClosed.
+#ifndef TURNOUT_QUEUE_SIZE
+#define TURNOUT_QUEUE_SIZE 16
+#endif
+// Time in milliseconds between operating queued servo, VPIN (e.g. solenoid) and LCN
+// turnouts, to spread the current peaks.  DCC accessory turnouts are not staggered.
+#ifndef TURNOUT_STAGGER_MS
+#define TURNOUT_STAGGER_MS 50
+#endif
 
 // Turnout type definitions
 enum {
@@ -77,6 +88,9 @@ protected:
   // Pointer to next turnout on linked list.
   Turnout *_nextTurnout = 0;
 
+  // CommandDistributor::stateVersion when created or last changed
+  uint16_t _version = 0;
+
   /*
    * Constructor
    */
@@ -95,12 +109,30 @@ protected:
   static Turnout *_firstTurnout;
   static int _turnoutlistHash;
 
+  // Array of all turnouts sorted by id, for a binary search in get().
+  // If memory runs out, the index is dropped and get() searches the list.
+  static Turnout **_turnoutIndex;
+  static uint16_t _turnoutIndexSize;
+  static uint16_t _turnoutIndexCapacity;
+  static bool _turnoutIndexFailed;
+
+  // Route queue of turnout changes waiting to be made by Turnout::loop().
+  struct QueuedChange {
+    uint16_t id;
+    bool closed;
+  };
+  static QueuedChange _queue[TURNOUT_QUEUE_SIZE];
+  static uint8_t _queueHead;
+  static uint8_t _queueCount;
+  static unsigned long _lastStaggeredTime;
+
   /* 
    * Virtual functions
    */
 
   virtual bool setClosedInternal(bool close) = 0;  // Mandatory in subclass
   virtual void save() {}
+  virtual VPIN getVpin() { return VPIN_NONE; }  // pin operated, if any
   
   /*
    * Static functions
@@ -108,8 +140,15 @@ protected:
 
 
   static void add(Turnout *tt);
+  static uint16_t findIndex(uint16_t id);  // Position of first turnout with id >= given id
+  static Turnout *find(uint16_t id);       // Existing object only, see get()
+  static void unqueue(uint16_t id);        // Drop any queued change for the turnout
   
 public:
+  // Heap use is counted for <D RAM>
+  static void *operator new(size_t size) noexcept { return MemoryPool::allocate(MEMORY_TURNOUTS, size); }
+  static void operator delete(void *p, size_t size) { MemoryPool::release(MEMORY_TURNOUTS, p, size); }
+  // Finds the turnout, creating the object for an EXRAIL TURNOUT the first time it is used.
   static Turnout *get(uint16_t id);
   /* 
    * Static data
@@ -127,6 +166,7 @@ public:
   inline bool isType(uint8_t type) { return _turnoutData.turnoutType == type; }
   inline uint16_t getId() { return _turnoutData.id; }
   inline Turnout *next() { return _nextTurnout; }
+  inline uint16_t getVersion() { return _version; }
   void printState(Print *stream);
   /* 
    * Virtual functions
@@ -139,7 +179,17 @@ public:
   /*
    * Public static functions
    */
-  inline static bool exists(uint16_t id) { return get(id) != 0; }
+  static bool exists(uint16_t id);
+
+  // Only the hidden state of an existing turnout can be changed, but this also knows
+  // about EXRAIL TURNOUTs which haven't been used yet.
+  static bool isHidden(uint16_t id);
+
+  // Steps pos through the EXRAIL TURNOUTs which haven't been used yet, so have no 
+  // object and are thrown, giving the id of each.  Returns false after the last.  
+  // Listings go through these after the objects, e.g.
+  //   for (uint16_t pos=0, id; Turnout::nextUnused(pos, id); ) ...
+  static bool nextUnused(uint16_t &pos, uint16_t &id, bool includeHidden=false);
 
   static bool remove(uint16_t id);
 
@@ -161,6 +211,17 @@ public:
 
   static bool setClosedStateOnly(uint16_t id, bool close);
 
+  // Queue a turnout change, for setting a route of several turnouts.  The changes are 
+  // made in order by loop(), DCC accessory packets as fast as the packet queue takes 
+  // them and other turnouts TURNOUT_STAGGER_MS apart.  If the queue is full, the change
+  // is made straight away.  isClosed() reports a queued change as made, and a direct
+  // setClosed() drops it.  Returns false if the turnout doesn't exist.
+  static bool queueClosed(uint16_t id, bool closeFlag);
+  // True if a queued change is still to operate the turnout on this vpin, so that
+  // EXRAIL WAITFOR waits for it as it would for the servo moving.
+  static bool isVpinQueued(VPIN vpin);
+  static void loop();
+
   inline static Turnout *first() { return _firstTurnout; }
 
 #ifndef DISABLE_EEPROM
@@ -174,7 +235,11 @@ public:
   static void printAll(Print *stream) {
     for (Turnout *tt = _firstTurnout; tt != 0; tt = tt->_nextTurnout)
       if (!tt->isHidden()) StringFormatter::send(stream, F("<H %d %d>\n"),tt->getId(), tt->isThrown());
+    for (uint16_t pos=0, id; nextUnused(pos, id); )
+      StringFormatter::send(stream, F("<H %d 1>\n"), id);
   }
+  // Print the definitions of the EXRAIL TURNOUTs which haven't been used yet, as <T> does for the others.
+  static void printUnused(Print *stream);
 
 
 };
@@ -210,6 +275,7 @@ protected:
   // ServoTurnout-specific code for throwing or closing a servo turnout.
   bool setClosedInternal(bool close) override;
   void save() override;
+  VPIN getVpin() override { return _servoTurnoutData.vpin; }
 
 };
 
@@ -259,6 +325,7 @@ private:
   struct VpinTurnoutData {
     VPIN vpin;
   } _vpinTurnoutData; // 2 bytes
+  VpinHandle _vpinHandle;
 
   // Constructor
  VpinTurnout(uint16_t id, VPIN vpin, bool closed);
@@ -274,6 +341,7 @@ public:
 protected:
   bool setClosedInternal(bool close) override;
   void save() override;
+  VPIN getVpin() override { return _vpinTurnoutData.vpin; }
 
 };
 
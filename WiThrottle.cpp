@@ -55,11 +55,16 @@
 #include "version.h"
 #include "EXRAIL2.h"
 #include "CommandDistributor.h"
+#include "DCCEXParser.h"
 
 #define LOOPLOCOS(THROTTLECHAR, CAB)  for (int loco=0;loco<MAX_MY_LOCO;loco++) \
       if ((myLocos[loco].throttle==THROTTLECHAR || '*'==THROTTLECHAR) && (CAB<0 || myLocos[loco].cab==CAB))
 
 WiThrottle * WiThrottle::firstThrottle=NULL;
+int WiThrottle::changeLog[CHANGE_LOG_SIZE];
+uint16_t WiThrottle::changeCount=0;
+bool WiThrottle::checkNeeded=false;
+unsigned long WiThrottle::heartbeatDeadline=0;
 
 WiThrottle* WiThrottle::getThrottle( int wifiClient) {
   for (WiThrottle* wt=firstThrottle; wt!=NULL ; wt=wt->nextThrottle)  
@@ -90,7 +95,9 @@ WiThrottle::WiThrottle( int wificlientid) {
    heartBeatEnable=false; // until client turns it on
    turnoutListHash = -1;  // make sure turnout list is sent once
    exRailSent=false;
+   listsPending=false;
    mostRecentCab=0;                
+   seenChangeCount=changeCount;
    for (int loco=0;loco<MAX_MY_LOCO; loco++) myLocos[loco].throttle='\0';
 }
 
@@ -115,52 +122,17 @@ void WiThrottle::parse(RingStream * stream, byte * cmdx) {
   if (Diag::WITHROTTLE) DIAG(F("%l WiThrottle(%d)<-[%e]"),millis(),clientid,cmd);
 
   if (initSent) {
-    // Send turnout list if changed since last sent (will replace list on client)
-    if (turnoutListHash != Turnout::turnoutlistHash) {
-      StringFormatter::send(stream,F("PTL"));
-      for(Turnout *tt=Turnout::first();tt!=NULL;tt=tt->next()){
-          if (tt->isHidden()) continue;
-          int id=tt->getId();
-          const FSH * tdesc=NULL;
-          #ifdef EXRAIL_ACTIVE
-          tdesc=RMFT2::getTurnoutDescription(id);
-          #endif
-          char tchar=Turnout::isClosed(id)?'2':'4';
-          if (tdesc==NULL) // turnout with no description
-              StringFormatter::send(stream,F("]\\[%d}|{T%d}|{T%c"), id,id,tchar);
-	        else 
-              StringFormatter::send(stream,F("]\\[%d}|{%S}|{%c"), id,tdesc,tchar);
-      }
-      StringFormatter::send(stream,F("\n"));
-      turnoutListHash = Turnout::turnoutlistHash; // keep a copy of hash for later comparison
-    }
-
-    else if (!exRailSent) {
-      // Send EX-RAIL routes list if not already sent (but not at same time as turnouts above)
-      exRailSent=true;
-#ifdef EXRAIL_ACTIVE
-   StringFormatter::send(stream,F("PRT]\\[Routes}|{Route]\\[Set}|{2]\\[Handoff}|{4\nPRL"));
-   for (byte pass=0;pass<2;pass++) {
-      // first pass automations, second pass routes.
-    for (int ix=0;;ix++) {
-        int16_t id=GETFLASHW((pass?RMFT2::automationIdList:RMFT2::routeIdList)+ix);
-        if (id==0) break;
-        const FSH * desc=RMFT2::getRouteDescription(id);
-        StringFormatter::send(stream,F("]\\[%c%d}|{%S}|{%c"),
-                      pass?'A':'R',id,desc, pass?'4':'2');
-    }
-   }
-   StringFormatter::send(stream,F("\n"));
-#endif
-      // allow heartbeat to slow down once all metadata sent     
-      StringFormatter::send(stream,F("*%d\n"),HEARTBEAT_SECONDS);
-    }
+    listsPending=sendLists(stream);
+    if (listsPending) checkNeeded=true;  // the loop finishes them as the ring has room
   }
   
   while (cmd[0]) {
     switch (cmd[0]) {
     case '*':  // heartbeat control
-      if (cmd[1]=='+') heartBeatEnable=true;
+      if (cmd[1]=='+') {
+        heartBeatEnable=true;
+        scheduleHeartbeat(heartBeat+ESTOP_SECONDS*1000UL);
+      }
       else if (cmd[1]=='-') heartBeatEnable=false;
       break;
     case 'P':  
@@ -235,6 +207,8 @@ void WiThrottle::parse(RingStream * stream, byte * cmdx) {
 	// set heartbeat to 1 second because we need to sync the metadata
 	StringFormatter::send(stream,F("*1\n"));
 	initSent = true;
+	listsPending=true;  // lists follow from the loop as the ring has room
+	checkNeeded=true;
       }
       break;           
     case 'Q': // 
@@ -283,13 +257,24 @@ void WiThrottle::multithrottle(RingStream * stream, byte * cmd){
   case '+':  // add loco request
     if (cmd[3]=='*') { 
       // M+* means get loco from prog track, then join tracks ready to drive away
+      // One client at a time, as the callback's stash only has room for one
+      if (stashPending) {
+        StringFormatter::send(stream, F("HMProg track busy\n"));
+        return;
+      }
       // Stash the things the callback will need later
       stashStream= stream;
       stashClient=stream->peekTargetMark();
       stashThrottleChar=throttleChar;
       stashInstance=this;
-      // ask DCC to call us back when the loco id has been read
-      DCC::getLocoId(getLocoCallback); // will remove any previous join                    
+      stashPending=true;  // before queueing, as the callback may come straight back
+      // ask DCC to call us back when the loco id has been read, after any other prog
+      // track commands.  This will remove any previous join.
+      if (!DCCEXParser::queueLocoId(getLocoCallback)) {
+        stashPending=false;
+        StringFormatter::send(stream, F("HMProg track busy\n"));
+        return;
+      }
       return; // return nothing in stream as response is sent later in the callback 
     }
     //return error if address zero requested
@@ -308,7 +293,7 @@ void WiThrottle::multithrottle(RingStream * stream, byte * cmd){
 	myLocos[loco].throttle=throttleChar;
 	myLocos[loco].cab=locoid; 
 	myLocos[loco].functionMap=DCC::getFunctionMap(locoid); 
-	myLocos[loco].broadcastPending=true; // means speed/dir will be sent later
+	markForResend(loco); // means speed/dir will be sent later
 	mostRecentCab=locoid;
 	StringFormatter::send(stream, F("M%c+%c%d<;>\n"), throttleChar, cmd[3] ,locoid); //tell client to add loco
 	int fkeys=29;
@@ -409,7 +394,7 @@ void WiThrottle::locoAction(RingStream * stream, byte* aval, char throttleChar,
     if (aval[1]=='V' || aval[1]=='R' ) {   //qV or qR
       // just flag the loco for broadcast and it will happen.
       LOOPLOCOS(throttleChar, cab) {              
-	myLocos[loco].broadcastPending=true;
+	markForResend(loco);
       }                           
     }     
     break;    
@@ -426,8 +411,8 @@ void WiThrottle::locoAction(RingStream * stream, byte* aval, char throttleChar,
   case 'X':
     //Emergency Stop  (speed code 1)
     LOOPLOCOS(throttleChar, cab) {
-      DCC::setThrottle(myLocos[loco].cab, 1, DCC::getThrottleDirection(myLocos[loco].cab));
-      // setThrottle will cause a broadcast so notification will be sent
+      DCC::emergencyStop(myLocos[loco].cab);
+      // emergencyStop will cause a broadcast so notification will be sent
     }
     break;
   case 'I': // Idle, set speed to 0
@@ -456,11 +441,20 @@ int WiThrottle::WiTToDCCSpeed(int WiTSpeed) {
 }
 
 void WiThrottle::loop(RingStream * stream) {
+  if (!checkNeeded && (long)(millis()-heartbeatDeadline) < 0) return;
+  checkNeeded=false;
+  // checkHeartbeat brings the deadline forward for each client with the heartbeat on
+  heartbeatDeadline=millis()+ESTOP_SECONDS*1000UL;
   // for each WiThrottle, check the heartbeat and broadcast needed
-  for (WiThrottle* wt=firstThrottle; wt!=NULL ; wt=wt->nextThrottle) 
+  WiThrottle* next;
+  for (WiThrottle* wt=firstThrottle; wt!=NULL ; wt=next) {
+    next=wt->nextThrottle;  // in case wt deletes itself
     wt->checkHeartbeat(stream);
-  
+  }
+}
 
+void WiThrottle::scheduleHeartbeat(unsigned long deadline) {
+  if ((long)(deadline-heartbeatDeadline) < 0) heartbeatDeadline=deadline;
 }
 
 void WiThrottle::checkHeartbeat(RingStream * stream) {
@@ -470,42 +464,71 @@ void WiThrottle::checkHeartbeat(RingStream * stream) {
     LOOPLOCOS('*', -1) { 
       if (myLocos[loco].throttle!='\0') {
         if (Diag::WITHROTTLE) DIAG(F("%l  eStopping cab %d"),millis(),myLocos[loco].cab);
-        DCC::setThrottle(myLocos[loco].cab, 1, DCC::getThrottleDirection(myLocos[loco].cab)); // speed 1 is eStop
+        DCC::emergencyStop(myLocos[loco].cab);
       }
     }
     delete this;
     return;
   }
+  if (heartBeatEnable) scheduleHeartbeat(heartBeat+ESTOP_SECONDS*1000UL);
+
+  if (listsPending) {
+    stream->mark(clientid);
+    listsPending=sendLists(stream);
+    stream->commit();
+    if (listsPending) checkNeeded=true;  // try again next loop
+  }
    
-   // send any outstanding speed/direction/function changes for this clients locos
+   // Flag the locos changed since the last check.  
    // Changes may have been caused by this client, or another non-Withrottle or Exrail
+  if (seenChangeCount!=changeCount) {
+    if ((uint16_t)(changeCount-seenChangeCount) > CHANGE_LOG_SIZE) {
+      // Missed some, check them all 
+      LOOPLOCOS('*', -1) myLocos[loco].broadcastPending=true;
+    } 
+    else for (uint16_t change=seenChangeCount; change!=changeCount; change++)
+      markForBroadcast2(changeLog[change % CHANGE_LOG_SIZE]);
+    seenChangeCount=changeCount;
+  }
+   
+   // send any outstanding speed/direction/function changes for this clients locos,
+   // all in one message, and only the fields that differ from what was last sent.
   bool streamHasBeenMarked=false; 
   LOOPLOCOS('*', -1) { 
     if (myLocos[loco].throttle!='\0' && myLocos[loco].broadcastPending) {
+      myLocos[loco].broadcastPending=false;
+      int cab=myLocos[loco].cab;
+      byte speed=DCC::getThrottleSpeed(cab);
+      byte direction=DCC::getThrottleDirection(cab);
+      uint32_t dccFunctionMap=DCC::getFunctionMap(cab);
+      uint32_t myFunctionMap=myLocos[loco].functionMap;
+      if (speed==myLocos[loco].sentSpeed && direction==myLocos[loco].sentDirection 
+          && dccFunctionMap==myFunctionMap) continue;  // nothing this client doesn't know 
       if (!streamHasBeenMarked) {
 	stream->mark(clientid);
 	streamHasBeenMarked=true;
       }
-      myLocos[loco].broadcastPending=false;
-      int cab=myLocos[loco].cab;
       char lors=LorS(cab);
       char throttle=myLocos[loco].throttle;
-      StringFormatter::send(stream,F("M%cA%c%d<;>V%d\n"),
-			    throttle, lors , cab, DCCToWiTSpeed(DCC::getThrottleSpeed(cab)));
-      StringFormatter::send(stream,F("M%cA%c%d<;>R%d\n"), 
-			    throttle, lors , cab, DCC::getThrottleDirection(cab));
+      if (speed!=myLocos[loco].sentSpeed) {
+        StringFormatter::emit(stream, 'M', throttle, 'A', lors, cab, F("<;>V"), 
+                              DCCToWiTSpeed(speed), '\n');
+        myLocos[loco].sentSpeed=speed;
+      }
+      if (direction!=myLocos[loco].sentDirection) {
+        StringFormatter::emit(stream, 'M', throttle, 'A', lors, cab, F("<;>R"), direction, '\n');
+        myLocos[loco].sentDirection=direction;
+      }
       
       // compare the DCC functionmap with the local copy and send changes  
-      uint32_t dccFunctionMap=DCC::getFunctionMap(cab);
-      uint32_t myFunctionMap=myLocos[loco].functionMap;
       myLocos[loco].functionMap=dccFunctionMap;
       
       // loop the maps sending any bit changed
       // Loop is terminated as soon as no changes are left
       for (byte fn=0;dccFunctionMap!=myFunctionMap;fn++) {
 	if ((dccFunctionMap&1) != (myFunctionMap&1)) {
-	  StringFormatter::send(stream,F("M%cA%c%d<;>F%c%d\n"),
-				throttle, lors , cab, (dccFunctionMap&1)?'1':'0',fn);
+	  StringFormatter::emit(stream, 'M', throttle, 'A', lors, cab, 
+				(dccFunctionMap&1) ? F("<;>F1") : F("<;>F0"), fn, '\n');
 	} 
 	// shift just checked bit off end of both maps
 	dccFunctionMap>>=1;
@@ -516,9 +539,111 @@ void WiThrottle::checkHeartbeat(RingStream * stream) {
   if (streamHasBeenMarked)   stream->commit();     
 }
 
+// Counts the characters printed, to size the lists without storing them
+class PrintLength : public Print {
+  public:
+  size_t length=0;
+  size_t write(uint8_t b) { (void) b; length++; return 1; }
+  using Print::write;
+};
+
+int WiThrottle::cachedTurnoutListHash=-1;
+int WiThrottle::cachedTurnoutListLength=0;
+int WiThrottle::cachedRouteListLength=-1;
+
+void WiThrottle::sendTurnoutList(Print * stream) {
+  StringFormatter::send(stream,F("PTL"));
+  Turnout *tt=Turnout::first();
+  uint16_t pos=0, unused;
+  for (;;) {
+      int id;
+      if (tt) {
+        id=tt->getId();
+        bool hidden=tt->isHidden();
+        tt=tt->next();
+        if (hidden) continue;
+      }
+      else if (Turnout::nextUnused(pos, unused)) id=unused;
+      else break;
+      const FSH * tdesc=NULL;
+      #ifdef EXRAIL_ACTIVE
+      tdesc=RMFT2::getTurnoutDescription(id);
+      #endif
+      char tchar=Turnout::isClosed(id)?'2':'4';
+      if (tdesc==NULL) // turnout with no description
+          StringFormatter::send(stream,F("]\\[%d}|{T%d}|{T%c"), id,id,tchar);
+      else 
+          StringFormatter::send(stream,F("]\\[%d}|{%S}|{%c"), id,tdesc,tchar);
+  }
+  StringFormatter::send(stream,F("\n"));
+}
+
+void WiThrottle::sendRouteList(Print * stream) {
+#ifdef EXRAIL_ACTIVE
+   StringFormatter::send(stream,F("PRT]\\[Routes}|{Route]\\[Set}|{2]\\[Handoff}|{4\nPRL"));
+   for (byte pass=0;pass<2;pass++) {
+      // first pass automations, second pass routes.
+    for (int ix=0;;ix++) {
+        int16_t id=GETFLASHW((pass?RMFT2::automationIdList:RMFT2::routeIdList)+ix);
+        if (id==0) break;
+        const FSH * desc=RMFT2::getRouteDescription(id);
+        StringFormatter::send(stream,F("]\\[%c%d}|{%S}|{%c"),
+                      pass?'A':'R',id,desc, pass?'4':'2');
+    }
+   }
+   StringFormatter::send(stream,F("\n"));
+#endif
+  // allow heartbeat to slow down once all metadata sent     
+  StringFormatter::send(stream,F("*%d\n"),HEARTBEAT_SECONDS);
+}
+
+// Send the turnout list if changed since last sent (will replace list on client), 
+// or else the route list if not yet sent, but only when the ring has room for it. 
+// The lengths are worked out once for all clients, the turnout list again only
+// when turnouts are added or removed.  A list too long for even an empty ring
+// is never sent.  Returns true while something is still to send.
+bool WiThrottle::sendLists(RingStream * stream) {
+  // The most this message can hold, as its mark is already in the ring
+  int maxLength=stream->capacity()-3;
+  if (turnoutListHash != Turnout::turnoutlistHash) {
+    if (cachedTurnoutListHash != Turnout::turnoutlistHash) {
+      PrintLength counter;
+      sendTurnoutList(&counter);
+      cachedTurnoutListLength=counter.length;
+      cachedTurnoutListHash=Turnout::turnoutlistHash;
+      if (cachedTurnoutListLength > maxLength) 
+        DIAG(F("WiThrottle turnout list too long (%d) for the outbound ring"), cachedTurnoutListLength);
+    }
+    if (cachedTurnoutListLength <= maxLength) {
+      if (cachedTurnoutListLength > stream->freeSpace()) return true;  // wait for the ring to empty
+      sendTurnoutList(stream);
+    }
+    turnoutListHash = Turnout::turnoutlistHash; // keep a copy of hash for later comparison
+    return !exRailSent;
+  }
+  if (exRailSent) return false;
+  // Send EX-RAIL routes list if not already sent (but not at same time as turnouts above)
+  if (cachedRouteListLength<0) {
+    PrintLength counter;
+    sendRouteList(&counter);
+    cachedRouteListLength=counter.length;
+    if (cachedRouteListLength > maxLength)
+      DIAG(F("WiThrottle route list too long (%d) for the outbound ring"), cachedRouteListLength);
+  }
+  if (cachedRouteListLength <= maxLength) {
+    if (cachedRouteListLength > stream->freeSpace()) return true;
+    sendRouteList(stream);
+  }
+  else StringFormatter::send(stream,F("*%d\n"),HEARTBEAT_SECONDS);  // as sendRouteList ends
+  exRailSent=true;
+  return false;
+}
+
+// Log the change for the clients to pick up in checkHeartbeat
 void WiThrottle::markForBroadcast(int cab) {
-  for (WiThrottle* wt=firstThrottle; wt!=NULL ; wt=wt->nextThrottle) 
-      wt->markForBroadcast2(cab);
+  changeLog[changeCount % CHANGE_LOG_SIZE]=cab;
+  changeCount++;
+  checkNeeded=true;
 }
 void WiThrottle::markForBroadcast2(int cab) {
   LOOPLOCOS('*', cab) { 
@@ -526,6 +651,14 @@ void WiThrottle::markForBroadcast2(int cab) {
   }
 }
 
+// Send speed and direction again, even if unchanged
+void WiThrottle::markForResend(int loco) {
+  myLocos[loco].broadcastPending=true;
+  myLocos[loco].sentSpeed=NOT_SENT;
+  myLocos[loco].sentDirection=NOT_SENT;
+  checkNeeded=true;
+}
+
 
 char WiThrottle::LorS(int cab) {
   return (cab<=HIGHEST_SHORT_ADDR)?'S':'L';
@@ -537,8 +670,10 @@ RingStream * WiThrottle::stashStream;
 WiThrottle * WiThrottle::stashInstance;
 byte         WiThrottle::stashClient;
 char         WiThrottle::stashThrottleChar;
+bool         WiThrottle::stashPending=false;
 
 void WiThrottle::getLocoCallback(int16_t locoid) {
+  stashPending=false;
   stashStream->mark(stashClient);
   
   if (locoid<=0) {
@@ -27,6 +27,8 @@ struct MYLOCO {
     char throttle; //indicates which throttle letter on client, often '0','1' or '2'
     int cab; //address of this loco
     bool broadcastPending;
+    byte sentSpeed;      // DCC speed last sent to the client, or NOT_SENT
+    byte sentDirection;  // ... and direction
     uint32_t functionMap;
     uint32_t functionToggles;
 };
@@ -37,6 +39,9 @@ class WiThrottle {
     void parse(RingStream * stream, byte * cmd);
     static WiThrottle* getThrottle( int wifiClient); 
     static void markForBroadcast(int cab);
+    // Heap use is counted for <D RAM>
+    static void *operator new(size_t size) noexcept { return MemoryPool::allocate(MEMORY_WITHROTTLES, size); }
+    static void operator delete(void *p, size_t size) { MemoryPool::release(MEMORY_WITHROTTLES, p, size); }
       
   private: 
     WiThrottle( int wifiClientId);
@@ -45,6 +50,23 @@ class WiThrottle {
       static const int MAX_MY_LOCO=10;      // maximum number of locos assigned to a single client
       static const int HEARTBEAT_SECONDS=10; // heartbeat at 4secs to provide messaging transport
       static const int ESTOP_SECONDS=20;     // eStop if no incoming messages for more than 8secs
+      static const byte NOT_SENT=0xFF;       // sentSpeed/sentDirection unknown to the client
+      // Cabs changed recently, shared by all clients.  Each client keeps the
+      // number of changes it has seen, so it only checks the locos that changed.
+      static const byte CHANGE_LOG_SIZE=16;  // must be a power of 2
+      static int changeLog[CHANGE_LOG_SIZE]; 
+      static uint16_t changeCount;           // changes logged, change n at changeLog[n%CHANGE_LOG_SIZE]
+      // The clients are only checked when something has changed or at the earliest
+      // heartbeat deadline, so idle throttles cost nothing in between.
+      static bool checkNeeded;
+      static unsigned long heartbeatDeadline;
+      static void scheduleHeartbeat(unsigned long deadline);
+      static int cachedTurnoutListHash;   // turnoutlistHash when the length was found
+      static int cachedTurnoutListLength;
+      static int cachedRouteListLength;   // -1 until found
+      static void sendTurnoutList(Print * stream);
+      static void sendRouteList(Print * stream);
+      bool sendLists(RingStream * stream);
       static WiThrottle* firstThrottle;
       static int getInt(byte * cmd);
       static int getLocoId(byte * cmd);
@@ -56,10 +78,12 @@ class WiThrottle {
       int clientid;
        
       MYLOCO myLocos[MAX_MY_LOCO];   
+      uint16_t seenChangeCount;  // changeCount at the last check of this client's locos
       bool heartBeatEnable;
       unsigned long heartBeat;
       bool initSent; // valid connection established
       bool exRailSent; // valid connection established
+      bool listsPending; // turnout or route list waiting for room in the ring
       uint16_t mostRecentCab;
       int turnoutListHash;  // used to check for changes to turnout list
       bool lastPowerState;  // last power state sent to this client
@@ -70,11 +94,13 @@ class WiThrottle {
       void accessory(RingStream *, byte* cmd);
       void checkHeartbeat(RingStream * stream); 
       void markForBroadcast2(int cab);
+      void markForResend(int loco);
        // callback stuff to support prog track acquire
        static RingStream * stashStream;
        static WiThrottle * stashInstance;
        static byte         stashClient;
        static char         stashThrottleChar;
+       static bool         stashPending;  // a loco read for a client is queued
        static void         getLocoCallback(int16_t locoid);
 
 };
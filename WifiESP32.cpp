@@ -0,0 +1,240 @@
+/*
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#if defined(ARDUINO_ARCH_ESP32)
+#include "WifiESP32.h"
+#include "CommandDistributor.h"
+#include "WiThrottle.h"
+#include "DIAG.h"
+#include "BinaryProtocol.h"
+
+#ifndef WIFI_CONNECT_TIMEOUT
+// How long to wait for the configured network before setting up an access point
+#define WIFI_CONNECT_TIMEOUT 16000
+#endif
+
+WiFiServer * WifiESP::server=NULL;
+WiFiClient WifiESP::clients[MAX_CLIENTS];
+bool WifiESP::active[MAX_CLIENTS];
+bool WifiESP::closing[MAX_CLIENTS];
+char WifiESP::frame[MAX_CLIENTS][MESSAGE_SIZE];
+byte WifiESP::frameLength[MAX_CLIENTS];
+byte WifiESP::frameSkip[MAX_CLIENTS];
+char WifiESP::frameSkipTo[MAX_CLIENTS];
+WifiESP::Queue<WifiESP::INBOUND_QUEUE> WifiESP::inbound;
+WifiESP::Queue<WifiESP::OUTBOUND_QUEUE> WifiESP::outbound;
+RingStream * WifiESP::outboundRing=NULL;
+int WifiESP::replyClient=-1;
+int WifiESP::replyRemaining=0;
+byte WifiESP::closed=0;
+
+bool WifiESP::setup(const FSH *SSid, const FSH *password,
+                    const FSH *hostname, int port, byte channel) {
+  // Flash strings are directly addressable on the ESP32
+  const char *yourNetwork = "Your network ";
+  const char *ssid=(const char *)SSid;
+  const char *pass=(const char *)password;
+
+  WiFi.setHostname((const char *)hostname);
+  if (ssid[0] && strncmp(yourNetwork, ssid, 13) != 0) {
+    WiFi.mode(WIFI_STA);
+    WiFi.begin(ssid, pass);
+    unsigned long startTime=millis();
+    while (WiFi.status()!=WL_CONNECTED && millis()-startTime < WIFI_CONNECT_TIMEOUT) delay(100);
+  }
+
+  if (WiFi.status()==WL_CONNECTED) {
+    DIAG(F("Wifi STA IP %s"), WiFi.localIP().toString().c_str());
+  } else {
+    // Set up an access point named after the MAC address, as with an ES module
+    byte mac[6];
+    WiFi.macAddress(mac);
+    char macTail[7];
+    sprintf(macTail, "%02X%02X%02X", mac[3], mac[4], mac[5]);
+    char apName[13];
+    sprintf(apName, "DCCEX_%s", macTail);
+    char apPass[12];
+    if (strncmp(yourNetwork, pass, 13) == 0) {
+      sprintf(apPass, "PASS_%s", macTail);
+      pass=apPass;
+    }
+    WiFi.mode(WIFI_AP);
+    if (!WiFi.softAP(apName, pass, channel)) {
+      DIAG(F("Wifi setup failed"));
+      return false;
+    }
+    DIAG(F("Wifi AP SSID %s PASS %s IP %s"), apName, pass, WiFi.softAPIP().toString().c_str());
+  }
+
+  outboundRing=new RingStream(OUTBOUND_RING);
+  server=new WiFiServer(port);
+  server->begin();
+  xTaskCreatePinnedToCore(networkTask, "DCCEX-WiFi", 4096, NULL, 1, NULL, WIFI_TASK_CORE);
+  DIAG(F("Wifi server port %d"), port);
+  return true;
+}
+
+// Arduino loop: execute commands from the networking task and pass back the replies.
+void WifiESP::loop() {
+  if (!outboundRing) return;
+  WiThrottle::loop(outboundRing);
+
+  // Leave commands queued while there isn't room for the reply
+  Message * in=inbound.front();
+  if (in && outboundRing->freeSpace() >= OUTBOUND_RESERVE) {
+    if (in->length==0) {
+      CommandDistributor::forget(in->client);
+      closed |= 1<<in->client;
+    }
+    else {
+      if (Diag::WIFI) DIAG(F("Wifi EXEC: %d %e"), in->client, in->data);
+      outboundRing->mark(in->client);
+      CommandDistributor::parse(in->client, (byte *)in->data, outboundRing);
+      if (!outboundRing->commit()) DIAG(F("OUTBOUND FULL processing cmd:%s"), in->data);
+    }
+    inbound.pop();
+  }
+
+  // Replies longer than a message are split over several
+  Message * out;
+  bool drained=false;
+  while ((out=outbound.back())) {
+    if (replyRemaining==0) {
+      replyClient=outboundRing->readClient();
+      if (replyClient<0) {
+        drained=true;
+        break;
+      }
+      replyRemaining=outboundRing->count();
+    }
+    byte count=0;
+    while (replyRemaining>0 && count<MESSAGE_SIZE) {
+      const uint8_t * span;
+      int block=outboundRing->peekSpan(span, min(replyRemaining, MESSAGE_SIZE-count));
+      if (block==0) break;
+      memcpy(out->data+count, span, block);
+      outboundRing->consume(block);
+      count+=block;
+      replyRemaining-=block;
+    }
+    out->client=replyClient;
+    out->length=count;
+    outbound.push();
+  }
+
+  // Nothing is left in the ring for clients that have gone, and none is added
+  // after forget(), so their slots can go back to the networking task.
+  for (byte c=0; drained && closed && c<MAX_CLIENTS; c++) {
+    if (!(closed & (1<<c))) continue;
+    if (!(out=outbound.back())) break;
+    out->client=c;
+    out->length=0;
+    outbound.push();
+    closed &= ~(1<<c);
+  }
+}
+
+// Networking task, on the other core from the Arduino loop.
+void WifiESP::networkTask(void * param) {
+  (void) param;
+  for (;;) {
+    // Tell the loop about clients that have gone, before their slot can be reused
+    for (byte c=0; c<MAX_CLIENTS; c++) {
+      if (!active[c] || clients[c].connected()) continue;
+      Message * m=inbound.back();
+      if (!m) break;
+      clients[c].stop();
+      active[c]=false;
+      closing[c]=true;  // until the loop has sent what it had for this client
+      m->client=c;
+      m->length=0;
+      inbound.push();
+    }
+
+    while (server->hasClient()) {
+      WiFiClient newClient=server->available();
+      byte c;
+      for (c=0; c<MAX_CLIENTS; c++) if (!active[c] && !closing[c]) break;
+      if (c==MAX_CLIENTS) {
+        newClient.stop();  // no room
+        continue;
+      }
+      clients[c]=newClient;
+      frameLength[c]=0;
+      frameSkip[c]=0;
+      frameSkipTo[c]=0;
+      active[c]=true;
+    }
+
+    for (byte c=0; c<MAX_CLIENTS; c++) if (active[c]) readClient(c);
+
+    Message * m;
+    while ((m=outbound.front())) {
+      if (m->length==0) closing[m->client]=false;
+      else if (active[m->client]) clients[m->client].write((const uint8_t *)m->data, m->length);
+      outbound.pop();
+    }
+
+    vTaskDelay(1);  // let the idle task run
+  }
+}
+
+// Collect a client's data into <...> commands or WiThrottle lines, and queue them.
+// Data is left in the socket while the inbound queue is full.
+void WifiESP::readClient(byte c) {
+  while (clients[c].available()) {
+    Message * m=inbound.back();
+    if (!m) return;
+    int ch=clients[c].read();
+    if (frameSkip[c]) {
+      frameSkip[c]--;
+      continue;
+    }
+    if (frameSkipTo[c]) {
+      if (ch==frameSkipTo[c] || (frameSkipTo[c]=='\n' && ch=='\r')) frameSkipTo[c]=0;
+      continue;
+    }
+    byte & length=frameLength[c];
+    if (length==0 && (ch=='\r' || ch=='\n' || ch==' ')) continue;
+    frame[c][length++]=ch;
+    if (length==2 && (byte)frame[c][0]==BINARY_START && !BinaryProtocol::validLength(ch)) {
+      // Skip the rest of the frame rather than take it as text
+      frameSkip[c]=ch;
+      length=0;
+      continue;
+    }
+    bool end;
+    if ((byte)frame[c][0]==BINARY_START) end=(length>=2 && length==2+(byte)frame[c][1]);
+    else end=(frame[c][0]=='<') ? (ch=='>') : (ch=='\n' || ch=='\r');
+    if (!end && length==MESSAGE_SIZE-1) {
+      // Too long for a message.  Drop it up to its end, rather than take the rest as
+      // another command.  (Binary frames are never this long, see validLength.)
+      frameSkipTo[c]=(frame[c][0]=='<') ? '>' : '\n';
+      length=0;
+      continue;
+    }
+    if (end) {
+      memcpy(m->data, frame[c], length);
+      m->data[length]='\0';
+      m->client=c;
+      m->length=length;
+      inbound.push();
+      length=0;
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,97 @@
+/*
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef WifiESP32_h
+#define WifiESP32_h
+#if defined(ARDUINO_ARCH_ESP32)
+#include <Arduino.h>
+#include <WiFi.h>
+#include "FSH.h"
+#include "RingStream.h"
+
+// WiFi on a native ESP32, in place of WifiInterface and an AT command processor.
+//
+// The WiFi stack and the TCP clients are serviced by a task on the other core
+// from the Arduino loop (and the DCC timer interrupt).  Commands and replies cross
+// between the two cores through single-producer single-consumer queues, so
+// the parsers and everything they call only ever run in the Arduino loop.
+
+// Core used by the networking task (the Arduino loop runs on the other one)
+#ifndef WIFI_TASK_CORE
+#define WIFI_TASK_CORE 0
+#endif
+
+class WifiESP {
+public:
+  static bool setup(const FSH *SSid, const FSH *password,
+                    const FSH *hostname, int port, byte channel);
+  static void loop();
+
+private:
+  static const byte MAX_CLIENTS = 8;       // as CommandDistributor
+  static const byte MESSAGE_SIZE = 128;    // longest command, or part of a reply
+  static const byte INBOUND_QUEUE = 8;     // must be a power of 2
+  static const byte OUTBOUND_QUEUE = 16;   // must be a power of 2
+  static const int OUTBOUND_RING = 2048;
+  // Commands wait in the inbound queue while the outbound ring has less free space than this
+  static const int OUTBOUND_RESERVE = 256;
+
+  // One command for, or part of a reply from, a client.
+  // A zero length inbound message tells the loop that the client has gone.  A zero
+  // length outbound one tells the networking task that the loop has sent all there
+  // is for that client, so its slot can be reused.
+  struct Message {
+    byte client;
+    byte length;
+    char data[MESSAGE_SIZE];
+  };
+
+  // Lock-free queue between one producer on one core and one consumer on the other.
+  // Each index is only ever written by one side.
+  template <byte N> struct Queue {
+    Message slots[N];
+    volatile byte head=0;  // next slot to write, producer only
+    volatile byte tail=0;  // next slot to read, consumer only
+    bool full() { return (byte)(head-tail)==N; }
+    Message * back() { return full() ? NULL : &slots[head & (N-1)]; }
+    void push() { __sync_synchronize(); head=head+1; }
+    Message * front() { if (head==tail) return NULL; __sync_synchronize(); return &slots[tail & (N-1)]; }
+    void pop() { __sync_synchronize(); tail=tail+1; }
+  };
+
+  static void networkTask(void * param);
+  static void readClient(byte client);
+  // Networking task only
+  static WiFiServer * server;
+  static WiFiClient clients[MAX_CLIENTS];
+  static bool active[MAX_CLIENTS];       // the loop knows about this client
+  static bool closing[MAX_CLIENTS];      // gone, but replies may still be on the way
+  static char frame[MAX_CLIENTS][MESSAGE_SIZE];  // command being collected
+  static byte frameLength[MAX_CLIENTS];
+  static byte frameSkip[MAX_CLIENTS];    // bytes still to drop of a binary frame with a bad length
+  static char frameSkipTo[MAX_CLIENTS];  // end of an oversize text frame being dropped
+  // Shared between the cores
+  static Queue<INBOUND_QUEUE> inbound;
+  static Queue<OUTBOUND_QUEUE> outbound;
+  // Arduino loop only
+  static RingStream * outboundRing;
+  static int replyClient;     // reply being moved from the ring to the outbound queue
+  static int replyRemaining;
+  static byte closed;         // clients gone, as bits, whose slots are to be handed back
+};
+
+#endif
+#endif
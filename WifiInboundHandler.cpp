@@ -20,7 +20,7 @@
  *  You should have received a copy of the GNU General Public License
  *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
  */
-#ifndef ARDUINO_AVR_UNO_WIFI_REV2
+#if !defined(ARDUINO_AVR_UNO_WIFI_REV2) && !defined(ARDUINO_ARCH_ESP32)
 #include <Arduino.h>
 #include "WifiInboundHandler.h"
 #include "RingStream.h"
@@ -58,10 +58,20 @@ void WifiInboundHandler::loop1() {
    
     // if nothing is already CIPSEND pending, we can CIPSEND one reply
     if (clientPendingCIPSEND<0) {
-       clientPendingCIPSEND=outboundRing->read();
+       clientPendingCIPSEND=outboundRing->readClient();
        if (clientPendingCIPSEND>=0) {
          currentReplySize=outboundRing->count();
+         firstReplySize=currentReplySize;
+         // Pack following replies to the same client into the same CIPSEND
+         int offset=currentReplySize;
+         for (;;) {
+           int next=outboundRing->peekCount(clientPendingCIPSEND,offset);
+           if (next<0 || currentReplySize+next > MAX_CIPSEND) break;
+           currentReplySize+=next;
+           offset+=next+3;
+         }
          pendingCipsend=true;
+         busyRetries=0;
        }
      }
     
@@ -74,14 +84,21 @@ void WifiInboundHandler::loop1() {
       }
     
     
-    // if something waiting to execute, we can call it 
+    // if something waiting to execute, we can call it, 
+    // provided there is room for the reply
+      if (outboundRing->freeSpace() < OUTBOUND_RESERVE) return;
       int clientId=inboundRing->read();
       if (clientId>=0) {
          int count=inboundRing->count();
          if (Diag::WIFI) DIAG(F("Wifi EXEC: %d %d:"),clientId,count); 
-         byte cmd[count+1];
-         for (int i=0;i<count;i++) cmd[i]=inboundRing->read();   
-         cmd[count]=0;
+         byte * cmd=cmdBuffer;
+         int len=0;
+         for (int i=0;i<count;i++) {
+           int ch=inboundRing->read();
+           if (len<MAX_COMMAND) cmd[len++]=ch;
+         }
+         cmd[len]=0;
+         if (len<count) DIAG(F("Wifi command too long (%d), truncated"),count);
          if (Diag::WIFI) DIAG(F("%e"),cmd); 
          
          outboundRing->mark(clientId);  // remember start of outbound data 
@@ -119,11 +136,7 @@ WifiInboundHandler::INBOUND_STATE WifiInboundHandler::loop2() {
         
         if (ch=='>') { 
            if (Diag::WIFI) DIAG(F("[XMIT %d]"),currentReplySize); 
-           for (int i=0;i<currentReplySize;i++) {
-             int cout=outboundRing->read();
-             wifiStream->write(cout);
-             if (Diag::WIFI) StringFormatter::printEscape(cout); // DIAG in disguise
-           }
+           readReply(true);
            clientPendingCIPSEND=-1;
            pendingCipsend=false;
            loopState=SKIPTOEND;
@@ -141,7 +154,12 @@ WifiInboundHandler::INBOUND_STATE WifiInboundHandler::loop2() {
         }
         
         if (ch=='b') {   // This is a busy indicator... probabaly must restart a CIPSEND  
-           pendingCipsend=(clientPendingCIPSEND>=0);
+           if (clientPendingCIPSEND>=0 && ++busyRetries >= MAX_BUSY_RETRIES) {
+             // Give up on this client's reply and let the others through,
+             // but the client is still connected, so it stays registered
+             purgeCurrentCIPSEND(false);
+           } else 
+             pendingCipsend=(clientPendingCIPSEND>=0);
            loopState=SKIPTOEND; 
            break; 
         }
@@ -199,24 +217,63 @@ WifiInboundHandler::INBOUND_STATE WifiInboundHandler::loop2() {
             break;
           }
           if (Diag::WIFI) DIAG(F("Wifi inbound data(%d:%d):"),runningClientId,dataLength); 
-          if (inboundRing->freeSpace()<=(dataLength+1)) {
+          if (inboundRing->freeSpace()<dataLength+FRAME_HEADER) {
             // This input would overflow the inbound ring, ignore it  
             loopState=IPD_IGNORE_DATA;
             if (Diag::WIFI) DIAG(F("Wifi OVERFLOW IGNORING:"));    
             break;
           }
-          inboundRing->mark(runningClientId);
+          frameType=0;
           loopState=IPD_DATA;
           break; 
         }
         dataLength = dataLength * 10 + (ch - '0');
         break;
         
-      case IPD_DATA: // reading data
-        inboundRing->write(ch);    
+      case IPD_DATA: // reading data, framed into the inbound ring one command at a time
+        if (frameType==0 && ch!='\r' && ch!='\n' && ch!=' ') {
+          if (inboundRing->freeSpace()<dataLength+FRAME_HEADER) {
+            // Each command has a header of its own, so the rest of a packet
+            // of several may not fit after all: ignore it
+            if (Diag::WIFI) DIAG(F("Wifi OVERFLOW IGNORING:"));
+            loopState=IPD_IGNORE_DATA;
+          }
+          else {
+            // <...> for DCC-EX commands, a binary frame, otherwise a WiThrottle line
+            inboundRing->mark(runningClientId);
+            frameType=ch;
+            inboundRing->write(ch);
+            binaryWantLength=true;
+          }
+        }
+        else if (frameType==BINARY_START) {
+          if (binaryWantLength) {
+            // after the length byte, the frame has that many more to come
+            binaryWantLength=false;
+            binaryRemaining=ch;
+            binaryValid=BinaryProtocol::validLength(ch);
+            if (!binaryValid) inboundRing->discard();  // its bytes are skipped, not taken as text
+          }
+          else binaryRemaining--;
+          if (binaryValid) inboundRing->write(ch);
+          if (binaryRemaining==0) {
+            if (binaryValid) inboundRing->commit();
+            frameType=0;
+          }
+        }
+        else if (frameType) {
+          inboundRing->write(ch);
+          if ((frameType=='<') ? (ch=='>') : (ch=='\n' || ch=='\r')) {
+            inboundRing->commit();
+            frameType=0;
+          }
+        }
         dataLength--;
         if (dataLength == 0) {
-          inboundRing->commit();    
+          // commit any command left unterminated at the end of the packet,
+          // but drop a binary frame cut short
+          if (frameType==BINARY_START) inboundRing->discard();
+          else if (frameType) inboundRing->commit();    
           loopState = ANYTHING;
         }
         break;
@@ -247,13 +304,37 @@ WifiInboundHandler::INBOUND_STATE WifiInboundHandler::loop2() {
   return (loopState==ANYTHING) ? INBOUND_IDLE: INBOUND_BUSY;
 }
 
-void WifiInboundHandler::purgeCurrentCIPSEND() {
+void WifiInboundHandler::purgeCurrentCIPSEND(bool forgetClient) {
          // A CIPSEND was sent but errored... or the client closed just toss it away
-         CommandDistributor::forget(clientPendingCIPSEND); 
+         if (forgetClient) CommandDistributor::forget(clientPendingCIPSEND); 
          DIAG(F("Wifi: DROPPING CIPSEND=%d,%d"),clientPendingCIPSEND,currentReplySize);
-         for (int i=0;i<currentReplySize;i++) outboundRing->read();
+         readReply(false);
          pendingCipsend=false;  
          clientPendingCIPSEND=-1;
 }
 
+// Read the replies packed into the current CIPSEND from the outbound ring,
+// sending them to the ES if transmit is set.
+void WifiInboundHandler::readReply(bool transmit) {
+  int remaining=currentReplySize;
+  int count=firstReplySize;
+  for (;;) {
+    remaining-=count;
+    while (count>0) {
+      const uint8_t * span;
+      int block=outboundRing->peekSpan(span, count);
+      if (block==0) break;
+      if (transmit) {
+        wifiStream->write(span, block);
+        if (Diag::WIFI) for (int i=0;i<block;i++) StringFormatter::printEscape(span[i]); // DIAG in disguise
+      }
+      outboundRing->consume(block);
+      count-=block;
+    }
+    if (remaining<=0) break;
+    outboundRing->readClient();  // skip header of next packed reply 
+    count=outboundRing->count();
+  }
+}
+
 #endif
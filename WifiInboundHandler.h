@@ -25,6 +25,7 @@
 #include "RingStream.h"
 #include "WiThrottle.h"
 #include "DIAG.h"
+#include "BinaryProtocol.h"
 
 class WifiInboundHandler {
  public:  
@@ -64,11 +65,28 @@ class WifiInboundHandler {
    WifiInboundHandler(Stream * ESStream);
    void loop1();
    INBOUND_STATE loop2();
-   void purgeCurrentCIPSEND();
+   // Drop the reply in the current CIPSEND, and with it the client unless
+   // it is only busy
+   void purgeCurrentCIPSEND(bool forgetClient=true);
+   void readReply(bool transmit);
    Stream * wifiStream;
    
    static const int INBOUND_RING = 512;
    static const int OUTBOUND_RING = 2048;
+   // Commands are left waiting in the inbound ring while the outbound ring has less 
+   // free space than this, rather than executing them and losing the reply.
+   static const int OUTBOUND_RESERVE = 256;
+   // A reply that gets this many busy responses in a row is dropped (the client
+   // stays connected), so that a client that isn't accepting data can't hold up
+   // the replies to other clients.
+   static const byte MAX_BUSY_RETRIES = 20;
+   // Consecutive replies to the same client are packed into one CIPSEND up to this size
+   static const int MAX_CIPSEND = 2048;
+   // Ring bytes taken by each inbound command besides its data: the client id and
+   // length that mark() writes
+   static const int FRAME_HEADER = 3;
+   // Longest single command executed, anything beyond is discarded
+   static const int MAX_COMMAND = 100;
  
    RingStream * inboundRing;
    RingStream * outboundRing;
@@ -77,7 +95,14 @@ class WifiInboundHandler {
   int runningClientId;   // latest client inbound processing data or CLOSE
   int dataLength; // dataLength of +IPD
   int clientPendingCIPSEND=-1;
-  int currentReplySize;
+  int currentReplySize;  // total of the replies packed in the CIPSEND
+  int firstReplySize;    // ... of which the first is this long
   bool pendingCipsend;
+  byte busyRetries;
+  byte frameType;  // first char of the command being framed from +IPD data, 0 if none
+  byte binaryRemaining;  // bytes to come of a binary frame
+  bool binaryWantLength; // the next byte is a binary frame's length
+  bool binaryValid;      // false while skipping a frame with a bad length
+  byte cmdBuffer[MAX_COMMAND+1];
 };
 #endif
@@ -19,7 +19,7 @@
  *  You should have received a copy of the GNU General Public License
  *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
  */
-#ifndef ARDUINO_AVR_UNO_WIFI_REV2
+#if !defined(ARDUINO_AVR_UNO_WIFI_REV2) && !defined(ARDUINO_ARCH_ESP32)
 // This code is NOT compiled on a unoWifiRev2 processor which uses a different architecture 
 #include "WifiInterface.h"        /* config.h included there */
 #include <avr/pgmspace.h>
@@ -34,6 +34,26 @@
 const unsigned long LOOP_TIMEOUT = 2000;
 bool WifiInterface::connected = false;
 Stream * WifiInterface::wifiStream;
+long WifiInterface::linkSpeed;
+const FSH * WifiInterface::ssid;
+const FSH * WifiInterface::password;
+const FSH * WifiInterface::hostname;
+int WifiInterface::port;
+byte WifiInterface::channel;
+byte WifiInterface::serialTry = 0;
+byte WifiInterface::step = WifiInterface::STEP_IDLE;
+byte WifiInterface::retry;
+bool WifiInterface::oldCmd = false;
+byte WifiInterface::waitResult = WifiInterface::WAIT_TIMEOUT;
+unsigned long WifiInterface::waitStart;
+unsigned int WifiInterface::waitTimeout;
+const FSH * WifiInterface::waitFor;
+const char * WifiInterface::locator;
+bool WifiInterface::waitEcho;
+bool WifiInterface::waitEscape;
+byte WifiInterface::captureMax;
+byte WifiInterface::captureLength;
+char WifiInterface::captured[18];
 
 #ifndef WIFI_CONNECT_TIMEOUT
 // Tested how long it takes to FAIL an unknown SSID on firmware 1.7.4.
@@ -61,82 +81,53 @@ Stream * WifiInterface::wifiStream;
 bool WifiInterface::setup(long serial_link_speed, 
                           const FSH *wifiESSID,
                           const FSH *wifiPassword,
-                          const FSH *hostname,
-                          const int port,
-                          const byte channel) {
-
-  wifiSerialState wifiUp = WIFI_NOAT;
-
-#if NUM_SERIAL == 0
-  // no warning about unused parameters. 
-  (void) serial_link_speed;
-  (void) wifiESSID;
-  (void) wifiPassword;
-  (void) hostname;
-  (void) port;
-  (void) channel;
-#endif  
-  
+                          const FSH *wifiHostname,
+                          const int wifiPort,
+                          const byte wifiChannel) {
+  linkSpeed = serial_link_speed;
+  ssid = wifiESSID;
+  password = wifiPassword;
+  hostname = wifiHostname;
+  port = wifiPort;
+  channel = wifiChannel;
+  serialTry = 0;
+  // Only the first step is taken here.  The rest follow in loop() as the ES
+  // answers, so DCC and the other interfaces don't wait for the network.
+  return nextSerial();
+}
+
+// Start looking for the ES on the next serial port, leaving out any used for commands.
+bool WifiInterface::nextSerial() {
+  HardwareSerial * serial = NULL;
+  while (serial == NULL && serialTry < NUM_SERIAL) {
+    switch (serialTry++) {
 #if NUM_SERIAL > 0 && !defined(SERIAL1_COMMANDS)
-  Serial1.begin(serial_link_speed);
-  wifiUp = setup(Serial1, wifiESSID, wifiPassword, hostname, port, channel);
+    case 0: serial = &Serial1; break;
 #endif
-
-// Other serials are tried, depending on hardware.
 #if NUM_SERIAL > 1 && !defined(SERIAL2_COMMANDS)
-  if (wifiUp == WIFI_NOAT)
-  {
-    Serial2.begin(serial_link_speed);
-    wifiUp = setup(Serial2, wifiESSID, wifiPassword, hostname, port, channel);
-  }
+    case 1: serial = &Serial2; break;
 #endif
-  
 #if NUM_SERIAL > 2 && !defined(SERIAL3_COMMANDS)
-  if (wifiUp == WIFI_NOAT)
-  {
-    Serial3.begin(serial_link_speed);
-    wifiUp = setup(Serial3, wifiESSID, wifiPassword, hostname, port, channel);
-  }
+    case 2: serial = &Serial3; break;
 #endif
-
-  if (wifiUp == WIFI_NOAT) // here and still not AT commands found
-      return false;
-
-  DCCEXParser::setAtCommandCallback(ATCommand);
-  // CAUTION... ONLY CALL THIS ONCE 
-  WifiInboundHandler::setup(wifiStream);
-  if (wifiUp == WIFI_CONNECTED)
-      connected = true;
-  else
-      connected = false;
-  return connected; 
-}
-
-wifiSerialState WifiInterface::setup(Stream & setupStream,  const FSH* SSid, const FSH* password,
-				     const FSH* hostname,  int port, byte channel) {
-  wifiSerialState wifiState;
-  static uint8_t ntry = 0;
-  ntry++;
-
-  wifiStream = &setupStream;
-
-  DIAG(F("++ Wifi Setup Try %d ++"), ntry);
-
-  wifiState = setup2( SSid, password, hostname,  port, channel);
-
-  if (wifiState == WIFI_NOAT) {
-      DIAG(F("++ Wifi Setup NO AT ++"));
-      return wifiState;
+    default: break;
+    }
   }
- 
-  if (wifiState == WIFI_CONNECTED) {
-    StringFormatter::send(wifiStream, F("ATE0\r\n")); // turn off the echo 
-    checkForOK(200, true);      
+  if (serial == NULL) {
+    step = STEP_IDLE;
+    return false;
   }
+  serial->begin(linkSpeed);
+  wifiStream = serial;
+  DIAG(F("++ Wifi Setup Try %d ++"), serialTry);
+  LCD(4, F("Wifi: Try %d"), serialTry);
 
-    
-  DIAG(F("++ Wifi Setup %S ++"), wifiState == WIFI_CONNECTED ? F("CONNECTED") : F("DISCONNECTED"));
-  return wifiState;
+  // First check... Restarting the Arduino does not restart the ES. 
+  //  There may alrerady be a connection with data in the pipeline.
+  // If there is, just shortcut the setup and continue to read the data as normal.
+  expect(200, F("+IPD"), true);
+  step = STEP_PROBE;
+  return true;
 }
 
 #ifdef DONT_TOUCH_WIFI_CONF
@@ -144,184 +135,298 @@ wifiSerialState WifiInterface::setup(Stream & setupStream,  const FSH* SSid, con
 #pragma GCC diagnostic ignored "-Wunused-variable"
 #pragma GCC diagnostic ignored "-Wunused-parameter"
 #endif
-wifiSerialState WifiInterface::setup2(const FSH* SSid, const FSH* password,
-				      const FSH* hostname, int port, byte channel) {
-  bool ipOK = false;
-  bool oldCmd = false;
-
-  char macAddress[17];  //  mac address extraction   
- 
-  // First check... Restarting the Arduino does not restart the ES. 
-  //  There may alrerady be a connection with data in the pipeline.
-  // If there is, just shortcut the setup and continue to read the data as normal.
-  if (checkForOK(200,F("+IPD"), true)) {
-    DIAG(F("Preconfigured Wifi already running with data waiting"));
-    return WIFI_CONNECTED; 
-  }
-
-  StringFormatter::send(wifiStream, F("AT\r\n"));   // Is something here that understands AT?
-  if(!checkForOK(200, true))
-    return WIFI_NOAT;                               // No AT compatible WiFi module here
-
-  StringFormatter::send(wifiStream, F("ATE1\r\n")); // Turn on the echo, se we can see what's happening
-  checkForOK(2000, true);                // Makes this visible on the console
-
-  // Display the AT version information
-  StringFormatter::send(wifiStream, F("AT+GMR\r\n")); 
-  checkForOK(2000, true, false);      // Makes this visible on the console
+// Take the next step of the bring-up if the ES has answered the last command.
+void WifiInterface::setupStep() {
+  if (waitResult == WAIT_PENDING && poll() == WAIT_PENDING) return;
+  bool ok = (waitResult == WAIT_FOUND);
+  const char *yourNetwork = "Your network ";
 
+  switch (step) {
+  case STEP_PROBE:
+    if (ok) {
+      DIAG(F("Preconfigured Wifi already running with data waiting"));
+      setupDone(true);
+      return;
+    }
+    StringFormatter::send(wifiStream, F("AT\r\n"));   // Is something here that understands AT?
+    expect(200, F("\r\nOK\r\n"), true);
+    step = STEP_AT;
+    return;
+
+  case STEP_AT:
+    if (!ok) {
+      DIAG(F("++ Wifi Setup NO AT ++"));   // No AT compatible WiFi module here
+      if (!nextSerial()) LCD(4, F("Wifi: None"));
+      return;
+    }
+    StringFormatter::send(wifiStream, F("ATE1\r\n")); // Turn on the echo, se we can see what's happening
+    expect(2000, F("\r\nOK\r\n"), true);           // Makes this visible on the console
+    step = STEP_ATE1;
+    return;
+
+  case STEP_ATE1:
+    // Display the AT version information
+    StringFormatter::send(wifiStream, F("AT+GMR\r\n")); 
+    expect(2000, F("\r\nOK\r\n"), true, false);    // Makes this visible on the console
+    step = STEP_GMR;
+    return;
+
+  case STEP_GMR:
 #ifdef DONT_TOUCH_WIFI_CONF
-  DIAG(F("DONT_TOUCH_WIFI_CONF was set: Using existing config"));
+    DIAG(F("DONT_TOUCH_WIFI_CONF was set: Using existing config"));
+    startServer();
 #else
-  // Older ES versions have AT+CWJAP, newer ones have AT+CWJAP_CUR and AT+CWHOSTNAME
-  StringFormatter::send(wifiStream, F("AT+CWJAP_CUR?\r\n"));
-  if (!(checkForOK(2000, true))) {
+    // Older ES versions have AT+CWJAP, newer ones have AT+CWJAP_CUR and AT+CWHOSTNAME
+    oldCmd = false;
+    StringFormatter::send(wifiStream, F("AT+CWJAP_CUR?\r\n"));
+    expect(2000, F("\r\nOK\r\n"), true);
+    step = STEP_CWJAP_QUERY;
+#endif
+    return;
+
+#ifndef DONT_TOUCH_WIFI_CONF
+  case STEP_CWJAP_QUERY:
+    if (!ok) {
       oldCmd=true;
       while (wifiStream->available()) StringFormatter::printEscape( wifiStream->read()); /// THIS IS A DIAG IN DISGUISE
-  }
-
-  StringFormatter::send(wifiStream, F("AT+CWMODE%s=1\r\n"), oldCmd ? "" : "_CUR"); // configure as "station" = WiFi client
-  checkForOK(1000, true);                       // Not always OK, sometimes "no change"
-
-  const char *yourNetwork = "Your network ";
-  if (strncmp_P(yourNetwork, (const char*)SSid, 13) == 0 || strncmp_P("", (const char*)SSid, 13) == 0) {
-    if (strncmp_P(yourNetwork, (const char*)password, 13) == 0) {
-      // If the source code looks unconfigured, check if the
-      // ESP8266 is preconfigured in station mode.
-      // We check the first 13 chars of the SSid and the password
-
-      // give a preconfigured ES8266 a chance to connect to a router
-      // typical connect time approx 7 seconds
-      delay(8000);
-      StringFormatter::send(wifiStream, F("AT+CIFSR\r\n"));
-      if (checkForOK(5000, F("+CIFSR:STAIP"), true,false))
-	  if (!checkForOK(1000, F("0.0.0.0"), true,false))
-	      ipOK = true;
     }
-  } else {
-      // SSID was configured, so we assume station (client) mode.
-      if (oldCmd) {
-	      // AT command early version supports CWJAP/CWSAP
-	      StringFormatter::send(wifiStream, F("AT+CWJAP=\"%S\",\"%S\"\r\n"), SSid, password);
-	      ipOK = checkForOK(WIFI_CONNECT_TIMEOUT, true);
-      } else {
-      // later version supports CWJAP_CUR
-        StringFormatter::send(wifiStream, F("AT+CWHOSTNAME=\"%S\"\r\n"), hostname); // Set Host name for Wifi Client
-      	checkForOK(2000, true); // dont care if not supported
-      
-        StringFormatter::send(wifiStream, F("AT+CWJAP_CUR=\"%S\",\"%S\"\r\n"), SSid, password);
-        ipOK = checkForOK(WIFI_CONNECT_TIMEOUT, true);
-      }
+    StringFormatter::send(wifiStream, F("AT+CWMODE%s=1\r\n"), oldCmd ? "" : "_CUR"); // configure as "station" = WiFi client
+    expect(1000, F("\r\nOK\r\n"), true);           // Not always OK, sometimes "no change"
+    step = STEP_CWMODE1;
+    return;
 
-      if (ipOK) {
-	      // But we really only have the ESSID and password correct
-        // Let's check for IP (via DHCP)
-        ipOK = false;
-        StringFormatter::send(wifiStream, F("AT+CIFSR\r\n"));
-        if (checkForOK(5000, F("+CIFSR:STAIP"), true,false))
-        if (!checkForOK(1000, F("0.0.0.0"), true,false))
-        ipOK = true;
+  case STEP_CWMODE1:
+    if (strncmp_P(yourNetwork, (const char*)ssid, 13) == 0 || strncmp_P("", (const char*)ssid, 13) == 0) {
+      if (strncmp_P(yourNetwork, (const char*)password, 13) == 0) {
+        // If the source code looks unconfigured, check if the
+        // ESP8266 is preconfigured in station mode.
+        // We check the first 13 chars of the SSid and the password
+
+        // give a preconfigured ES8266 a chance to connect to a router
+        // typical connect time approx 7 seconds
+        LCD(4, F("Wifi: Joining"));
+        expect(8000, NULL, true);
+        step = STEP_PRECONFIGURED;
       }
-  }
-
-  if (!ipOK) {
-    // If we have not managed to get this going in station mode, go for AP mode
-
-  //    StringFormatter::send(wifiStream, F("AT+RST\r\n"));
-  //    checkForOK(1000, true); // Not always OK, sometimes "no change"
-
-    int i=0;
-    do {
-      // configure as AccessPoint. Try really hard as this is the
-      // last way out to get any Wifi connectivity. 
+      else startAccessPoint();
+      return;
+    }
+    // SSID was configured, so we assume station (client) mode.
+    LCD(4, F("Wifi: Joining"));
+    if (oldCmd) {
+      // AT command early version supports CWJAP/CWSAP
+      StringFormatter::send(wifiStream, F("AT+CWJAP=\"%S\",\"%S\"\r\n"), ssid, password);
+      expect(WIFI_CONNECT_TIMEOUT, F("\r\nOK\r\n"), true);
+      step = STEP_JOIN;
+    } else {
+      // later version supports CWJAP_CUR
+      StringFormatter::send(wifiStream, F("AT+CWHOSTNAME=\"%S\"\r\n"), hostname); // Set Host name for Wifi Client
+      expect(2000, F("\r\nOK\r\n"), true); // dont care if not supported
+      step = STEP_HOSTNAME;
+    }
+    return;
+
+  case STEP_HOSTNAME:
+    StringFormatter::send(wifiStream, F("AT+CWJAP_CUR=\"%S\",\"%S\"\r\n"), ssid, password);
+    expect(WIFI_CONNECT_TIMEOUT, F("\r\nOK\r\n"), true);
+    step = STEP_JOIN;
+    return;
+
+  case STEP_JOIN:
+    // But we really only have the ESSID and password correct
+    if (!ok) {
+      startAccessPoint();
+      return;
+    }
+    // Let's check for IP (via DHCP)
+    // fall through
+  case STEP_PRECONFIGURED:
+    StringFormatter::send(wifiStream, F("AT+CIFSR\r\n"));
+    expect(5000, F("+CIFSR:STAIP"), true, false);
+    step = STEP_STAIP;
+    return;
+
+  case STEP_STAIP:
+    if (!ok) {
+      startAccessPoint();
+      return;
+    }
+    expect(1000, F("0.0.0.0"), true, false);
+    step = STEP_STAIP_ZERO;
+    return;
+
+  case STEP_STAIP_ZERO:
+    if (ok) startAccessPoint();  // no address yet
+    else startServer();
+    return;
+
+  case STEP_CWMODE2:
+    // configure as AccessPoint. Try really hard as this is the
+    // last way out to get any Wifi connectivity. 
+    if (!ok && retry++<10) {
       StringFormatter::send(wifiStream, F("AT+CWMODE%s=2\r\n"), oldCmd ? "" : "_CUR"); 
-    } while (!checkForOK(1000+i*500, true) && i++<10);
-
+      expect(1000+retry*500, F("\r\nOK\r\n"), true);
+      return;
+    }
     while (wifiStream->available()) StringFormatter::printEscape( wifiStream->read()); /// THIS IS A DIAG IN DISGUISE
 
     // Figure out MAC addr
     StringFormatter::send(wifiStream, F("AT+CIFSR\r\n")); // not TOMATO
     // looking fpr mac addr eg +CIFSR:APMAC,"be:dd:c2:5c:6b:b7"
-    if (checkForOK(5000, F("+CIFSR:APMAC,\""), true,false)) {
-      // Copy 17 byte mac address
-      for (int i=0; i<17;i++) {
-        while(!wifiStream->available());
-	macAddress[i]=wifiStream->read();
-	StringFormatter::printEscape(macAddress[i]);
-      }
-    } else {
-	memset(macAddress,'f',sizeof(macAddress));
+    expect(5000, F("+CIFSR:APMAC,\""), true, false, 17);
+    step = STEP_APMAC;
+    return;
+
+  case STEP_APMAC:
+    if (!ok || captureLength < 17) memset(captured, 'f', 17);
+    expect(1000, F("\r\nOK\r\n"), true, false);  // suck up remainder of AT+CIFSR
+    step = STEP_APMAC_REST;
+    return;
+
+  case STEP_APMAC_REST:
+    retry = 0;
+    sendCWSAP();
+    return;
+
+  case STEP_CWSAP:
+    // do twice if necessary but ignore failure as AP mode may still be ok
+    if (!ok && retry++<2) {
+      sendCWSAP();
+      return;
     }
-    char macTail[]={macAddress[9],macAddress[10],macAddress[12],macAddress[13],macAddress[15],macAddress[16],'\0'};
-
-    checkForOK(1000, true, false);  // suck up remainder of AT+CIFSR
-  
-    i=0;
-    do {
-      if (strncmp_P(yourNetwork, (const char*)password, 13) == 0) {
-	// unconfigured
-        StringFormatter::send(wifiStream, F("AT+CWSAP%s=\"DCCEX_%s\",\"PASS_%s\",%d,4\r\n"),
-                                          oldCmd ? "" : "_CUR", macTail, macTail, channel);
-      } else {
-        // password configured by user
-       StringFormatter::send(wifiStream, F("AT+CWSAP%s=\"DCCEX_%s\",\"%S\",%d,4\r\n"), oldCmd ? "" : "_CUR",
-	                                       macTail, password, channel);
-      }
-    } while (!checkForOK(WIFI_CONNECT_TIMEOUT, true) && i++<2); // do twice if necessary but ignore failure as AP mode may still be ok
-    if (i >= 2)
-	DIAG(F("Warning: Setting AP SSID and password failed"));       // but issue warning
+    if (retry >= 2)
+      DIAG(F("Warning: Setting AP SSID and password failed"));       // but issue warning
 
     if (!oldCmd) {
       StringFormatter::send(wifiStream, F("AT+CIPRECVMODE=0\r\n"), port); // make sure transfer mode is correct
-      checkForOK(2000, true);
+      expect(2000, F("\r\nOK\r\n"), true);
+      step = STEP_RECVMODE;
+      return;
     }
-  }
-#endif //DONT_TOUCH_WIFI_CONF
+    startServer();
+    return;
 
-  StringFormatter::send(wifiStream, F("AT+CIPSERVER=0\r\n")); // turn off tcp server (to clean connections before CIPMUX=1)
-  checkForOK(1000, true); // ignore result in case it already was off
-
-  StringFormatter::send(wifiStream, F("AT+CIPMUX=1\r\n")); // configure for multiple connections
-  if (!checkForOK(1000, true)) return WIFI_DISCONNECTED;
+  case STEP_RECVMODE:
+    startServer();
+    return;
+#endif //DONT_TOUCH_WIFI_CONF
 
-  if(!oldCmd) {                                                                    // no idea to test this on old firmware
-    StringFormatter::send(wifiStream, F("AT+MDNS=1,\"%S\",\"withrottle\",%d\r\n"),
+  case STEP_CIPSERVER0:
+    // ignore result in case it already was off
+    StringFormatter::send(wifiStream, F("AT+CIPMUX=1\r\n")); // configure for multiple connections
+    expect(1000, F("\r\nOK\r\n"), true);
+    step = STEP_CIPMUX;
+    return;
+
+  case STEP_CIPMUX:
+    if (!ok) {
+      setupDone(false);
+      return;
+    }
+    if(!oldCmd) {                                                                    // no idea to test this on old firmware
+      StringFormatter::send(wifiStream, F("AT+MDNS=1,\"%S\",\"withrottle\",%d\r\n"),
 			  hostname, port);                                         // mDNS responder
-    checkForOK(1000, true);                                                        // dont care if not supported
-  }
-
-  StringFormatter::send(wifiStream, F("AT+CIPSERVER=1,%d\r\n"), port); // turn on server on port
-  if (!checkForOK(1000, true)) return WIFI_DISCONNECTED;
- 
-  StringFormatter::send(wifiStream, F("AT+CIFSR\r\n")); // Display  ip addresses to the DIAG 
-  if (!checkForOK(1000, F("IP,\"") , true, false)) return WIFI_DISCONNECTED;
-  // Copy the IP address
-  {
-    const byte MAX_IP_LENGTH=15;
-    char ipString[MAX_IP_LENGTH+1];
-    ipString[MAX_IP_LENGTH]='\0'; // protection against missing " character on end. 
-    for(byte ipLen=0;ipLen<MAX_IP_LENGTH;ipLen++) {
-      while(!wifiStream->available());
-      int ipChar=wifiStream->read();
-      StringFormatter::printEscape(ipChar);
-      if (ipChar=='"') {
-        ipString[ipLen]='\0';
-        break;
-      }
-      ipString[ipLen]=ipChar;
+      expect(1000, F("\r\nOK\r\n"), true);                                           // dont care if not supported
+      step = STEP_MDNS;
+      return;
+    }
+    // fall through
+  case STEP_MDNS:
+    StringFormatter::send(wifiStream, F("AT+CIPSERVER=1,%d\r\n"), port); // turn on server on port
+    expect(1000, F("\r\nOK\r\n"), true);
+    step = STEP_CIPSERVER1;
+    return;
+
+  case STEP_CIPSERVER1:
+    if (!ok) {
+      setupDone(false);
+      return;
+    }
+    StringFormatter::send(wifiStream, F("AT+CIFSR\r\n")); // Display  ip addresses to the DIAG 
+    expect(1000, F("IP,\""), true, false, 15);      // Copy the IP address
+    step = STEP_IP;
+    return;
+
+  case STEP_IP:
+    if (!ok) {
+      setupDone(false);
+      return;
     }
-    LCD(4,F("%s"),ipString);  // There is not enough room on some LCDs to put a title to this      
+    LCD(4,F("%s"),captured);  // There is not enough room on some LCDs to put a title to this      
+    // suck up anything after the IP. 
+    expect(1000, F("\r\nOK\r\n"), true, false);
+    step = STEP_IP_REST;
+    return;
+
+  case STEP_IP_REST:
+    if (!ok) {
+      setupDone(false);
+      return;
+    }
+    LCD(5,F("PORT=%d"),port);
+    setupDone(true);
+    return;
+
+  case STEP_ATE0:
+    connected = true;
+    DIAG(F("++ Wifi Setup CONNECTED ++"));
+    step = STEP_IDLE;
+    return;
   }
-  // suck up anything after the IP. 
-  if (!checkForOK(1000, true, false)) return WIFI_DISCONNECTED;
-  LCD(5,F("PORT=%d"),port);
-   
-  return WIFI_CONNECTED;
 }
 #ifdef DONT_TOUCH_WIFI_CONF
 #pragma GCC diagnostic pop
 #endif
 
+#ifndef DONT_TOUCH_WIFI_CONF
+// If we have not managed to get this going in station mode, go for AP mode
+void WifiInterface::startAccessPoint() {
+  //    StringFormatter::send(wifiStream, F("AT+RST\r\n"));
+  //    checkForOK(1000, true); // Not always OK, sometimes "no change"
+  LCD(4, F("Wifi: Access point"));
+  retry = 0;
+  StringFormatter::send(wifiStream, F("AT+CWMODE%s=2\r\n"), oldCmd ? "" : "_CUR"); 
+  expect(1000, F("\r\nOK\r\n"), true);
+  step = STEP_CWMODE2;
+}
+
+void WifiInterface::sendCWSAP() {
+  char macTail[]={captured[9],captured[10],captured[12],captured[13],captured[15],captured[16],'\0'};
+  if (strncmp_P("Your network ", (const char*)password, 13) == 0) {
+    // unconfigured
+    StringFormatter::send(wifiStream, F("AT+CWSAP%s=\"DCCEX_%s\",\"PASS_%s\",%d,4\r\n"),
+                                      oldCmd ? "" : "_CUR", macTail, macTail, channel);
+  } else {
+    // password configured by user
+    StringFormatter::send(wifiStream, F("AT+CWSAP%s=\"DCCEX_%s\",\"%S\",%d,4\r\n"), oldCmd ? "" : "_CUR",
+                                       macTail, password, channel);
+  }
+  expect(WIFI_CONNECT_TIMEOUT, F("\r\nOK\r\n"), true);
+  step = STEP_CWSAP;
+}
+#endif
+
+void WifiInterface::startServer() {
+  StringFormatter::send(wifiStream, F("AT+CIPSERVER=0\r\n")); // turn off tcp server (to clean connections before CIPMUX=1)
+  expect(1000, F("\r\nOK\r\n"), true);
+  step = STEP_CIPSERVER0;
+}
+
+// The ES has been found, so hand it over to the inbound handler.
+void WifiInterface::setupDone(bool ok) {
+  DCCEXParser::setAtCommandCallback(ATCommand);
+  // CAUTION... ONLY CALL THIS ONCE 
+  WifiInboundHandler::setup(wifiStream);
+  if (!ok) {
+    DIAG(F("++ Wifi Setup DISCONNECTED ++"));
+    LCD(4, F("Wifi: Disconnected"));
+    step = STEP_IDLE;
+    return;
+  }
+  StringFormatter::send(wifiStream, F("ATE0\r\n")); // turn off the echo 
+  expect(200, F("\r\nOK\r\n"), true);
+  step = STEP_ATE0;
+}
 
 // This function is used to allow users to enter <+ commands> through the DCCEXParser
 // <+command>  sends AT+command to the ES and returns to the caller.
@@ -373,28 +478,70 @@ bool WifiInterface::checkForOK( const unsigned int timeout,  bool echo, bool esc
 }
 
 bool WifiInterface::checkForOK( const unsigned int timeout, const FSH * waitfor, bool echo, bool escapeEcho) {
-  unsigned long  startTime = millis();
-  char *locator = (char *)waitfor;
-  DIAG(F("Wifi Check: [%E]"), waitfor);
-  while ( millis() - startTime < timeout) {
-    while (wifiStream->available()) {
-      int ch = wifiStream->read();
-      if (echo) {
-        if (escapeEcho) StringFormatter::printEscape( ch); /// THIS IS A DIAG IN DISGUISE
-        else StringFormatter::diagSerial->print((char)ch); 
+  expect(timeout, waitfor, echo, escapeEcho);
+  while (poll() == WAIT_PENDING) {}
+  return waitResult == WAIT_FOUND;
+}
+
+void WifiInterface::expect(const unsigned int timeout, const FSH * waitfor, bool echo, bool escapeEcho, byte capture) {
+  if (waitfor) DIAG(F("Wifi Check: [%E]"), waitfor);
+  waitResult = WAIT_PENDING;
+  waitStart = millis();
+  waitTimeout = timeout;
+  waitFor = waitfor;
+  locator = (const char *)waitfor;
+  waitEcho = echo;
+  waitEscape = escapeEcho;
+  captureMax = capture;
+  captureLength = 0;
+  captured[0] = '\0';
+}
+
+// Read what the ES has sent so far, without waiting for more.
+byte WifiInterface::poll() {
+  if (waitResult != WAIT_PENDING) return waitResult;
+  while (wifiStream->available()) {
+    int ch = wifiStream->read();
+    if (waitEcho) {
+      if (waitEscape) StringFormatter::printEscape( ch); /// THIS IS A DIAG IN DISGUISE
+      else StringFormatter::diagSerial->print((char)ch); 
+    }
+    if (waitFor == NULL) continue;
+    if (GETFLASH(locator) == '\0') {
+      // Found, and now capturing what follows
+      if (ch == '"') {
+        waitResult = WAIT_FOUND;
+        return waitResult;
+      }
+      captured[captureLength++] = ch;
+      captured[captureLength] = '\0';
+      if (captureLength == captureMax) {
+        waitResult = WAIT_FOUND;
+        return waitResult;
       }
-      if (ch != GETFLASH(locator)) locator = (char *)waitfor;
-      if (ch == GETFLASH(locator)) {
-        locator++;
-        if (!GETFLASH(locator)) {
-          DIAG(F("Found in %dms"), millis() - startTime);
-          return true;
+      continue;
+    }
+    if (ch != GETFLASH(locator)) locator = (const char *)waitFor;
+    if (ch == GETFLASH(locator)) {
+      locator++;
+      if (!GETFLASH(locator)) {
+        DIAG(F("Found in %dms"), millis() - waitStart);
+        if (captureMax == 0) {
+          waitResult = WAIT_FOUND;
+          return waitResult;
         }
       }
     }
   }
-  DIAG(F("TIMEOUT after %dms"), timeout);
-  return false;
+  if (millis() - waitStart >= waitTimeout) {
+    // A capture cut short still counts as found
+    if (waitFor && GETFLASH(locator) == '\0') waitResult = WAIT_FOUND;
+    else {
+      if (waitFor) DIAG(F("TIMEOUT after %dms"), waitTimeout);
+      waitResult = WAIT_TIMEOUT;
+    }
+  }
+  return waitResult;
 }
 
 
@@ -402,6 +549,7 @@ void WifiInterface::loop() {
   if (connected) {
     WifiInboundHandler::loop(); 
   }
+  else if (step != STEP_IDLE) setupStep();
 }
 
 #endif
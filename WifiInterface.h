@@ -25,12 +25,12 @@
 #include <Arduino.h>
 #include <avr/pgmspace.h>
 
-enum wifiSerialState { WIFI_NOAT, WIFI_DISCONNECTED, WIFI_CONNECTED };
-
 class WifiInterface
 {
 
 public:
+  // Starts bringing up the ES, which carries on in loop().  Returns false
+  // if there is no serial port to look for it on.
   static bool setup(long serial_link_speed, 
                           const FSH *wifiESSID,
                           const FSH *wifiPassword,
@@ -41,14 +41,51 @@ public:
   static void ATCommand(HardwareSerial * stream,const byte *command);
   
 private:
-  static wifiSerialState setup(Stream &setupStream, const FSH *SSSid, const FSH *password,
-                    const FSH *hostname, int port, byte channel);
+  // Steps of the bring-up.  Each step handles the reply to the AT command
+  // sent by the step before, and sends the next one.
+  enum : byte {
+    STEP_IDLE, STEP_PROBE, STEP_AT, STEP_ATE1, STEP_GMR, STEP_CWJAP_QUERY, STEP_CWMODE1,
+    STEP_HOSTNAME, STEP_JOIN, STEP_PRECONFIGURED, STEP_STAIP, STEP_STAIP_ZERO,
+    STEP_CWMODE2, STEP_APMAC, STEP_APMAC_REST, STEP_CWSAP, STEP_RECVMODE,
+    STEP_CIPSERVER0, STEP_CIPMUX, STEP_MDNS, STEP_CIPSERVER1, STEP_IP, STEP_IP_REST, STEP_ATE0,
+  };
+  enum : byte { WAIT_PENDING, WAIT_FOUND, WAIT_TIMEOUT };
   static Stream *wifiStream;
   static DCCEXParser parser;
-  static wifiSerialState setup2(const FSH *SSSid, const FSH *password,
-                     const FSH *hostname, int port, byte channel);
+  static bool nextSerial();
+  static void setupStep();
+  static void startAccessPoint();
+  static void sendCWSAP();
+  static void startServer();
+  static void setupDone(bool ok);
+  // Start waiting for waitfor (or just for the timeout if NULL).  With capture, the
+  // text after it, up to a quote or capture characters, is kept in captured[].
+  static void expect(const unsigned int timeout, const FSH *waitfor, bool echo, bool escapeEcho = true, byte capture = 0);
+  static byte poll();
   static bool checkForOK(const unsigned int timeout, bool echo, bool escapeEcho = true);
   static bool checkForOK(const unsigned int timeout, const FSH *waitfor, bool echo, bool escapeEcho = true);
   static bool connected;
+
+  static long linkSpeed;
+  static const FSH *ssid;
+  static const FSH *password;
+  static const FSH *hostname;
+  static int port;
+  static byte channel;
+  static byte serialTry;  // serial ports tried so far
+  static byte step;
+  static byte retry;
+  static bool oldCmd;     // ES firmware without the _CUR commands
+
+  static byte waitResult;
+  static unsigned long waitStart;
+  static unsigned int waitTimeout;
+  static const FSH *waitFor;
+  static const char *locator;
+  static bool waitEcho;
+  static bool waitEscape;
+  static byte captureMax;
+  static byte captureLength;
+  static char captured[18];
 };
 #endif
@@ -103,6 +103,14 @@ The configuration file for DCC-EX Command Station
 // is not for Wifi. You will then need the Arduino Ethernet library as well
 //
 //#define ENABLE_ETHERNET true
+//
+// ETHERNET_MULTICAST: Also send every broadcast (sensors, turnouts, locos, power)
+// once as a UDP packet to this multicast group, on port ETHERNET_MULTICAST_PORT
+// (default 2561).  A client sends <D MULTICAST ON> over its TCP connection to stop
+// getting broadcasts there too.  Each packet starts <N sequence>; a client that sees
+// a gap can catch up with <$ VERSION>.  This uses one of the shield's sockets.
+//
+//#define ETHERNET_MULTICAST 239,255,220,1
 
 
 /////////////////////////////////////////////////////////////////////////////////////
@@ -195,5 +203,45 @@ The configuration file for DCC-EX Command Station
 //#define SERIAL1_COMMANDS
 //#define SERIAL2_COMMANDS
 //#define SERIAL3_COMMANDS
+//
+// The serial ports run at 115200 baud unless changed below.  On a 16MHz AVR
+// 250000, 500000 and 1000000 are exact, and better than 115200 for busy JMRI
+// sessions if the other end can use them.  A native USB serial port runs at
+// USB speed whatever the setting.
+//#define SERIAL_BAUD 500000
+//#define SERIAL1_BAUD 115200
+//#define SERIAL2_BAUD 115200
+//#define SERIAL3_BAUD 115200
+
+/////////////////////////////////////////////////////////////////////////////////////
+//
+// LCN
+// Layout control nodes are connected to the serial port named by LCN_SERIAL.
+// Uncomment LCN_BINARY if the LCN master sends and receives frames (see LCN.h),
+// which synchronise the state of a large layout much faster than text.
+//
+//#define LCN_SERIAL Serial3
+//#define LCN_BINARY
+
+/////////////////////////////////////////////////////////////////////////////////////
+//
+// RAILCOM
+// Uncomment to open a RailCom cutout in the main track signal after each packet,
+// so RailCom decoders can report to RailcomDetector devices (see IO_Railcom.h).
+// The main track motor driver must have a brake pin, which is applied for the
+// cutout.  <D RAILCOM OFF> and <D RAILCOM ON> stop and restart the cutout.
+//
+//#define RAILCOM
+
+/////////////////////////////////////////////////////////////////////////////////////
+//
+// POWER DISTRICTS
+// Further main track outputs (boosters), each with its own motor driver, which
+// carry the main track signal but have their own current sensing and overload
+// protection, so a short in one district doesn't stop the trains in the others.
+// <1> and <0> switch them all with the main track, and <c> reports their
+// current as CurrentD1, CurrentD2...  Up to 7 drivers, listed as in MotorDrivers.h:
+//
+//#define POWER_DISTRICTS new MotorDriver(5, 4, UNUSED_PIN, UNUSED_PIN, A2, 2.99, 2000, UNUSED_PIN), new MotorDriver(6, 7, UNUSED_PIN, UNUSED_PIN, A3, 2.99, 2000, UNUSED_PIN)
 
 /////////////////////////////////////////////////////////////////////////////////////
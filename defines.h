@@ -40,7 +40,7 @@
 // WIFI_ON: All prereqs for running with WIFI are met
 // Note: WIFI_CHANNEL may not exist in early config.h files so is added here if needed.
 
-#if (defined(ARDUINO_AVR_MEGA) || defined(ARDUINO_AVR_MEGA2560) || defined(ARDUINO_SAMD_ZERO)  || defined(TEENSYDUINO)) || defined(ARDUINO_AVR_NANO_EVERY)
+#if (defined(ARDUINO_AVR_MEGA) || defined(ARDUINO_AVR_MEGA2560) || defined(ARDUINO_SAMD_ZERO)  || defined(TEENSYDUINO)) || defined(ARDUINO_AVR_NANO_EVERY) || defined(ARDUINO_ARCH_ESP32)
  #define BIG_RAM
 #endif 
 #if ENABLE_WIFI
@@ -21,6 +21,7 @@
 
 #include <Arduino.h>
 #include "freeMemory.h"
+#include "StringFormatter.h"
 
 // thanks go to  https://github.com/mpflaga/Arduino-MemoryFree
 #if defined(__arm__)
@@ -28,32 +29,101 @@ extern "C" char* sbrk(int);
 #elif defined(__AVR__)
 extern char *__brkval;
 extern char *__malloc_heap_start;
+// avr-libc malloc's list of freed blocks
+struct __freelist {
+  size_t sz;
+  struct __freelist *nx;
+};
+extern struct __freelist *__flp;
+#elif defined(ARDUINO_ARCH_ESP32)
+#include <esp_heap_caps.h>
+#elif defined(ARDUINO_ARCH_NATIVE)
+// Host build, where free memory means nothing
 #else
 #error Unsupported board type
 #endif
 
 
-static volatile int minimum_free_memory = __INT_MAX__;
+#if defined(ARDUINO_ARCH_NATIVE)
+void paintFreeMemory() {}
+
+int minimumFreeMemory() {
+  return __INT_MAX__;
+}
+
+void displayHeap(Print *stream) {
+  StringFormatter::send(stream, F("Host build, no heap figures\n"));
+}
+
+#elif defined(ARDUINO_ARCH_ESP32)
+// The heap keeps its own low water mark.
+void paintFreeMemory() {}
+
+int minimumFreeMemory() {
+  return heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+}
+
+void displayHeap(Print *stream) {
+  StringFormatter::send(stream, F("Heap free=%d largest block=%d\n"),
+    (int)heap_caps_get_free_size(MALLOC_CAP_8BIT), (int)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+}
 
-#if !defined(__IMXRT1062__)
-static inline int freeMemory() {
-  char top;
-#if defined(__arm__)
-  return &top - reinterpret_cast<char*>(sbrk(0));
 #elif defined(__AVR__)
-  return __brkval ? &top - __brkval : &top - __malloc_heap_start;
-#else
-#error bailed out already above
-#endif
+static const byte PAINT = 0xC5;
+static char *stackLow = NULL;  // lowest address the stack has been seen to use
+static char *heapHigh = NULL;  // highest top of heap seen
+
+static inline char *heapTop() {
+  return __brkval ? __brkval : __malloc_heap_start;
+}
+
+void paintFreeMemory() {
+  char top;
+  // Leave room below the stack for any interrupts meanwhile.
+  char *end = &top - 64;
+  for (char *p = heapTop(); p < end; p++) *p = PAINT;
+  stackLow = end;
 }
 
-// Return low memory value.
+// The stack has reached down to the lowest byte that is no longer paint.  Locals
+// aren't always written, so a frame can leave a run of paint of any length, and the
+// search goes up from the top of the heap.  It is done a slice at a time, so as not to
+// hold up the loop, and the figure is updated when a search finishes.
+// Both ends only move towards each other, so this is the worst case so far.
+static const int SCAN_SLICE = 256;
+static char *scanPos = NULL;   // next byte to look at
+
 int minimumFreeMemory() {
-  byte sreg_save = SREG;
-  noInterrupts(); // Disable interrupts
-  int retval = minimum_free_memory;
-  SREG = sreg_save; // Restore interrupt state
-  return retval;
+  char top;
+  if (heapTop() > heapHigh) heapHigh = heapTop();
+  if (!stackLow || &top < stackLow) stackLow = &top;
+  if (!scanPos || scanPos < heapHigh) scanPos = heapHigh;
+  char *end = stackLow - scanPos > SCAN_SLICE ? scanPos + SCAN_SLICE : stackLow;
+  while (scanPos < end && (byte)*scanPos == PAINT) scanPos++;
+  if (scanPos < end) stackLow = scanPos;  // first byte the stack has used
+  if (scanPos >= stackLow) scanPos = heapHigh;  // start again next time
+  return stackLow > heapHigh ? stackLow - heapHigh : 0;
+}
+
+void displayHeap(Print *stream) {
+  char top;
+  int blocks = 0, freeBytes = 0, largest = 0;
+  for (struct __freelist *fp = __flp; fp; fp = fp->nx) {
+    blocks++;
+    freeBytes += fp->sz;
+    if ((int)fp->sz > largest) largest = fp->sz;
+  }
+  StringFormatter::send(stream, F("Heap size=%d free list=%d in %d blocks largest=%d, free above heap=%d\n"),
+    (int)(heapTop() - __malloc_heap_start), freeBytes, blocks, largest, (int)(&top - heapTop()));
+}
+
+#else
+static int minimum_free_memory = __INT_MAX__;
+
+#if !defined(__IMXRT1062__)
+static inline int freeMemory() {
+  char top;
+  return &top - reinterpret_cast<char*>(sbrk(0));
 }
 
 #else
@@ -84,29 +154,19 @@ static inline int freeMemory() {
   return freemem;
 }
 
-// Return low memory value.
-int minimumFreeMemory() {
-  //byte sreg_save = SREG;
-  //noInterrupts(); // Disable interrupts
-  int retval = minimum_free_memory;
-  //SREG = sreg_save; // Restore interrupt state
-  return retval;
-}
 #endif
 
+// Without painted memory, the free memory is sampled whenever it is asked for.
+void paintFreeMemory() {}
 
-// Update low ram level.  Allow for extra bytes to be specified
-// by estimation or inspection, that may be used by other 
-// called subroutines.  Must be called with interrupts disabled.
-// 
-// Although __brkval may go up and down as heap memory is allocated
-// and freed, this function records only the worst case encountered.
-// So even if all of the heap is freed, the reported minimum free 
-// memory will not increase.
-//
-void updateMinimumFreeMemory(unsigned char extraBytes) {
-  int spare = freeMemory()-extraBytes;
+int minimumFreeMemory() {
+  int spare = freeMemory();
   if (spare < 0) spare = 0;
   if (spare < minimum_free_memory) minimum_free_memory = spare;
+  return minimum_free_memory;
 }
 
+void displayHeap(Print *stream) {
+  StringFormatter::send(stream, F("Free memory now=%d\n"), freeMemory());
+}
+#endif
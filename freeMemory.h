@@ -20,6 +20,14 @@
 
 #ifndef freeMemory_h
 #define freeMemory_h
-void updateMinimumFreeMemory(unsigned char extraBytes=0);
+#include <Arduino.h>
+
+// Fill the free memory between the heap and the stack with a pattern, so that
+// minimumFreeMemory() can find how far the stack has reached without needing
+// to be sampled from an interrupt.  Called first thing in setup().
+void paintFreeMemory();
+// Lowest free memory seen so far.  Call from the loop, not an interrupt.
 int minimumFreeMemory();
+// Heap use and free list summary, for <D RAM>
+void displayHeap(Print *stream);
 #endif
@@ -0,0 +1,176 @@
+/*
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef Arduino_h
+#define Arduino_h
+
+// Just enough of the Arduino core for the command station to build and run on
+// the host ([env:native] in platformio.ini), to time the parser, the formatter,
+// broadcasts and the reminders without a board.  Pins and the ADC do nothing,
+// time is the host's and Serial is stdout.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <math.h>
+
+#ifndef ARDUINO_ARCH_NATIVE
+#define ARDUINO_ARCH_NATIVE
+#endif
+#define ARDUINO 10819
+#define F_CPU 16000000UL  // as a Mega, for the sums in DCCTimer
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define A0 54
+#define A1 55
+#define A2 56
+#define A3 57
+#define A4 58
+#define A5 59
+#define A6 60
+#define A7 61
+#define NOT_A_PIN 0
+#define NUM_DIGITAL_PINS 70
+#define BIN 2
+#define OCT 8
+#define DEC 10
+#define HEX 16
+
+#define PROGMEM
+#define pgm_read_byte_near(addr) (*(const unsigned char *)(addr))
+#define pgm_read_word_near(addr) (*(const unsigned short *)(addr))
+#define pgm_read_byte(addr) pgm_read_byte_near(addr)
+#define pgm_read_word(addr) pgm_read_word_near(addr)
+#define strlen_P strlen
+#define strcpy_P strcpy
+#define strcmp_P strcmp
+#define strncmp_P strncmp
+#define memcpy_P memcpy
+#define sprintf_P sprintf
+
+class __FlashStringHelper;
+#define F(string_literal) (reinterpret_cast<const __FlashStringHelper *>(string_literal))
+
+#define lowByte(w) ((uint8_t) ((w) & 0xff))
+#define highByte(w) ((uint8_t) ((w) >> 8))
+#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
+#define bitSet(value, bit) ((value) |= (1UL << (bit)))
+#define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
+// Macros, as on the AVR, so mixed types are compared without complaint
+#define min(a,b) ((a)<(b)?(a):(b))
+#define max(a,b) ((a)>(b)?(a):(b))
+#define constrain(amt,low,high) ((amt)<(low)?(low):((amt)>(high)?(high):(amt)))
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+long random(long howbig);
+long random(long howsmall, long howbig);
+long map(long x, long in_min, long in_max, long out_min, long out_max);
+char *itoa(int value, char *str, int base);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t pin);
+void analogWrite(uint8_t pin, int value);
+
+// Each pin is a one bit "port" of its own
+extern volatile uint8_t nativePorts[NUM_DIGITAL_PINS];
+#define digitalPinToPort(pin) ((pin) < NUM_DIGITAL_PINS ? (pin) : NOT_A_PIN)
+#define digitalPinToBitMask(pin) 1
+#define portOutputRegister(port) (&nativePorts[port])
+#define portInputRegister(port) (&nativePorts[port])
+
+// There is no timer interrupt on the host: yield(), which the waits for the
+// waveform call, runs the DCC timer handler in its place, unless cli().
+extern uint8_t SREG;
+#define cli() (SREG &= 0x7F)
+#define sei() (SREG |= 0x80)
+#define noInterrupts() cli()
+#define interrupts() sei()
+void nativeTimerInterrupt(void (*handler)());
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t b) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size) {
+    size_t n = 0;
+    while (size--) n += write(*buffer++);
+    return n;
+  }
+  size_t write(const char *str) { return str ? write((const uint8_t *)str, strlen(str)) : 0; }
+  size_t write(const char *buffer, size_t size) { return write((const uint8_t *)buffer, size); }
+  virtual void flush() {}
+
+  size_t print(const __FlashStringHelper *s) { return write((const char *)s); }
+  size_t print(const char *s) { return write(s); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(unsigned char n, int base = 10) { return print((unsigned long)n, base); }
+  size_t print(int n, int base = 10) { return print((long)n, base); }
+  size_t print(unsigned int n, int base = 10) { return print((unsigned long)n, base); }
+  size_t print(long n, int base = 10);
+  size_t print(unsigned long n, int base = 10);
+  size_t print(double n, int digits = 2);
+
+  size_t println() { return write((const uint8_t *)"\r\n", 2); }
+  template <typename T> size_t println(T value) { size_t n = print(value); return n + println(); }
+  template <typename T> size_t println(T value, int format) { size_t n = print(value, format); return n + println(); }
+};
+
+class Stream : public Print {
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+};
+
+// stdout, with input from whatever the program puts in
+class HardwareSerial : public Stream {
+public:
+  void begin(unsigned long baud) { (void)baud; }
+  operator bool() { return true; }
+  size_t write(uint8_t b) override;
+  size_t write(const uint8_t *buffer, size_t size) override;
+  using Print::write;
+  int available() override;
+  int read() override;
+  int peek() override;
+  // Queue input for read()
+  void inject(const char *text);
+  // Swallow output, so that timings aren't of the terminal
+  bool quiet = false;
+private:
+  char _input[256];
+  int _inputLength = 0;
+  int _inputPos = 0;
+};
+extern HardwareSerial Serial;
+
+#endif
@@ -0,0 +1,42 @@
+/*
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef EEPROM_h
+#define EEPROM_h
+#include <Arduino.h>
+
+// A Mega's 4K of EEPROM, in RAM, erased at startup
+class EEPROMClass {
+public:
+  uint8_t read(int address) { return _data[address & (SIZE-1)]; }
+  void write(int address, uint8_t value) { _data[address & (SIZE-1)] = value; }
+  void update(int address, uint8_t value) { write(address, value); }
+  uint16_t length() { return SIZE; }
+  template <typename T> T &get(int address, T &t) {
+    memcpy(&t, &_data[address], sizeof(T));
+    return t;
+  }
+  template <typename T> const T &put(int address, const T &t) {
+    memcpy(&_data[address], &t, sizeof(T));
+    return t;
+  }
+private:
+  static const int SIZE = 4096;
+  uint8_t _data[SIZE];
+};
+extern EEPROMClass EEPROM;
+
+#endif
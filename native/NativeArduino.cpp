@@ -0,0 +1,166 @@
+/*
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// The Arduino core functions of native/Arduino.h, for the host build only.
+// (src_dir is the whole tree, so every board compiles this file to nothing.)
+#if defined(ARDUINO_ARCH_NATIVE)
+#include <chrono>
+#include <thread>
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <Wire.h>
+
+HardwareSerial Serial;
+EEPROMClass EEPROM;
+TwoWire Wire;
+volatile uint8_t nativePorts[NUM_DIGITAL_PINS];
+uint8_t SREG = 0x80;
+
+static void (*timerHandler)() = NULL;
+
+static const auto startTime = std::chrono::steady_clock::now();
+
+unsigned long millis() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+unsigned long micros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+void delay(unsigned long ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void delayMicroseconds(unsigned int us) {
+  std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+void nativeTimerInterrupt(void (*handler)()) {
+  timerHandler = handler;
+}
+
+void yield() {
+  if (!timerHandler || !(SREG & 0x80)) return;
+  cli();
+  timerHandler();
+  sei();
+}
+
+long random(long howbig) {
+  return howbig > 0 ? ::random() % howbig : 0;
+}
+
+long random(long howsmall, long howbig) {
+  return howsmall >= howbig ? howsmall : howsmall + random(howbig - howsmall);
+}
+
+long map(long x, long in_min, long in_max, long out_min, long out_max) {
+  return (x - in_min) * (out_max - out_min) / (in_max - in_min) + out_min;
+}
+
+char *itoa(int value, char *str, int base) {
+  char digits[34];
+  int n = 0;
+  bool negative = value < 0 && base == 10;
+  unsigned int v = negative ? -(unsigned int)value : (unsigned int)value;
+  do {
+    int d = v % base;
+    digits[n++] = d < 10 ? '0' + d : 'a' + d - 10;
+    v /= base;
+  } while (v);
+  char *p = str;
+  if (negative) *p++ = '-';
+  while (n) *p++ = digits[--n];
+  *p = '\0';
+  return str;
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  (void)pin;
+  (void)mode;
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  if (pin < NUM_DIGITAL_PINS) nativePorts[pin] = value ? 1 : 0;
+}
+
+int digitalRead(uint8_t pin) {
+  return pin < NUM_DIGITAL_PINS ? nativePorts[pin] : LOW;
+}
+
+int analogRead(uint8_t pin) {
+  (void)pin;
+  return 0;  // no current drawn, ever
+}
+
+void analogWrite(uint8_t pin, int value) {
+  digitalWrite(pin, value > 127);
+}
+
+size_t Print::print(long n, int base) {
+  if (n < 0 && base == 10) return print('-') + print((unsigned long)-n, base);
+  return print((unsigned long)n, base);
+}
+
+size_t Print::print(unsigned long n, int base) {
+  char buffer[33];
+  char *p = buffer + sizeof(buffer) - 1;
+  *p = '\0';
+  if (base < 2) base = 10;
+  do {
+    int d = n % base;
+    *--p = d < 10 ? '0' + d : 'A' + d - 10;
+    n /= base;
+  } while (n);
+  return write(p);
+}
+
+size_t Print::print(double n, int digits) {
+  char buffer[40];
+  snprintf(buffer, sizeof(buffer), "%.*f", digits, n);
+  return write(buffer);
+}
+
+size_t HardwareSerial::write(uint8_t b) {
+  if (!quiet) fputc(b, stdout);
+  return 1;
+}
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size) {
+  if (!quiet) fwrite(buffer, 1, size, stdout);
+  return size;
+}
+
+int HardwareSerial::available() {
+  return _inputLength - _inputPos;
+}
+
+int HardwareSerial::read() {
+  return _inputPos < _inputLength ? (uint8_t)_input[_inputPos++] : -1;
+}
+
+int HardwareSerial::peek() {
+  return _inputPos < _inputLength ? (uint8_t)_input[_inputPos] : -1;
+}
+
+void HardwareSerial::inject(const char *text) {
+  if (_inputPos == _inputLength) _inputPos = _inputLength = 0;
+  while (*text && _inputLength < (int)sizeof(_input)) _input[_inputLength++] = *text++;
+}
+
+#endif
@@ -0,0 +1,131 @@
+/*
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Throughput of the command parser, the formatter, broadcasts and loco reminders,
+// built and run on the host with
+//
+//    pio run -e native && .pio/build/native/program [iterations]
+//
+// Host timings are no guide to a board's, but the ratios between two builds are,
+// so a change to one of these paths can be checked before it goes near a Mega
+// (where mega2560-sim and <D LOOP> take over).
+#if defined(ARDUINO_ARCH_NATIVE)
+#include <chrono>
+#include "DCC.h"
+#include "DCCWaveform.h"
+#include "DCCEXParser.h"
+#include "CommandDistributor.h"
+#include "RingStream.h"
+#include "StringFormatter.h"
+#include "defines.h"
+#include "MotorDrivers.h"
+
+// Replies go nowhere
+class NullPrint : public Print {
+public:
+  size_t write(uint8_t b) override { (void)b; return 1; }
+  size_t write(const uint8_t *buffer, size_t size) override { (void)buffer; return size; }
+  using Print::write;
+};
+static NullPrint nullPrint;
+
+static double nanosSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void report(const char *name, long count, const char *unit, double nanos) {
+  printf("%-10s %9ld %-10s %9.1f ns each %12.0f per second\n", name, count, unit,
+         nanos / count, count * 1e9 / nanos);
+}
+
+// Everything a client or JMRI sends most, in turn
+static void benchParse(long iterations) {
+  static const char *commands[] = {
+    "<t 1 3 50 1>", "<F 3 0 1>", "<t 1 3 0 0>", "<F 3 0 0>", "<t 1 1234 126 1>",
+    "<#>", "<s>", "<T>", "<Q>", "<a 100 1 1>",
+  };
+  const int nCommands = sizeof(commands) / sizeof(commands[0]);
+  byte buffer[64];
+  auto start = std::chrono::steady_clock::now();
+  for (long i = 0; i < iterations; i++) {
+    strcpy((char *)buffer, commands[i % nCommands]);  // the parser may change it
+    DCCEXParser::parse(&nullPrint, buffer, NULL);
+  }
+  report("parse", iterations, "commands", nanosSince(start));
+}
+
+static void benchFormat(long iterations) {
+  auto start = std::chrono::steady_clock::now();
+  for (long i = 0; i < iterations; i++)
+    StringFormatter::send(&nullPrint, F("<l %d %d %d %l>\n"), (int)(i & 0x3FFF), 3, (int)(i & 0x7F), (long)i);
+  report("send", iterations, "replies", nanosSince(start));
+  start = std::chrono::steady_clock::now();
+  for (long i = 0; i < iterations; i++)
+    StringFormatter::emit(&nullPrint, F("<l "), (int)(i & 0x3FFF), ' ', 3, ' ', (int)(i & 0x7F), ' ', (long)i, F(">\n"));
+  report("emit", iterations, "replies", nanosSince(start));
+}
+
+// Four network clients, each broadcast stored once in the ring and read out for each
+static void benchBroadcast(long iterations) {
+  RingStream ring(2048);
+  const byte nClients = 4;
+  byte buffer[8];
+  for (byte c = 0; c < nClients; c++) {
+    strcpy((char *)buffer, "<#>");
+    ring.mark(c);
+    CommandDistributor::parse(c, buffer, &ring);
+    ring.commit();
+  }
+  long bytes = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (long i = 0; i < iterations; i++) {
+    if (i & 1) CommandDistributor::broadcastTurnout(i & 0xFF, i & 2);
+    else CommandDistributor::broadcastSensor(i & 0xFF, i & 2);
+    while (ring.readClient() >= 0)
+      for (int n = ring.count(); n > 0; n--, bytes++) ring.read();
+  }
+  report("broadcast", iterations, "messages", nanosSince(start));
+  if (bytes == 0) printf("  (no bytes came out of the ring: clients not registered?)\n");
+}
+
+// The reminder loop with every slot in use, waiting for the waveform to send
+// each packet before the next call (the wait isn't counted)
+static void benchReminders(long iterations) {
+  for (int loco = 1; loco <= MAX_LOCOS; loco++) DCC::setThrottle(loco, loco, true);
+  double nanos = 0;
+  for (long i = 0; i < iterations; i++) {
+    while (DCCWaveform::mainTrack.isPacketPending()) yield();
+    auto start = std::chrono::steady_clock::now();
+    DCC::loop();
+    nanos += nanosSince(start);
+  }
+  report("reminders", iterations, "loops", nanos);
+}
+
+int main(int argc, char **argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 100000;
+  if (iterations <= 0) iterations = 100000;
+  Serial.quiet = true;  // DIAGs and anything else for Serial
+  DCC::begin(MOTOR_SHIELD_TYPE);
+  DCCWaveform::mainTrack.setPowerMode(POWERMODE::ON);
+  benchParse(iterations);
+  benchFormat(iterations);
+  benchBroadcast(iterations);
+  benchReminders(iterations);
+  return 0;
+}
+#endif
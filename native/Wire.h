@@ -0,0 +1,37 @@
+/*
+ *  This file is part of CommandStation-EX
+ *
+ *  This is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  It is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with CommandStation.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef Wire_h
+#define Wire_h
+#include <Arduino.h>
+
+// An I2C bus with nothing on it: every address is NACKed
+class TwoWire : public Stream {
+public:
+  void begin() {}
+  void setClock(unsigned long clock) { (void)clock; }
+  void beginTransmission(uint8_t address) { (void)address; }
+  uint8_t endTransmission(bool stop = true) { (void)stop; return 2; }  // address NACK
+  size_t requestFrom(uint8_t address, size_t quantity) { (void)address; (void)quantity; return 0; }
+  size_t write(uint8_t b) override { (void)b; return 1; }
+  using Print::write;
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+};
+extern TwoWire Wire;
+
+#endif